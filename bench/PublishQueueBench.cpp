@@ -0,0 +1,1242 @@
+// Host benchmark for PublishQueueAsyncRK
+//
+// Build and run from this directory:
+//   make run
+//
+// Reports the time per operation and the number of bytes moved per operation (memmove, memcpy, and
+// strcpy for retained memory; bytes transferred over the simulated I2C bus for FRAM; bytes read and
+// written for file systems) for enqueue, dequeue (getOldestEvent + discardOldEvent), and evict
+// (publish to a full queue, or for file systems, a queue limited with withMaxEvents) across buffer
+// and payload sizes. Drain sends a full retained queue with and without batching (withBatching) and
+// reports the events sent per Particle.publish. Pipeline sends a retained queue with a simulated
+// 20 ms publish round trip, with one and four publishes in progress (withPipelining). Compress
+// reports the compression ratio and time per event for JSON telemetry, and how many more events fit
+// in a retained queue with withCompression. Last-value replaces a state event (withLastValueOnly)
+// queued behind other events. Idle runs the worker thread and reports the CPU it uses with nothing
+// to send, while a publish is in progress, and the time from publish() to Particle.publish.
+// Isr-enqueue is the time to call publishFromISR, and isr-drain the time for the worker thread to
+// add those events to the storage. Format-publish formats event data with snprintf and calls
+// publish(), and reserve-commit formats it into the reservation buffer with reserve() and commit().
+// Tiered publishes to a retained queue that spills to FRAM (PublishQueueAsyncTiered), and reports
+// the thread's spill and the dequeue, and in-flight checks that events are spilled, not evicted,
+// while publishes are in progress. Setup-recover is setup() with a full FRAM or events file
+// whose header doesn't match the events, which keeps the valid events. The POSIX file system is
+// measured opening and closing the file for each operation, keeping the file open, with group
+// commit, and with segment files. For file systems, trickle publishes and sends one event at a time
+// with depth events queued, and trickle-disk is the total size of the events files afterwards.
+//
+// make run-nolog runs the same benchmark built with PUBLISH_QUEUE_LOG_LEVEL=LOG_LEVEL_WARN, which
+// removes the trace and info log messages, to compare the cost of logging.
+
+#include "Particle.h"
+#include "MB85RC256V-FRAM-RK.h"
+#include "PublishQueueAsyncRK.h"
+
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <dirent.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+// Minimum number of operations for each measurement
+static size_t minOps = 20000;
+
+static uint64_t nowNs() {
+	return (uint64_t) std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * @brief Accumulates the time and bytes moved for a single benchmark case
+ */
+class Measurement {
+public:
+	void start() {
+		startNs = nowNs();
+		startBytes = benchBytesCopied + extraBytes();
+	}
+	void stop(size_t ops) {
+		ns += nowNs() - startNs;
+		bytes += benchBytesCopied + extraBytes() - startBytes;
+		this->ops += ops;
+	}
+	virtual unsigned long long extraBytes() { return 0; }
+
+	void report(const char *backend, const char *op, const char *sizeLabel, size_t size, size_t payload) {
+		if (ops == 0) {
+			printf("%-11s %-14s %s=%-6u payload=%-4u %12s %14s\n", backend, op, sizeLabel, (unsigned)size, (unsigned)payload, "n/a", "");
+			return;
+		}
+		printf("%-11s %-14s %s=%-6u payload=%-4u %9.1f ns/op %9.1f bytes/op\n", backend, op, sizeLabel, (unsigned)size, (unsigned)payload,
+			(double)ns / (double)ops, (double)bytes / (double)ops);
+	}
+
+	uint64_t startNs = 0;
+	unsigned long long startBytes = 0;
+	uint64_t ns = 0;
+	unsigned long long bytes = 0;
+	size_t ops = 0;
+};
+
+static std::string makePayload(size_t size, int counter) {
+	// Repetitive JSON-like data
+	std::string s = "{\"n\":" + std::to_string(counter) + ",\"v\":\"";
+	while(s.size() + 2 < size) {
+		s += (char)('a' + (s.size() % 26));
+	}
+	s += "\"}";
+	s.resize(size);
+	return s;
+}
+
+//
+// Retained memory
+//
+
+/**
+ * @brief Exposes isSending so the benchmark can evict the second oldest event
+ */
+class BenchRetained : public PublishQueueAsyncRetained {
+public:
+	BenchRetained(uint8_t *buf, uint16_t size) : PublishQueueAsyncRetained(buf, size) {}
+
+	void setSending(bool value) { isSending = value; }
+
+	void drainISR() { drainISRQueue(); }
+
+	/**
+	 * @brief Runs the worker thread state machine once. Use withRateLimit(1, 0) to not wait between publishes.
+	 */
+	void sendNext() {
+		checkQueueState();
+	}
+};
+
+/**
+ * @brief Publishes events until the queue starts evicting
+ */
+static void fillQueue(PublishQueueAsyncBase &q, const std::string &payload) {
+	while(true) {
+		uint16_t before = q.getNumEvents();
+		q.publish("benchEvent", payload.c_str(), PRIVATE);
+		if (q.getNumEvents() <= before) {
+			break;
+		}
+	}
+}
+
+static void benchRetained(size_t bufSize, size_t payloadSize) {
+	uint8_t *buf = new uint8_t[bufSize];
+	memset(buf, 0, bufSize);
+
+	// Objects are never deleted, like the global objects they normally are
+	BenchRetained &q = *new BenchRetained(buf, (uint16_t)bufSize);
+	q.setup();
+
+	std::string payload = makePayload(payloadSize, 0);
+
+	// Enqueue into a queue that's not full
+	Measurement enqueue;
+	while(enqueue.ops < minOps) {
+		q.clearEvents();
+		size_t count = 0;
+		enqueue.start();
+		while(true) {
+			uint16_t before = q.getNumEvents();
+			q.publish("benchEvent", payload.c_str(), PRIVATE);
+			count++;
+			if (q.getNumEvents() <= before) {
+				break;
+			}
+		}
+		enqueue.stop(count);
+	}
+	enqueue.report("retained", "enqueue", "buf", bufSize, payloadSize);
+
+	// Dequeue from a full queue
+	Measurement dequeue;
+	while(dequeue.ops < minOps) {
+		fillQueue(q, payload);
+		size_t count = q.getNumEvents();
+		dequeue.start();
+		while(q.getOldestEvent() != NULL) {
+			q.discardOldEvent(false);
+		}
+		dequeue.stop(count);
+	}
+	dequeue.report("retained", "dequeue", "buf", bufSize, payloadSize);
+
+	// Publish to a full queue, discarding the oldest event
+	Measurement evict;
+	fillQueue(q, payload);
+	evict.start();
+	for(size_t ii = 0; ii < minOps; ii++) {
+		q.publish("benchEvent", payload.c_str(), PRIVATE);
+	}
+	evict.stop(minOps);
+	evict.report("retained", "evict", "buf", bufSize, payloadSize);
+
+	// Publish to a full queue while sending, discarding the second oldest event
+	Measurement evictSending;
+	q.clearEvents();
+	fillQueue(q, payload);
+	q.getOldestEvent();
+	q.setSending(true);
+	evictSending.start();
+	for(size_t ii = 0; ii < minOps; ii++) {
+		q.publish("benchEvent", payload.c_str(), PRIVATE);
+	}
+	evictSending.stop(minOps);
+	q.setSending(false);
+	evictSending.report("retained", "evict-sending", "buf", bufSize, payloadSize);
+}
+
+/**
+ * @brief Sends a full retained queue, with and without batching
+ *
+ * Reports the time per event sent and the number of events per Particle.publish. At one publish
+ * per second, the number of publishes is also the number of seconds to drain the queue.
+ */
+static void benchDrain(const char *backend, size_t bufSize, size_t payloadSize) {
+	uint8_t *buf = new uint8_t[bufSize];
+	memset(buf, 0, bufSize);
+
+	BenchRetained &q = *new BenchRetained(buf, (uint16_t)bufSize);
+	q.withRateLimit(1, 0);
+	if (strcmp(backend, "retained-batch") == 0) {
+		q.withBatching();
+	}
+	q.setup();
+
+	std::string payload = makePayload(payloadSize, 0);
+
+	Particle.connect();
+
+	Measurement drain;
+	size_t events = 0;
+	unsigned long publishes = 0;
+	while(drain.ops < minOps) {
+		fillQueue(q, payload);
+		size_t count = q.getNumEvents();
+		unsigned long before = Particle.publishCount;
+		drain.start();
+		while(q.getNumEvents() != 0) {
+			q.sendNext();
+		}
+		drain.stop(count);
+		events += count;
+		publishes += Particle.publishCount - before;
+	}
+
+	Particle.disconnect();
+
+	printf("%-14s %-11s buf=%-6u payload=%-4u %9.1f ns/op %9.1f events/publish\n", backend, "drain", (unsigned)bufSize, (unsigned)payloadSize,
+		(double)drain.ns / (double)drain.ops, (double)events / (double)publishes);
+}
+
+/**
+ * @brief Sends a retained queue with a simulated publish round trip, with and without pipelining
+ *
+ * Reports the events sent per second of (simulated) time. This uses millis(), so it runs in real
+ * time and is only done once per depth.
+ */
+static void benchPipeline(uint16_t depth, unsigned long latencyMs) {
+	const size_t bufSize = 3072;
+	uint8_t *buf = new uint8_t[bufSize];
+	memset(buf, 0, bufSize);
+
+	BenchRetained &q = *new BenchRetained(buf, (uint16_t)bufSize);
+	q.withRateLimit(depth, 0);
+	q.withPipelining(depth);
+	q.setup();
+
+	std::string payload = makePayload(32, 0);
+	fillQueue(q, payload);
+	size_t count = q.getNumEvents();
+
+	Particle.publishLatencyMs = latencyMs;
+	Particle.connect();
+
+	unsigned long startMs = millis();
+	while(q.getNumEvents() != 0) {
+		q.sendNext();
+	}
+	unsigned long elapsedMs = millis() - startMs;
+
+	Particle.disconnect();
+	Particle.publishLatencyMs = 0;
+
+	printf("%-14s %-11s depth=%-4u latency=%-3lu %9.1f events/sec\n", "retained", "pipeline", (unsigned)depth, latencyMs,
+		(double)count * 1000.0 / (double)(elapsedMs ? elapsedMs : 1));
+}
+
+/**
+ * @brief Fails one publish while others are in progress and checks that only its events are sent again
+ *
+ * duplicates is the number of publishes beyond one per event and one per failure, which is 0 if the
+ * publishes after the failed one that succeeded aren't sent again.
+ */
+static void benchPipelineFailure(uint16_t depth, unsigned long failPublish) {
+	const size_t bufSize = 3072;
+	uint8_t *buf = new uint8_t[bufSize];
+	memset(buf, 0, bufSize);
+
+	BenchRetained &q = *new BenchRetained(buf, (uint16_t)bufSize);
+	q.withRateLimit(depth, 0);
+	q.withPipelining(depth);
+	q.setup();
+
+	std::string payload = makePayload(32, 0);
+	fillQueue(q, payload);
+	size_t count = q.getNumEvents();
+
+	Particle.publishLatencyMs = 20;
+	Particle.publishCount = 0;
+	Particle.failPublishCount = failPublish;
+	Particle.connect();
+
+	while(q.getNumEvents() != 0) {
+		q.sendNext();
+	}
+	unsigned long publishes = Particle.publishCount;
+	uint32_t failed = q.getMetrics().failed;
+
+	Particle.disconnect();
+	Particle.publishLatencyMs = 0;
+	Particle.failPublishCount = 0;
+
+	printf("%-14s %-11s depth=%-4u fail=%-3lu events=%u publishes=%lu failed=%lu duplicates=%ld\n", "retained", "pipeline", (unsigned)depth, failPublish,
+		(unsigned)count, publishes, (unsigned long)failed, (long)publishes - (long)count - (long)failed);
+}
+
+/**
+ * @brief JSON telemetry like a sensor might publish, an array of readings with the same keys
+ */
+static std::string makeTelemetry(size_t size, int counter) {
+	std::string s = "[";
+	for(int ii = 0; s.size() < size; ii++) {
+		int n = counter * 7 + ii * 13;
+		char reading[128];
+		snprintf(reading, sizeof(reading), "%s{\"t\":%d,\"temp\":%d.%d,\"hum\":%d,\"batt\":3.%02d,\"rssi\":-%d}",
+			(ii > 0) ? "," : "", 1700000000 + n * 60, 18 + n % 9, n % 10, 35 + n % 20, 70 + n % 29, 60 + n % 31);
+		s += reading;
+	}
+	s.resize(size - 1);
+	s += "]";
+	return s;
+}
+
+/**
+ * @brief Measures the compression ratio and the time to compress and decompress event data
+ *
+ * Also reports the number of events that fit in a retained queue with and without withCompression,
+ * and the time to enqueue and dequeue each event with compression.
+ */
+static void benchCompression(size_t payloadSize) {
+	const size_t bufSize = 3072;
+	const int numPayloads = 16;
+
+	std::vector<std::string> payloads;
+	for(int ii = 0; ii < numPayloads; ii++) {
+		payloads.push_back(makeTelemetry(payloadSize, ii));
+	}
+
+	uint8_t compressed[particle::protocol::MAX_EVENT_DATA_LENGTH];
+	uint8_t expanded[particle::protocol::MAX_EVENT_DATA_LENGTH];
+	uint16_t hashTable[PublishQueueCompression::HASH_SIZE];
+
+	Measurement compress;
+	Measurement decompress;
+	size_t totalIn = 0;
+	size_t totalOut = 0;
+	while(compress.ops < minOps) {
+		for(const std::string &payload : payloads) {
+			compress.start();
+			size_t len = PublishQueueCompression::compress((const uint8_t *)payload.c_str(), payload.size(), compressed, sizeof(compressed), hashTable);
+			compress.stop(1);
+
+			decompress.start();
+			bool valid = PublishQueueCompression::decompress(compressed, len, expanded, payload.size());
+			decompress.stop(1);
+
+			if (len == 0 || !valid || memcmp(expanded, payload.c_str(), payload.size()) != 0) {
+				printf("compression failed payload=%u\n", (unsigned)payloadSize);
+				exit(1);
+			}
+			totalIn += payload.size();
+			totalOut += len;
+		}
+	}
+
+	// Events that fit in the same retained buffer, and the time per event to queue and send them
+	size_t eventsFit[2];
+	Measurement enqueue;
+	Measurement dequeue;
+	for(int withCompression = 0; withCompression < 2; withCompression++) {
+		uint8_t *buf = new uint8_t[bufSize];
+		memset(buf, 0, bufSize);
+
+		BenchRetained &q = *new BenchRetained(buf, (uint16_t)bufSize);
+		q.withCompression(withCompression != 0);
+		q.setup();
+
+		size_t count = 0;
+		while(enqueue.ops < minOps || count == 0) {
+			q.clearEvents();
+			count = 0;
+			if (withCompression) {
+				enqueue.start();
+			}
+			while(true) {
+				uint16_t before = q.getNumEvents();
+				q.publish("benchEvent", payloads[count % numPayloads].c_str(), PRIVATE);
+				if (q.getNumEvents() <= before) {
+					break;
+				}
+				count++;
+			}
+			if (!withCompression) {
+				break;
+			}
+			enqueue.stop(count + 1);
+
+			size_t events = q.getNumEvents();
+			dequeue.start();
+			while(q.getOldestEvent() != NULL) {
+				q.discardOldEvent(false);
+			}
+			dequeue.stop(events);
+		}
+		eventsFit[withCompression] = count;
+	}
+
+	printf("%-14s %-11s payload=%-4u ratio=%.2f compress=%.1f ns/op decompress=%.1f ns/op\n", "codec", "compress", (unsigned)payloadSize,
+		(double)totalOut / (double)totalIn, (double)compress.ns / (double)compress.ops, (double)decompress.ns / (double)decompress.ops);
+	printf("%-14s %-11s buf=%-6u payload=%-4u events=%u (%u uncompressed) enqueue=%.1f ns/op dequeue=%.1f ns/op\n", "retained", "compress", (unsigned)bufSize, (unsigned)payloadSize,
+		(unsigned)eventsFit[1], (unsigned)eventsFit[0], (double)enqueue.ns / (double)enqueue.ops, (double)dequeue.ns / (double)dequeue.ops);
+}
+
+//
+// FRAM
+//
+
+/**
+ * @brief Exposes isSending so the benchmark can evict the second oldest event
+ */
+class BenchFRAM : public PublishQueueAsyncFRAM {
+public:
+	BenchFRAM(MB85RC &fram) : PublishQueueAsyncFRAM(fram) {}
+
+	void setSending(bool value) { isSending = value; }
+
+	void drainISR() { drainISRQueue(); }
+};
+
+class FRAMMeasurement : public Measurement {
+public:
+	virtual unsigned long long extraBytes() { return MB85RC::bytesTransferred; }
+};
+
+static void benchFRAM(size_t framSize, size_t payloadSize) {
+	// Objects are never deleted, like the global objects they normally are
+	MB85RC &fram = *new MB85RC(framSize);
+	BenchFRAM &q = *new BenchFRAM(fram);
+	q.setup();
+
+	std::string payload = makePayload(payloadSize, 0);
+
+	size_t framOps = minOps / 10;
+
+	FRAMMeasurement enqueue;
+	while(enqueue.ops < framOps) {
+		q.clearEvents();
+		size_t count = 0;
+		enqueue.start();
+		while(true) {
+			uint16_t before = q.getNumEvents();
+			q.publish("benchEvent", payload.c_str(), PRIVATE);
+			count++;
+			if (q.getNumEvents() <= before) {
+				break;
+			}
+		}
+		enqueue.stop(count);
+	}
+	enqueue.report("fram", "enqueue", "fram", framSize, payloadSize);
+
+	FRAMMeasurement dequeue;
+	while(dequeue.ops < framOps) {
+		fillQueue(q, payload);
+		size_t count = q.getNumEvents();
+		dequeue.start();
+		while(q.getOldestEvent() != NULL) {
+			q.discardOldEvent(false);
+		}
+		dequeue.stop(count);
+	}
+	dequeue.report("fram", "dequeue", "fram", framSize, payloadSize);
+
+	// Startup with a full queue
+	FRAMMeasurement startup;
+	fillQueue(q, payload);
+	while(startup.ops < framOps) {
+		BenchFRAM &q2 = *new BenchFRAM(fram);
+		startup.start();
+		q2.setup();
+		startup.stop(1);
+	}
+	startup.report("fram", "setup-full", "fram", framSize, payloadSize);
+
+	// Startup with a full queue and a queue header that doesn't match the events, which scans the
+	// event headers and checks the crc of the newest event
+	FRAMMeasurement recover;
+	while(recover.ops < framOps) {
+		PublishQueueFRAMHeader header;
+		fram.readData(0, (uint8_t *)&header, sizeof(header));
+		header.events.tail = 0;
+		fram.writeData(0, (uint8_t *)&header, sizeof(header));
+
+		BenchFRAM &q2 = *new BenchFRAM(fram);
+		recover.start();
+		q2.setup();
+		recover.stop(1);
+		if (q2.getNumEvents() != q.getNumEvents()) {
+			printf("fram setup-recover kept %u of %u events\n", (unsigned)q2.getNumEvents(), (unsigned)q.getNumEvents());
+		}
+	}
+	recover.report("fram", "setup-recover", "fram", framSize, payloadSize);
+
+	FRAMMeasurement evict;
+	fillQueue(q, payload);
+	evict.start();
+	for(size_t ii = 0; ii < framOps; ii++) {
+		q.publish("benchEvent", payload.c_str(), PRIVATE);
+	}
+	evict.stop(framOps);
+	evict.report("fram", "evict", "fram", framSize, payloadSize);
+
+	FRAMMeasurement evictSending;
+	q.clearEvents();
+	fillQueue(q, payload);
+	q.getOldestEvent();
+	q.setSending(true);
+	evictSending.start();
+	for(size_t ii = 0; ii < framOps; ii++) {
+		q.publish("benchEvent", payload.c_str(), PRIVATE);
+	}
+	evictSending.stop(framOps);
+	q.setSending(false);
+	evictSending.report("fram", "evict-sending", "fram", framSize, payloadSize);
+}
+
+//
+// POSIX file system
+//
+
+/**
+ * @brief Counts the bytes read from and written to the events file, and exposes isSending so the
+ * benchmark can evict the second oldest event
+ */
+class BenchPOSIX : public PublishQueueAsyncPOSIX {
+public:
+	BenchPOSIX(const char *filename) : PublishQueueAsyncPOSIX(filename) {}
+
+	virtual size_t readBytes(int seekTo, uint8_t *buffer, size_t length) {
+		size_t count = PublishQueueAsyncPOSIX::readBytes(seekTo, buffer, length);
+		fileBytes += count;
+		return count;
+	}
+
+	virtual size_t writeBytes(int seekTo, const uint8_t *buffer, size_t length) {
+		size_t count = PublishQueueAsyncPOSIX::writeBytes(seekTo, buffer, length);
+		fileBytes += count;
+		return count;
+	}
+
+	void setSending(bool value) { isSending = value; }
+
+	void drainISR() { drainISRQueue(); }
+
+	static unsigned long long fileBytes;
+};
+unsigned long long BenchPOSIX::fileBytes = 0;
+
+class FileMeasurement : public Measurement {
+public:
+	virtual unsigned long long extraBytes() { return BenchPOSIX::fileBytes; }
+};
+
+static std::string tempDir;
+
+/**
+ * @brief Total size of the events file and its segment files in tempDir
+ */
+static unsigned long long diskUsage(const std::string &path) {
+	std::string name = path.substr(tempDir.size() + 1);
+	unsigned long long total = 0;
+
+	DIR *dir = opendir(tempDir.c_str());
+	struct dirent *ent;
+	while((ent = readdir(dir)) != NULL) {
+		std::string entName = ent->d_name;
+		if (entName == name || entName.compare(0, name.size() + 1, name + ".") == 0) {
+			struct stat sb;
+			if (stat((tempDir + "/" + entName).c_str(), &sb) == 0) {
+				total += sb.st_size;
+			}
+		}
+	}
+	closedir(dir);
+
+	return total;
+}
+
+/**
+ * @brief Benchmark the POSIX file system queue
+ *
+ * @param backend Name of the case: "posix" opens and closes the file for each operation, "posix-sync"
+ * keeps the file open and syncs after every modification, "posix-open" keeps the file open and
+ * never syncs, which measures only the cost of reopening the file, "posix-group" stages up to
+ * 16 events in RAM and writes them with one append and one file header update, and "posix-seg"
+ * stores the events in 8 Kbyte segment files.
+ */
+static void benchPOSIX(const char *backend, size_t depth, size_t payloadSize) {
+	std::string path = tempDir + "/events-" + std::to_string(depth) + "-" + std::to_string(payloadSize);
+	unlink(path.c_str());
+
+	BenchPOSIX &q = *new BenchPOSIX(path.c_str());
+	if (strcmp(backend, "posix-sync") == 0) {
+		q.withKeepFileOpen();
+	}
+	else
+	if (strcmp(backend, "posix-open") == 0) {
+		q.withKeepFileOpen().withSyncEveryWrites(0);
+	}
+	else
+	if (strcmp(backend, "posix-group") == 0) {
+		q.withGroupCommit(16, 1000, 8192);
+	}
+	else
+	if (strcmp(backend, "posix-seg") == 0) {
+		q.withSegmentSize(8192);
+	}
+	q.setup();
+
+	std::string payload = makePayload(payloadSize, 0);
+
+	size_t fileOps = minOps / 10;
+
+	FileMeasurement enqueue;
+	while(enqueue.ops < fileOps) {
+		q.clearEvents();
+		enqueue.start();
+		for(size_t ii = 0; ii < depth; ii++) {
+			q.publish("benchEvent", payload.c_str(), PRIVATE);
+		}
+		q.flush();
+		enqueue.stop(depth);
+	}
+	enqueue.report(backend, "enqueue", "depth", depth, payloadSize);
+
+	FileMeasurement dequeue;
+	while(dequeue.ops < fileOps) {
+		q.clearEvents();
+		for(size_t ii = 0; ii < depth; ii++) {
+			q.publish("benchEvent", payload.c_str(), PRIVATE);
+		}
+		q.flush();
+		dequeue.start();
+		while(q.getOldestEvent() != NULL) {
+			q.discardOldEvent(false);
+		}
+		dequeue.stop(depth);
+	}
+	dequeue.report(backend, "dequeue", "depth", depth, payloadSize);
+
+	// Startup with depth events queued. This is the same whether or not the file is kept open.
+	FileMeasurement startup;
+	if (strcmp(backend, "posix") == 0) {
+		q.clearEvents();
+		for(size_t ii = 0; ii < depth; ii++) {
+			q.publish("benchEvent", payload.c_str(), PRIVATE);
+		}
+		while(startup.ops < fileOps / 10) {
+			BenchPOSIX &q2 = *new BenchPOSIX(path.c_str());
+			startup.start();
+			q2.setup();
+			startup.stop(1);
+		}
+	}
+	startup.report(backend, "setup-full", "depth", depth, payloadSize);
+
+	// Startup with depth events queued and a file header that doesn't match the file, which reads
+	// every event and checks its crc
+	FileMeasurement recover;
+	if (strcmp(backend, "posix") == 0) {
+		while(recover.ops < fileOps / 10) {
+			PublishQueueFileHeader header;
+			FILE *fp = fopen(path.c_str(), "r+b");
+			if (fp == NULL || fread(&header, sizeof(header), 1, fp) != 1) {
+				break;
+			}
+			header.endPos = 0;
+			fseek(fp, 0, SEEK_SET);
+			fwrite(&header, sizeof(header), 1, fp);
+			fclose(fp);
+
+			BenchPOSIX &q2 = *new BenchPOSIX(path.c_str());
+			recover.start();
+			q2.setup();
+			recover.stop(1);
+			if (q2.getNumEvents() != depth) {
+				printf("%s setup-recover kept %u of %u events\n", backend, (unsigned)q2.getNumEvents(), (unsigned)depth);
+			}
+		}
+	}
+	recover.report(backend, "setup-recover", "depth", depth, payloadSize);
+
+	// Publish to a queue limited to depth events, discarding the oldest event
+	FileMeasurement evict;
+	q.clearEvents();
+	q.withMaxEvents(depth);
+	for(size_t ii = 0; ii < depth; ii++) {
+		q.publish("benchEvent", payload.c_str(), PRIVATE);
+	}
+	evict.start();
+	for(size_t ii = 0; ii < fileOps; ii++) {
+		q.publish("benchEvent", payload.c_str(), PRIVATE);
+	}
+	q.flush();
+	evict.stop(fileOps);
+	evict.report(backend, "evict", "depth", depth, payloadSize);
+
+	// Publish to a full queue while sending, marking the second oldest event as deleted
+	FileMeasurement evictSending;
+	q.getOldestEvent();
+	q.setSending(true);
+	evictSending.start();
+	for(size_t ii = 0; ii < fileOps; ii++) {
+		q.publish("benchEvent", payload.c_str(), PRIVATE);
+	}
+	q.flush();
+	evictSending.stop(fileOps);
+	q.setSending(false);
+	q.withMaxEvents(0);
+	evictSending.report(backend, "evict-sending", "depth", depth, payloadSize);
+
+	// Publish and send one event at a time, never draining the queue
+	FileMeasurement trickle;
+	q.clearEvents();
+	for(size_t ii = 0; ii < depth; ii++) {
+		q.publish("benchEvent", payload.c_str(), PRIVATE);
+	}
+	trickle.start();
+	for(size_t ii = 0; ii < fileOps; ii++) {
+		q.publish("benchEvent", payload.c_str(), PRIVATE);
+		q.getOldestEvent();
+		q.discardOldEvent(false);
+	}
+	q.flush();
+	trickle.stop(fileOps);
+	trickle.report(backend, "trickle", "depth", depth, payloadSize);
+	printf("%-11s %-14s depth=%-6u payload=%-4u %12llu bytes\n", backend, "trickle-disk", (unsigned)depth, (unsigned)payloadSize, diskUsage(path));
+
+	q.clearEvents();
+}
+
+//
+// Last value
+//
+
+/**
+ * @brief Publishes a state event (withLastValueOnly) behind a backlog of other events
+ *
+ * Each publish replaces the queued state event. Reports the time and bytes moved per publish, which
+ * shouldn't depend on the number of events queued, and the number of events queued afterwards.
+ */
+static void benchLastValue(const char *backend, size_t backlog) {
+	PublishQueueAsyncBase *q;
+	Measurement *measurement;
+	std::string path;
+	if (strcmp(backend, "retained") == 0) {
+		const size_t bufSize = 16384;
+		uint8_t *buf = new uint8_t[bufSize];
+		memset(buf, 0, bufSize);
+		q = new BenchRetained(buf, (uint16_t)bufSize);
+		measurement = new Measurement();
+	}
+	else
+	if (strcmp(backend, "fram") == 0) {
+		q = new BenchFRAM(*new MB85RC(32768));
+		measurement = new FRAMMeasurement();
+	}
+	else {
+		path = tempDir + "/events-lastvalue";
+		unlink(path.c_str());
+		q = new BenchPOSIX(path.c_str());
+		measurement = new FileMeasurement();
+	}
+	q->withLastValueOnly("state");
+	q->setup();
+
+	std::string payload = makePayload(32, 0);
+	for(size_t ii = 0; ii < backlog; ii++) {
+		q->publish("benchEvent", payload.c_str(), PRIVATE);
+	}
+
+	// Same size each time, so the event is always replaced in place
+	size_t ops = (strcmp(backend, "retained") == 0) ? minOps : minOps / 10;
+	for(size_t ii = 0; measurement->ops < ops; ii++) {
+		std::string state = makePayload(32, (int)(ii % 10));
+		measurement->start();
+		q->publish("state", state.c_str(), PRIVATE);
+		measurement->stop(1);
+	}
+	measurement->report(backend, "last-value", "queued", backlog, 32);
+	printf("%-11s %-14s events=%u replaced=%lu\n", backend, "last-value", (unsigned)q->getNumEvents(), (unsigned long)q->getReplacedCount());
+
+	if (!path.empty()) {
+		unlink(path.c_str());
+	}
+}
+
+//
+// Tiered
+//
+
+/**
+ * @brief Exposes the worker thread's background spill
+ */
+class BenchTiered : public PublishQueueAsyncTiered {
+public:
+	BenchTiered(PublishQueueAsyncRetained &front, PublishQueueAsyncBase &back) : PublishQueueAsyncTiered(front, back) {}
+
+	void runThreadTasks() { threadTasks(); }
+
+	/**
+	 * @brief Runs the worker thread state machine once. Use withRateLimit(1, 0) to not wait between publishes.
+	 */
+	void sendNext() { checkQueueState(); }
+};
+
+/**
+ * @brief Queues events in a 2 KB retained front tier that spills to a 32 KB FRAM back tier, then removes them
+ *
+ * enqueue is the time in publish(). spill is the worker thread moving events to the FRAM, per event
+ * spilled. dequeue is getOldestEvent + discardOldEvent, which reads the FRAM in bulk, and checks that the
+ * events come out in the order they were queued.
+ */
+static void benchTiered(size_t payloadSize) {
+	const size_t bufSize = 2048;
+	uint8_t *buf = new uint8_t[bufSize];
+	memset(buf, 0, bufSize);
+
+	// Objects are never deleted, like the global objects they normally are
+	PublishQueueAsyncRetained &front = *new PublishQueueAsyncRetained(buf, (uint16_t)bufSize);
+	PublishQueueAsyncFRAM &back = *new PublishQueueAsyncFRAM(*new MB85RC(32768));
+	BenchTiered &q = *new BenchTiered(front, back);
+	q.setup();
+
+	size_t tieredOps = minOps / 10;
+
+	FRAMMeasurement enqueue;
+	FRAMMeasurement spill;
+	FRAMMeasurement dequeue;
+	size_t maxEvents = 0;
+	bool inOrder = true;
+	while(dequeue.ops < tieredOps) {
+		q.clearEvents();
+		int counter = 0;
+		uint32_t spilledBefore = q.getSpilledCount();
+		while(true) {
+			std::string payload = makePayload(payloadSize, counter++);
+			uint16_t before = q.getNumEvents();
+			enqueue.start();
+			q.publish("benchEvent", payload.c_str(), PRIVATE);
+			enqueue.stop(1);
+
+			spill.start();
+			q.runThreadTasks();
+			spill.stop(0);
+
+			// Stop when the back tier starts evicting
+			if (q.getNumEvents() <= before) {
+				break;
+			}
+		}
+		spill.ops += q.getSpilledCount() - spilledBefore;
+
+		size_t count = q.getNumEvents();
+		if (count > maxEvents) {
+			maxEvents = count;
+		}
+
+		int last = -1;
+		dequeue.start();
+		PublishQueueEventData *eventData;
+		while((eventData = q.getOldestEvent()) != NULL) {
+			int n = atoi(PublishQueueAsyncBase::getEventData(eventData) + 5);
+			if (n <= last) {
+				inOrder = false;
+			}
+			last = n;
+			q.discardOldEvent(false);
+		}
+		dequeue.stop(count);
+	}
+	enqueue.report("tiered", "enqueue", "events", maxEvents, payloadSize);
+	spill.report("tiered", "spill", "events", maxEvents, payloadSize);
+	dequeue.report("tiered", "dequeue", "events", maxEvents, payloadSize);
+	printf("%-11s %-14s events=%u spilled=%lu order=%s\n", "tiered", "summary", (unsigned)maxEvents, (unsigned long)q.getSpilledCount(),
+		inOrder ? "ok" : "WRONG");
+}
+
+/**
+ * @brief Queues events in the tiered queue while publishes are in progress, and checks that they're spilled
+ *
+ * The events being sent stay in the front tier and the events after them are spilled, so nothing
+ * should be evicted. Once the publishes complete, the rest of the events must come out in order.
+ */
+static void benchTieredInFlight(uint16_t depth, size_t payloadSize) {
+	const size_t bufSize = 2048;
+	const int numEvents = 45;
+	uint8_t *buf = new uint8_t[bufSize];
+	memset(buf, 0, bufSize);
+
+	PublishQueueAsyncRetained &front = *new PublishQueueAsyncRetained(buf, (uint16_t)bufSize);
+	PublishQueueAsyncFRAM &back = *new PublishQueueAsyncFRAM(*new MB85RC(32768));
+	BenchTiered &q = *new BenchTiered(front, back);
+	q.withRateLimit(depth, 0);
+	q.withPipelining(depth);
+	q.setup();
+
+	int counter = 0;
+	for(uint16_t ii = 0; ii < depth; ii++) {
+		q.publish("benchEvent", makePayload(payloadSize, counter++).c_str(), PRIVATE);
+	}
+
+	Particle.publishLatencyMs = 100;
+	Particle.connect();
+	for(uint16_t ii = 0; ii < depth; ii++) {
+		q.sendNext();
+	}
+
+	// The publishes are still in progress
+	while(counter < numEvents) {
+		q.publish("benchEvent", makePayload(payloadSize, counter++).c_str(), PRIVATE);
+		q.runThreadTasks();
+	}
+	uint16_t frontEvents = front.getNumEvents();
+	uint16_t backEvents = back.getNumEvents();
+	uint32_t evicted = front.getMetrics().evicted + back.getMetrics().evicted;
+
+	// Let the publishes in progress complete without starting more. If their events were evicted,
+	// they're not counted as published.
+	Particle.disconnect();
+	unsigned long startMs = millis();
+	while(q.getMetrics().published < depth && millis() - startMs < 1000) {
+		q.sendNext();
+	}
+	Particle.publishLatencyMs = 0;
+
+	int expected = depth;
+	bool inOrder = true;
+	PublishQueueEventData *eventData;
+	while((eventData = q.getOldestEvent()) != NULL) {
+		// Evicted events leave gaps, so only check that the order is increasing
+		int n = atoi(PublishQueueAsyncBase::getEventData(eventData) + 5);
+		if (n < expected) {
+			inOrder = false;
+		}
+		expected = n + 1;
+		q.discardOldEvent(false);
+	}
+
+	printf("%-11s %-14s depth=%u events=%d front=%u back=%u evicted=%lu spilled=%lu order=%s\n", "tiered", "in-flight", (unsigned)depth, numEvents,
+		(unsigned)frontEvents, (unsigned)backEvents, (unsigned long)evicted, (unsigned long)q.getSpilledCount(), inOrder ? "ok" : "WRONG");
+}
+
+//
+// publishFromISR
+//
+
+/**
+ * @brief Compares publish() with publishFromISR() and the time for the thread to drain the ring
+ *
+ * isr-enqueue is the time in the caller, which doesn't depend on the storage. isr-drain is the time
+ * and bytes moved to add the events from the ring to the storage, which happens in the worker thread.
+ */
+template<class Q, class M>
+static void benchISR(const char *backend, Q &q, size_t payloadSize) {
+	std::string payload = makePayload(payloadSize, 0);
+	size_t ops = minOps / 10;
+
+	M enqueue;
+	while(enqueue.ops < ops) {
+		q.clearEvents();
+		enqueue.start();
+		for(int ii = 0; ii < 32; ii++) {
+			q.publish("benchEvent", payload.c_str(), PRIVATE);
+		}
+		enqueue.stop(32);
+	}
+
+	M isrEnqueue;
+	M isrDrain;
+	while(isrEnqueue.ops < ops) {
+		q.clearEvents();
+		size_t count = 0;
+		isrEnqueue.start();
+		while(q.publishFromISR("benchEvent", payload.c_str(), PRIVATE)) {
+			count++;
+		}
+		isrEnqueue.stop(count);
+
+		isrDrain.start();
+		q.drainISR();
+		isrDrain.stop(count);
+	}
+
+	enqueue.report(backend, "enqueue", "ring", 4096, payloadSize);
+	isrEnqueue.report(backend, "isr-enqueue", "ring", 4096, payloadSize);
+	isrDrain.report(backend, "isr-drain", "ring", 4096, payloadSize);
+}
+
+//
+// reserve and commit
+//
+
+/**
+ * @brief Compares formatting event data into a local buffer and calling publish() with formatting it into
+ * the buffer returned by reserve() and calling commit()
+ *
+ * The data is formatted with snprintf in both cases, so the difference is the strlen calls that
+ * reserve() avoids and the copy of the reservation buffer that commit() adds.
+ */
+template<class Q, class M>
+static void benchReserve(const char *backend, Q &q, size_t payloadSize) {
+	// Leaves room for the rest of the JSON
+	std::string value = makePayload(payloadSize - 16, 0);
+	size_t ops = minOps / 10;
+
+	M format;
+	while(format.ops < ops) {
+		q.clearEvents();
+		format.start();
+		for(int ii = 0; ii < 32; ii++) {
+			char buf[particle::protocol::MAX_EVENT_DATA_LENGTH + 1];
+			snprintf(buf, sizeof(buf), "{\"n\":%d,\"v\":%s}", ii, value.c_str());
+			q.publish("benchEvent", buf, PRIVATE);
+		}
+		format.stop(32);
+	}
+
+	M reserve;
+	while(reserve.ops < ops) {
+		q.clearEvents();
+		reserve.start();
+		for(int ii = 0; ii < 32; ii++) {
+			PublishQueueReservation event = q.reserve("benchEvent", payloadSize, PRIVATE);
+			int len = snprintf(event.data(), payloadSize + 1, "{\"n\":%d,\"v\":%s}", ii, value.c_str());
+			event.commit((size_t)len);
+		}
+		reserve.stop(32);
+	}
+
+	format.report(backend, "format-publish", "queued", 32, payloadSize);
+	reserve.report(backend, "reserve-commit", "queued", 32, payloadSize);
+}
+
+//
+// Worker thread
+//
+
+/**
+ * @brief Returns the user and system CPU time used by the process, in microseconds
+ */
+static uint64_t cpuUsageUs() {
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	return (uint64_t)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000 + ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+/**
+ * @brief Returns the percentage of one CPU used by the process while sleeping for ms milliseconds
+ */
+static double idleCpuPercent(unsigned long ms) {
+	uint64_t startUs = cpuUsageUs();
+	delay(ms);
+	return (double)(cpuUsageUs() - startUs) * 100.0 / ((double)ms * 1000.0);
+}
+
+/**
+ * @brief Runs a retained queue with its worker thread and measures the CPU it uses when idle
+ *
+ * Reports the CPU used with an empty queue while cloud connected, while waiting for a slow publish to
+ * complete, and with events queued while disconnected, and the average time from publish() until the
+ * worker thread calls Particle.publish.
+ * This runs in real time, and the worker thread keeps running afterwards, so it's done last.
+ */
+static void benchIdle() {
+	const size_t bufSize = 3072;
+	const int numLatency = 50;
+
+	uint8_t *buf = new uint8_t[bufSize];
+	memset(buf, 0, bufSize);
+
+	Thread::startThreads = true;
+	BenchRetained &q = *new BenchRetained(buf, (uint16_t)bufSize);
+	q.withRateLimit(1, 0);
+	q.setup();
+	Thread::startThreads = false;
+
+	Particle.connect();
+	delay(100);
+	double emptyCpu = idleCpuPercent(1000);
+
+	std::string payload = makePayload(32, 0);
+	uint64_t latencyNs = 0;
+	for(int ii = 0; ii < numLatency; ii++) {
+		unsigned long before = Particle.publishCount;
+		uint64_t startNs = nowNs();
+		q.publish("benchEvent", payload.c_str(), PRIVATE);
+		while(Particle.publishCount == before) {
+			std::this_thread::yield();
+		}
+		latencyNs += nowNs() - startNs;
+		delay(5);
+	}
+
+	// One publish that takes longer than the measurement
+	Particle.publishLatencyMs = 2000;
+	q.publish("benchEvent", payload.c_str(), PRIVATE);
+	delay(100);
+	double inFlightCpu = idleCpuPercent(1000);
+	Particle.publishLatencyMs = 0;
+
+	Particle.disconnect();
+	delay(100);
+	for(int ii = 0; ii < 10; ii++) {
+		q.publish("benchEvent", payload.c_str(), PRIVATE);
+	}
+	double disconnectedCpu = idleCpuPercent(1000);
+
+	printf("%-14s %-11s empty=%.1f%% cpu in-flight=%.1f%% cpu disconnected=%.1f%% cpu publish-latency=%.1f us\n", "retained", "idle",
+		emptyCpu, inFlightCpu, disconnectedCpu, (double)latencyNs / (double)numLatency / 1000.0);
+}
+
+int main(int argc, char **argv) {
+	if (argc > 1) {
+		minOps = (size_t) atoi(argv[1]);
+	}
+
+	// The benchmark calls the queue methods directly, and Particle.connected() is false
+	Thread::startThreads = false;
+
+	// PublishQueueBenchNoLog is built with the trace and info messages compiled out, see run-nolog in the Makefile
+	printf("PUBLISH_QUEUE_LOG_LEVEL=%d\n", (int)(PUBLISH_QUEUE_LOG_LEVEL));
+
+	char tempTemplate[] = "/tmp/pubqbenchXXXXXX";
+	tempDir = mkdtemp(tempTemplate);
+
+	const size_t bufSizes[] = { 1024, 3072, 16384 };
+	const size_t payloadSizes[] = { 16, 128, 512 };
+
+	for(size_t bufSize : bufSizes) {
+		for(size_t payloadSize : payloadSizes) {
+			benchRetained(bufSize, payloadSize);
+		}
+	}
+
+	const size_t drainPayloadSizes[] = { 32, 80 };
+	for(const char *backend : { "retained", "retained-batch" }) {
+		for(size_t payloadSize : drainPayloadSizes) {
+			benchDrain(backend, 3072, payloadSize);
+		}
+	}
+
+	for(uint16_t depth : { 1, 4 }) {
+		benchPipeline(depth, 20);
+	}
+	benchPipelineFailure(3, 2);
+
+	for(size_t payloadSize : { 64, 200, 600 }) {
+		benchCompression(payloadSize);
+	}
+
+	const size_t framSizes[] = { 4096, 32768 };
+	for(size_t framSize : framSizes) {
+		for(size_t payloadSize : payloadSizes) {
+			benchFRAM(framSize, payloadSize);
+		}
+	}
+
+	const char *fileBackends[] = { "posix", "posix-sync", "posix-open", "posix-group", "posix-seg" };
+	const size_t depths[] = { 100, 1000 };
+	for(const char *backend : fileBackends) {
+		for(size_t depth : depths) {
+			for(size_t payloadSize : payloadSizes) {
+				benchPOSIX(backend, depth, payloadSize);
+			}
+		}
+	}
+
+	for(const char *backend : { "retained", "fram", "posix" }) {
+		for(size_t backlog : { 10, 100 }) {
+			benchLastValue(backend, backlog);
+		}
+	}
+
+	for(size_t payloadSize : { 16, 128 }) {
+		benchTiered(payloadSize);
+	}
+	for(uint16_t depth : { 1, 2 }) {
+		benchTieredInFlight(depth, 128);
+	}
+
+	for(size_t payloadSize : { 16, 128 }) {
+		uint8_t *buf = new uint8_t[16384];
+		memset(buf, 0, 16384);
+		BenchRetained &retained = *new BenchRetained(buf, 16384);
+		retained.withISRQueue(4096).setup();
+		benchISR<BenchRetained, Measurement>("retained", retained, payloadSize);
+
+		BenchFRAM &fram = *new BenchFRAM(*new MB85RC(32768));
+		fram.withISRQueue(4096).setup();
+		benchISR<BenchFRAM, FRAMMeasurement>("fram", fram, payloadSize);
+
+		std::string path = tempDir + "/events-isr";
+		unlink(path.c_str());
+		BenchPOSIX &posix = *new BenchPOSIX(path.c_str());
+		posix.withISRQueue(4096).setup();
+		benchISR<BenchPOSIX, FileMeasurement>("posix", posix, payloadSize);
+		unlink(path.c_str());
+	}
+
+	for(size_t payloadSize : { 64, 512 }) {
+		uint8_t *buf = new uint8_t[16384];
+		memset(buf, 0, 16384);
+		BenchRetained &retained = *new BenchRetained(buf, 16384);
+		retained.setup();
+		benchReserve<BenchRetained, Measurement>("retained", retained, payloadSize);
+
+		BenchFRAM &fram = *new BenchFRAM(*new MB85RC(32768));
+		fram.setup();
+		benchReserve<BenchFRAM, FRAMMeasurement>("fram", fram, payloadSize);
+
+		std::string path = tempDir + "/events-reserve";
+		unlink(path.c_str());
+		BenchPOSIX &posix = *new BenchPOSIX(path.c_str());
+		posix.withGroupCommit(32, 0).setup();
+		benchReserve<BenchPOSIX, FileMeasurement>("posix-group", posix, payloadSize);
+		unlink(path.c_str());
+	}
+
+	rmdir(tempDir.c_str());
+
+	benchIdle();
+
+	return 0;
+}
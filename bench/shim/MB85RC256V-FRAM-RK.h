@@ -0,0 +1,72 @@
+#ifndef __MB85RC256V_FRAM_RK
+#define __MB85RC256V_FRAM_RK
+
+/**
+ * @brief Minimal stand-in for the MB85RC256V-FRAM-RK library so PublishQueueAsyncFRAM can be built and
+ * benchmarked on a host.
+ *
+ * The FRAM is simulated in RAM. The number of bytes transferred is counted so the benchmark can report
+ * the I2C traffic per operation. moveData() is counted as a read and a write of each byte, the same as
+ * the real library, which moves data through a small RAM buffer. The copies are not counted in
+ * benchBytesCopied.
+ */
+
+#include "Particle.h"
+
+class MB85RC {
+public:
+	/**
+	 * @brief Construct a simulated FRAM of length bytes, initialized to 0
+	 */
+	explicit MB85RC(size_t length) : memLength(length) {
+		mem = new uint8_t[length];
+		(memset)(mem, 0, length);
+	}
+
+	virtual ~MB85RC() {
+		delete[] mem;
+	}
+
+	void begin() {}
+
+	size_t length() const { return memLength; }
+
+	bool erase() {
+		(memset)(mem, 0, memLength);
+		return true;
+	}
+
+	bool readData(size_t framAddr, uint8_t *data, size_t dataLen) {
+		if (framAddr + dataLen > memLength) {
+			return false;
+		}
+		(memcpy)(data, &mem[framAddr], dataLen);
+		bytesTransferred += dataLen;
+		return true;
+	}
+
+	bool writeData(size_t framAddr, const uint8_t *data, size_t dataLen) {
+		if (framAddr + dataLen > memLength) {
+			return false;
+		}
+		(memcpy)(&mem[framAddr], data, dataLen);
+		bytesTransferred += dataLen;
+		return true;
+	}
+
+	bool moveData(size_t framAddrFrom, size_t framAddrTo, size_t numBytes) {
+		if (framAddrFrom + numBytes > memLength || framAddrTo + numBytes > memLength) {
+			return false;
+		}
+		(memmove)(&mem[framAddrTo], &mem[framAddrFrom], numBytes);
+		bytesTransferred += 2 * numBytes;
+		return true;
+	}
+
+	uint8_t *mem;
+	size_t memLength;
+
+	static unsigned long long bytesTransferred;		//!< Bytes read and written over the simulated I2C bus
+};
+
+#endif /* __MB85RC256V_FRAM_RK */
@@ -0,0 +1,273 @@
+#include "Particle.h"
+#include "MB85RC256V-FRAM-RK.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+LogLevel Logger::outputLevel = LOG_LEVEL_NONE;
+
+bool Thread::startThreads = true;
+
+unsigned long long MB85RC::bytesTransferred = 0;
+
+#ifdef PUBLISH_QUEUE_BENCH_COUNT_COPIES
+unsigned long long benchBytesCopied = 0;
+#endif
+
+Logger Log("app");
+
+CloudClass Particle;
+
+SystemClass System;
+
+TimeClass Time;
+
+static const std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+
+spark::feature::State system_thread_get_state(void *) {
+	return spark::feature::ENABLED;
+}
+
+unsigned long millis() {
+	return (unsigned long) std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - startTime).count();
+}
+
+unsigned long micros() {
+	return (unsigned long) std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - startTime).count();
+}
+
+void delay(unsigned long ms) {
+	std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+void Logger::log(LogLevel level, const char *fmt, va_list ap) const {
+	// Device OS formats the message before handlers filter it by category, so always format
+	char buf[1024];
+	vsnprintf(buf, sizeof(buf), fmt, ap);
+
+	if (level >= outputLevel) {
+		printf("[%s] %s\n", name, buf);
+	}
+}
+
+void Logger::trace(const char *fmt, ...) const {
+	va_list ap;
+	va_start(ap, fmt);
+	log(LOG_LEVEL_TRACE, fmt, ap);
+	va_end(ap);
+}
+
+void Logger::info(const char *fmt, ...) const {
+	va_list ap;
+	va_start(ap, fmt);
+	log(LOG_LEVEL_INFO, fmt, ap);
+	va_end(ap);
+}
+
+void Logger::warn(const char *fmt, ...) const {
+	va_list ap;
+	va_start(ap, fmt);
+	log(LOG_LEVEL_WARN, fmt, ap);
+	va_end(ap);
+}
+
+void Logger::error(const char *fmt, ...) const {
+	va_list ap;
+	va_start(ap, fmt);
+	log(LOG_LEVEL_ERROR, fmt, ap);
+	va_end(ap);
+}
+
+int os_mutex_create(os_mutex_t *mutex) {
+	*mutex = new std::mutex();
+	return 0;
+}
+
+int os_mutex_destroy(os_mutex_t mutex) {
+	delete static_cast<std::mutex *>(mutex);
+	return 0;
+}
+
+int os_mutex_lock(os_mutex_t mutex) {
+	static_cast<std::mutex *>(mutex)->lock();
+	return 0;
+}
+
+int os_mutex_unlock(os_mutex_t mutex) {
+	static_cast<std::mutex *>(mutex)->unlock();
+	return 0;
+}
+
+int os_thread_yield() {
+	std::this_thread::yield();
+	return 0;
+}
+
+os_thread_t os_thread_current(void * /* reserved */) {
+	// Any address that's unique to the calling thread
+	static thread_local char current;
+	return &current;
+}
+
+/**
+ * @brief os_queue_t implementation, a bounded queue of fixed size items
+ */
+struct ShimQueue {
+	std::mutex mutex;
+	std::condition_variable changed;
+	std::deque<std::vector<uint8_t>> items;
+	size_t itemSize;
+	size_t itemCount;
+};
+
+int os_queue_create(os_queue_t *queue, size_t item_size, size_t item_count, void *) {
+	ShimQueue *q = new ShimQueue();
+	q->itemSize = item_size;
+	q->itemCount = item_count;
+	*queue = q;
+	return 0;
+}
+
+int os_queue_destroy(os_queue_t queue, void *) {
+	delete static_cast<ShimQueue *>(queue);
+	return 0;
+}
+
+int os_queue_put(os_queue_t queue, const void *item, system_tick_t delay, void *) {
+	ShimQueue *q = static_cast<ShimQueue *>(queue);
+	std::unique_lock<std::mutex> lock(q->mutex);
+	auto notFull = [q]() { return q->items.size() < q->itemCount; };
+	if (delay == CONCURRENT_WAIT_FOREVER) {
+		q->changed.wait(lock, notFull);
+	}
+	else
+	if (delay == 0) {
+		if (!notFull()) {
+			return 1;
+		}
+	}
+	else
+	if (!q->changed.wait_for(lock, std::chrono::milliseconds(delay), notFull)) {
+		return 1;
+	}
+	const uint8_t *p = static_cast<const uint8_t *>(item);
+	q->items.push_back(std::vector<uint8_t>(p, p + q->itemSize));
+	q->changed.notify_all();
+	return 0;
+}
+
+int os_queue_take(os_queue_t queue, void *item, system_tick_t delay, void *) {
+	ShimQueue *q = static_cast<ShimQueue *>(queue);
+	std::unique_lock<std::mutex> lock(q->mutex);
+	auto notEmpty = [q]() { return !q->items.empty(); };
+	if (delay == CONCURRENT_WAIT_FOREVER) {
+		q->changed.wait(lock, notEmpty);
+	}
+	else
+	if (delay == 0) {
+		if (!notEmpty()) {
+			return 1;
+		}
+	}
+	else
+	if (!q->changed.wait_for(lock, std::chrono::milliseconds(delay), notEmpty)) {
+		return 1;
+	}
+	memcpy(item, q->items.front().data(), q->itemSize);
+	q->items.pop_front();
+	q->changed.notify_all();
+	return 0;
+}
+
+bool SystemClass::on(system_event_t events, system_event_handler_t handler) {
+	for(size_t ii = 0; ii < sizeof(handlers) / sizeof(handlers[0]); ii++) {
+		if (handlers[ii] == NULL) {
+			handlerEvents[ii] = events;
+			handlers[ii] = handler;
+			return true;
+		}
+	}
+	return false;
+}
+
+void SystemClass::notify(system_event_t event, int param) {
+	for(size_t ii = 0; ii < sizeof(handlers) / sizeof(handlers[0]); ii++) {
+		if (handlers[ii] != NULL && (handlerEvents[ii] & event) != 0) {
+			handlers[ii](event, param);
+		}
+	}
+}
+
+Thread::Thread(const char *, os_thread_fn_t fn, void *param, os_thread_prio_t, size_t) {
+	if (startThreads) {
+		std::thread(fn, param).detach();
+	}
+}
+
+/**
+ * @brief Callbacks waiting for shimCallAt(), ordered by time, and the thread that calls them
+ */
+struct ShimSystemThread {
+	std::mutex mutex;
+	std::condition_variable changed;
+	std::multimap<unsigned long, std::function<void()>> calls;
+	bool started = false;
+};
+
+// Never destroyed, because the thread is still waiting on it when the program exits
+static ShimSystemThread &shimSystemThread = *new ShimSystemThread();
+
+static void shimSystemThreadFunction() {
+	ShimSystemThread &t = shimSystemThread;
+	std::unique_lock<std::mutex> lock(t.mutex);
+	while(true) {
+		if (t.calls.empty()) {
+			t.changed.wait(lock);
+			continue;
+		}
+		unsigned long now = millis();
+		auto first = t.calls.begin();
+		if (first->first > now) {
+			t.changed.wait_for(lock, std::chrono::milliseconds(first->first - now));
+			continue;
+		}
+		std::function<void()> fn = first->second;
+		t.calls.erase(first);
+
+		// Called without the lock, so the callback can schedule another call
+		lock.unlock();
+		fn();
+		lock.lock();
+	}
+}
+
+void shimCallAt(unsigned long ms, std::function<void()> fn) {
+	ShimSystemThread &t = shimSystemThread;
+	std::lock_guard<std::mutex> lock(t.mutex);
+	if (!t.started) {
+		t.started = true;
+		std::thread(shimSystemThreadFunction).detach();
+	}
+	t.calls.insert(std::make_pair(ms, fn));
+	t.changed.notify_all();
+}
+
+void CloudClass::connect() {
+	isConnected = true;
+	System.notify(cloud_status, cloud_status_connected);
+}
+
+void CloudClass::disconnect() {
+	isConnected = false;
+	System.notify(cloud_status, cloud_status_disconnected);
+}
+
+particle::Future<bool> CloudClass::publish(const char *, const char *, int, PublishFlags) {
+	publishCount++;
+	return particle::Future<bool>(millis() + publishLatencyMs, publishSucceeds && publishCount != failPublishCount);
+}
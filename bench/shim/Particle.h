@@ -0,0 +1,355 @@
+#ifndef __PARTICLE_SHIM_H
+#define __PARTICLE_SHIM_H
+
+/**
+ * @brief Minimal stand-in for Particle.h so PublishQueueAsyncRK can be built and benchmarked on a host.
+ *
+ * This only implements the small subset of the Device OS API that the library uses: Logger, Thread,
+ * os_mutex_*, os_queue_*, System.on, millis(), delay(), Time, PublishFlags, String, and a fake Particle.publish
+ * that completes its future, and calls its callbacks, after a configurable latency. It is not a device simulator.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <functional>
+#include <memory>
+#include <string>
+
+// Behave like a Gen 3 device with a POSIX file system so PublishQueueAsyncPOSIX is available
+#ifndef HAL_PLATFORM_FILESYSTEM
+#define HAL_PLATFORM_FILESYSTEM 1
+#endif
+
+typedef int32_t s32_t;
+
+namespace particle {
+namespace protocol {
+	const size_t MAX_EVENT_DATA_LENGTH = 622;
+}
+}
+
+namespace spark {
+namespace feature {
+	enum State { DISABLED, ENABLED };
+}
+}
+
+/**
+ * @brief Always reports threading as enabled
+ */
+spark::feature::State system_thread_get_state(void *reserved);
+
+//
+// Timing
+//
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+
+//
+// Logging
+//
+typedef enum {
+	LOG_LEVEL_ALL = 1,
+	LOG_LEVEL_TRACE = 1,
+	LOG_LEVEL_INFO = 30,
+	LOG_LEVEL_WARN = 40,
+	LOG_LEVEL_ERROR = 50,
+	LOG_LEVEL_NONE = 70
+} LogLevel;
+
+/**
+ * @brief Stand-in for the Device OS Logger class
+ *
+ * Like Device OS, the message is formatted before the log handler filters it. Messages at or above
+ * Logger::outputLevel are written to stdout.
+ */
+class Logger {
+public:
+	explicit Logger(const char *name) : name(name) {}
+
+	void trace(const char *fmt, ...) const;
+	void info(const char *fmt, ...) const;
+	void warn(const char *fmt, ...) const;
+	void error(const char *fmt, ...) const;
+
+	void log(LogLevel level, const char *fmt, va_list ap) const;
+
+	const char *name;
+
+	static LogLevel outputLevel;	//!< Messages below this level are formatted and discarded (default: LOG_LEVEL_NONE)
+};
+
+extern Logger Log;
+
+//
+// Threads and mutexes
+//
+typedef void *os_mutex_t;
+typedef void *os_queue_t;
+typedef void *os_thread_t;
+typedef uint8_t os_thread_prio_t;
+typedef uint32_t system_tick_t;
+
+#define CONCURRENT_WAIT_FOREVER ((system_tick_t)-1)
+
+const os_thread_prio_t OS_THREAD_PRIORITY_DEFAULT = 2;
+
+int os_mutex_create(os_mutex_t *mutex);
+int os_mutex_destroy(os_mutex_t mutex);
+int os_mutex_lock(os_mutex_t mutex);
+int os_mutex_unlock(os_mutex_t mutex);
+int os_thread_yield();
+os_thread_t os_thread_current(void *reserved);
+
+int os_queue_create(os_queue_t *queue, size_t item_size, size_t item_count, void *reserved);
+int os_queue_destroy(os_queue_t queue, void *reserved);
+int os_queue_put(os_queue_t queue, const void *item, system_tick_t delay, void *reserved);
+int os_queue_take(os_queue_t queue, void *item, system_tick_t delay, void *reserved);
+
+typedef void (*os_thread_fn_t)(void *param);
+
+/**
+ * @brief Stand-in for the Device OS Thread class. The thread is detached and runs until exit.
+ */
+class Thread {
+public:
+	Thread(const char *name, os_thread_fn_t fn, void *param = NULL, os_thread_prio_t priority = OS_THREAD_PRIORITY_DEFAULT, size_t stackSize = 0);
+
+	/**
+	 * @brief Set to false before calling setup() to not start worker threads (default: true)
+	 *
+	 * The benchmark drives the queue methods directly and doesn't want idle worker threads
+	 * competing for the CPU.
+	 */
+	static bool startThreads;
+};
+
+//
+// Publish
+//
+enum class PublishFlag : uint8_t {
+	PUBLIC_VALUE = 0x00,
+	PRIVATE_VALUE = 0x01,
+	NO_ACK_VALUE = 0x02,
+	WITH_ACK_VALUE = 0x08
+};
+
+class PublishFlags {
+public:
+	PublishFlags() : val(0) {}
+	PublishFlags(PublishFlag flag) : val((uint8_t)flag) {}
+
+	uint8_t value() const { return val; }
+
+	PublishFlags operator|(PublishFlags other) const { PublishFlags r; r.val = val | other.val; return r; }
+
+protected:
+	uint8_t val;
+};
+
+inline PublishFlags operator|(PublishFlag a, PublishFlag b) { return PublishFlags(a) | PublishFlags(b); }
+
+const PublishFlag PUBLIC = PublishFlag::PUBLIC_VALUE;
+const PublishFlag PRIVATE = PublishFlag::PRIVATE_VALUE;
+const PublishFlag NO_ACK = PublishFlag::NO_ACK_VALUE;
+const PublishFlag WITH_ACK = PublishFlag::WITH_ACK_VALUE;
+
+/**
+ * @brief Calls fn from the shim's system thread once millis() reaches ms
+ *
+ * This stands in for the Device OS system thread completing asynchronous operations. The thread is
+ * started the first time this is called.
+ */
+void shimCallAt(unsigned long ms, std::function<void()> fn);
+
+namespace particle {
+
+/**
+ * @brief Stand-in for the Device OS error passed to a future's onError callback
+ */
+class Error {
+public:
+	enum Type {
+		NONE = 0,
+		UNKNOWN = -100
+	};
+
+	Error(Type type = UNKNOWN) : errorType(type) {}
+
+	Type type() const { return errorType; }
+
+protected:
+	Type errorType;
+};
+
+/**
+ * @brief Stand-in for the Device OS publish future. Completes at a fixed millis() value.
+ *
+ * Like Device OS, the onSuccess() and onError() callbacks are called from the system thread when the
+ * future completes, or right away if it's already complete. Copies share the callbacks.
+ */
+template<typename T>
+class Future {
+public:
+	typedef std::function<void(const T &)> OnSuccessCallback;
+	typedef std::function<void(const Error &)> OnErrorCallback;
+
+	Future() {}
+	Future(unsigned long doneAt, bool succeeded) : state(std::make_shared<State>()) {
+		state->doneAt = doneAt;
+		state->succeeded = succeeded;
+	}
+
+	bool isDone() const { return !state || millis() >= state->doneAt; }
+	bool isSucceeded() const { return state && isDone() && state->succeeded; }
+
+	Future &onSuccess(OnSuccessCallback callback) {
+		if (state && state->succeeded) {
+			whenDone([callback]() { callback(T(true)); });
+		}
+		return *this;
+	}
+
+	Future &onError(OnErrorCallback callback) {
+		if (state && !state->succeeded) {
+			whenDone([callback]() { callback(Error()); });
+		}
+		return *this;
+	}
+
+protected:
+	struct State {
+		unsigned long doneAt = 0;
+		bool succeeded = false;
+	};
+
+	void whenDone(std::function<void()> fn) {
+		if (isDone()) {
+			fn();
+		}
+		else {
+			shimCallAt(state->doneAt, fn);
+		}
+	}
+
+	std::shared_ptr<State> state;
+};
+
+}
+
+//
+// System events
+//
+typedef uint64_t system_event_t;
+
+const system_event_t cloud_status = 0x0080;
+
+const int cloud_status_disconnected = 0;
+const int cloud_status_connected = 8;
+
+typedef void (*system_event_handler_t)(system_event_t event, int param);
+
+/**
+ * @brief Stand-in for the System object. Only cloud_status events are generated, by Particle.connect() and disconnect().
+ */
+class SystemClass {
+public:
+	bool on(system_event_t events, system_event_handler_t handler);
+
+	void notify(system_event_t event, int param);
+
+protected:
+	system_event_t handlerEvents[4] = {};
+	system_event_handler_t handlers[4] = {};
+};
+
+extern SystemClass System;
+
+/**
+ * @brief Stand-in for the Particle cloud object
+ */
+class CloudClass {
+public:
+	particle::Future<bool> publish(const char *eventName, const char *eventData, int ttl, PublishFlags flags);
+
+	bool connected() const { return isConnected; }
+	void connect();
+	void disconnect();
+
+	bool isConnected = false;			//!< Connection state reported by connected()
+	unsigned long publishLatencyMs = 0;	//!< Time until the publish future completes
+	bool publishSucceeds = true;		//!< Result of the publish future
+	unsigned long publishCount = 0;		//!< Number of calls to publish()
+	unsigned long failPublishCount = 0;	//!< If not 0, the publish() call that makes publishCount this value fails
+};
+
+extern CloudClass Particle;
+
+/**
+ * @brief Stand-in for the Time object. The time is the host time plus an adjustable offset.
+ */
+class TimeClass {
+public:
+	bool isValid() const { return valid; }
+	uint32_t now() const { return (uint32_t) time(NULL) + offset; }
+
+	bool valid = true;					//!< Value returned by isValid()
+	uint32_t offset = 0;				//!< Seconds added to the host time, to simulate time passing
+};
+
+extern TimeClass Time;
+
+//
+// String
+//
+
+/**
+ * @brief Minimal Wiring String
+ */
+class String {
+public:
+	String() {}
+	String(const char *s) : str(s ? s : "") {}
+
+	static String format(const char *fmt, ...) {
+		char buf[256];
+		va_list ap;
+		va_start(ap, fmt);
+		vsnprintf(buf, sizeof(buf), fmt, ap);
+		va_end(ap);
+		return String(buf);
+	}
+
+	const char *c_str() const { return str.c_str(); }
+	operator const char *() const { return str.c_str(); }
+	size_t length() const { return str.length(); }
+
+protected:
+	std::string str;
+};
+
+#ifdef PUBLISH_QUEUE_BENCH_COUNT_COPIES
+//
+// Count the bytes copied by memmove, memcpy, and strcpy so the benchmark can report bytes moved
+// per operation. This is only enabled for the benchmark build.
+//
+extern unsigned long long benchBytesCopied;
+
+inline void *benchMemmove(void *dst, const void *src, size_t n) { benchBytesCopied += n; return memmove(dst, src, n); }
+inline void *benchMemcpy(void *dst, const void *src, size_t n) { benchBytesCopied += n; return memcpy(dst, src, n); }
+inline char *benchStrcpy(char *dst, const char *src) { benchBytesCopied += strlen(src) + 1; return strcpy(dst, src); }
+
+#define memmove(dst, src, n) benchMemmove(dst, src, n)
+#define memcpy(dst, src, n) benchMemcpy(dst, src, n)
+#define strcpy(dst, src) benchStrcpy(dst, src)
+#endif /* PUBLISH_QUEUE_BENCH_COUNT_COPIES */
+
+#endif /* __PARTICLE_SHIM_H */
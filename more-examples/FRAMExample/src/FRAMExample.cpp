@@ -53,7 +53,17 @@ void setup() {
 
 	fram.begin();
 	//fram.erase();
+
+	// Only the queue header and the oldest event header are read, so this takes the same time
+	// regardless of how many events are in the queue
+	unsigned long setupStart = micros();
 	publishQueue.setup();
+	Log.info("publishQueue.setup() took %lu us numEvents=%u", micros() - setupStart, publishQueue.getNumEvents());
+
+	// validateBuffer() reads every event header, which is what setup() did in 0.2.x, for comparison
+	unsigned long validateStart = micros();
+	bool valid = publishQueue.validateBuffer();
+	Log.info("publishQueue.validateBuffer() took %lu us valid=%d", micros() - validateStart, (int)valid);
 }
 
 void loop() {
@@ -4,355 +4,2727 @@
 
 Logger pubqLogger("app.pubq");
 
-PublishQueueAsyncBase::PublishQueueAsyncBase() {
+PublishQueueAsyncBase *PublishQueueAsyncBase::firstInstance = NULL;
 
+bool PublishQueueTokenBucket::canPublish() {
+	refill();
+	return tokens > inFlight;
 }
 
-PublishQueueAsyncBase::~PublishQueueAsyncBase() {
+unsigned long PublishQueueTokenBucket::getWaitMs() {
+	refill();
+	if (tokens > inFlight || refillMs == 0) {
+		return 0;
+	}
+	unsigned long elapsed = millis() - lastRefill;
+	return (elapsed < refillMs) ? refillMs - elapsed : 0;
+}
 
+void PublishQueueTokenBucket::publishStarted() {
+	inFlight++;
 }
 
-void PublishQueueAsyncBase::setup() {
+void PublishQueueTokenBucket::publishDone() {
+	if (inFlight > 0) {
+		inFlight--;
+	}
+	refill();
+	if (tokens > 0) {
+		tokens--;
+	}
+}
 
-	if (system_thread_get_state(nullptr) != spark::feature::ENABLED) {
-		pubqLogger.error("SYSTEM_THREAD(ENABLED) is required");
+void PublishQueueTokenBucket::refill() {
+	unsigned long now = millis();
+
+	if (refillMs == 0 || tokens >= burst) {
+		tokens = burst;
+		lastRefill = now;
 		return;
 	}
 
-	haveSetup = true;
-
-	os_mutex_create(&mutex);
+	unsigned long add = (now - lastRefill) / refillMs;
+	if (add >= (unsigned long)(burst - tokens)) {
+		tokens = burst;
+		lastRefill = now;
+	}
+	else
+	if (add > 0) {
+		tokens += (uint16_t)add;
+		lastRefill += add * refillMs;
+	}
+}
 
-	thread = new Thread("PublishQueueAsync", threadFunctionStatic, this, OS_THREAD_PRIORITY_DEFAULT, 2048);
+unsigned long PublishQueueBackoff::publishFailed() {
+	unsigned long delayMs = nextMs;
 
-}
+	if (nextMs < maxMs) {
+		nextMs = (nextMs <= maxMs / multiplier) ? nextMs * multiplier : maxMs;
+	}
 
-void PublishQueueAsyncBase::mutexLock() const {
-	os_mutex_lock(mutex);
+	if (jitterPercent > 0 && delayMs > 0) {
+		unsigned long jitterMs = (unsigned long)((uint64_t)delayMs * jitterPercent / 100);
+		delayMs -= (unsigned long)(rand() % (jitterMs + 1));
+	}
+	return delayMs;
 }
 
-void PublishQueueAsyncBase::mutexUnlock() const {
-	os_mutex_unlock(mutex);
+void PublishQueueBackoff::publishSucceeded() {
+	nextMs = initialMs;
 }
 
-void PublishQueueAsyncBase::logPublishQueueEventData(const void *data) const {
-	const PublishQueueEventData *eventDataStruct = (const PublishQueueEventData *)data;
-	const char *eventName = &((const char *)data)[sizeof(PublishQueueEventData)];
-	const char *eventData = eventName + strlen(eventName) + 1;
-
-	
-	pubqLogger.trace("ttl=%d flags=0x%2x size=%d eventName=%s", eventDataStruct->ttl, (int)eventDataStruct->flags, (int)eventDataStruct->size, eventName);
-	pubqLogger.trace("eventData=%s", eventData);
+// Hash of the 3 bytes at p, used to find the previous position of the same 3 bytes
+static inline uint16_t compressionHash(const uint8_t *p) {
+	uint32_t value = (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16);
+	return (uint16_t)((uint32_t)(value * 2654435761UL) >> 24) % PublishQueueCompression::HASH_SIZE;
 }
 
+// [static]
+size_t PublishQueueCompression::compress(const uint8_t *src, size_t srcLen, uint8_t *dst, size_t dstLen, uint16_t *hashTable) {
+	const uint16_t NO_ENTRY = 0xffff;
 
-void PublishQueueAsyncBase::threadFunction() {
-	// Call the stateHandler forever
-	while(true) {
-		stateHandler(*this);
-		os_thread_yield();
+	for(size_t ii = 0; ii < HASH_SIZE; ii++) {
+		hashTable[ii] = NO_ENTRY;
 	}
-}
 
-void PublishQueueAsyncBase::startState() {
-	// If we had other initialization to do, this would be a good place to do it.
+	size_t in = 0;
+	size_t out = 0;
+	size_t control = 0;
+	uint8_t bit = 8;
 
-	// Ready to process events
-	stateHandler = &PublishQueueAsyncBase::checkQueueState;
-}
+	while(in < srcLen) {
+		if (bit == 8) {
+			// Start a new group
+			if (out >= dstLen) {
+				return 0;
+			}
+			control = out++;
+			dst[control] = 0;
+			bit = 0;
+		}
 
+		size_t matchLen = 0;
+		size_t matchOffset = 0;
+		if (in + MIN_MATCH <= srcLen) {
+			uint16_t hash = compressionHash(&src[in]);
+			uint16_t candidate = hashTable[hash];
+			hashTable[hash] = (uint16_t) in;
+
+			if (candidate != NO_ENTRY && in - candidate <= WINDOW_SIZE) {
+				size_t maxLen = srcLen - in;
+				if (maxLen > MAX_MATCH) {
+					maxLen = MAX_MATCH;
+				}
+				while(matchLen < maxLen && src[candidate + matchLen] == src[in + matchLen]) {
+					matchLen++;
+				}
+				matchOffset = in - candidate;
+			}
+		}
 
-void PublishQueueAsyncBase::checkQueueState() {
-	if (!pausePublishing && Particle.connected() && millis() - lastPublish >= 1010) {
+		if (matchLen >= MIN_MATCH) {
+			if (out + 2 > dstLen) {
+				return 0;
+			}
+			dst[control] |= (uint8_t)(1 << bit);
+			dst[out++] = (uint8_t)(matchOffset - 1);
+			dst[out++] = (uint8_t)((((matchOffset - 1) >> 8) << 6) | (matchLen - MIN_MATCH));
 
-		PublishQueueEventData *data = getOldestEvent();
-		if (data) {
-			// We have an event and can probably publish
-			isSending = true;
+			// Add the positions inside the match so later matches can refer to them
+			for(size_t ii = in + 1; ii < in + matchLen && ii + MIN_MATCH <= srcLen; ii++) {
+				hashTable[compressionHash(&src[ii])] = (uint16_t) ii;
+			}
+			in += matchLen;
+		}
+		else {
+			if (out >= dstLen) {
+				return 0;
+			}
+			dst[out++] = src[in++];
+		}
+		bit++;
+	}
 
-			const char *buf = reinterpret_cast<const char *>(data);
-			const char *eventName = &buf[sizeof(PublishQueueEventData)];
-			const char *eventData = eventName;
-			eventData += strlen(eventData) + 1;
+	return out;
+}
 
-			PublishFlags flags(PublishFlag(data->flags));
+// [static]
+bool PublishQueueCompression::decompress(const uint8_t *src, size_t srcLen, uint8_t *dst, size_t dstLen) {
+	size_t in = 0;
+	size_t out = 0;
 
-			pubqLogger.info("publishing %s %s ttl=%d flags=%x", eventName, eventData, data->ttl, flags.value());
+	while(out < dstLen) {
+		if (in >= srcLen) {
+			return false;
+		}
+		uint8_t control = src[in++];
 
-			auto request = Particle.publish(eventName, eventData, data->ttl, flags);
+		for(uint8_t bit = 0; bit < 8 && out < dstLen; bit++) {
+			if ((control & (1 << bit)) != 0) {
+				if (in + 2 > srcLen) {
+					return false;
+				}
+				size_t matchOffset = ((size_t)src[in] | ((size_t)(src[in + 1] >> 6) << 8)) + 1;
+				size_t matchLen = (src[in + 1] & 0x3f) + MIN_MATCH;
+				in += 2;
 
-			// Use this technique of looping because the future will not be handled properly
-			// when waiting in a worker thread like this.
-			while(!request.isDone()) {
-				delay(1);
-				if (!isSending) {
-					pubqLogger.info("publish canceled");
-					return;
+				if (matchOffset > out || matchLen > dstLen - out) {
+					return false;
+				}
+				// Byte by byte because the match can overlap the output
+				for(size_t ii = 0; ii < matchLen; ii++, out++) {
+					dst[out] = dst[out - matchOffset];
 				}
-			}
-			bool bResult = request.isSucceeded();
-			if (bResult) {
-				// Successfully published
-				pubqLogger.info("published successfully");
-				discardOldEvent(false);
 			}
 			else {
-				// Did not successfully transmit, try again after retry time
-				// This string is searched for in the automated test suite, if edited the
-				// test suite must also be edited
-				pubqLogger.info("publish failed, will retry in %lu ms", failureRetryMs);
-				stateHandler = &PublishQueueAsyncBase::waitRetryState;
+				if (in >= srcLen) {
+					return false;
+				}
+				dst[out++] = src[in++];
 			}
-			isSending = false;
-			lastPublish = millis();
-		}
-		else {
-			// No event
 		}
 	}
-	else {
-		// Not cloud connected or can't publish yet (not connected or published too recently)
-	}
 
+	return true;
 }
 
-void PublishQueueAsyncBase::waitRetryState() {
-	if (millis() - lastPublish >= failureRetryMs) {
-		stateHandler = &PublishQueueAsyncBase::checkQueueState;
-	}
+void PublishQueueISRRing::setup(uint16_t size) {
+	this->size = size & ~3;
+	buf = new uint8_t[this->size];
 }
 
+bool PublishQueueISRRing::put(const char *eventName, size_t nameLen, const char *data, size_t dataLen, int ttl, uint8_t flags) {
+	size_t recordSize = (sizeof(PublishQueueISRRecord) + nameLen + dataLen + 2 + 3) & ~3;
+	uint16_t h = head.load(std::memory_order_relaxed);
+	uint16_t t = tail.load(std::memory_order_acquire);
 
-// [static]
-void PublishQueueAsyncBase::threadFunctionStatic(void *param) {
-	static_cast<PublishQueueAsync *>(param)->threadFunction();
-}
+	// head == tail means empty, so a record can't end at tail
+	uint16_t offset;
+	if (h >= t && (size_t)h + recordSize < (size_t)size + ((t != 0) ? 1 : 0)) {
+		offset = h;
+	}
+	else
+	if (h >= t && recordSize < t) {
+		// Wrap to the start of the buffer
+		if ((size_t)size - h >= sizeof(PublishQueueISRRecord)) {
+			reinterpret_cast<PublishQueueISRRecord *>(&buf[h])->size = 0;
+		}
+		offset = 0;
+	}
+	else
+	if (h < t && (size_t)h + recordSize < t) {
+		offset = h;
+	}
+	else {
+		return false;
+	}
 
+	PublishQueueISRRecord *record = reinterpret_cast<PublishQueueISRRecord *>(&buf[offset]);
+	record->size = (uint16_t) recordSize;
+	record->flags = flags;
+	record->nameLen = (uint8_t) nameLen;
+	record->ttl = ttl;
 
-PublishQueueAsyncRetained::PublishQueueAsyncRetained(uint8_t *retainedBuffer, uint16_t retainedBufferSize) :
-		retainedBuffer(retainedBuffer), retainedBufferSize(retainedBufferSize) {
+	char *cp = (char *)&record[1];
+	memcpy(cp, eventName, nameLen + 1);
+	memcpy(&cp[nameLen + 1], data, dataLen + 1);
 
+	head.store((uint16_t)((offset + recordSize) % size), std::memory_order_release);
+	return true;
 }
 
-PublishQueueAsyncRetained::~PublishQueueAsyncRetained() {
+const PublishQueueISRRecord *PublishQueueISRRing::peek() {
+	uint16_t t = tail.load(std::memory_order_relaxed);
+	uint16_t h = head.load(std::memory_order_acquire);
+	if (t == h) {
+		return NULL;
+	}
 
+	if ((size_t)size - t < sizeof(PublishQueueISRRecord) || reinterpret_cast<PublishQueueISRRecord *>(&buf[t])->size == 0) {
+		// The producer wrapped to the start of the buffer
+		t = 0;
+	}
+	return reinterpret_cast<const PublishQueueISRRecord *>(&buf[t]);
 }
 
-void PublishQueueAsyncRetained::setup() {
-// Initialize the retained buffer
-	bool initBuffer = false;
+void PublishQueueISRRing::remove(const PublishQueueISRRecord *record) {
+	size_t offset = (const uint8_t *)record - buf;
+	tail.store((uint16_t)((offset + record->size) % size), std::memory_order_release);
+}
 
-	volatile PublishQueueHeader *hdr = reinterpret_cast<PublishQueueHeader *>(retainedBuffer);
-	if (hdr->magic == PUBLISH_QUEUE_HEADER_MAGIC && hdr->size == retainedBufferSize) {
-		// Calculate the next write offset
-		uint8_t *end = &retainedBuffer[retainedBufferSize];
+PublishQueueAsyncBase::PublishQueueAsyncBase() {
 
-		pubqLogger.trace("retained numEvents=%d", (int)hdr->numEvents);
+}
 
-		nextFree = &retainedBuffer[sizeof(PublishQueueHeader)];
-		for(uint16_t ii = 0; ii < hdr->numEvents; ii++) {
-			nextFree = skipEvent(nextFree);
-			if (nextFree > end) {
-				// Overflowed buffer, must be corrupted
-				initBuffer = true;
-				break;
-			}
+PublishQueueAsyncBase::~PublishQueueAsyncBase() {
+	for(PublishQueueAsyncBase **p = &firstInstance; *p != NULL; p = &(*p)->nextInstance) {
+		if (*p == this) {
+			*p = nextInstance;
+			break;
 		}
 	}
-	else {
-		// Not valid
-		initBuffer = true;
-	}
+}
 
-	//initBuffer = true; // Uncomment to discard old data
+void PublishQueueAsyncBase::setup() {
 
-	if (initBuffer) {
-		hdr->magic = PUBLISH_QUEUE_HEADER_MAGIC;
-		hdr->size = retainedBufferSize;
-		hdr->numEvents = 0;
-		nextFree = &retainedBuffer[sizeof(PublishQueueHeader)];
+	if (system_thread_get_state(nullptr) != spark::feature::ENABLED) {
+		PUBLISH_QUEUE_LOG_ERROR("SYSTEM_THREAD(ENABLED) is required");
+		return;
 	}
-	pubqLogger.trace("at init numEvents=%d nextFree=%d", (int)hdr->numEvents, (int)(nextFree - retainedBuffer));
 
-	// Do superclass setup (starting the thread)
-	PublishQueueAsyncBase::setup();
-}
+	haveSetup = true;
 
-bool PublishQueueAsyncRetained::publishCommon(const char *eventName, const char *data, int ttl, PublishFlags flags1, PublishFlags flags2) {
+	if (inFlight == NULL) {
+		inFlight = new PublishQueueInFlight[pipelineDepth];
+		if (pipelineDepth > 1) {
+			inFlightBuf = new char[pipelineDepth * IN_FLIGHT_BUF_SIZE];
+		}
+		else
+		if (batching) {
+			batchBuf = new char[particle::protocol::MAX_EVENT_DATA_LENGTH + 1];
+		}
+	}
 
-	if (!haveSetup) {
-		setup();
+	if (compression && compressBuf == NULL) {
+		compressBuf = new uint8_t[particle::protocol::MAX_EVENT_DATA_LENGTH];
+		compressHash = new uint16_t[PublishQueueCompression::HASH_SIZE];
+		if (expandBuf == NULL) {
+			expandBuf = new uint8_t[EVENT_BUF_SIZE];
+		}
 	}
 
-	if (data == NULL) {
-		data = "";
+	if (isrQueueSize != 0) {
+		isrRing.setup(isrQueueSize);
 	}
 
-	// Size is the size of the header (8 bytes), the two c-strings (with null terminators), rounded up to a multiple of 4
-	size_t size = sizeof(PublishQueueEventData) + strlen(eventName) + strlen(data) + 2;
-	if ((size % 4) != 0) {
-		size += 4 - (size % 4);
+	os_mutex_create(&mutex);
+	os_mutex_create(&reserveMutex);
+
+	if (tieredQueue != NULL) {
+		// A tier of a PublishQueueAsyncTiered is sent by the tiered queue's thread
+		return;
 	}
 
-	pubqLogger.info("queueing eventName=%s data=%s ttl=%d flags1=%d flags2=%d size=%d", eventName, data, ttl, flags1.value(), flags2.value(), size);
+	os_queue_create(&wakeQueue, sizeof(uint8_t), 1, NULL);
 
-	if  (size > (retainedBufferSize - sizeof(PublishQueueHeader))) {
-		// Special case: event is larger than the retained buffer. Rather than throw out all events
-		// before discovering this, check that case first
-		return false;
+	if (firstInstance == NULL) {
+		System.on(cloud_status, systemEventHandler);
 	}
+	nextInstance = firstInstance;
+	firstInstance = this;
 
-	while(true) {
-		{
-			StMutexLock lock(this);
+	thread = new Thread("PublishQueueAsync", threadFunctionStatic, this, OS_THREAD_PRIORITY_DEFAULT, 2048);
 
-			uint8_t *end = &retainedBuffer[retainedBufferSize];
-			if ((size_t)(end - nextFree) >= size) {
-				// There is room to fit this
-				pubqLogger.trace("saving event at nextFree=%d", (int)(nextFree - retainedBuffer));
+}
 
-				PublishQueueEventData *eventData = reinterpret_cast<PublishQueueEventData *>(nextFree);
-				eventData->ttl = ttl;
-				eventData->flags = flags1.value() | flags2.value();
-				eventData->size = size;
+void PublishQueueAsyncBase::mutexLock() const {
+	os_mutex_lock(mutex);
+}
 
-				char *cp = reinterpret_cast<char *>(nextFree);
-				cp += sizeof(PublishQueueEventData);
+void PublishQueueAsyncBase::mutexUnlock() const {
+	os_mutex_unlock(mutex);
+}
 
-				strcpy(cp, eventName);
-				cp += strlen(cp) + 1;
+void PublishQueueAsyncBase::logPublishQueueEventData(const void *data) const {
+	const PublishQueueEventData *eventDataStruct = (const PublishQueueEventData *)data;
+	const char *eventName = getEventName(eventDataStruct);
+	const char *eventData = isEventCompressed(eventDataStruct) ? "(compressed)" : getEventData(eventDataStruct);
 
-				strcpy(cp, data);
+	
+	PUBLISH_QUEUE_LOG_TRACE("ttl=%d flags=0x%2x size=%d eventName=%s", eventDataStruct->ttl, (int)eventDataStruct->flags, (int)eventDataStruct->size, eventName);
+	PUBLISH_QUEUE_LOG_TRACE("eventData=%s", eventData);
+}
 
-				nextFree += size;
+// [static]
+size_t PublishQueueAsyncBase::getEventSize(size_t nameLen, size_t dataLen) {
+	if (nameLen > MAX_EVENT_NAME_LEN || dataLen > particle::protocol::MAX_EVENT_DATA_LENGTH) {
+		return 0;
+	}
 
+	// Size is the size of the header (16 bytes), the two c-strings (with null terminators), rounded up to a multiple of 4
+	return (sizeof(PublishQueueEventData) + nameLen + dataLen + 2 + 3) & ~3;
+}
 
-				PublishQueueHeader *hdr = reinterpret_cast<PublishQueueHeader *>(retainedBuffer);
-				hdr->numEvents++;
+// [static]
+void PublishQueueAsyncBase::writeEventData(uint8_t *buf, const char *eventName, size_t nameLen, const char *data, size_t dataLen, int ttl, uint8_t flags, size_t size, uint8_t priority) {
+	writeEventHeader(buf, eventName, nameLen, ttl, flags, size, priority);
 
-				pubqLogger.trace("after saving numEvents=%d nextFree=%d end=%d", (int)hdr->numEvents, (int)(nextFree - retainedBuffer), retainedBufferSize);
-				return true;
-			}
+	uint8_t *cp = &buf[sizeof(PublishQueueEventData) + nameLen + 1];
+	memcpy(cp, data, dataLen + 1);
+	cp += dataLen + 1;
 
-			// If there's only one event, there's nothing left to discard, this event is too large
-			// to fit with the existing first event (which we can't delete because it might be
-			// in the process of being sent)
-			PublishQueueHeader *hdr = reinterpret_cast<PublishQueueHeader *>(retainedBuffer);
-			if (hdr->numEvents == 1) {
-				return false;
-			}
-		}
+	// Zero the padding so the stored record is deterministic
+	while(cp < &buf[size]) {
+		*cp++ = 0;
+	}
 
-		// Discard the oldest event (false) if we're not currently sending.
-		// If we are sending (isSending=true), discard the second oldest event
-		if (!discardOldEvent(isSending)) {
-			// There isn't an event to discard, so we don't have enough room
-			return false;
-		}
+	updateEventCrc(reinterpret_cast<PublishQueueEventData *>(buf));
+}
+
+void PublishQueueAsyncBase::writeEventHeader(uint8_t *buf, const char *eventName, size_t nameLen, int ttl, uint8_t flags, size_t size, uint8_t priority) {
+	PublishQueueEventData *eventData = reinterpret_cast<PublishQueueEventData *>(buf);
+	eventData->ttl = ttl;
+	eventData->flags = flags;
+	eventData->nameLen = (uint8_t) nameLen;
+	eventData->size = (uint16_t) size;
+	if (priority > PUBLISH_QUEUE_PRIORITY_MAX) {
+		priority = PUBLISH_QUEUE_PRIORITY_MAX;
 	}
+	eventData->recordFlags = (uint16_t)(priority << PUBLISH_QUEUE_RECORD_PRIORITY_SHIFT);
+	eventData->crc = 0;
+	eventData->timestamp = Time.isValid() ? (uint32_t) Time.now() : 0;
 
-	// Not reached
-	return false;
+	memcpy(&buf[sizeof(PublishQueueEventData)], eventName, nameLen + 1);
 }
 
+size_t PublishQueueAsyncBase::getStoredEventSize(size_t nameLen, const char *data, size_t dataLen) {
+	size_t size = getEventSize(nameLen, dataLen);
 
-PublishQueueEventData *PublishQueueAsyncRetained::getOldestEvent() {
-	// This entire function holds a mutex lock that's released when returning
-	StMutexLock lock(this);
-	PublishQueueEventData *eventData = NULL;
+	compressedLen = 0;
+	if (size == 0 || !compression || compressBuf == NULL || dataLen < 16) {
+		return size;
+	}
 
-	volatile PublishQueueHeader *hdr = reinterpret_cast<PublishQueueHeader *>(retainedBuffer);
-	if (hdr->numEvents > 0) {
-		eventData = reinterpret_cast<PublishQueueEventData *>(&retainedBuffer[sizeof(PublishQueueHeader)]);
+	// The compressed data and its 2-byte length must be smaller than the data and its null terminator
+	size_t len = PublishQueueCompression::compress(reinterpret_cast<const uint8_t *>(data), dataLen, compressBuf, dataLen - 2, compressHash);
+	if (len == 0) {
+		return size;
 	}
 
-	return eventData;
+	size_t compressedSize = (sizeof(PublishQueueEventData) + nameLen + 1 + 2 + len + 3) & ~3;
+	if (compressedSize >= size) {
+		return size;
+	}
+
+	compressedLen = len;
+	return compressedSize;
 }
 
-bool PublishQueueAsyncRetained::clearEvents() {
+void PublishQueueAsyncBase::writeStoredEvent(uint8_t *buf, const char *eventName, size_t nameLen, const char *data, size_t dataLen, int ttl, uint8_t flags, size_t size, uint8_t priority) {
+	if (compressedLen == 0) {
+		writeEventData(buf, eventName, nameLen, data, dataLen, ttl, flags, size, priority);
+		return;
+	}
 
-	// This entire function holds a mutex lock that's released when returning
-	StMutexLock lock(this);
+	// Write the header and name with empty data, then replace the data
+	writeEventData(buf, eventName, nameLen, "", 0, ttl, flags, size, priority);
 
-	PublishQueueHeader *hdr = reinterpret_cast<PublishQueueHeader *>(retainedBuffer);
-	hdr->numEvents = 0;
-	nextFree = &retainedBuffer[sizeof(PublishQueueHeader)];
-	isSending = false;
-	lastPublish = 0;
+	PublishQueueEventData *eventData = reinterpret_cast<PublishQueueEventData *>(buf);
+	eventData->recordFlags |= PUBLISH_QUEUE_RECORD_FLAG_COMPRESSED;
 
-    pubqLogger.trace("clearEvents numEvents=%d size=%d", (int)hdr->numEvents, (int)hdr->size);
+	uint8_t *cp = &buf[sizeof(PublishQueueEventData) + nameLen + 1];
+	*cp++ = (uint8_t)(dataLen & 0xff);
+	*cp++ = (uint8_t)(dataLen >> 8);
+	memcpy(cp, compressBuf, compressedLen);
+	cp += compressedLen;
 
-	return true;
+	while(cp < &buf[size]) {
+		*cp++ = 0;
+	}
+
+	updateEventCrc(eventData);
 }
 
-uint8_t *PublishQueueAsyncRetained::skipEvent(uint8_t *start) {
-	start += sizeof(PublishQueueEventData);
-	start += strlen(reinterpret_cast<char *>(start)) + 1;
-	start += strlen(reinterpret_cast<char *>(start)) + 1;
+size_t PublishQueueAsyncBase::finishReservedEvent(uint8_t *buf, size_t dataLen) {
+	PublishQueueEventData *eventData = reinterpret_cast<PublishQueueEventData *>(buf);
+	uint8_t *cp = &buf[sizeof(PublishQueueEventData) + eventData->nameLen + 1];
 
-	// Align
-	size_t offset = start - retainedBuffer;
-	if ((offset % 4) != 0) {
-		start += 4 - (offset % 4);
+	char *data = reinterpret_cast<char *>(cp);
+	data[dataLen] = 0;
+
+	size_t size = getStoredEventSize(eventData->nameLen, data, dataLen);
+	if (compressedLen == 0) {
+		cp += dataLen + 1;
+	}
+	else {
+		// The data was compressed into compressBuf, so it can be overwritten
+		eventData->recordFlags |= PUBLISH_QUEUE_RECORD_FLAG_COMPRESSED;
+		*cp++ = (uint8_t)(dataLen & 0xff);
+		*cp++ = (uint8_t)(dataLen >> 8);
+		memcpy(cp, compressBuf, compressedLen);
+		cp += compressedLen;
 	}
 
+	while(cp < &buf[size]) {
+		*cp++ = 0;
+	}
+	eventData->size = (uint16_t) size;
+	updateEventCrc(eventData);
 
-	return start;
+	return size;
 }
 
+const PublishQueueEventData *PublishQueueAsyncBase::getUncompressedEvent(const PublishQueueEventData *eventData) {
+	if (!isEventCompressed(eventData)) {
+		return eventData;
+	}
 
-bool PublishQueueAsyncRetained::discardOldEvent(bool secondEvent) {
-	// This entire function holds a mutex lock that's released when returning
-	StMutexLock lock(this);
+	if (expandBuf == NULL) {
+		// Compression was enabled when this event was queued, but not now
+		expandBuf = new uint8_t[EVENT_BUF_SIZE];
+	}
+	expandEvent(eventData, expandBuf);
+	return reinterpret_cast<const PublishQueueEventData *>(expandBuf);
+}
+
+// [static]
+bool PublishQueueAsyncBase::expandEvent(const PublishQueueEventData *src, uint8_t *dst) {
+	if (!isEventCompressed(src)) {
+		memcpy(dst, src, src->size);
+		return true;
+	}
 
-	PublishQueueHeader *hdr = reinterpret_cast<PublishQueueHeader *>(retainedBuffer);
-	uint8_t *start = &retainedBuffer[sizeof(PublishQueueHeader)];
-	uint8_t *end = &retainedBuffer[retainedBufferSize];
+	const uint8_t *srcBuf = reinterpret_cast<const uint8_t *>(src);
+	size_t dataOffset = sizeof(PublishQueueEventData) + src->nameLen + 1;
+	size_t dataLen = 0;
+	bool valid = false;
 
-	if (secondEvent) {
-		if (hdr->numEvents < 2) {
-			return false;
+	if (dataOffset + 2 <= src->size) {
+		dataLen = (size_t)srcBuf[dataOffset] | ((size_t)srcBuf[dataOffset + 1] << 8);
+		if (dataLen <= particle::protocol::MAX_EVENT_DATA_LENGTH) {
+			valid = PublishQueueCompression::decompress(&srcBuf[dataOffset + 2], src->size - dataOffset - 2, &dst[dataOffset], dataLen);
 		}
-		start = skipEvent(start);
 	}
-	else {
-		if (hdr->numEvents < 1) {
-			return false;
-		}
+	if (!valid) {
+		PUBLISH_QUEUE_LOG_ERROR("compressed event data is not valid, sending empty data");
+		dataLen = 0;
 	}
 
-	// Remove the event at start
-	uint8_t *next = skipEvent(start);
-	size_t len = next - start;
+	memcpy(dst, src, dataOffset);
 
-	pubqLogger.trace("discardOldestEvent secondEvent=%d start=%d next=%d nextFree=%d", (int)secondEvent, (int)(start - retainedBuffer), (int)(next - retainedBuffer), (int)(nextFree - retainedBuffer));
+	PublishQueueEventData *eventData = reinterpret_cast<PublishQueueEventData *>(dst);
+	eventData->recordFlags &= ~PUBLISH_QUEUE_RECORD_FLAG_COMPRESSED;
+	eventData->size = (uint16_t) getEventSize(src->nameLen, dataLen);
 
-	size_t after = end - next;
-	if (after > 0) {
-		// Move events down
-		memmove(start, next, after);
+	uint8_t *cp = &dst[dataOffset + dataLen];
+	while(cp < &dst[eventData->size]) {
+		*cp++ = 0;
 	}
 
-	nextFree -= len;
-	hdr->numEvents--;
+	return valid;
+}
+
+// [static]
+bool PublishQueueAsyncBase::isValidEventHeader(const PublishQueueEventData *eventData, size_t maxSize) {
+	return eventData->nameLen <= MAX_EVENT_NAME_LEN &&
+		eventData->size >= getEventSize(eventData->nameLen, 0) &&
+		(eventData->size % 4) == 0 &&
+		eventData->size <= EVENT_BUF_SIZE &&
+		eventData->size <= maxSize;
+}
 
-	pubqLogger.trace("after discardOldestEvent numEvents=%d nextFree=%d", hdr->numEvents, (int)(nextFree - retainedBuffer));
+/**
+ * @brief Adds bytes to a CRC-16/CCITT-FALSE (polynomial 0x1021) without a table
+ */
+static uint16_t updateCrc16(uint16_t crc, const uint8_t *buf, size_t len) {
+	for(size_t ii = 0; ii < len; ii++) {
+		uint8_t x = (uint8_t)(crc >> 8) ^ buf[ii];
+		x ^= x >> 4;
+		crc = (uint16_t)((crc << 8) ^ ((uint16_t)x << 12) ^ ((uint16_t)x << 5) ^ x);
+	}
+	return crc;
+}
 
+// [static]
+uint16_t PublishQueueAsyncBase::getEventCrc(const PublishQueueEventData *eventData) {
+	PublishQueueEventData header = *eventData;
+	header.recordFlags &= ~PUBLISH_QUEUE_RECORD_FLAG_DELETED;
+	header.crc = 0;
+
+	uint16_t crc = updateCrc16(0xffff, reinterpret_cast<const uint8_t *>(&header), sizeof(PublishQueueEventData));
+	if (eventData->size > sizeof(PublishQueueEventData)) {
+		crc = updateCrc16(crc, reinterpret_cast<const uint8_t *>(eventData) + sizeof(PublishQueueEventData), eventData->size - sizeof(PublishQueueEventData));
+	}
+	return crc;
+}
 
-	return true;
+// [static]
+bool PublishQueueAsyncBase::isValidEvent(const PublishQueueEventData *eventData, size_t maxSize) {
+	return isValidEventHeader(eventData, maxSize) && eventData->crc == getEventCrc(eventData);
 }
 
-uint16_t PublishQueueAsyncRetained::getNumEvents() const {
-	uint16_t numEvents = 0;
+// [static]
+size_t PublishQueueAsyncBase::convertEventDataV1(const uint8_t *src, size_t srcLen, uint8_t *dst, size_t &srcSize) {
+	if (srcLen < PUBLISH_QUEUE_EVENT_DATA_V1_SIZE + 2) {
+		return 0;
+	}
 
-	{
-		StMutexLock lock(this);
+	// The c-strings must be null terminated within srcLen
+	const char *eventName = reinterpret_cast<const char *>(&src[PUBLISH_QUEUE_EVENT_DATA_V1_SIZE]);
+	size_t remaining = srcLen - PUBLISH_QUEUE_EVENT_DATA_V1_SIZE;
 
-		PublishQueueHeader *hdr = reinterpret_cast<PublishQueueHeader *>(retainedBuffer);
-		numEvents = hdr->numEvents;
+	size_t nameLen = strnlen(eventName, remaining);
+	if (nameLen >= remaining) {
+		return 0;
 	}
+	const char *data = eventName + nameLen + 1;
+	remaining -= nameLen + 1;
 
-	return numEvents;
+	size_t dataLen = strnlen(data, remaining);
+	if (dataLen >= remaining) {
+		return 0;
+	}
+
+	srcSize = (PUBLISH_QUEUE_EVENT_DATA_V1_SIZE + nameLen + dataLen + 2 + 3) & ~3;
+	if (srcSize > srcLen) {
+		return 0;
+	}
+
+	size_t size = getEventSize(nameLen, dataLen);
+	if (size == 0) {
+		return 0;
+	}
+
+	// ttl and flags are at the same offsets in version 1 and version 2
+	const PublishQueueEventData *oldEventData = reinterpret_cast<const PublishQueueEventData *>(src);
+	writeEventData(dst, eventName, nameLen, data, dataLen, oldEventData->ttl, oldEventData->flags, size);
+
+	// The time the event was queued is not known
+	reinterpret_cast<PublishQueueEventData *>(dst)->timestamp = 0;
+	updateEventCrc(reinterpret_cast<PublishQueueEventData *>(dst));
+
+	return size;
+}
+
+
+void PublishQueueAsyncBase::threadFunction() {
+	// Call the stateHandler forever
+	while(true) {
+		drainISRQueue();
+		stateHandler(*this);
+		threadTasks();
+
+		// Sleep until woken by wakeThread() or until there's something to check
+		system_tick_t waitMs = getThreadTasksWaitMs();
+		if (threadWaitMs < waitMs) {
+			waitMs = threadWaitMs;
+		}
+		uint8_t item;
+		os_queue_take(wakeQueue, &item, waitMs, NULL);
+	}
 }
 
+bool PublishQueueAsyncBase::publishFromISRCommon(const char *eventName, const char *data, int ttl, PublishFlags flags1, PublishFlags flags2) {
+	if (data == NULL) {
+		data = "";
+	}
+	size_t nameLen = strlen(eventName);
+	size_t dataLen = strlen(data);
+
+	// No logging here, it's not safe from an ISR
+	if (nameLen > MAX_EVENT_NAME_LEN || dataLen > particle::protocol::MAX_EVENT_DATA_LENGTH ||
+		!isrRing.put(eventName, nameLen, data, dataLen, ttl, flags1.value() | flags2.value())) {
+		isrDroppedCount++;
+		return false;
+	}
+
+	wakeThread();
+	return true;
+}
+
+void PublishQueueAsyncBase::drainISRQueue() {
+	const PublishQueueISRRecord *record;
+	while((record = isrRing.peek()) != NULL) {
+		// Queued directly from the ring, which isn't overwritten until remove()
+		PublishFlags flags(PublishFlag(record->flags));
+		if (!publishCommon(PublishQueueISRRing::getEventName(record), PublishQueueISRRing::getEventData(record), record->ttl, flags)) {
+			PUBLISH_QUEUE_LOG_INFO("could not queue event %s from publishFromISR", PublishQueueISRRing::getEventName(record));
+			isrDroppedCount++;
+		}
+		isrRing.remove(record);
+	}
+}
+
+PublishQueueReservation PublishQueueAsyncBase::reserve(const char *eventName, size_t maxDataLen, int ttl, PublishFlags flags1, PublishFlags flags2) {
+	if (reservedThread == os_thread_current(NULL)) {
+		// The mutex is not recursive, so reserving again from the same thread would deadlock
+		PUBLISH_QUEUE_LOG_ERROR("reserve called before the previous reservation was released");
+		return PublishQueueReservation();
+	}
 
+	size_t nameLen = strlen(eventName);
+	if (getEventSize(nameLen, maxDataLen) == 0) {
+		// Event name or data is too long to publish
+		metrics.rejected++;
+		return PublishQueueReservation();
+	}
+
+	size_t size = getEventSize(nameLen, maxDataLen);
+	if (!reserveEvent(size)) {
+		metrics.rejected++;
+		return PublishQueueReservation();
+	}
+
+	// Waits for a reservation held by another thread. The queue mutex isn't locked while it's held.
+	os_mutex_lock(reserveMutex);
+	reservedThread = os_thread_current(NULL);
+
+	if (reserveBuf == NULL) {
+		reserveBuf = new uint8_t[EVENT_BUF_SIZE];
+	}
+	writeEventHeader(reserveBuf, eventName, nameLen, ttl, flags1.value() | flags2.value(), size);
+	return PublishQueueReservation(this, reinterpret_cast<char *>(&reserveBuf[sizeof(PublishQueueEventData) + nameLen + 1]), maxDataLen);
+}
+
+PublishQueueReservation::PublishQueueReservation(PublishQueueReservation &&other) : queue(other.queue), buf(other.buf), maxLen(other.maxLen) {
+	other.queue = NULL;
+	other.buf = NULL;
+}
+
+PublishQueueReservation &PublishQueueReservation::operator=(PublishQueueReservation &&other) {
+	if (this != &other) {
+		abort();
+		queue = other.queue;
+		buf = other.buf;
+		maxLen = other.maxLen;
+		other.queue = NULL;
+		other.buf = NULL;
+	}
+	return *this;
+}
+
+bool PublishQueueReservation::commit(size_t dataLen) {
+	if (queue == NULL) {
+		return false;
+	}
+	PublishQueueAsyncBase *q = queue;
+	queue = NULL;
+	buf = NULL;
+
+	if (dataLen > maxLen) {
+		dataLen = maxLen;
+	}
+
+	size_t size;
+	{
+		// Other threads can use compressBuf
+		StMutexLock lock(q);
+		size = q->finishReservedEvent(q->reserveBuf, dataLen);
+	}
+	bool result = q->commitEvent(q->reserveBuf, size);
+
+	q->reservedThread = NULL;
+	os_mutex_unlock(q->reserveMutex);
+	return result;
+}
+
+void PublishQueueReservation::abort() {
+	if (queue == NULL) {
+		return;
+	}
+	PublishQueueAsyncBase *q = queue;
+	queue = NULL;
+	buf = NULL;
+
+	// The queue isn't changed until commit(), so there's nothing to undo
+	q->reservedThread = NULL;
+	os_mutex_unlock(q->reserveMutex);
+}
+
+uint16_t PublishQueueAsyncBase::readRecords(uint8_t *buf, size_t bufSize, size_t &len) {
+	uint16_t count = 0;
+	uint16_t limit = 0;
+
+	len = 0;
+	forEachEvent([&](const PublishQueueEventData *eventData) {
+		if (count == 0) {
+			// Events queued in a higher priority lane go before the other lanes, so only the lane being
+			// sent stays at the start of the order. This is read with the mutex locked.
+			limit = getActiveLaneEvents();
+		}
+		if (count >= limit || len + eventData->size > bufSize) {
+			return false;
+		}
+		memcpy(&buf[len], eventData, eventData->size);
+		len += eventData->size;
+		count++;
+		return true;
+	});
+	return count;
+}
+
+PublishQueueMetrics PublishQueueAsyncBase::getMetrics() const {
+	PublishQueueMetrics result;
+
+	result.enqueued = metrics.enqueued;
+	result.published = metrics.published;
+	result.failed = metrics.failed;
+	result.evicted = metrics.evicted;
+	result.rejected = metrics.rejected;
+	result.expired = expiredCount;
+	result.replaced = replacedCount;
+	result.isrDropped = isrDroppedCount;
+	result.corrupted = metrics.corrupted;
+	result.eventsInUse = metrics.eventsInUse;
+	result.eventsHighWater = metrics.eventsHighWater;
+	result.bytesInUse = metrics.bytesInUse;
+	result.bytesHighWater = metrics.bytesHighWater;
+	result.retrying = inBackoff;
+	result.consecutiveFailures = consecutiveFailures;
+
+	uint32_t latencyCount = metrics.latencyCount;
+	if (latencyCount != 0) {
+		result.latencyMinMs = metrics.latencyMinMs;
+		result.latencyAvgMs = metrics.latencyTotalMs / latencyCount;
+		result.latencyMaxMs = metrics.latencyMaxMs;
+	}
+	return result;
+}
+
+void PublishQueueAsyncBase::resetMetrics() {
+	metrics.enqueued = 0;
+	metrics.published = 0;
+	metrics.failed = 0;
+	metrics.evicted = 0;
+	metrics.rejected = 0;
+	expiredCount = 0;
+	replacedCount = 0;
+	isrDroppedCount = 0;
+	metrics.corrupted = 0;
+	metrics.eventsHighWater = metrics.eventsInUse.load();
+	metrics.bytesHighWater = metrics.bytesInUse.load();
+	metrics.latencyCount = 0;
+	metrics.latencyTotalMs = 0;
+	metrics.latencyMinMs = 0;
+	metrics.latencyMaxMs = 0;
+}
+
+// Raises an atomic maximum to value. Another thread can change it between the load and the store,
+// for example resetMetrics(), so the store is retried until it succeeds or value is no longer larger.
+static void updateMaximum(std::atomic<uint32_t> &maximum, uint32_t value) {
+	uint32_t old = maximum.load();
+	while(value > old && !maximum.compare_exchange_weak(old, value)) {
+	}
+}
+
+void PublishQueueAsyncBase::updateUsageMetrics() {
+	uint32_t numEvents, numBytes;
+	getQueueUsage(numEvents, numBytes);
+
+	metrics.eventsInUse = numEvents;
+	updateMaximum(metrics.eventsHighWater, numEvents);
+	metrics.bytesInUse = numBytes;
+	updateMaximum(metrics.bytesHighWater, numBytes);
+}
+
+void PublishQueueAsyncBase::eventQueued() {
+	metrics.enqueued++;
+	updateUsageMetrics();
+	wakeThread();
+}
+
+void PublishQueueAsyncBase::wakeThread() {
+	if (wakeQueue != NULL) {
+		// Does nothing if the thread was already woken
+		uint8_t item = 0;
+		os_queue_put(wakeQueue, &item, 0, NULL);
+	}
+}
+
+// [static]
+void PublishQueueAsyncBase::systemEventHandler(system_event_t /* event */, int /* param */) {
+	for(PublishQueueAsyncBase *q = firstInstance; q != NULL; q = q->nextInstance) {
+		q->wakeThread();
+	}
+}
+
+void PublishQueueAsyncBase::startState() {
+	// If we had other initialization to do, this would be a good place to do it.
+
+	// Ready to process events
+	stateHandler = &PublishQueueAsyncBase::checkQueueState;
+}
+
+
+void PublishQueueAsyncBase::checkQueueState() {
+	bool started = false;
+
+	// Sleep until woken by publish, pause, or a cloud connection change, unless set lower below
+	threadWaitMs = CONCURRENT_WAIT_FOREVER;
+
+	if (inFlightCount != 0 && inFlight[inFlightStart].retry) {
+		// The oldest publish failed while later publishes were in progress, and the retry time is up
+		if (!pausePublishing && Particle.connected()) {
+			if (rateLimiter->canPublish()) {
+				started = retryPublish();
+			}
+			else {
+				threadWaitMs = rateLimiter->getWaitMs();
+			}
+		}
+	}
+	else
+	if (inFlightCount < pipelineDepth && !pausePublishing && Particle.connected() && !hasFailedPublish()) {
+		if (rateLimiter->canPublish()) {
+			started = startPublish();
+		}
+		else {
+			// Published too recently
+			threadWaitMs = rateLimiter->getWaitMs();
+		}
+	}
+	else {
+		// Not cloud connected, paused, or the publish window is full
+	}
+
+	if (inFlightCount == 0) {
+		// No event
+		return;
+	}
+
+	if (!isSending) {
+		PUBLISH_QUEUE_LOG_INFO("publish canceled");
+		abandonPublishes();
+		threadWaitMs = 0;
+		return;
+	}
+
+	PublishQueueInFlight &slot = inFlight[inFlightStart];
+	if (!slot.request.isDone() || slot.retry) {
+		// The oldest publish is still in progress, or waiting to be published again. Later publishes that complete first are handled
+		// after it, so events are always removed in order. The future's callbacks wake the thread when
+		// it completes, so only check again right away if another publish might be started.
+		if (started) {
+			threadWaitMs = 0;
+		}
+		else
+		if (threadWaitMs > PUBLISH_TIMEOUT_MS) {
+			threadWaitMs = PUBLISH_TIMEOUT_MS;
+		}
+		return;
+	}
+
+	finishPublish();
+	threadWaitMs = 0;
+}
+
+bool PublishQueueAsyncBase::startPublish() {
+	PublishQueueEventData *data = NULL;
+	if (inFlightCount == 0) {
+		{
+			// Set before getting the oldest event so it's not discarded to make room
+			StMutexLock lock(this);
+			isSending = true;
+		}
+
+		while(true) {
+			data = getOldestEvent();
+			if (!data || !isExpired(data)) {
+				break;
+			}
+
+			// Expired events are discarded when they become the oldest event
+			PUBLISH_QUEUE_LOG_INFO("discarding expired event %s", getEventName(data));
+			discardOldEvent(false);
+			expiredCount++;
+
+			StMutexLock lock(this);
+			updateUsageMetrics();
+		}
+
+		if (!data) {
+			StMutexLock lock(this);
+			isSending = false;
+			return false;
+		}
+	}
+
+	// We have an event (or events after the ones being sent) and can probably publish
+	uint16_t slotIndex = (inFlightStart + inFlightCount) % pipelineDepth;
+	PublishQueueInFlight &slot = inFlight[slotIndex];
+	{
+		StMutexLock lock(this);
+
+		slot.count = (data != NULL) ? 1 : 0;
+		sendingCount += slot.count;
+		inFlightCount++;
+		isSending = true;
+	}
+
+	const char *eventName = NULL;
+	const char *eventData = NULL;
+	uint16_t count = 0;
+
+	if (batching || data == NULL) {
+		char *nameBuf = (inFlightBuf != NULL) ? &inFlightBuf[slotIndex * IN_FLIGHT_BUF_SIZE] : NULL;
+		char *dataBuf = (inFlightBuf != NULL) ? &nameBuf[MAX_EVENT_NAME_LEN + 1] : batchBuf;
+
+		count = packEvents(slot, data, nameBuf, dataBuf);
+		if (count > 1 || data == NULL) {
+			if (count > 1 && !batchSameNameOnly) {
+				eventName = batchEventName;
+			}
+			else {
+				eventName = (nameBuf != NULL) ? nameBuf : getEventName(data);
+			}
+			eventData = dataBuf;
+		}
+	}
+	if (data != NULL && count < 2) {
+		// Send the oldest event by itself, directly from the buffer returned by getOldestEvent(). It's
+		// not overwritten until all publishes complete.
+		eventName = getEventName(data);
+		eventData = getEventData(data);
+		slot.ttl = data->ttl;
+		slot.flags = data->flags;
+		count = 1;
+	}
+
+	if (count == 0) {
+		// No more events after the ones being sent
+		StMutexLock lock(this);
+
+		inFlightCount--;
+		return false;
+	}
+
+	slot.eventName = eventName;
+	slot.eventData = eventData;
+	slot.retry = false;
+	sendPublish(slot);
+
+	return true;
+}
+
+void PublishQueueAsyncBase::sendPublish(PublishQueueInFlight &slot) {
+	PublishFlags flags(PublishFlag(slot.flags));
+
+	PUBLISH_QUEUE_LOG_INFO("publishing %s %s ttl=%d flags=%x count=%u", slot.eventName, slot.eventData, slot.ttl, flags.value(), slot.count);
+
+	rateLimiter->publishStarted();
+	slot.startMs = millis();
+	slot.request = Particle.publish(slot.eventName, slot.eventData, slot.ttl, flags);
+
+	// Called from the system thread, or right away if the publish already completed
+	slot.request.onSuccess([this](bool) {
+		wakeThread();
+	});
+	slot.request.onError([this](const particle::Error &) {
+		wakeThread();
+	});
+}
+
+void PublishQueueAsyncBase::finishPublish() {
+	PublishQueueInFlight &slot = inFlight[inFlightStart];
+
+	rateLimiter->publishDone();
+	lastPublish = millis();
+
+	bool bResult = slot.request.isSucceeded();
+	if (bResult) {
+		// Successfully published
+		PUBLISH_QUEUE_LOG_INFO("published successfully");
+		retryPolicy->publishSucceeded();
+		consecutiveFailures = 0;
+
+		uint32_t latencyMs = lastPublish - slot.startMs;
+		uint32_t latencyMinMs = metrics.latencyMinMs.load();
+		while((metrics.latencyCount == 0 || latencyMs < latencyMinMs) && !metrics.latencyMinMs.compare_exchange_weak(latencyMinMs, latencyMs)) {
+		}
+		updateMaximum(metrics.latencyMaxMs, latencyMs);
+		metrics.latencyTotalMs += latencyMs;
+		metrics.latencyCount++;
+
+		// slot.count is decremented as the events are discarded, and if events in this publish
+		// were discarded to make room while sending
+		uint16_t count = slot.count;
+		metrics.published += count;
+		for(uint16_t ii = 0; ii < count && slot.count != 0 && sendingCount != 0; ii++) {
+			discardOldEvent(false);
+		}
+
+		StMutexLock lock(this);
+		updateUsageMetrics();
+
+		sendingCount -= (slot.count < sendingCount) ? slot.count : sendingCount;
+		slot.count = 0;
+		inFlightStart = (inFlightStart + 1) % pipelineDepth;
+		inFlightCount--;
+		if (inFlightCount == 0) {
+			isSending = false;
+			sendingCount = 0;
+		}
+	}
+	else
+	if (slot.count == 0 && inFlightCount > 1) {
+		// The events of the failed publish were all discarded to make room, so there's nothing to
+		// publish again
+		metrics.failed++;
+
+		StMutexLock lock(this);
+		inFlightStart = (inFlightStart + 1) % pipelineDepth;
+		inFlightCount--;
+	}
+	else {
+		// Did not successfully transmit, try again after retry time
+		// This string is searched for in the automated test suite, if edited the
+		// test suite must also be edited
+		retryDelayMs = retryPolicy->publishFailed();
+		if (consecutiveFailures < 0xffff) {
+			consecutiveFailures++;
+		}
+		backoffCount++;
+		metrics.failed++;
+		stateTime = millis();
+		inBackoff = true;
+		PUBLISH_QUEUE_LOG_INFO("publish failed, will retry in %lu ms", retryDelayMs);
+		stateHandler = &PublishQueueAsyncBase::waitRetryState;
+
+		// The events of a later publish can't be removed before the events of this one. If one is still
+		// in progress or succeeded, keep them all, and only publish the failed ones again after the
+		// retry time. Otherwise, the events are packed into new publishes.
+		bool keepLater = false;
+		for(uint16_t ii = 1; ii < inFlightCount; ii++) {
+			const PublishQueueInFlight &later = inFlight[(inFlightStart + ii) % pipelineDepth];
+			if (!later.request.isDone() || later.request.isSucceeded()) {
+				keepLater = true;
+				break;
+			}
+		}
+		if (keepLater) {
+			slot.retry = true;
+			return;
+		}
+
+		inFlightStart = (inFlightStart + 1) % pipelineDepth;
+		{
+			StMutexLock lock(this);
+			inFlightCount--;
+		}
+		abandonPublishes();
+	}
+}
+
+bool PublishQueueAsyncBase::retryPublish() {
+	PublishQueueInFlight &oldest = inFlight[inFlightStart];
+	if (oldest.count == 0) {
+		// The events of the failed publish were all discarded to make room while waiting
+		oldest.retry = false;
+
+		StMutexLock lock(this);
+		inFlightStart = (inFlightStart + 1) % pipelineDepth;
+		inFlightCount--;
+		if (inFlightCount == 0) {
+			isSending = false;
+			sendingCount = 0;
+		}
+	}
+
+	bool started = false;
+	for(uint16_t ii = 0; ii < inFlightCount; ii++) {
+		PublishQueueInFlight &slot = inFlight[(inFlightStart + ii) % pipelineDepth];
+		if (!slot.request.isDone() || slot.request.isSucceeded() || slot.count == 0) {
+			continue;
+		}
+
+		// The name and data are still in inFlightBuf, or in the buffer from getOldestEvent() for the
+		// oldest event, which isn't discarded while sending. Only the failure of the oldest publish
+		// was already passed to the rate limiter.
+		if (!slot.retry) {
+			rateLimiter->publishDone();
+		}
+		slot.retry = false;
+		sendPublish(slot);
+		started = true;
+	}
+	return started;
+}
+
+void PublishQueueAsyncBase::abandonPublishes() {
+	StMutexLock lock(this);
+
+	for(uint16_t ii = 0; ii < inFlightCount; ii++) {
+		PublishQueueInFlight &slot = inFlight[(inFlightStart + ii) % pipelineDepth];
+		if (!slot.retry) {
+			rateLimiter->publishDone();
+		}
+		slot.retry = false;
+	}
+	clearSendingCount();
+	inFlightCount = 0;
+	isSending = false;
+}
+
+bool PublishQueueAsyncBase::hasFailedPublish() const {
+	for(uint16_t ii = 0; ii < inFlightCount; ii++) {
+		const PublishQueueInFlight &slot = inFlight[(inFlightStart + ii) % pipelineDepth];
+		if (slot.request.isDone() && !slot.request.isSucceeded()) {
+			return true;
+		}
+	}
+	return false;
+}
+
+void PublishQueueAsyncBase::countDiscardedEvent(uint16_t index) {
+	if (tieredQueue != NULL) {
+		tieredQueue->tierEventDiscarded(this, index);
+	}
+
+	for(uint16_t ii = 0; ii < numLastValues; ii++) {
+		PublishQueueLastValue &lastValue = lastValues[ii];
+		if (lastValue.state == PublishQueueLastValue::STATE_QUEUED) {
+			if (lastValue.index == index) {
+				lastValue.state = PublishQueueLastValue::STATE_NONE;
+			}
+			else
+			if (lastValue.index > index) {
+				lastValue.index--;
+			}
+		}
+	}
+
+	if (sendingCount == 0) {
+		return;
+	}
+
+	// Find the publish that includes the event
+	for(uint16_t ii = 0; ii < inFlightCount; ii++) {
+		PublishQueueInFlight &slot = inFlight[(inFlightStart + ii) % pipelineDepth];
+		if (index < slot.count) {
+			slot.count--;
+			sendingCount--;
+			return;
+		}
+		index -= slot.count;
+	}
+}
+
+PublishQueueAsyncBase &PublishQueueAsyncBase::withLastValueOnly(const char *eventName) {
+	PublishQueueLastValue *newLastValues = new PublishQueueLastValue[numLastValues + 1];
+	for(uint16_t ii = 0; ii < numLastValues; ii++) {
+		newLastValues[ii] = lastValues[ii];
+	}
+	newLastValues[numLastValues].eventName = eventName;
+	newLastValues[numLastValues].nameLen = (uint8_t) strlen(eventName);
+
+	delete[] lastValues;
+	lastValues = newLastValues;
+	numLastValues++;
+
+	return *this;
+}
+
+PublishQueueLastValue *PublishQueueAsyncBase::findLastValue(const char *eventName, size_t nameLen) {
+	for(uint16_t ii = 0; ii < numLastValues; ii++) {
+		if (lastValues[ii].nameLen == nameLen && memcmp(lastValues[ii].eventName, eventName, nameLen) == 0) {
+			return &lastValues[ii];
+		}
+	}
+	return NULL;
+}
+
+// [static]
+bool PublishQueueAsyncBase::isLastValueEvent(const PublishQueueLastValue *lastValue, const PublishQueueEventData *eventData) {
+	return eventData->nameLen == lastValue->nameLen &&
+		(eventData->recordFlags & PUBLISH_QUEUE_RECORD_FLAG_DELETED) == 0 &&
+		memcmp(getEventName(eventData), lastValue->eventName, lastValue->nameLen) == 0;
+}
+
+void PublishQueueAsyncBase::lastValueInserted(uint32_t index) {
+	for(uint16_t ii = 0; ii < numLastValues; ii++) {
+		if (lastValues[ii].state == PublishQueueLastValue::STATE_QUEUED && lastValues[ii].index >= index) {
+			lastValues[ii].index++;
+		}
+	}
+}
+
+void PublishQueueAsyncBase::resetLastValues(uint8_t state) {
+	for(uint16_t ii = 0; ii < numLastValues; ii++) {
+		lastValues[ii].state = state;
+	}
+}
+
+void PublishQueueAsyncBase::forgetLastValuePositions() {
+	for(uint16_t ii = 0; ii < numLastValues; ii++) {
+		lastValues[ii].pos = PublishQueueLastValue::POS_UNKNOWN;
+	}
+}
+
+void PublishQueueAsyncBase::clearSendingCount() {
+	for(uint16_t ii = 0; ii < inFlightCount; ii++) {
+		inFlight[(inFlightStart + ii) % pipelineDepth].count = 0;
+	}
+	sendingCount = 0;
+}
+
+uint16_t PublishQueueAsyncBase::packEvents(PublishQueueInFlight &slot, const PublishQueueEventData *oldest, char *nameBuf, char *dataBuf) {
+	const size_t maxLen = particle::protocol::MAX_EVENT_DATA_LENGTH;
+	const char *firstName = (oldest != NULL) ? getEventName(oldest) : nameBuf;
+	uint8_t firstNameLen = 0;
+	size_t len = 0;
+	uint16_t index = 0;
+	uint16_t skip = 0;
+	uint16_t limit = 0;
+	uint16_t count = 0;
+	bool single = false;
+
+	forEachEvent([&](const PublishQueueEventData *eventData) {
+		if (index == 0) {
+			// Skip the events in earlier publishes. This is read with the mutex locked.
+			skip = sendingCount - slot.count;
+			limit = getActiveLaneEvents();
+		}
+		if (index >= limit) {
+			// The rest of the events are in other priority lanes
+			return false;
+		}
+		if (index++ < skip) {
+			return true;
+		}
+
+		if ((count > 0 || oldest == NULL) && (isExpired(eventData) || !isValidEvent(eventData, EVENT_BUF_SIZE))) {
+			// Expired events and events with a crc mismatch are discarded when they become the oldest event
+			return false;
+		}
+
+		eventData = getUncompressedEvent(eventData);
+
+		const char *eventName = getEventName(eventData);
+		const char *eventDataStr = getEventData(eventData);
+		size_t dataLen = strlen(eventDataStr);
+
+		if (count == 0) {
+			if (oldest != NULL) {
+				if (eventData->nameLen != oldest->nameLen || strcmp(eventName, firstName) != 0) {
+					// The oldest event changed after getOldestEvent(), so send it by itself
+					return false;
+				}
+			}
+			else {
+				if (hasWaitingPriorityEvent()) {
+					// Send the higher priority event once the publishes in progress complete
+					return false;
+				}
+
+				// Updated with the mutex locked so an event discarded to make room is counted
+				slot.count++;
+				sendingCount++;
+			}
+			if (nameBuf != NULL) {
+				memcpy(nameBuf, eventName, eventData->nameLen + 1);
+			}
+			firstNameLen = eventData->nameLen;
+			slot.ttl = eventData->ttl;
+			slot.flags = eventData->flags;
+
+			if (!batching || strchr(eventDataStr, '\n') != NULL || (!batchSameNameOnly && firstNameLen + 1 + dataLen > maxLen)) {
+				// Sent by itself
+				memcpy(dataBuf, eventDataStr, dataLen + 1);
+				single = true;
+				count = 1;
+				return false;
+			}
+		}
+		else {
+			if (eventData->flags != slot.flags || strchr(eventDataStr, '\n') != NULL) {
+				return false;
+			}
+			if (batchSameNameOnly && (eventData->nameLen != firstNameLen || strcmp(eventName, firstName) != 0)) {
+				return false;
+			}
+		}
+
+		size_t needed = dataLen + ((count > 0) ? 1 : 0) + (batchSameNameOnly ? 0 : eventData->nameLen + 1);
+		if (len + needed > maxLen) {
+			return false;
+		}
+
+		if (count > 0) {
+			dataBuf[len++] = '\n';
+		}
+		if (!batchSameNameOnly) {
+			memcpy(&dataBuf[len], eventName, eventData->nameLen);
+			len += eventData->nameLen;
+			dataBuf[len++] = '\t';
+		}
+		memcpy(&dataBuf[len], eventDataStr, dataLen);
+		len += dataLen;
+		dataBuf[len] = 0;
+
+		if (count > 0) {
+			// Updated with the mutex locked so an event discarded to make room is counted
+			slot.count++;
+			sendingCount++;
+		}
+		count++;
+		return true;
+	});
+
+	if (count == 1 && !single && !batchSameNameOnly) {
+		// Only one event, so send its data without the event name
+		memmove(dataBuf, &dataBuf[firstNameLen + 1], len - firstNameLen);
+	}
+
+	return count;
+}
+
+bool PublishQueueAsyncBase::isExpired(const PublishQueueEventData *eventData) const {
+	uint32_t maxAge = (maxAgeUseTtl && eventData->ttl > 0) ? (uint32_t) eventData->ttl : maxAgeSec;
+	if (maxAge == 0 || eventData->timestamp == 0 || !Time.isValid()) {
+		return false;
+	}
+
+	uint32_t now = (uint32_t) Time.now();
+	return now > eventData->timestamp && now - eventData->timestamp > maxAge;
+}
+
+void PublishQueueAsyncBase::waitRetryState() {
+	unsigned long elapsed = millis() - stateTime;
+	if (elapsed >= retryDelayMs) {
+		backoffMs += elapsed;
+		inBackoff = false;
+		stateHandler = &PublishQueueAsyncBase::checkQueueState;
+		threadWaitMs = 0;
+	}
+	else {
+		threadWaitMs = retryDelayMs - elapsed;
+	}
+}
+
+uint32_t PublishQueueAsyncBase::getBackoffMs() const {
+	uint32_t result = backoffMs;
+	if (inBackoff) {
+		result += millis() - stateTime.load();
+	}
+	return result;
+}
+
+
+// [static]
+void PublishQueueAsyncBase::threadFunctionStatic(void *param) {
+	static_cast<PublishQueueAsync *>(param)->threadFunction();
+}
+
+
+PublishQueueAsyncRetained::PublishQueueAsyncRetained(uint8_t *retainedBuffer, uint16_t retainedBufferSize) :
+		retainedBuffer(retainedBuffer), retainedBufferSize(retainedBufferSize) {
+
+}
+
+PublishQueueAsyncRetained::~PublishQueueAsyncRetained() {
+
+}
+
+void PublishQueueAsyncRetained::setup() {
+// Initialize the retained buffer
+	bool initBuffer = false;
+
+	PublishQueueRingHeader *hdr = getHeader();
+	if (hdr->magic == PUBLISH_QUEUE_RING_HEADER_MAGIC && hdr->size == retainedBufferSize) {
+		PUBLISH_QUEUE_LOG_TRACE("retained numEvents=%d head=%d tail=%d", (int)hdr->numEvents, (int)hdr->head, (int)hdr->tail);
+
+		if (!validateBuffer()) {
+			if (recoverBuffer()) {
+				PUBLISH_QUEUE_LOG_INFO("retained buffer invalid, kept numEvents=%d", (int)hdr->numEvents);
+			}
+			else {
+				PUBLISH_QUEUE_LOG_INFO("retained buffer invalid, reinitializing");
+				initBuffer = true;
+			}
+		}
+	}
+	else
+	if (hdr->magic == PUBLISH_QUEUE_HEADER_MAGIC && hdr->size == retainedBufferSize) {
+		// Retained buffer from 0.2.x or earlier
+		if (!convertLinearBuffer()) {
+			PUBLISH_QUEUE_LOG_INFO("could not convert retained buffer, reinitializing");
+			initBuffer = true;
+		}
+	}
+	else {
+		// Not valid
+		initBuffer = true;
+	}
+
+	//initBuffer = true; // Uncomment to discard old data
+
+	if (initBuffer) {
+		hdr->magic = PUBLISH_QUEUE_RING_HEADER_MAGIC;
+		hdr->size = retainedBufferSize;
+		hdr->numEvents = 0;
+		hdr->head = hdr->tail = dataStart();
+	}
+	PUBLISH_QUEUE_LOG_TRACE("at init numEvents=%d head=%d tail=%d", (int)hdr->numEvents, (int)hdr->head, (int)hdr->tail);
+	updateUsageMetrics();
+
+	// Do superclass setup (starting the thread)
+	PublishQueueAsyncBase::setup();
+}
+
+bool PublishQueueAsyncRetained::validateBuffer() const {
+	PublishQueueRingHeader *hdr = getHeader();
+
+	if (hdr->head < dataStart() || hdr->head > dataEnd() || (hdr->head % 4) != 0 ||
+		hdr->tail < dataStart() || hdr->tail > dataEnd() || (hdr->tail % 4) != 0) {
+		return false;
+	}
+
+	uint16_t offset = hdr->head;
+	for(uint16_t ii = 0; ii < hdr->numEvents; ii++) {
+		if (ii > 0) {
+			offset = wrapOffset(offset);
+		}
+		PublishQueueEventData *eventData = getEventAt(offset);
+		if (!isValidEvent(eventData, dataEnd() - offset)) {
+			// Overflowed buffer or partially written, must be corrupted
+			return false;
+		}
+		offset += eventData->size;
+	}
+
+	return offset == hdr->tail;
+}
+
+bool PublishQueueAsyncRetained::recoverBuffer() {
+	PublishQueueRingHeader *hdr = getHeader();
+
+	if (hdr->head < dataStart() || (size_t)(hdr->head + sizeof(PublishQueueEventData)) > dataEnd() || (hdr->head % 4) != 0) {
+		return false;
+	}
+
+	uint16_t offset = hdr->head;
+	uint16_t numEvents = 0;
+	size_t used = 0;
+	while(numEvents < hdr->numEvents) {
+		if (numEvents > 0) {
+			if (offset == hdr->tail) {
+				break;
+			}
+			offset = wrapOffset(offset);
+		}
+		PublishQueueEventData *eventData = getEventAt(offset);
+		if (!isValidEvent(eventData, dataEnd() - offset) || used + eventData->size > (size_t)(dataEnd() - dataStart())) {
+			PUBLISH_QUEUE_LOG_INFO("event invalid at offset=%u index=%u", (unsigned)offset, (unsigned)numEvents);
+			break;
+		}
+		used += eventData->size;
+		offset += eventData->size;
+		numEvents++;
+	}
+
+	if (numEvents == 0) {
+		return false;
+	}
+
+	hdr->numEvents = numEvents;
+	hdr->tail = offset;
+	return true;
+}
+
+bool PublishQueueAsyncRetained::convertLinearBuffer() {
+	// 0.2.x and earlier: an 8-byte PublishQueueHeader followed by packed version 1 events. Find the
+	// events using the c-strings, because old versions did not always set size.
+	const PublishQueueHeader *oldHdr = reinterpret_cast<const PublishQueueHeader *>(retainedBuffer);
+	uint16_t oldNumEvents = oldHdr->numEvents;
+	uint16_t numEvents = oldNumEvents;
+
+	size_t first = sizeof(PublishQueueHeader);
+	size_t end = dataEnd();
+
+	size_t cur = first;
+	for(uint16_t ii = 0; ii < numEvents; ii++) {
+		size_t srcSize;
+		if (convertEventDataV1(&retainedBuffer[cur], end - cur, publishBuf, srcSize) == 0) {
+			// Overflowed buffer or not a valid event, must be corrupted
+			return false;
+		}
+		cur += srcSize;
+	}
+
+	// The header is 4 bytes larger and each event is 8 bytes larger now, so discard the oldest
+	// events if the buffer is too full
+	const size_t growth = sizeof(PublishQueueEventData) - PUBLISH_QUEUE_EVENT_DATA_V1_SIZE;
+	size_t avail = dataEnd() - dataStart();
+	size_t used = cur - first;
+	while(numEvents > 0 && used + numEvents * growth > avail) {
+		size_t srcSize;
+		convertEventDataV1(&retainedBuffer[first], cur - first, publishBuf, srcSize);
+		first += srcSize;
+		used -= srcSize;
+		numEvents--;
+	}
+
+	// Move the old events to the end of the buffer, then convert them into place starting at
+	// dataStart(). Since the converted events all fit, the converted events being written never
+	// overwrite old events that have not been converted yet.
+	size_t src = end - used;
+	memmove(&retainedBuffer[src], &retainedBuffer[first], used);
+
+	size_t dst = dataStart();
+	for(uint16_t ii = 0; ii < numEvents; ii++) {
+		size_t srcSize;
+		size_t size = convertEventDataV1(&retainedBuffer[src], end - src, publishBuf, srcSize);
+		memcpy(&retainedBuffer[dst], publishBuf, size);
+		src += srcSize;
+		dst += size;
+	}
+
+	PublishQueueRingHeader *hdr = getHeader();
+	hdr->magic = PUBLISH_QUEUE_RING_HEADER_MAGIC;
+	hdr->size = retainedBufferSize;
+	hdr->numEvents = numEvents;
+	hdr->head = dataStart();
+	hdr->tail = dst;
+
+	PUBLISH_QUEUE_LOG_INFO("converted retained buffer from 0.2.x numEvents=%d discarded=%d", (int)numEvents, (int)(oldNumEvents - numEvents));
+
+	return true;
+}
+
+uint16_t PublishQueueAsyncRetained::wrapOffset(uint16_t offset) const {
+	if ((size_t)(dataEnd() - offset) < sizeof(PublishQueueEventData) || getEventAt(offset)->size == 0) {
+		return dataStart();
+	}
+	return offset;
+}
+
+bool PublishQueueAsyncRetained::allocateEvent(size_t size, uint16_t &offset) {
+	PublishQueueRingHeader *hdr = getHeader();
+
+	if (hdr->numEvents == 0) {
+		// Start over at the beginning so there's the maximum amount of contiguous space
+		hdr->head = hdr->tail = dataStart();
+	}
+
+	if (hdr->numEvents > 0 && hdr->tail <= hdr->head) {
+		// Wrapped (or full when tail == head). Free space is between tail and head.
+		if ((size_t)(hdr->head - hdr->tail) < size) {
+			return false;
+		}
+		offset = hdr->tail;
+	}
+	else
+	if ((size_t)(dataEnd() - hdr->tail) >= size) {
+		// Fits between tail and the end of the buffer
+		offset = hdr->tail;
+	}
+	else
+	if ((size_t)(hdr->head - dataStart()) >= size) {
+		// Fits at the beginning of the buffer
+		if ((size_t)(dataEnd() - hdr->tail) >= sizeof(PublishQueueEventData)) {
+			getEventAt(hdr->tail)->size = 0;
+		}
+		offset = dataStart();
+	}
+	else {
+		return false;
+	}
+
+	hdr->tail = offset + size;
+	hdr->numEvents++;
+
+	return true;
+}
+
+bool PublishQueueAsyncRetained::hasRoom(size_t size) const {
+	PublishQueueRingHeader *hdr = getHeader();
+
+	if (hdr->numEvents == 0) {
+		return size <= (size_t)(dataEnd() - dataStart());
+	}
+	if (hdr->tail <= hdr->head) {
+		return (size_t)(hdr->head - hdr->tail) >= size;
+	}
+	return (size_t)(dataEnd() - hdr->tail) >= size || (size_t)(hdr->head - dataStart()) >= size;
+}
+
+bool PublishQueueAsyncRetained::publishCommon(const char *eventName, const char *data, int ttl, PublishFlags flags1, PublishFlags flags2, uint8_t priority) {
+
+	if (!haveSetup) {
+		setup();
+	}
+
+	if (data == NULL) {
+		data = "";
+	}
+
+	size_t nameLen = strlen(eventName);
+	size_t dataLen = strlen(data);
+	size_t size = getEventSize(nameLen, dataLen);
+
+	PUBLISH_QUEUE_LOG_INFO("queueing eventName=%s data=%s ttl=%d flags1=%d flags2=%d size=%d", eventName, data, ttl, flags1.value(), flags2.value(), size);
+
+	if (size == 0) {
+		// Event name or data is too long to publish
+		metrics.rejected++;
+		return false;
+	}
+
+	if  (size > (size_t)(dataEnd() - dataStart())) {
+		// Special case: event is larger than the retained buffer. Rather than throw out all events
+		// before discovering this, check that case first
+		metrics.rejected++;
+		return false;
+	}
+
+	if (priority > PUBLISH_QUEUE_PRIORITY_MAX) {
+		priority = PUBLISH_QUEUE_PRIORITY_MAX;
+	}
+
+	while(true) {
+		{
+			StMutexLock lock(this);
+
+			// Compressed again each time because another thread can use compressBuf while the
+			// mutex is unlocked to discard an event
+			size = getStoredEventSize(nameLen, data, dataLen);
+
+			// Replace the unsent event with the same name if only the newest one is kept
+			PublishQueueLastValue *lastValue = findLastValue(eventName, nameLen);
+			bool replace = (lastValue != NULL && findLastValueEvent(lastValue));
+			if (replace) {
+				bool contiguous;
+				uint16_t oldIndex = (uint16_t) lastValue->index;
+				uint16_t oldOffset = getEventOffset(oldIndex, contiguous);
+				PublishQueueEventData *oldEventData = getEventAt(oldOffset);
+
+				if (oldEventData->size >= size && getEventPriority(oldEventData) == priority) {
+					// Overwrite it in place. The padding at the end is zeroed.
+					PUBLISH_QUEUE_LOG_TRACE("replacing event at offset=%d index=%d", (int)oldOffset, (int)oldIndex);
+					writeStoredEvent(&retainedBuffer[oldOffset], eventName, nameLen, data, dataLen, ttl, flags1.value() | flags2.value(), oldEventData->size, priority);
+					replacedCount++;
+					eventQueued();
+					return true;
+				}
+			}
+
+			// Normal priority events are always added at the end of the queue
+			uint16_t index = (priority > 0) ? findInsertIndex(priority) : getHeader()->numEvents;
+
+			uint16_t offset;
+			if ((index == getHeader()->numEvents) ? allocateEvent(size, offset) : insertEvent(index, size, offset)) {
+				// There is room to fit this
+				PUBLISH_QUEUE_LOG_TRACE("saving event at offset=%d index=%d", (int)offset, (int)index);
+
+				writeStoredEvent(&retainedBuffer[offset], eventName, nameLen, data, dataLen, ttl, flags1.value() | flags2.value(), size, priority);
+
+				if (replace) {
+					// Removed after the new event is in the ring, so it's kept if the new event doesn't fit.
+					// insertEvent() updated its index if the new event was inserted before it.
+					uint16_t oldIndex = (uint16_t) lastValue->index;
+					PUBLISH_QUEUE_LOG_TRACE("removing event at index=%d to replace it", (int)oldIndex);
+					removeEvent(oldIndex);
+					countDiscardedEvent(oldIndex);
+					if (oldIndex < index) {
+						index--;
+					}
+					replacedCount++;
+				}
+				if (lastValue != NULL) {
+					lastValue->state = PublishQueueLastValue::STATE_QUEUED;
+					lastValue->index = index;
+				}
+
+				PublishQueueRingHeader *hdr = getHeader();
+				PUBLISH_QUEUE_LOG_TRACE("after saving numEvents=%d head=%d tail=%d end=%d", (int)hdr->numEvents, (int)hdr->head, (int)hdr->tail, retainedBufferSize);
+				eventQueued();
+				return true;
+			}
+
+			// If there's only one event, there's nothing left to discard, this event is too large
+			// to fit with the existing first event (which we can't delete because it might be
+			// in the process of being sent). An event being replaced isn't being sent.
+			if (getHeader()->numEvents == 1 && !replace) {
+				metrics.rejected++;
+				return false;
+			}
+		}
+
+		// Discard the oldest event with the lowest priority. If we are sending (isSending=true),
+		// the oldest event is not discarded.
+		if (!evictEvent(priority)) {
+			// There isn't an event to discard, so we don't have enough room
+			metrics.rejected++;
+			return false;
+		}
+	}
+
+	// Not reached
+	return false;
+}
+
+bool PublishQueueAsyncRetained::reserveEvent(size_t size) {
+	if (!haveSetup) {
+		setup();
+	}
+	return size <= (size_t)(dataEnd() - dataStart());
+}
+
+bool PublishQueueAsyncRetained::commitEvent(const uint8_t *buf, size_t size) {
+	const PublishQueueEventData *eventData = reinterpret_cast<const PublishQueueEventData *>(buf);
+
+	while(true) {
+		{
+			StMutexLock lock(this);
+
+			// Look for the event to replace before the new event is in the ring, so it isn't found instead
+			PublishQueueLastValue *lastValue = findLastValue(getEventName(eventData), eventData->nameLen);
+			bool replace = (lastValue != NULL && findLastValueEvent(lastValue));
+
+			uint16_t offset;
+			if (allocateEvent(size, offset)) {
+				PUBLISH_QUEUE_LOG_TRACE("committing event at offset=%d size=%d", (int)offset, (int)size);
+				memcpy(&retainedBuffer[offset], buf, size);
+
+				PublishQueueRingHeader *hdr = getHeader();
+				if (replace) {
+					// Removed after the new event is in the ring, because removeEvent() can move the events
+					uint16_t oldIndex = (uint16_t) lastValue->index;
+					PUBLISH_QUEUE_LOG_TRACE("removing event at index=%d to replace it", (int)oldIndex);
+					removeEvent(oldIndex);
+					countDiscardedEvent(oldIndex);
+					replacedCount++;
+				}
+				if (lastValue != NULL) {
+					lastValue->state = PublishQueueLastValue::STATE_QUEUED;
+					lastValue->index = hdr->numEvents - 1;
+				}
+
+				PUBLISH_QUEUE_LOG_TRACE("after committing numEvents=%d head=%d tail=%d end=%d", (int)hdr->numEvents, (int)hdr->head, (int)hdr->tail, retainedBufferSize);
+				eventQueued();
+				return true;
+			}
+
+			// The same as publishCommon(), the oldest event can't be discarded while it's being sent
+			if (getHeader()->numEvents == 1 && !replace) {
+				metrics.rejected++;
+				return false;
+			}
+		}
+
+		if (!evictEvent(0)) {
+			metrics.rejected++;
+			return false;
+		}
+	}
+}
+
+uint16_t PublishQueueAsyncRetained::getEventOffset(uint16_t index, bool &contiguous) const {
+	uint16_t offset = getHeader()->head;
+
+	contiguous = true;
+	for(uint16_t ii = 0; ii < index; ii++) {
+		uint16_t next = offset + getEventAt(offset)->size;
+		offset = wrapOffset(next);
+		if (offset != next) {
+			contiguous = false;
+		}
+	}
+	return offset;
+}
+
+uint16_t PublishQueueAsyncRetained::findInsertIndex(uint8_t priority) const {
+	PublishQueueRingHeader *hdr = getHeader();
+
+	uint16_t first = (sendingCount > 1) ? sendingCount : 1;
+	if (first >= hdr->numEvents) {
+		return hdr->numEvents;
+	}
+
+	bool contiguous;
+	uint16_t offset = getEventOffset(first, contiguous);
+	for(uint16_t ii = first; ii < hdr->numEvents; ii++) {
+		if (ii > first) {
+			offset = wrapOffset(offset);
+		}
+		PublishQueueEventData *eventData = getEventAt(offset);
+		if (getEventPriority(eventData) < priority) {
+			return ii;
+		}
+		offset += eventData->size;
+	}
+	return hdr->numEvents;
+}
+
+bool PublishQueueAsyncRetained::insertEvent(uint16_t index, size_t size, uint16_t &offset) {
+	PublishQueueRingHeader *hdr = getHeader();
+
+	bool contiguous;
+	offset = getEventOffset(index, contiguous);
+
+	// Free space immediately before head
+	size_t before = (hdr->tail <= hdr->head) ? (hdr->head - hdr->tail) : (hdr->head - dataStart());
+	if (contiguous && before >= size) {
+		// Move the events before index toward the beginning of the buffer
+		memmove(&retainedBuffer[hdr->head - size], &retainedBuffer[hdr->head], offset - hdr->head);
+		hdr->head -= size;
+		offset -= size;
+	}
+	else {
+		// Make the free space contiguous at the end of the buffer, then move the events starting
+		// at index toward the end
+		linearize();
+		if ((size_t)(dataEnd() - hdr->tail) < size) {
+			return false;
+		}
+		offset = getEventOffset(index, contiguous);
+		memmove(&retainedBuffer[offset + size], &retainedBuffer[offset], hdr->tail - offset);
+		hdr->tail += size;
+	}
+	hdr->numEvents++;
+	lastValueInserted(index);
+	if (tieredQueue != NULL) {
+		tieredQueue->tierEventInserted(this, index);
+	}
+
+	return true;
+}
+
+void PublishQueueAsyncRetained::removeEvent(uint16_t index, uint16_t count) {
+	PublishQueueRingHeader *hdr = getHeader();
+
+	bool contiguous;
+	uint16_t last = getEventOffset(index + count - 1, contiguous);
+	if (!contiguous) {
+		linearize();
+		last = getEventOffset(index + count - 1, contiguous);
+	}
+	uint16_t offset = getEventOffset(index, contiguous);
+
+	// Move the events before index into the end of the space the events occupied
+	uint16_t size = last + getEventAt(last)->size - offset;
+	memmove(&retainedBuffer[hdr->head + size], &retainedBuffer[hdr->head], offset - hdr->head);
+	hdr->head += size;
+	hdr->numEvents -= count;
+
+	if (hdr->numEvents == 0) {
+		hdr->head = hdr->tail = dataStart();
+	}
+	else {
+		// The removed events can be the last ones before the end of the buffer
+		hdr->head = wrapOffset(hdr->head);
+	}
+}
+
+bool PublishQueueAsyncRetained::evictEvent(uint8_t priority) {
+	StMutexLock lock(this);
+
+	PublishQueueRingHeader *hdr = getHeader();
+	uint16_t first = isSending ? 1 : 0;
+	if (first >= hdr->numEvents) {
+		return false;
+	}
+
+	// Find the oldest event with the lowest priority. Only events with a higher priority are
+	// queued before normal priority events, so this usually stops at the first event checked.
+	uint16_t index = 0;
+	bool contiguous;
+	uint16_t offset = getEventOffset(first, contiguous);
+	uint8_t lowest = PUBLISH_QUEUE_PRIORITY_MAX + 1;
+	for(uint16_t ii = first; ii < hdr->numEvents && lowest > 0; ii++) {
+		if (ii > first) {
+			offset = wrapOffset(offset);
+		}
+		PublishQueueEventData *eventData = getEventAt(offset);
+		if (getEventPriority(eventData) < lowest) {
+			lowest = getEventPriority(eventData);
+			index = ii;
+		}
+		offset += eventData->size;
+	}
+
+	if (lowest > priority) {
+		// Don't discard a higher priority event to make room
+		return false;
+	}
+
+	if (index > 1) {
+		PUBLISH_QUEUE_LOG_TRACE("discarding event index=%d to make room", (int)index);
+		removeEvent(index);
+		countDiscardedEvent(index);
+		metrics.evicted++;
+		return true;
+	}
+
+	// Discard while still holding the lock, as startPublish() could otherwise start sending the
+	// oldest event after isSending was checked above
+	if (!discardEvent(index != 0)) {
+		return false;
+	}
+	metrics.evicted++;
+	return true;
+}
+
+bool PublishQueueAsyncRetained::findLastValueEvent(PublishQueueLastValue *lastValue) {
+	PublishQueueRingHeader *hdr = getHeader();
+	uint16_t first = getFirstUnsentIndex();
+	bool contiguous;
+
+	if (lastValue->state == PublishQueueLastValue::STATE_QUEUED) {
+		if (lastValue->index < first) {
+			// The newest event with this name is being sent
+			return false;
+		}
+		if (lastValue->index < hdr->numEvents && isLastValueEvent(lastValue, getEventAt(getEventOffset((uint16_t)lastValue->index, contiguous)))) {
+			return true;
+		}
+	}
+	else
+	if (lastValue->state == PublishQueueLastValue::STATE_NONE) {
+		return false;
+	}
+
+	// Search the unsent events for the newest one with this name
+	lastValue->state = PublishQueueLastValue::STATE_NONE;
+	if (first < hdr->numEvents) {
+		uint16_t offset = getEventOffset(first, contiguous);
+		for(uint16_t ii = first; ii < hdr->numEvents; ii++) {
+			if (ii > first) {
+				offset = wrapOffset(offset);
+			}
+			PublishQueueEventData *eventData = getEventAt(offset);
+			if (isLastValueEvent(lastValue, eventData)) {
+				lastValue->state = PublishQueueLastValue::STATE_QUEUED;
+				lastValue->index = ii;
+			}
+			offset += eventData->size;
+		}
+	}
+	return lastValue->state == PublishQueueLastValue::STATE_QUEUED;
+}
+
+void PublishQueueAsyncRetained::linearize() {
+	PublishQueueRingHeader *hdr = getHeader();
+
+	if (hdr->numEvents == 0) {
+		hdr->head = hdr->tail = dataStart();
+	}
+	else
+	if (hdr->tail > hdr->head) {
+		// Not wrapped
+		memmove(&retainedBuffer[dataStart()], &retainedBuffer[hdr->head], hdr->tail - hdr->head);
+		hdr->tail -= hdr->head - dataStart();
+		hdr->head = dataStart();
+	}
+	else {
+		// Find the end of the events before the wrap
+		uint16_t offset = hdr->head;
+		do {
+			offset += getEventAt(offset)->size;
+		} while(wrapOffset(offset) == offset);
+
+		// Rotate so the events from head to the end come first, followed by the events from the
+		// beginning of the buffer to tail, then the free space
+		std::rotate(&retainedBuffer[dataStart()], &retainedBuffer[hdr->head], &retainedBuffer[offset]);
+		hdr->tail = dataStart() + (offset - hdr->head) + (hdr->tail - dataStart());
+		hdr->head = dataStart();
+	}
+}
+
+
+PublishQueueEventData *PublishQueueAsyncRetained::getOldestEvent() {
+	// This entire function holds a mutex lock that's released when returning
+	StMutexLock lock(this);
+	PublishQueueEventData *eventData = NULL;
+
+	PublishQueueRingHeader *hdr = getHeader();
+	while(hdr->numEvents > 0) {
+		PublishQueueEventData *src = getEventAt(hdr->head);
+		if (isValidEvent(src, dataEnd() - hdr->head)) {
+			// Copy the event so it can be moved in the retained buffer while it's being published
+			expandEvent(src, publishBuf);
+			eventData = reinterpret_cast<PublishQueueEventData *>(publishBuf);
+			break;
+		}
+
+		// Every event is checked in setup(), so something else wrote to retained memory
+		PUBLISH_QUEUE_LOG_ERROR("event crc mismatch at offset=%u, discarding it", (unsigned)hdr->head);
+		bool validHeader = isValidEventHeader(src, dataEnd() - hdr->head);
+		do {
+			// If the size isn't valid, the next event can't be found, so all of the events are discarded
+			hdr->numEvents--;
+			countDiscardedEvent(0);
+			metrics.corrupted++;
+		} while(!validHeader && hdr->numEvents > 0);
+
+		if (hdr->numEvents > 0) {
+			hdr->head = wrapOffset(hdr->head + src->size);
+		}
+		else {
+			hdr->head = hdr->tail = dataStart();
+		}
+		updateUsageMetrics();
+	}
+
+	return eventData;
+}
+
+bool PublishQueueAsyncRetained::clearEvents() {
+
+	// This entire function holds a mutex lock that's released when returning
+	StMutexLock lock(this);
+
+	PublishQueueRingHeader *hdr = getHeader();
+	hdr->numEvents = 0;
+	hdr->head = hdr->tail = dataStart();
+	isSending = false;
+	clearSendingCount();
+	resetLastValues(PublishQueueLastValue::STATE_NONE);
+	lastPublish = 0;
+	updateUsageMetrics();
+
+    PUBLISH_QUEUE_LOG_TRACE("clearEvents numEvents=%d size=%d", (int)hdr->numEvents, (int)hdr->size);
+
+	return true;
+}
+
+uint8_t *PublishQueueAsyncRetained::skipEvent(uint8_t *start) {
+	return start + reinterpret_cast<PublishQueueEventData *>(start)->size;
+}
+
+
+bool PublishQueueAsyncRetained::discardOldEvent(bool secondEvent) {
+	// This entire function holds a mutex lock that's released when returning
+	StMutexLock lock(this);
+
+	return discardEvent(secondEvent);
+}
+
+bool PublishQueueAsyncRetained::discardEvent(bool secondEvent) {
+	PublishQueueRingHeader *hdr = getHeader();
+
+	if (secondEvent) {
+		if (hdr->numEvents < 2) {
+			return false;
+		}
+	}
+	else {
+		if (hdr->numEvents < 1) {
+			return false;
+		}
+	}
+
+	uint16_t head = hdr->head;
+	uint16_t firstSize = getEventAt(head)->size;
+	uint16_t next = wrapOffset(head + firstSize);
+
+	PUBLISH_QUEUE_LOG_TRACE("discardOldestEvent secondEvent=%d head=%d next=%d tail=%d", (int)secondEvent, (int)head, (int)next, (int)hdr->tail);
+
+	if (!secondEvent) {
+		// Remove the oldest event by advancing head
+		hdr->numEvents--;
+		hdr->head = (hdr->numEvents > 0) ? next : hdr->tail;
+		countDiscardedEvent(0);
+	}
+	else
+	if (next == head + firstSize) {
+		// The second event immediately follows the oldest event, so move the oldest event into the
+		// end of the space the second event occupied. The events after it don't move.
+		uint16_t secondSize = getEventAt(next)->size;
+		memmove(&retainedBuffer[head + secondSize], &retainedBuffer[head], firstSize);
+		hdr->head = head + secondSize;
+		hdr->numEvents--;
+		countDiscardedEvent(1);
+	}
+	else {
+		// The second event wrapped around to the beginning of the buffer. Discard events from the
+		// beginning of the buffer until there's room to move the oldest event there.
+		size_t freed = 0;
+		do {
+			freed += getEventAt(dataStart() + freed)->size;
+			hdr->numEvents--;
+			countDiscardedEvent(1);
+		} while(freed < firstSize && hdr->numEvents > 1);
+
+		if (freed >= firstSize) {
+			uint16_t newHead = dataStart() + freed - firstSize;
+			memmove(&retainedBuffer[newHead], &retainedBuffer[head], firstSize);
+			hdr->head = newHead;
+		}
+		else {
+			// Only the oldest event remains
+			memmove(&retainedBuffer[dataStart()], &retainedBuffer[head], firstSize);
+			hdr->head = dataStart();
+			hdr->tail = dataStart() + firstSize;
+		}
+	}
+
+	if (hdr->numEvents == 0) {
+		hdr->head = hdr->tail = dataStart();
+	}
+
+	PUBLISH_QUEUE_LOG_TRACE("after discardOldestEvent numEvents=%d head=%d tail=%d", hdr->numEvents, (int)hdr->head, (int)hdr->tail);
+
+
+	return true;
+}
+
+void PublishQueueAsyncRetained::forEachEvent(std::function<bool(const PublishQueueEventData *)> fn) {
+	// This entire function holds a mutex lock that's released when returning
+	StMutexLock lock(this);
+
+	PublishQueueRingHeader *hdr = getHeader();
+	uint16_t offset = hdr->head;
+	for(uint16_t ii = 0; ii < hdr->numEvents; ii++) {
+		if (ii > 0) {
+			offset = wrapOffset(offset);
+		}
+		PublishQueueEventData *eventData = getEventAt(offset);
+		if (!fn(eventData)) {
+			break;
+		}
+		offset += eventData->size;
+	}
+}
+
+void PublishQueueAsyncRetained::getQueueUsage(uint32_t &numEvents, uint32_t &numBytes) const {
+	PublishQueueRingHeader *hdr = getHeader();
+
+	numEvents = hdr->numEvents;
+	if (numEvents == 0) {
+		numBytes = 0;
+	}
+	else
+	if (hdr->tail > hdr->head) {
+		numBytes = hdr->tail - hdr->head;
+	}
+	else {
+		// Wrapped. This includes the unused space at the end of the buffer.
+		numBytes = (dataEnd() - dataStart()) - (hdr->head - hdr->tail);
+	}
+}
+
+uint16_t PublishQueueAsyncRetained::getNumEvents() const {
+	uint16_t numEvents = 0;
+
+	{
+		StMutexLock lock(this);
+
+		numEvents = getHeader()->numEvents;
+	}
+
+	return numEvents;
+}
+
+
+PublishQueueAsyncTiered::PublishQueueAsyncTiered(PublishQueueAsyncRetained &front, PublishQueueAsyncBase &back) :
+		front(front), back(back) {
+
+}
+
+PublishQueueAsyncTiered::~PublishQueueAsyncTiered() {
+	delete[] refillBuf;
+}
+
+void PublishQueueAsyncTiered::setup() {
+	// The tiers don't start threads, and tell this queue when they discard an event
+	front.tieredQueue = this;
+	back.tieredQueue = this;
+	front.setup();
+	back.setup();
+
+	if (refillBuf == NULL) {
+		refillBuf = new uint8_t[refillSize];
+	}
+
+	// Do superclass setup (starting the thread)
+	PublishQueueAsyncBase::setup();
+
+	StMutexLock lock(this);
+	syncTiers();
+	updateUsageMetrics();
+
+	PUBLISH_QUEUE_LOG_TRACE("tiered setup front=%u back=%u", (unsigned)front.getNumEvents(), (unsigned)backEvents);
+}
+
+bool PublishQueueAsyncTiered::publishCommon(const char *eventName, const char *data, int ttl, PublishFlags flags1, PublishFlags flags2, uint8_t priority) {
+	if (!haveSetup) {
+		setup();
+	}
+
+	if (data == NULL) {
+		data = "";
+	}
+
+	size_t size = getEventSize(strlen(eventName), strlen(data));
+	if (size == 0) {
+		// Event name or data is too long to publish
+		metrics.rejected++;
+		return false;
+	}
+
+	StMutexLock lock(this);
+	syncTiers();
+
+	// Normally the thread has already spilled events, so this only happens when events are
+	// queued faster than the thread runs
+	if (!frontHasRoom(size) && spillEvents()) {
+		syncTiers();
+	}
+
+	if (!front.publishCommon(eventName, data, ttl, flags1, flags2, priority)) {
+		metrics.rejected++;
+		return false;
+	}
+	eventQueued();
+	return true;
+}
+
+bool PublishQueueAsyncTiered::reserveEvent(size_t size) {
+	if (!haveSetup) {
+		setup();
+	}
+	return front.reserveEvent(size);
+}
+
+bool PublishQueueAsyncTiered::commitEvent(const uint8_t *buf, size_t size) {
+	StMutexLock lock(this);
+	syncTiers();
+
+	if (!frontHasRoom(size) && spillEvents()) {
+		syncTiers();
+	}
+
+	if (!front.commitEvent(buf, size)) {
+		metrics.rejected++;
+		return false;
+	}
+	eventQueued();
+	return true;
+}
+
+PublishQueueEventData *PublishQueueAsyncTiered::getOldestEvent() {
+	StMutexLock lock(this);
+	syncTiers();
+
+	if (sendingCount == 0) {
+		selectTier();
+		syncTiers();
+	}
+
+	if (backEvents == 0 || getFrontLead() > 0) {
+		return front.getOldestEvent();
+	}
+
+	while(true) {
+		refill();
+		if (refillCount == 0) {
+			// Could not read a complete event into refillBuf
+			return back.getOldestEvent();
+		}
+
+		PublishQueueEventData *eventData = (PublishQueueEventData *)&refillBuf[refillStart];
+		if (isValidEvent(eventData, EVENT_BUF_SIZE)) {
+			expandEvent(eventData, publishBuf);
+			return (PublishQueueEventData *)publishBuf;
+		}
+
+		PUBLISH_QUEUE_LOG_ERROR("back tier event crc mismatch, discarding it");
+		uint16_t oldRefillCount = refillCount;
+		if (!back.discardOldEvent(false)) {
+			return NULL;
+		}
+		back.metrics.corrupted++;
+		if (refillCount == oldRefillCount) {
+			// Normally tierEventDiscarded() removes it from refillBuf, but the back tier may have been reset
+			refillStart = refillLen = 0;
+			refillCount = 0;
+		}
+		syncTiers();
+		if (backEvents == 0) {
+			return front.getOldestEvent();
+		}
+	}
+}
+
+bool PublishQueueAsyncTiered::clearEvents() {
+	StMutexLock lock(this);
+
+	front.clearEvents();
+	back.clearEvents();
+	backEvents = 0;
+	refillStart = refillLen = 0;
+	refillCount = 0;
+	sendFront = false;
+	frontLead = 0;
+
+	isSending = false;
+	clearSendingCount();
+	lastPublish = 0;
+	updateUsageMetrics();
+
+	return true;
+}
+
+bool PublishQueueAsyncTiered::discardOldEvent(bool secondEvent) {
+	StMutexLock lock(this);
+	syncTiers();
+
+	uint16_t lead = getFrontLead();
+	if (lead > 0) {
+		if (secondEvent && lead == 1 && backEvents > 0) {
+			// The second oldest event is the oldest event in the back tier
+			return back.discardOldEvent(false);
+		}
+		return front.discardOldEvent(secondEvent);
+	}
+	if (backEvents == 0) {
+		return front.discardOldEvent(secondEvent);
+	}
+	if (secondEvent && backEvents == 1) {
+		// The second oldest event is the oldest event in the front tier
+		return front.discardOldEvent(false);
+	}
+	return back.discardOldEvent(secondEvent);
+}
+
+void PublishQueueAsyncTiered::forEachEvent(std::function<bool(const PublishQueueEventData *)> fn) {
+	StMutexLock lock(this);
+	syncTiers();
+
+	uint16_t lead = getFrontLead();
+	if (lead > 0) {
+		uint16_t index = 0;
+		bool more = true;
+		front.forEachEvent([&](const PublishQueueEventData *eventData) {
+			if (index++ == lead) {
+				return false;
+			}
+			more = fn(eventData);
+			return more;
+		});
+		if (!more) {
+			return;
+		}
+	}
+
+	if (backEvents > 0) {
+		refill();
+
+		size_t offset = refillStart;
+		for(uint16_t ii = 0; ii < refillCount; ii++) {
+			const PublishQueueEventData *eventData = (const PublishQueueEventData *)&refillBuf[offset];
+			if (!fn(eventData)) {
+				return;
+			}
+			offset += eventData->size;
+		}
+
+		if (refillCount < backEvents) {
+			// The rest of the back tier events are visited after they're read into refillBuf
+			return;
+		}
+	}
+
+	if (!sendFront) {
+		uint16_t index = 0;
+		front.forEachEvent([&](const PublishQueueEventData *eventData) {
+			if (index++ < lead) {
+				return true;
+			}
+			return fn(eventData);
+		});
+	}
+}
+
+uint16_t PublishQueueAsyncTiered::getNumEvents() const {
+	uint32_t numEvents = 0;
+
+	{
+		StMutexLock lock(this);
+
+		numEvents = (uint32_t)front.getNumEvents() + back.getNumEvents();
+	}
+
+	return (numEvents < 0xffff) ? (uint16_t)numEvents : 0xffff;
+}
+
+void PublishQueueAsyncTiered::getQueueUsage(uint32_t &numEvents, uint32_t &numBytes) const {
+	uint32_t backNumEvents, backNumBytes;
+	{
+		StMutexLock lock(&front);
+		front.getQueueUsage(numEvents, numBytes);
+	}
+	{
+		StMutexLock lock(&back);
+		back.getQueueUsage(backNumEvents, backNumBytes);
+	}
+	numEvents += backNumEvents;
+	numBytes += backNumBytes;
+}
+
+bool PublishQueueAsyncTiered::hasWaitingPriorityEvent() const {
+	if (sendFront || backEvents == 0 || refillCount == 0) {
+		return false;
+	}
+	if (frontLead == 0 && getFrontPriority() > getEventPriority((const PublishQueueEventData *)&refillBuf[refillStart])) {
+		return true;
+	}
+
+	StMutexLock lock(&back);
+	return back.hasWaitingPriorityEvent();
+}
+
+uint16_t PublishQueueAsyncTiered::getActiveLaneEvents() const {
+	// The front tier header is read directly because forEachEvent() holds the front tier mutex
+	return sendFront ? front.getHeader()->numEvents : 0xffff;
+}
+
+void PublishQueueAsyncTiered::threadTasks() {
+	front.threadTasks();
+	back.threadTasks();
+
+	// bytesInUse is checked without the mutex so the idle thread doesn't contend for it. It's only
+	// updated when events are queued, so it can be higher than the actual usage, but not lower.
+	size_t threshold = (size_t)(front.dataEnd() - front.dataStart()) * spillPercent / 100;
+	if (front.metrics.bytesInUse > threshold) {
+		StMutexLock lock(this);
+		syncTiers();
+		if (spillEvents()) {
+			syncTiers();
+			updateUsageMetrics();
+		}
+	}
+}
+
+system_tick_t PublishQueueAsyncTiered::getThreadTasksWaitMs() {
+	system_tick_t frontMs = front.getThreadTasksWaitMs();
+	system_tick_t backMs = back.getThreadTasksWaitMs();
+	return (frontMs < backMs) ? frontMs : backMs;
+}
+
+void PublishQueueAsyncTiered::syncTiers() {
+	backEvents = back.getNumEvents();
+	if (refillCount > backEvents) {
+		// The back tier was reset
+		refillStart = refillLen = 0;
+		refillCount = 0;
+	}
+
+	if (sendFront && front.getHeader()->numEvents == 0) {
+		sendFront = false;
+	}
+	if (backEvents == 0 || frontLead > front.getHeader()->numEvents) {
+		// Without back tier events, the order is the same without the lead
+		frontLead = 0;
+	}
+	if (sendFront) {
+		// The events being sent are all in the front tier
+		back.isSending = false;
+		back.sendingCount = 0;
+		front.sendingCount = sendingCount;
+		front.isSending = isSending;
+		return;
+	}
+
+	// The front tier events before the back tier are sent first, then the back tier events
+	uint16_t leadSending = (sendingCount < frontLead) ? sendingCount : frontLead;
+	uint16_t rest = sendingCount - leadSending;
+	uint16_t backSending = (rest < backEvents) ? rest : backEvents;
+
+	back.isSending = isSending && (frontLead == 0 || backSending > 0);
+	back.sendingCount = backSending;
+	front.sendingCount = sendingCount - backSending;
+	front.isSending = isSending && (front.sendingCount > 0 || backEvents == 0 || frontLead > 0);
+}
+
+void PublishQueueAsyncTiered::selectTier() {
+	sendFront = false;
+	if (backEvents == 0) {
+		return;
+	}
+
+	if (refillCount > 0) {
+		StMutexLock lock(&back);
+		if (back.hasWaitingPriorityEvent()) {
+			// Read the refill buffer again from the higher priority lane
+			refillStart = refillLen = 0;
+			refillCount = 0;
+		}
+	}
+
+	refill();
+	if (refillCount == 0) {
+		return;
+	}
+
+	uint8_t backPriority = getEventPriority((const PublishQueueEventData *)&refillBuf[refillStart]);
+	sendFront = getFrontPriority() > backPriority;
+	if (sendFront) {
+		PUBLISH_QUEUE_LOG_TRACE("sending front tier first priority=%u", (unsigned)getFrontPriority());
+	}
+}
+
+uint8_t PublishQueueAsyncTiered::getFrontPriority() const {
+	const PublishQueueRingHeader *hdr = front.getHeader();
+	if (hdr->numEvents == 0) {
+		return 0;
+	}
+
+	// Priority events are queued after the oldest event and before lower priority events, so the
+	// highest priority is the first or second event
+	const PublishQueueEventData *eventData = front.getEventAt(hdr->head);
+	uint8_t priority = getEventPriority(eventData);
+	if (hdr->numEvents > 1) {
+		uint8_t second = getEventPriority(front.getEventAt(front.wrapOffset(hdr->head + eventData->size)));
+		if (second > priority) {
+			priority = second;
+		}
+	}
+	return priority;
+}
+
+bool PublishQueueAsyncTiered::frontHasRoom(size_t size) {
+	StMutexLock lock(&front);
+	return front.hasRoom(size);
+}
+
+bool PublishQueueAsyncTiered::spillEvents() {
+	// Events being sent stay in the front tier, and the events after them are spilled. Spilled events
+	// go after the back tier events, so that's only in order if the back tier events are sent first.
+	uint16_t first = frontLead;
+	uint16_t sending = front.sendingCount;
+	if (front.isSending && sending == 0) {
+		// startPublish() is getting the oldest event
+		sending = 1;
+	}
+	if (sending > first) {
+		if (!sendFront && backEvents > 0) {
+			// The events being sent continue from the back tier into the front tier
+			return false;
+		}
+		first = sending;
+	}
+
+	size_t target = (size_t)(front.dataEnd() - front.dataStart()) * spillPercent / 200;
+	bool result = false;
+
+	while(true) {
+		uint16_t count = 0;
+		uint16_t added = 0;
+		{
+			StMutexLock lock(&front);
+
+			uint32_t numEvents, numBytes;
+			front.getQueueUsage(numEvents, numBytes);
+			PublishQueueRingHeader *hdr = front.getHeader();
+			if (first >= hdr->numEvents || numBytes <= target) {
+				break;
+			}
+
+			bool contiguous;
+			uint16_t start = front.getEventOffset(first, contiguous);
+			if (!contiguous) {
+				// The events that stay wrap around the end of the buffer. Removing the events after
+				// them moves them, so they must be contiguous.
+				front.linearize();
+				start = front.getEventOffset(first, contiguous);
+			}
+
+			// Find the events from start up to the end of the buffer (or tail) that bring the usage to target
+			uint16_t end = (hdr->tail > start) ? hdr->tail : front.dataEnd();
+			uint16_t offset = start;
+			while(first + count < hdr->numEvents && (size_t)(end - offset) >= sizeof(PublishQueueEventData)) {
+				uint16_t size = front.getEventAt(offset)->size;
+				if (size == 0) {
+					// Wrap marker
+					break;
+				}
+				offset += size;
+				count++;
+				if (numBytes - (offset - start) <= target) {
+					break;
+				}
+			}
+
+			// The records are written directly from the retained buffer
+			added = back.appendRecords(&front.retainedBuffer[start], offset - start, count);
+
+			if (added > 0) {
+				// The events are still queued, so the front tier doesn't report them as discarded
+				spilling = true;
+				front.removeEvent(first, added);
+				for(uint16_t ii = 0; ii < added; ii++) {
+					front.countDiscardedEvent(first);
+				}
+				spilling = false;
+			}
+		}
+		PUBLISH_QUEUE_LOG_TRACE("spilled %u of %u events after %u", (unsigned)added, (unsigned)count, (unsigned)first);
+
+		if (added > 0 && first > 0) {
+			// The events that stayed are sent before the back tier
+			sendFront = false;
+			frontLead = first;
+		}
+		backEvents += added;
+		spilledCount += added;
+		if (added == 0 || added < count) {
+			// The back tier is full or could not be written
+			result = result || (added > 0);
+			break;
+		}
+		result = true;
+	}
+
+	{
+		StMutexLock lock(&front);
+		front.updateUsageMetrics();
+	}
+	return result;
+}
+
+void PublishQueueAsyncTiered::refill() {
+	if (refillCount != 0) {
+		return;
+	}
+
+	refillStart = 0;
+	refillCount = back.readRecords(refillBuf, refillSize, refillLen);
+
+	PUBLISH_QUEUE_LOG_TRACE("refill count=%u len=%u", (unsigned)refillCount, (unsigned)refillLen);
+}
+
+void PublishQueueAsyncTiered::removeRefillEvent(uint16_t index) {
+	if (index >= refillCount) {
+		return;
+	}
+
+	size_t offset = refillStart;
+	for(uint16_t ii = 0; ii < index; ii++) {
+		offset += ((PublishQueueEventData *)&refillBuf[offset])->size;
+	}
+	size_t size = ((PublishQueueEventData *)&refillBuf[offset])->size;
+
+	if (index == 0) {
+		refillStart += size;
+	}
+	else {
+		memmove(&refillBuf[offset], &refillBuf[offset + size], refillLen - offset - size);
+		refillLen -= size;
+	}
+
+	refillCount--;
+	if (refillCount == 0) {
+		refillStart = refillLen = 0;
+	}
+}
+
+void PublishQueueAsyncTiered::tierEventDiscarded(PublishQueueAsyncBase *tier, uint16_t index) {
+	if (tier == &front) {
+		if (spilling) {
+			// Moved to the back tier, not discarded
+			return;
+		}
+		if (index < frontLead) {
+			frontLead--;
+			countDiscardedEvent(index);
+			return;
+		}
+		countDiscardedEvent(sendFront ? index : backEvents + index);
+		return;
+	}
+
+	if (backEvents > 0) {
+		backEvents--;
+	}
+	removeRefillEvent(index);
+	countDiscardedEvent(getFrontLead() + index);
+}
+
+void PublishQueueAsyncTiered::tierEventInserted(PublishQueueAsyncBase *tier, uint16_t index) {
+	if (tier == &front && index < frontLead) {
+		// A priority event queued between the events sent before the back tier is sent with them
+		frontLead++;
+	}
+}
@@ -3,6 +3,9 @@
 
 #include "Particle.h"
 
+#include <algorithm>
+#include <atomic>
+
 /**
  * @brief Library for asynchronous Particle.publish on the Particle Photon, Electron, and other devices.
  *
@@ -23,15 +26,20 @@
 
 /**
  * @brief Magic bytes used in retained memory and FRAM to detect if the data structures look valid-ish
+ *
+ * This is the magic for 0.2.x and earlier, which use version 1 event records. Storage with this magic is
+ * converted to version 2 event records in setup().
  */
 static const uint32_t PUBLISH_QUEUE_HEADER_MAGIC = 0xd19cab61;
 
+
 /**
- * @brief Structure stored at the beginning of retained memory.
+ * @brief Structure stored at the beginning of retained memory, FRAM, and event files in 0.2.x and earlier.
  *
  * It's followed by a packed event PublishQueueEventData structures.
  *
- * It's also what's stored in FRAM, or in the event file on SPIFFS or SdFat file system.
+ * In 0.3.0 and later, it's only used to convert data from 0.2.x. Retained memory and FRAM use
+ * PublishQueueRingHeader and file systems use PublishQueueFileHeader.
  */
 typedef struct { // 8 bytes
 	uint32_t	magic;			//!< PUBLISH_QUEUE_HEADER_MAGIC
@@ -40,1271 +48,7431 @@ typedef struct { // 8 bytes
 } PublishQueueHeader;
 
 /**
- * @brief Event data structure.
+ * @brief Magic bytes used in retained memory for the circular buffer layout (PublishQueueRingHeader)
+ *
+ * A retained buffer that still has PUBLISH_QUEUE_HEADER_MAGIC was written by 0.2.x and earlier,
+ * which used a linear layout. It's converted to the circular layout in setup().
+ */
+static const uint32_t PUBLISH_QUEUE_RING_HEADER_MAGIC = 0xd19cab64;
+
+/**
+ * @brief Structure stored at the beginning of retained memory in 0.3.0 and later.
+ *
+ * It's followed by a circular buffer of PublishQueueEventData structures. The oldest event is at
+ * head and the next event will be written at tail. Both are byte offsets from the beginning of
+ * the retained buffer (including this header), and are always 4-byte aligned.
+ *
+ * The same layout is used in FRAM, with offsets relative to the start address.
+ *
+ * If an event doesn't fit between tail and the end of the buffer, it's stored at the beginning of
+ * the data area instead. If there's room for a PublishQueueEventData at the old tail, a wrap marker
+ * (an event with size 0) is written there. Otherwise, the reader wraps implicitly because there isn't
+ * room for an event header.
+ *
+ * Because the oldest event is removed by just advancing head, removing an event does not move
+ * any other events in memory.
+ */
+typedef struct { // 12 bytes
+	uint32_t	magic;			//!< PUBLISH_QUEUE_RING_HEADER_MAGIC
+	uint16_t	size;			//!< retainedBufferSize, in case it changed
+	uint16_t	numEvents;		//!< number of events, see the PublishQueueEventData structure
+	uint16_t	head;			//!< offset of the oldest event
+	uint16_t	tail;			//!< offset where the next event will be written
+} PublishQueueRingHeader;
+
+/**
+ * @brief Magic bytes used in FRAM for the circular buffer layout (PublishQueueFRAMHeader)
+ */
+static const uint32_t PUBLISH_QUEUE_FRAM_HEADER_MAGIC = 0xd19cab67;
+
+/**
+ * @brief One circular buffer in FRAM, part of PublishQueueFRAMHeader
  *
+ * This works like PublishQueueRingHeader, with offsets relative to the start address. Events are never
+ * moved to remove another event. An event that's removed when it's not at head is marked with
+ * PUBLISH_QUEUE_RECORD_FLAG_DELETED, and head skips the deleted events after the event it removes. The
+ * event at head is never deleted.
  */
 typedef struct { // 8 bytes
+	uint16_t	numEvents;		//!< number of events from head to tail, including deleted events
+	uint16_t	head;			//!< offset of the oldest event
+	uint16_t	tail;			//!< offset where the next event will be written
+	uint16_t	deletedEvents;	//!< number of events from head to tail that are marked as deleted
+} PublishQueueFRAMRing;
+
+/**
+ * @brief Structure stored at the beginning of the FRAM area in 0.3.0 and later
+ *
+ * The FRAM area holds two circular buffers. Events with normal priority are in events, which is
+ * always sent oldest first. Events queued with a priority above 0 are in priority, which uses the last
+ * prioritySize bytes of the FRAM area. The number of events in each priority is written with the rings,
+ * so setup() doesn't read the event headers to count them unless the counts don't match the rings.
+ */
+typedef struct { // 32 bytes
+	uint32_t	magic;			//!< PUBLISH_QUEUE_FRAM_HEADER_MAGIC
+	uint16_t	size;			//!< Length of the FRAM area, in case it changed
+	uint16_t	prioritySize;	//!< Bytes at the end of the FRAM area for priority events, in case it changed
+	PublishQueueFRAMRing events;	//!< Events with normal priority
+	PublishQueueFRAMRing priority;	//!< Events with a priority above 0
+	uint16_t	laneEvents[3];	//!< Number of events with priority 1 to 3 in priority, not including deleted events
+	uint16_t	reserved;		//!< 0
+} PublishQueueFRAMHeader;
+
+/**
+ * @brief Magic bytes at the beginning of the event file for file systems (PublishQueueFileHeader)
+ *
+ * An event file that has PUBLISH_QUEUE_HEADER_MAGIC was written by 0.2.x and earlier. It's converted
+ * in setup().
+ */
+static const uint32_t PUBLISH_QUEUE_FILE_HEADER_MAGIC = 0xd19cab65;
+
+/**
+ * @brief Structure stored at the beginning of the event file on SPIFFS, SdFat, or POSIX file systems
+ *
+ * It's followed by packed PublishQueueEventData structures. Events that have been sent remain in
+ * the file until all of the events have been sent, then the file is truncated.
+ *
+ * oldestPos is checkpointed every time an event is sent, so setup() doesn't need to read the
+ * events to find the oldest unsent event.
+ *
+ * Events queued with a priority above 0 are stored in a separate priority file with the same layout,
+ * named with the events filename followed by .p.
+ */
+typedef struct { // 16 bytes
+	uint32_t	magic;			//!< PUBLISH_QUEUE_FILE_HEADER_MAGIC
+	uint16_t	numSent;		//!< number of events at the beginning of the file that have been sent already
+	uint16_t	numEvents;		//!< number of events in the file, including the ones that have been sent
+	uint32_t	oldestPos;		//!< file offset of the oldest event that has not been sent
+	uint32_t	endPos;			//!< file offset just past the last event, where the next event will be written
+} PublishQueueFileHeader;
+
+/**
+ * @brief Magic bytes at the beginning of the events file when events are stored in segment files (PublishQueueSegmentHeader)
+ */
+static const uint32_t PUBLISH_QUEUE_SEGMENT_HEADER_MAGIC = 0xd19cab66;
+
+/**
+ * @brief Structure stored in the events file when the events are stored in segment files
+ *
+ * Each segment is a separate file with a PublishQueueFileHeader and events, named with the events
+ * filename followed by a period and the segment number. Segment numbers from headSegment (oldest
+ * events) to tailSegment (where events are appended) are in use.
+ *
+ * This is only written when a segment is added or removed.
+ */
+typedef struct { // 16 bytes
+	uint32_t	magic;			//!< PUBLISH_QUEUE_SEGMENT_HEADER_MAGIC
+	uint32_t	headSegment;	//!< segment number of the oldest segment
+	uint32_t	tailSegment;	//!< segment number of the newest segment
+	uint32_t	reserved;		//!< reserved, currently always 0
+} PublishQueueSegmentHeader;
+
+/**
+ * @brief Event data structure (version 2)
+ *
+ * Version 2 records (0.3.0 and later) store the length of the event name and the size of the whole
+ * record up front, so finding the next event, the event name, or the event data never requires
+ * scanning the strings. For FRAM and file systems, only this structure needs to be read to find the
+ * next event.
+ *
+ * Version 1 records (0.2.x and earlier) were 8 bytes, the same as the first 8 bytes of this structure
+ * except that nameLen was unused and size was not always set. They're converted in setup().
+ *
+ * crc is a checksum of the whole record (see PublishQueueAsyncBase::getEventCrc()), so a record that
+ * was only partially written when power was lost can be found in setup() and the events before it kept,
+ * or when it's read to be sent and discarded.
+ */
+typedef struct { // 16 bytes
 	int ttl;					//!< Event TTL (not actually used by the cloud, but we can send it up if sent)
 	uint8_t flags;				//!< Event flags (like PRIVATE or WITH_ACK)
-	uint8_t reserved1;			//!< Not currently used (compiler will pad structure out to 8 bytes anyway)
-	uint16_t size;				//!< Size of entire structure, including eventName, eventData, and padding in 0.3.0 and later
+	uint8_t nameLen;			//!< Length of eventName, not including the null terminator
+	uint16_t size;				//!< Size of entire structure, including eventName, eventData, and padding
+	uint16_t recordFlags;		//!< PUBLISH_QUEUE_RECORD_FLAG_* bits, 0 for a normal event
+	uint16_t crc;				//!< CRC-16 of the record, not including crc and PUBLISH_QUEUE_RECORD_FLAG_DELETED
+	uint32_t timestamp;			//!< Time.now() when the event was queued, or 0 if the time was not valid
 	// eventName (c-string, packed)
 	// eventData (c-string, packed)
 	// padded to 4-byte alignment
 } PublishQueueEventData;
 
+/**
+ * @brief Bit in PublishQueueEventData recordFlags for an event that was deleted to make room
+ *
+ * File system and FRAM queues delete an event that is not the oldest by setting this bit in place instead
+ * of moving the other events. Deleted events are skipped when they become the oldest event. This bit is
+ * not included in the crc, so setting it doesn't require rewriting the record.
+ */
+static const uint16_t PUBLISH_QUEUE_RECORD_FLAG_DELETED = 0x0001;
+
+/**
+ * @brief Bit in PublishQueueEventData recordFlags for an event whose data is compressed
+ *
+ * The event name is stored normally. It's followed by the length of the uncompressed data (2 bytes,
+ * little endian) and the data compressed by PublishQueueCompression, instead of the data c-string.
+ */
+static const uint16_t PUBLISH_QUEUE_RECORD_FLAG_COMPRESSED = 0x0002;
+
+/**
+ * @brief Bits in PublishQueueEventData recordFlags that hold the event priority (0 - 3)
+ */
+static const uint16_t PUBLISH_QUEUE_RECORD_PRIORITY_MASK = 0x0300;
+
+/**
+ * @brief Shift for the event priority in PublishQueueEventData recordFlags
+ */
+static const uint8_t PUBLISH_QUEUE_RECORD_PRIORITY_SHIFT = 8;
+
+/**
+ * @brief Highest event priority. Events with priority 0 (the default) have the lowest priority.
+ */
+static const uint8_t PUBLISH_QUEUE_PRIORITY_MAX = 3;
+
+/**
+ * @brief Size of the version 1 (0.2.x and earlier) event header
+ */
+static const size_t PUBLISH_QUEUE_EVENT_DATA_V1_SIZE = 8;
+
 /**
  * @brief Logger class that logs to app.pubq
  */
 extern Logger pubqLogger;
 
 /**
- * @brief Abstract base class for async publish queue.
+ * @brief Lowest level of the publish queue log messages that are compiled in
  *
- * You don't instantiate one of these, you instead instantitate a concrete subclass like:
- * - PublishQueueAsyncRetained
- * - PublishQueueAsyncFRAM
- * - PublishQueueAsyncSpiffs
- * - PublishQueueAsyncSdFat
+ * Messages below this level are removed at compile time, including the evaluation and formatting of
+ * their arguments, even if a log handler would filter them out. For example, LOG_LEVEL_WARN removes
+ * the trace and info messages, which include the data of each event queued and published. Define it
+ * in the build flags so it also applies to PublishQueueAsyncRK.cpp. The default is the Device OS
+ * LOG_COMPILE_TIME_LEVEL, if defined, otherwise LOG_LEVEL_ALL.
  */
-class PublishQueueAsyncBase {
+#ifndef PUBLISH_QUEUE_LOG_LEVEL
+#ifdef LOG_COMPILE_TIME_LEVEL
+#define PUBLISH_QUEUE_LOG_LEVEL LOG_COMPILE_TIME_LEVEL
+#else
+#define PUBLISH_QUEUE_LOG_LEVEL LOG_LEVEL_ALL
+#endif
+#endif
+
+/**
+ * @brief Logs to pubqLogger if the level is at least PUBLISH_QUEUE_LOG_LEVEL
+ *
+ * The arguments are only evaluated if the level is compiled in.
+ */
+#define PUBLISH_QUEUE_LOG(level, fn, ...) do { if ((int)(level) >= (int)(PUBLISH_QUEUE_LOG_LEVEL)) { pubqLogger.fn(__VA_ARGS__); } } while(0)
+
+#define PUBLISH_QUEUE_LOG_TRACE(...) PUBLISH_QUEUE_LOG(LOG_LEVEL_TRACE, trace, __VA_ARGS__)	//!< pubqLogger.trace if compiled in
+#define PUBLISH_QUEUE_LOG_INFO(...) PUBLISH_QUEUE_LOG(LOG_LEVEL_INFO, info, __VA_ARGS__)		//!< pubqLogger.info if compiled in
+#define PUBLISH_QUEUE_LOG_WARN(...) PUBLISH_QUEUE_LOG(LOG_LEVEL_WARN, warn, __VA_ARGS__)		//!< pubqLogger.warn if compiled in
+#define PUBLISH_QUEUE_LOG_ERROR(...) PUBLISH_QUEUE_LOG(LOG_LEVEL_ERROR, error, __VA_ARGS__)	//!< pubqLogger.error if compiled in
+
+/**
+ * @brief Interface for a policy that controls how often events are published
+ *
+ * The publish queue uses a PublishQueueTokenBucket by default. You can implement this interface and
+ * pass it to withRateLimiter() to use a different policy. Both methods are only called from the
+ * publish queue thread.
+ */
+class PublishQueueRateLimiter {
 public:
 	/**
-	 * @brief Construct a publish queue
+	 * @brief Destructor
 	 */
-	PublishQueueAsyncBase();
+	virtual ~PublishQueueRateLimiter() {};
 
 	/**
-	 * @brief You normally allocate this as a global object and never delete it
+	 * @brief Returns true if a publish can be started now
 	 */
-	virtual ~PublishQueueAsyncBase();
+	virtual bool canPublish() = 0;
 
 	/**
-	 * @brief Start the thread. You must call this from setup.
-	 *
-	 * Since version 0.0.1 did not have the setup method, if you don't setup() it will be set up when you first
-	 * publish, but starting the thread earlier is suggested, but only with retained memory (PublishQueueAsync).
+	 * @brief Returns the number of milliseconds until canPublish() could return true
 	 *
-	 * In 0.1.0 or later you must call setup(), or the library will not function with FRAM, Spiffs, or SdFat.
+	 * Called when canPublish() returns false. The publish queue thread sleeps until then, or until it's
+	 * woken for another reason. The default implementation returns 10, so a rate limiter that doesn't
+	 * implement this is checked every 10 milliseconds.
 	 */
-	virtual void setup();
+	virtual unsigned long getWaitMs() { return 10; };
 
 	/**
-	 * @brief Overload for publishing an event
+	 * @brief Called when a publish is started
 	 *
-	 * @param eventName The name of the event (63 character maximum).
-	 *
-	 * @param flags1 Normally PRIVATE. You can also use PUBLIC, but one or the other must be specified.
-	 *
-	 * @param flags2 (optional) You can use NO_ACK or WITH_ACK if desired.
-	 *
-	 * @return true if the event was queued or false if it was not.
-	 *
-	 * This function almost always returns true. If you queue more events than fit in the buffer the
-	 * oldest (sometimes second oldest) is discarded.
+	 * When pipelining (withPipelining), more than one publish can be started before the first one
+	 * completes. The default implementation does nothing.
 	 */
-	inline 	bool publish(const char *eventName, PublishFlags flags1, PublishFlags flags2 = PublishFlags()) {
-		return publishCommon(eventName, "", 60, flags1, flags2);
-	}
+	virtual void publishStarted() {};
 
 	/**
-	 * @brief Overload for publishing an event
-	 *
-	 * @param eventName The name of the event (63 character maximum).
-	 *
-	 * @param data The event data (255 bytes maximum, 622 bytes in system firmware 0.8.0-rc.4 and later).
-	 *
-	 * @param flags1 Normally PRIVATE. You can also use PUBLIC, but one or the other must be specified.
-	 *
-	 * @param flags2 (optional) You can use NO_ACK or WITH_ACK if desired.
-	 *
-	 * @return true if the event was queued or false if it was not.
-	 *
-	 * This function almost always returns true. If you queue more events than fit in the buffer the
-	 * oldest (sometimes second oldest) is discarded.
+	 * @brief Called when a publish completes, whether it succeeded or not
 	 */
-	inline  bool publish(const char *eventName, const char *data, PublishFlags flags1, PublishFlags flags2 = PublishFlags()) {
-		return publishCommon(eventName, data, 60, flags1, flags2);
-	}
+	virtual void publishDone() = 0;
+};
 
+/**
+ * @brief Token bucket rate limiter, the default publish rate limit policy
+ *
+ * The bucket holds up to burst tokens and starts full. Each publish uses a token when it completes,
+ * and a token is added every refillMs milliseconds. A publish can be started whenever there's a
+ * token, so up to burst events can be published back-to-back, after which events are published
+ * every refillMs milliseconds.
+ *
+ * The default (burst 1, refillMs 1010) publishes one event 1010 milliseconds after the previous
+ * publish completed, the same as 0.2.x and earlier.
+ */
+class PublishQueueTokenBucket : public PublishQueueRateLimiter {
+public:
 	/**
-	 * @brief Overload for publishing an event
-	 *
-	 * @param eventName The name of the event (63 character maximum).
-	 *
-	 * @param data The event data (255 bytes maximum, 622 bytes in system firmware 0.8.0-rc.4 and later).
-	 *
-	 * @param ttl The time-to-live value. If not specified in one of the other overloads, the value 60 is
-	 * used. However, the ttl is ignored by the cloud, so it doesn't matter what you set it to. Essentially
-	 * all events are discarded immediately if not subscribed to so they essentially have a ttl of 0.
-	 *
-	 * @param flags1 Normally PRIVATE. You can also use PUBLIC, but one or the other must be specified.
-	 *
-	 * @param flags2 (optional) You can use NO_ACK or WITH_ACK if desired.
+	 * @brief Construct a token bucket
 	 *
-	 * @return true if the event was queued or false if it was not.
+	 * @param burst Maximum number of tokens (publishes that can be made back-to-back). Must be at least 1.
 	 *
-	 * This function almost always returns true. If you queue more events than fit in the buffer the
-	 * oldest (sometimes second oldest) is discarded.
+	 * @param refillMs Milliseconds to add a token, or 0 for no rate limit
 	 */
-	inline  bool publish(const char *eventName, const char *data, int ttl, PublishFlags flags1, PublishFlags flags2 = PublishFlags()) {
-		return publishCommon(eventName, data, ttl, flags1, flags2);
+	PublishQueueTokenBucket(uint16_t burst = 1, unsigned long refillMs = 1010) {
+		withRateLimit(burst, refillMs);
 	}
 
 	/**
-	 * @brief Common publish function. All other overloads lead here. This is a pure virtual function, implemented in subclasses.
-	 *
-	 * @param eventName The name of the event (63 character maximum).
-	 *
-	 * @param data The event data (255 bytes maximum, 622 bytes in system firmware 0.8.0-rc.4 and later).
-	 *
-	 * @param ttl The time-to-live value. If not specified in one of the other overloads, the value 60 is
-	 * used. However, the ttl is ignored by the cloud, so it doesn't matter what you set it to. Essentially
-	 * all events are discarded immediately if not subscribed to so they essentially have a ttl of 0.
-	 *
-	 * @param flags1 Normally PRIVATE. You can also use PUBLIC, but one or the other must be specified.
-	 *
-	 * @param flags2 (optional) You can use NO_ACK or WITH_ACK if desired.
-	 *
-	 * @return true if the event was queued or false if it was not.
-	 *
-	 * This function almost always returns true. If you queue more events than fit in the buffer the
-	 * oldest (sometimes second oldest) is discarded.
+	 * @brief Destructor
 	 */
-	virtual bool publishCommon(const char *eventName, const char *data, int ttl, PublishFlags flags1, PublishFlags flags2 = PublishFlags()) = 0;
+	virtual ~PublishQueueTokenBucket() {};
 
 	/**
-	 * @brief Sets the retry after publish failure time
+	 * @brief Sets the burst and refill time and fills the bucket
 	 *
-	 * @param value The time in milliseconds (default: 30000, or 30 seconds)
+	 * @param burst Maximum number of tokens (publishes that can be made back-to-back). Must be at least 1.
 	 *
-	 * If a publish fails, this is the amount of time to wait before trying to send the event again.
+	 * @param refillMs Milliseconds to add a token, or 0 for no rate limit
 	 */
-	inline PublishQueueAsyncBase &withFailureRetryMs(unsigned long value) { failureRetryMs = value; return *this; };
+	PublishQueueTokenBucket &withRateLimit(uint16_t burst, unsigned long refillMs) {
+		this->burst = (burst > 0) ? burst : 1;
+		this->refillMs = refillMs;
+		tokens = this->burst;
+		return *this;
+	}
 
 	/**
-	 * @brief Remove any saved events
-	 *
-	 * @return true if the operation succeeded, or false if an event is currently being sent so the
-	 * events cannot be deleted.
+	 * @brief Returns true if there's a token that isn't reserved for a publish in progress
 	 */
-	virtual bool clearEvents() = 0;
+	virtual bool canPublish();
 
 	/**
-	 * @brief Get the oldest event that hasn't been published yet
-	 *
-	 * Returns a pointer to a PublishQueueEventData structure. This will remain valid until getOldestEvent()
-	 * is called again.
+	 * @brief Returns the time until the next token is added
 	 */
-	virtual PublishQueueEventData *getOldestEvent() = 0;
+	virtual unsigned long getWaitMs();
 
 	/**
-	 * @brief Discards the oldest event or second oldest event
-	 *
-	 * @param secondEvent True to discard the second oldest event
-	 *
-	 * When using retained memory, the getOldestEvent() function returns a pointer to retained memory. This
-	 * pointer must remain valid while in the process of publishing. If the retained buffer is full, we
-	 * want to discard and old event to make room for a newer event, but we can't dispose of the oldest
-	 * event, because it may be in use, so we pass true for secondEvent.
-	 *
-	 * After successfully publishingm this is called with secondEvent = false to discard the event we
-	 * just published.
-	 *
-	 * For file systems (SPIFFS and SdCard), secondEvent is never set to true.
+	 * @brief Reserves a token for the publish until it completes
 	 */
-	virtual bool discardOldEvent(bool secondEvent) = 0;
-
+	virtual void publishStarted();
 
 	/**
-	 * @brief Get the number of events in the queue (0 = empty)
+	 * @brief Uses a token
 	 */
-	virtual uint16_t getNumEvents() const = 0;
+	virtual void publishDone();
 
 	/**
-	 * @brief Pause publishing, even if it would be allowed because the cloud is connected
-	 *
-	 * This is used by the test suite, or you could use it in special cases.
+	 * @brief Returns the number of tokens available now
 	 */
-	void setPausePublishing(bool pause) { pausePublishing = pause; };
+	uint16_t getTokens() { refill(); return tokens; };
 
+protected:
 	/**
-	 * @brief Returns true if publishing is manually paused.
+	 * @brief Adds the tokens for the time since the last refill
 	 *
-	 * It does not take into account the cloud connection state, only manual pausing.
+	 * When the bucket is full, no time is accumulated, so a full bucket doesn't save up tokens.
 	 */
-	bool getPausePublishing() const { return pausePublishing; };
+	void refill();
+
+	uint16_t burst = 1;					//!< Maximum number of tokens
+	uint16_t tokens = 1;				//!< Number of tokens available
+	unsigned long refillMs = 1010;		//!< Milliseconds to add a token (0 = no limit)
+	unsigned long lastRefill = 0;		//!< millis() value when a token was last added, or when the bucket was last full
+	uint16_t inFlight = 0;				//!< Number of publishes started that have not completed
+};
 
+/**
+ * @brief Interface for a policy that controls how long to wait before retrying after a publish fails
+ *
+ * The publish queue uses a PublishQueueBackoff by default. You can implement this interface and
+ * pass it to withRetryPolicy() to use a different policy. Both methods are only called from the
+ * publish queue thread.
+ */
+class PublishQueueRetryPolicy {
+public:
 	/**
-	 * @brief Obtain a mutex lock
-	 *
-	 * This is done before any operation that modifies the retianed buffer or other shared
-	 * resources, typically using the StMutexLock class instead of calling mutexLock()
-	 * and mutexUnlock() directly.
-	 *
-	 * Prior to version 0.1.0 there was no mutex and SINGLE_THREADED_BLOCK was used, but the
-	 * mutex is more efficient and safer. When using a SINGLE_THREADED_BLOCK there is a greater
-	 * chance of accidentally causing deadlock.
+	 * @brief Destructor
 	 */
-	void mutexLock() const;
+	virtual ~PublishQueueRetryPolicy() {};
 
 	/**
-	 * @brief Unlock the mutex
+	 * @brief Called when a publish fails
+	 *
+	 * @returns The number of milliseconds to wait before publishing again
 	 */
-	void mutexUnlock() const;
+	virtual unsigned long publishFailed() = 0;
 
 	/**
-	 * @brief Log event data to the debug log
+	 * @brief Called when a publish succeeds
 	 */
-	void logPublishQueueEventData(const void *data) const;
+	virtual void publishSucceeded() = 0;
+};
 
+/**
+ * @brief Exponential backoff with jitter, the default retry policy
+ *
+ * After the first failure, the wait is initialMs. Each consecutive failure multiplies the wait by
+ * multiplier, up to maxMs. A successful publish resets the wait to initialMs.
+ *
+ * With jitter, the wait is reduced by a random amount up to jitterPercent percent, so a fleet of
+ * devices that lost their connection at the same time don't all retry at the same time.
+ *
+ * The default (initialMs 30000, maxMs 30000, no jitter) always waits 30 seconds, the same as 0.2.x
+ * and earlier.
+ */
+class PublishQueueBackoff : public PublishQueueRetryPolicy {
+public:
 	/**
-	 * @brief Maximum size of PublishQueueEventData with strings (696 bytes)
+	 * @brief Construct a backoff policy
 	 *
-	 * PublishQueueEventData contains flags and ttl (8 bytes)
-	 * 65 is the maximum event name length (64) + trailing null
-	 * 623 is the maximum event value length (622) + trailing null
-	 * It's padded to a 4-byte boundary, by 696 is already at a 4-byte boundary
+	 * @param initialMs Milliseconds to wait after the first failure
 	 *
-	 * Note: This size is not used for the retained memory subclass, but since it's used by
-	 * multiple other subclasses, it's included here.
+	 * @param maxMs Maximum milliseconds to wait
+	 *
+	 * @param multiplier Factor to multiply the wait by after each consecutive failure. Must be at least 1.
+	 *
+	 * @param jitterPercent Maximum random reduction of the wait in percent (0 - 100)
 	 */
-	static const size_t EVENT_BUF_SIZE = sizeof(PublishQueueEventData) + 65 + particle::protocol::MAX_EVENT_DATA_LENGTH;
+	PublishQueueBackoff(unsigned long initialMs = 30000, unsigned long maxMs = 30000, uint16_t multiplier = 2, uint8_t jitterPercent = 0) {
+		withBackoff(initialMs, maxMs, multiplier, jitterPercent);
+	}
 
-protected:
 	/**
-	 * @brief The thread function for the publish thread
+	 * @brief Destructor
 	 */
-	void threadFunction();
+	virtual ~PublishQueueBackoff() {};
 
 	/**
-	 * @brief Static version of the thread function
+	 * @brief Sets the backoff parameters and resets the wait
+	 *
+	 * @param initialMs Milliseconds to wait after the first failure
+	 *
+	 * @param maxMs Maximum milliseconds to wait. If less than initialMs, initialMs is used.
+	 *
+	 * @param multiplier Factor to multiply the wait by after each consecutive failure. Must be at least 1.
+	 *
+	 * @param jitterPercent Maximum random reduction of the wait in percent (0 - 100)
 	 */
-	static void threadFunctionStatic(void *param);
+	PublishQueueBackoff &withBackoff(unsigned long initialMs, unsigned long maxMs, uint16_t multiplier = 2, uint8_t jitterPercent = 0) {
+		this->initialMs = initialMs;
+		this->maxMs = (maxMs > initialMs) ? maxMs : initialMs;
+		this->multiplier = (multiplier > 0) ? multiplier : 1;
+		this->jitterPercent = (jitterPercent < 100) ? jitterPercent : 100;
+		nextMs = initialMs;
+		return *this;
+	}
 
 	/**
-	 * @brief Worker thread state machine start handler
+	 * @brief Returns the wait for this failure and increases the wait for the next one
 	 */
-	void startState();
+	virtual unsigned long publishFailed();
 
 	/**
-	 * @brief Worker thread state machine check queue state handler
+	 * @brief Resets the wait to initialMs
 	 */
-	void checkQueueState();
+	virtual void publishSucceeded();
 
 	/**
-	 * @brief Worker thread state machine wait to retry publishing state handler
+	 * @brief Returns the wait (before jitter) that will be used for the next failure
 	 */
-	void waitRetryState();
+	unsigned long getNextMs() const { return nextMs; };
 
-	/**
-	 * @brief Thread object, created in setup()
-	 */
-	Thread *thread = NULL;
+protected:
+	unsigned long initialMs = 30000;	//!< Wait after the first failure
+	unsigned long maxMs = 30000;		//!< Maximum wait
+	uint16_t multiplier = 2;			//!< Wait multiplier for each consecutive failure
+	uint8_t jitterPercent = 0;			//!< Maximum random reduction of the wait in percent
+	unsigned long nextMs = 30000;		//!< Wait before jitter for the next failure
+};
+
+/**
+ * @brief Small LZ77-style codec for event data (withCompression)
+ *
+ * Matches are only found within the same event, and the window is small enough that the compressor
+ * needs a 512-byte hash table and the decompressor needs no memory other than its output buffer.
+ *
+ * The compressed data is a sequence of groups of up to 8 items. Each group starts with a control
+ * byte. Each bit of the control byte, starting with the least significant bit, is 0 if the item is a
+ * literal byte or 1 if it's a match. A match is two bytes: the low 8 bits of offset - 1, then the
+ * high 2 bits of offset - 1 in bits 6 - 7 and length - MIN_MATCH in bits 0 - 5.
+ */
+class PublishQueueCompression {
+public:
+	static const size_t WINDOW_SIZE = 1024;		//!< Maximum distance back to a match
+	static const size_t MIN_MATCH = 3;			//!< Shortest match that is encoded
+	static const size_t MAX_MATCH = 66;			//!< Longest match that can be encoded
+	static const size_t HASH_SIZE = 256;		//!< Number of entries in the compressor hash table
 
 	/**
-	 * @brief Mutex to protect against concurrent access, created in setup()
+	 * @brief Compress data
+	 *
+	 * @param src The data to compress
+	 *
+	 * @param srcLen The length of the data
+	 *
+	 * @param dst Buffer for the compressed data
+	 *
+	 * @param dstLen The size of dst. Compression stops if the compressed data doesn't fit.
+	 *
+	 * @param hashTable HASH_SIZE entries used while compressing
+	 *
+	 * @return The length of the compressed data, or 0 if it doesn't fit in dstLen bytes
 	 */
-	os_mutex_t mutex;
+	static size_t compress(const uint8_t *src, size_t srcLen, uint8_t *dst, size_t dstLen, uint16_t *hashTable);
 
 	/**
-	 * @brief Default time to wait before trying to publish again after failure
+	 * @brief Decompress data
 	 *
-	 * Default is 30000 milliseconds (30 seconds)
+	 * @param src The compressed data
+	 *
+	 * @param srcLen The maximum length of the compressed data. Bytes after the end of the compressed
+	 * data are ignored.
+	 *
+	 * @param dst Buffer for the decompressed data
+	 *
+	 * @param dstLen The length of the uncompressed data
+	 *
+	 * @return true if exactly dstLen bytes were decompressed, false if the compressed data is not valid
 	 */
-	unsigned long failureRetryMs = 30000;
+	static bool decompress(const uint8_t *src, size_t srcLen, uint8_t *dst, size_t dstLen);
+};
+
+/**
+ * @brief A publish in progress
+ *
+ * When pipelining (withPipelining), there is one of these for each publish that can be in progress
+ * at the same time. They're stored in a ring in the order the publishes were started.
+ */
+struct PublishQueueInFlight {
+	particle::Future<bool> request;		//!< Result of Particle.publish
+	uint16_t count = 0;					//!< Number of queued events included in this publish
+	int ttl = 0;						//!< TTL of the publish
+	uint8_t flags = 0;					//!< Flags of the publish (PRIVATE, WITH_ACK, etc.)
+	unsigned long startMs = 0;			//!< millis() value when Particle.publish was called
+	const char *eventName = NULL;		//!< Event name passed to Particle.publish, kept to publish again
+	const char *eventData = NULL;		//!< Event data passed to Particle.publish, kept to publish again
+	bool retry = false;					//!< Failed and waiting for the retry time to be published again
+};
+
+/**
+ * @brief A snapshot of the queue metrics, returned by PublishQueueAsyncBase::getMetrics()
+ *
+ * The counts are since setup() or resetMetrics().
+ */
+struct PublishQueueMetrics {
+	uint32_t enqueued = 0;				//!< Events queued, including events that replaced an event (withLastValueOnly)
+	uint32_t published = 0;				//!< Events sent successfully. Each event in a batch is counted.
+	uint32_t failed = 0;				//!< Publishes that failed and will be retried
+	uint32_t evicted = 0;				//!< Events discarded to make room when the queue was full
+	uint32_t rejected = 0;				//!< Events not queued because they were too large or room could not be made
+	uint32_t expired = 0;				//!< Events discarded because they were older than the maximum age (withMaxAge)
+	uint32_t replaced = 0;				//!< Events replaced by a newer event with the same name (withLastValueOnly)
+	uint32_t isrDropped = 0;			//!< Events from publishFromISR that were not queued
+	uint32_t corrupted = 0;				//!< Events discarded because their crc didn't match when they were read to be sent
+	uint32_t eventsInUse = 0;			//!< Events in the queue. For file systems, only unsent events.
+	uint32_t eventsHighWater = 0;		//!< Largest value of eventsInUse
+	uint32_t bytesInUse = 0;			//!< Bytes of storage used by the events in the queue
+	uint32_t bytesHighWater = 0;		//!< Largest value of bytesInUse
+	bool retrying = false;				//!< Waiting to retry after a failed publish
+	uint16_t consecutiveFailures = 0;	//!< Publish failures since the last successful publish
+	uint32_t latencyMinMs = 0;			//!< Shortest time from Particle.publish until it succeeded
+	uint32_t latencyAvgMs = 0;			//!< Average time from Particle.publish until it succeeded
+	uint32_t latencyMaxMs = 0;			//!< Longest time from Particle.publish until it succeeded
+};
+
+/**
+ * @brief Counters for PublishQueueMetrics
+ *
+ * They're atomic so getMetrics() can read them from any thread without locking the mutex.
+ */
+struct PublishQueueMetricsCounters {
+	std::atomic<uint32_t> enqueued{0};			//!< PublishQueueMetrics::enqueued
+	std::atomic<uint32_t> published{0};			//!< PublishQueueMetrics::published
+	std::atomic<uint32_t> failed{0};			//!< PublishQueueMetrics::failed
+	std::atomic<uint32_t> evicted{0};			//!< PublishQueueMetrics::evicted
+	std::atomic<uint32_t> rejected{0};			//!< PublishQueueMetrics::rejected
+	std::atomic<uint32_t> corrupted{0};			//!< PublishQueueMetrics::corrupted
+	std::atomic<uint32_t> eventsInUse{0};		//!< PublishQueueMetrics::eventsInUse
+	std::atomic<uint32_t> eventsHighWater{0};	//!< PublishQueueMetrics::eventsHighWater
+	std::atomic<uint32_t> bytesInUse{0};		//!< PublishQueueMetrics::bytesInUse
+	std::atomic<uint32_t> bytesHighWater{0};	//!< PublishQueueMetrics::bytesHighWater
+	std::atomic<uint32_t> latencyMinMs{0};		//!< PublishQueueMetrics::latencyMinMs, if latencyCount is not 0
+	std::atomic<uint32_t> latencyMaxMs{0};		//!< PublishQueueMetrics::latencyMaxMs
+	std::atomic<uint32_t> latencyTotalMs{0};	//!< Sum of the latency of the successful publishes
+	std::atomic<uint32_t> latencyCount{0};		//!< Number of successful publishes
+};
+
+/**
+ * @brief An event name for which only the newest queued event is kept (withLastValueOnly)
+ *
+ * The location of the unsent event with this name is remembered so it can be replaced without searching
+ * the queue. The location is checked before it's used, and the queue is only searched if it's out of
+ * date, such as after a restart.
+ */
+struct PublishQueueLastValue {
+	static const uint8_t STATE_UNKNOWN = 0;				//!< The queue must be searched for the event
+	static const uint8_t STATE_NONE = 1;				//!< There is no unsent event with this name
+	static const uint8_t STATE_QUEUED = 2;				//!< index (and segment and pos, if known) is the event
+	static const uint32_t POS_UNKNOWN = 0xffffffff;		//!< pos value when only index is known
+	static const uint32_t SEGMENT_STAGED = 0xffffffff;	//!< segment value for an event staged in RAM (withGroupCommit)
+
+	const char *eventName = NULL;		//!< Event name. The string is not copied.
+	uint8_t nameLen = 0;				//!< Length of eventName
+	uint8_t state = STATE_UNKNOWN;		//!< STATE_* constant
+	uint32_t index = 0;					//!< Index of the event in the queue. 0 is the oldest event.
+	uint32_t segment = 0;				//!< File system segment containing the event, or SEGMENT_STAGED
+	uint32_t pos = POS_UNKNOWN;			//!< Offset of the event in the storage, if known
+};
+
+/**
+ * @brief Header of an event in the publishFromISR staging ring (PublishQueueISRRing)
+ *
+ * It's followed by the event name and event data c-strings, padded to a 4-byte boundary.
+ */
+struct PublishQueueISRRecord {
+	uint16_t size;						//!< Size of the record including this header and padding (0 = wrap to the start)
+	uint8_t flags;						//!< PublishFlags value
+	uint8_t nameLen;					//!< Length of the event name, not including the null terminator
+	int ttl;							//!< Time to live
+};
 
+/**
+ * @brief Lock-free single-producer, single-consumer ring of events queued by publishFromISR
+ *
+ * The producer (the interrupt handler or software timer calling publishFromISR) only writes head, and
+ * the consumer (the publish queue thread) only writes tail, so neither needs a lock and put() never
+ * blocks. A record is never split across the end of the buffer. If it doesn't fit at the end, a record
+ * with size 0 is written there, or if there isn't room for that, the consumer skips the last few bytes.
+ */
+class PublishQueueISRRing {
+public:
 	/**
-	 * @brief State handler function pointer
+	 * @brief Allocates the buffer. Call before put() or peek(), not from an ISR.
 	 *
-	 * Set to startState, checkQueueState, or waitRetryState
+	 * @param size Buffer size in bytes. It's rounded down to a multiple of 4.
 	 */
-	std::function<void(PublishQueueAsyncBase&)> stateHandler = &PublishQueueAsyncBase::startState;
+	void setup(uint16_t size);
 
 	/**
-	 * @brief Last millis value for certain state changes like waitRetryState
+	 * @brief Copies an event into the ring. Only call from one producer.
+	 *
+	 * @return true if the event was added, false if there was not enough room
 	 */
-	unsigned long stateTime = 0;
+	bool put(const char *eventName, size_t nameLen, const char *data, size_t dataLen, int ttl, uint8_t flags);
 
 	/**
-	 * @brief milis() value for the last publish, used to control the frequency of publishes
+	 * @brief Returns the oldest event in the ring, or NULL if it's empty. Only call from the consumer.
+	 *
+	 * The record stays valid until remove() is called.
 	 */
-	unsigned long lastPublish = 0;
+	const PublishQueueISRRecord *peek();
 
 	/**
-	 * @brief true if we're currently publishing
-	 *
-	 * This is used to control whether we discard the oldest or second oldest event if the retained buffer
-	 * is full.
+	 * @brief Removes the record returned by peek(). Only call from the consumer.
 	 */
-	bool isSending = false;
+	void remove(const PublishQueueISRRecord *record);
 
 	/**
-	 * @brief True if setup() has been called.
-	 *
-	 * You should always call the setup() method from setup().
+	 * @brief Returns the event name of a record
 	 */
-	bool haveSetup = false;
+	static const char *getEventName(const PublishQueueISRRecord *record) { return (const char *)&record[1]; };
 
 	/**
-	 * @brief True if publishing has been manually paused
+	 * @brief Returns the event data of a record
 	 */
-	bool pausePublishing = false;
+	static const char *getEventData(const PublishQueueISRRecord *record) { return getEventName(record) + record->nameLen + 1; };
+
+protected:
+	uint8_t *buf = NULL;					//!< Buffer allocated in setup()
+	uint16_t size = 0;						//!< Size of buf in bytes
+	std::atomic<uint16_t> head{0};			//!< Offset where the next record is written, only changed by put()
+	std::atomic<uint16_t> tail{0};			//!< Offset of the oldest record, only changed by remove()
 };
 
+class PublishQueueAsyncTiered;
+class PublishQueueAsyncBase;
+
 /**
- * @brief Class to store the publish queue in retained memory.
+ * @brief An event reserved with PublishQueueAsyncBase::reserve()
  *
- * Also works for regular RAM, though it won't survive a reset or SLEEP_MODE_DEEP.
+ * Only one event can be reserved in a queue at a time. If the reservation goes out of scope without
+ * commit() or abort() being called, the destructor calls abort(), so an early return or exception
+ * doesn't leave the queue reserved. It can be moved but not copied.
  */
-class PublishQueueAsyncRetained : public PublishQueueAsyncBase {
+class PublishQueueReservation {
 public:
 	/**
-	 * @brief Construct a publish queue
-	 *
-	 * You normally allocate one of these as a global object. You should not create more than one, as
-	 * the rate limiting would not work right.
-	 *
-	 * @param retainedBuffer Pointer to the buffer in retained or regular memory
-	 *
-	 * @param retainedBufferSize Buffer size. Must be at least 704 bytes, but it's best for it to be
-	 * at least 1024 bytes, and ideally larger than that.
+	 * @brief Constructs an empty reservation, as is returned when reserve() fails
 	 */
-	PublishQueueAsyncRetained(uint8_t *retainedBuffer, uint16_t retainedBufferSize);
+	PublishQueueReservation() {};
 
 	/**
-	 * @brief You normally allocate this as a global object and never delete it
+	 * @brief Takes over the reservation held by other, leaving other empty
 	 */
-	virtual ~PublishQueueAsyncRetained();
+	PublishQueueReservation(PublishQueueReservation &&other);
 
 	/**
-	 * @brief You must call setup from global setup()
+	 * @brief Aborts the reservation held by this object, if any, and takes over the one held by other
 	 */
-	virtual void setup();
+	PublishQueueReservation &operator=(PublishQueueReservation &&other);
+
+	PublishQueueReservation(const PublishQueueReservation &) = delete;
+	PublishQueueReservation &operator=(const PublishQueueReservation &) = delete;
 
 	/**
-	 * @brief Publish an event. All other overloads lead here.
-	 *
-	 * @param eventName The name of the event (63 character maximum).
-	 *
-	 * @param data The event data (255 bytes maximum, 622 bytes in system firmware 0.8.0-rc.4 and later).
-	 *
-	 * @param ttl The time-to-live value. If not specified in one of the other overloads, the value 60 is
-	 * used. However, the ttl is ignored by the cloud, so it doesn't matter what you set it to. Essentially
-	 * all events are discarded immediately if not subscribed to so they essentially have a ttl of 0.
-	 *
-	 * @param flags1 Normally PRIVATE. You can also use PUBLIC, but one or the other must be specified.
-	 *
-	 * @param flags2 (optional) You can use NO_ACK or WITH_ACK if desired.
-	 *
-	 * @return true if the event was queued or false if it was not.
-	 *
-	 * This function almost always returns true. If you queue more events than fit in the buffer the
-	 * oldest (sometimes second oldest) is discarded.
+	 * @brief Calls abort() if the event was not committed
 	 */
-	virtual bool publishCommon(const char *eventName, const char *data, int ttl, PublishFlags flags1, PublishFlags flags2 = PublishFlags());
+	~PublishQueueReservation() { abort(); };
 
 	/**
-	 * @brief Get the oldest event that hasn't been published yet
-	 *
-	 * Returns a pointer to a PublishQueueEventData structure. This will remain valid until getOldestEvent()
-	 * is called again.
+	 * @brief Returns true if an event is reserved
 	 */
-	virtual PublishQueueEventData *getOldestEvent();
+	explicit operator bool() const { return queue != NULL; };
 
 	/**
-	 * @brief Remove any saved events
+	 * @brief Returns the buffer to write the event data into, or NULL if no event is reserved
 	 *
-	 * @return true if the operation succeeded, or false if an event is currently being sent so the
-	 * events cannot be deleted.
+	 * It has room for maxDataLen() bytes plus a null terminator.
 	 */
-	virtual bool clearEvents();
+	char *data() const { return buf; };
 
 	/**
-	 * @brief Discards the oldest event or second oldest event
-	 *
-	 * @param secondEvent True to discard the second oldest event
-	 *
-	 * When using retained memory, the getOldestEvent() function returns a pointer to retained memory. This
-	 * pointer must remain valid while in the process of publishing. If the retained buffer is full, we
-	 * want to discard and old event to make room for a newer event, but we can't dispose of the oldest
-	 * event, because it may be in use, so we pass true for secondEvent.
+	 * @brief Returns the maxDataLen passed to reserve()
 	 */
-	bool discardOldEvent(bool secondEvent);
+	size_t maxDataLen() const { return maxLen; };
 
 	/**
-	 * @brief Given a pointer into the retained buffer, finds the offset of the next event
+	 * @brief Queues the reserved event
 	 *
-	 * @param start Where to start (pointer to RAM, not an offset)
+	 * @param dataLen The length of the data written to data(). It doesn't need to be null terminated. If
+	 * it's larger than maxDataLen, the data is truncated.
 	 *
-	 * @returns A pointer to the beginning of the next event
+	 * @return true if the event was queued, false if it wasn't or no event is reserved
+	 *
+	 * Old events are discarded to make room the same way as publish(). Events queued this way have normal priority. If the event name was passed to withLastValueOnly(), the
+	 * unsent event with the same name is removed, or with file systems, overwritten if the new event fits.
 	 */
-	uint8_t *skipEvent(uint8_t *start);
+	bool commit(size_t dataLen);
 
 	/**
-	 * @brief Get the number of events in the queue (0 = empty)
+	 * @brief Discards the reserved event. Does nothing if no event is reserved.
 	 */
-	uint16_t getNumEvents() const;
-
+	void abort();
 
 protected:
-	uint8_t *retainedBuffer;		//!< Pointer to the beginning of the retained (or regular) RAM buffer
-	uint16_t retainedBufferSize;	//!< Size of the buffer in bytes. Must be at least 704 bytes!
-	uint8_t *nextFree = NULL;		//!< Pointer into the retained buffer for the next free space (where the next queued publish will be stored)
+	/**
+	 * @brief Used by PublishQueueAsyncBase::reserve()
+	 */
+	PublishQueueReservation(PublishQueueAsyncBase *queue, char *buf, size_t maxLen) : queue(queue), buf(buf), maxLen(maxLen) {};
+
+	PublishQueueAsyncBase *queue = NULL;	//!< Queue the event is reserved in, NULL if no event is reserved
+	char *buf = NULL;						//!< Data area of the event record in the queue's reserveBuf
+	size_t maxLen = 0;						//!< maxDataLen passed to reserve()
 
+	friend class PublishQueueAsyncBase;
 };
 
 /**
- * @brief Backward compatible API so code build for version 0.0.5 and earlier will still compile
+ * @brief Abstract base class for async publish queue.
+ *
+ * You don't instantiate one of these, you instead instantitate a concrete subclass like:
+ * - PublishQueueAsyncRetained
+ * - PublishQueueAsyncFRAM
+ * - PublishQueueAsyncSpiffs
+ * - PublishQueueAsyncSdFat
+ * - PublishQueueAsyncTiered
  */
-class PublishQueueAsync : public PublishQueueAsyncRetained {
+class PublishQueueAsyncBase {
 public:
 	/**
 	 * @brief Construct a publish queue
-	 *
-	 * You normally allocate one of these as a global object. You should not create more than one, as
-	 * the rate limiting would not work right.
 	 */
-	PublishQueueAsync(uint8_t *retainedBuffer, uint16_t retainedBufferSize) : PublishQueueAsyncRetained(retainedBuffer, retainedBufferSize) {};
+	PublishQueueAsyncBase();
 
 	/**
 	 * @brief You normally allocate this as a global object and never delete it
 	 */
-	virtual ~PublishQueueAsync() {};
-};
+	virtual ~PublishQueueAsyncBase();
 
-/**
- * @brief Class to automatically lock and unlock the mutex. Create as a variable on the stack.
- *
- * This is used to make sure the mutex is always unlocked, for example if there is a return
- * statement in the middle of the function. When the stack variable goes out of scope it will
- * always unlock the mutex.
- */
-class StMutexLock {
-public:
 	/**
-	 * @brief Call the mutexLock() method of publishQueue()
+	 * @brief Start the thread. You must call this from setup.
 	 *
-	 * Instantiate this object on the stack so unlock can be done when the variable goes out of
-	 * scope, such as when exiting a block or function.
+	 * Since version 0.0.1 did not have the setup method, if you don't setup() it will be set up when you first
+	 * publish, but starting the thread earlier is suggested, but only with retained memory (PublishQueueAsync).
+	 *
+	 * In 0.1.0 or later you must call setup(), or the library will not function with FRAM, Spiffs, or SdFat.
 	 */
-	StMutexLock(const PublishQueueAsyncBase *publishQueue) : publishQueue(publishQueue) {
-		publishQueue->mutexLock();
-	}
+	virtual void setup();
 
 	/**
-	 * @brief Unlock the mutex on destructor
+	 * @brief Overload for publishing an event
+	 *
+	 * @param eventName The name of the event (63 character maximum).
+	 *
+	 * @param flags1 Normally PRIVATE. You can also use PUBLIC, but one or the other must be specified.
+	 *
+	 * @param flags2 (optional) You can use NO_ACK or WITH_ACK if desired.
+	 *
+	 * @return true if the event was queued or false if it was not.
+	 *
+	 * This function almost always returns true. If you queue more events than fit in the buffer the
+	 * oldest (sometimes second oldest) is discarded.
 	 */
-	~StMutexLock() {
-		publishQueue->mutexUnlock();
+	inline 	bool publish(const char *eventName, PublishFlags flags1, PublishFlags flags2 = PublishFlags()) {
+		return publishCommon(eventName, "", 60, flags1, flags2);
 	}
 
 	/**
-	 * @brief Saved publishQueue, used in destructor
+	 * @brief Overload for publishing an event
+	 *
+	 * @param eventName The name of the event (63 character maximum).
+	 *
+	 * @param data The event data (255 bytes maximum, 622 bytes in system firmware 0.8.0-rc.4 and later).
+	 *
+	 * @param flags1 Normally PRIVATE. You can also use PUBLIC, but one or the other must be specified.
+	 *
+	 * @param flags2 (optional) You can use NO_ACK or WITH_ACK if desired.
+	 *
+	 * @return true if the event was queued or false if it was not.
+	 *
+	 * This function almost always returns true. If you queue more events than fit in the buffer the
+	 * oldest (sometimes second oldest) is discarded.
 	 */
-	const PublishQueueAsyncBase *publishQueue;
-};
-
-#if defined(__MB85RC256V_FRAM_RK) || defined(DOXYGEN_BUILD)
+	inline  bool publish(const char *eventName, const char *data, PublishFlags flags1, PublishFlags flags2 = PublishFlags()) {
+		return publishCommon(eventName, data, 60, flags1, flags2);
+	}
 
-/**
- * @brief Support for MB85RC256V-FRAM-RK library.
- *
- * If you include "MB85RC256V-FRAM-RK.h" before PublishQueueAsyncRK.h, this code will be enabled
- */
-class PublishQueueAsyncFRAM : public PublishQueueAsyncBase {
-public:
 	/**
-	 * @brief Constrctor for FRAM base class
+	 * @brief Overload for publishing an event
 	 *
-	 * @param fram The MB85RC256V object for the FRAM. You must call begin() on the FRAM before calling setup() on this object.
+	 * @param eventName The name of the event (63 character maximum).
 	 *
-	 * @param start Optional start address, default is 0 (beginning of FRAM)
+	 * @param data The event data (255 bytes maximum, 622 bytes in system firmware 0.8.0-rc.4 and later).
 	 *
-	 * @param len Optional length, default is size of FRAM. Note that this is a length relative to start, not an ending address.
+	 * @param ttl The time-to-live value. If not specified in one of the other overloads, the value 60 is
+	 * used. However, the ttl is ignored by the cloud, so it doesn't matter what you set it to. Essentially
+	 * all events are discarded immediately if not subscribed to so they essentially have a ttl of 0.
+	 *
+	 * @param flags1 Normally PRIVATE. You can also use PUBLIC, but one or the other must be specified.
+	 *
+	 * @param flags2 (optional) You can use NO_ACK or WITH_ACK if desired.
+	 *
+	 * @return true if the event was queued or false if it was not.
+	 *
+	 * This function almost always returns true. If you queue more events than fit in the buffer the
+	 * oldest (sometimes second oldest) is discarded.
 	 */
-	PublishQueueAsyncFRAM(MB85RC &fram, size_t start = 0, size_t len = 0) : fram(fram), start(start), len(len) {
-		if (len == 0) {
-			len = fram.length() - start;
-		}
+	inline  bool publish(const char *eventName, const char *data, int ttl, PublishFlags flags1, PublishFlags flags2 = PublishFlags()) {
+		return publishCommon(eventName, data, ttl, flags1, flags2);
 	}
 
 	/**
-	 * @brief Destructor. You norrmally allocate one of these as a global variable and don't delete it.
+	 * @brief Publish an event with a priority
+	 *
+	 * @param priority The priority lane, 0 (normal, the same as publish()) to PUBLISH_QUEUE_PRIORITY_MAX (3).
+	 *
+	 * @param eventName The name of the event (63 character maximum).
+	 *
+	 * @param data The event data (255 bytes maximum, 622 bytes in system firmware 0.8.0-rc.4 and later).
+	 *
+	 * @param flags1 Normally PRIVATE. You can also use PUBLIC, but one or the other must be specified.
+	 *
+	 * @param flags2 (optional) You can use NO_ACK or WITH_ACK if desired.
+	 *
+	 * @return true if the event was queued or false if it was not.
+	 *
+	 * Events with a higher priority are sent before events with a lower priority, and events with the
+	 * same priority are sent in the order they were queued. When the queue is full, the oldest event
+	 * with the lowest priority is discarded. An event is not queued if it would require discarding an
+	 * event with a higher priority.
+	 *
+	 * Retained memory, FRAM, and file system queues support priorities. FRAM keeps priority events in
+	 * a separate area and file systems in a separate priority file, which are sent first.
 	 */
-	virtual ~PublishQueueAsyncFRAM() {
+	inline  bool publishWithPriority(uint8_t priority, const char *eventName, const char *data, PublishFlags flags1, PublishFlags flags2 = PublishFlags()) {
+		return publishCommon(eventName, data, 60, flags1, flags2, priority);
+	}
+
+	/**
+	 * @brief Publish an event with a priority and ttl
+	 *
+	 * @param priority The priority lane, 0 (normal, the same as publish()) to PUBLISH_QUEUE_PRIORITY_MAX (3).
+	 *
+	 * @param eventName The name of the event (63 character maximum).
+	 *
+	 * @param data The event data (255 bytes maximum, 622 bytes in system firmware 0.8.0-rc.4 and later).
+	 *
+	 * @param ttl The time-to-live value.
+	 *
+	 * @param flags1 Normally PRIVATE. You can also use PUBLIC, but one or the other must be specified.
+	 *
+	 * @param flags2 (optional) You can use NO_ACK or WITH_ACK if desired.
+	 *
+	 * @return true if the event was queued or false if it was not.
+	 */
+	inline  bool publishWithPriority(uint8_t priority, const char *eventName, const char *data, int ttl, PublishFlags flags1, PublishFlags flags2 = PublishFlags()) {
+		return publishCommon(eventName, data, ttl, flags1, flags2, priority);
+	}
+
+	/**
+	 * @brief Common publish function with normal priority. This is a pure virtual function, implemented in subclasses.
+	 *
+	 * This is the signature from before priorities were added. Subclasses written for it still work,
+	 * as the publishCommon() overload with a priority calls it and ignores the priority. The subclasses in
+	 * this library override both and call the overload with a priority of 0 from this one.
+	 */
+	virtual bool publishCommon(const char *eventName, const char *data, int ttl, PublishFlags flags1, PublishFlags flags2 = PublishFlags()) = 0;
+
+	/**
+	 * @brief Common publish function. All other overloads lead here. Subclasses override it.
+	 *
+	 * @param eventName The name of the event (63 character maximum).
+	 *
+	 * @param data The event data (255 bytes maximum, 622 bytes in system firmware 0.8.0-rc.4 and later).
+	 *
+	 * @param ttl The time-to-live value. If not specified in one of the other overloads, the value 60 is
+	 * used. However, the ttl is ignored by the cloud, so it doesn't matter what you set it to. Essentially
+	 * all events are discarded immediately if not subscribed to so they essentially have a ttl of 0.
+	 *
+	 * @param flags1 Normally PRIVATE. You can also use PUBLIC, but one or the other must be specified.
+	 *
+	 * @param flags2 You can use NO_ACK or WITH_ACK if desired.
+	 *
+	 * @param priority The priority lane, 0 (normal) to PUBLISH_QUEUE_PRIORITY_MAX.
+	 *
+	 * @return true if the event was queued or false if it was not.
+	 *
+	 * This function almost always returns true. If you queue more events than fit in the buffer the
+	 * oldest (sometimes second oldest) is discarded.
+	 *
+	 * The default implementation calls the publishCommon() overload without a priority, for subclasses
+	 * written before priorities were added.
+	 */
+	virtual bool publishCommon(const char *eventName, const char *data, int ttl, PublishFlags flags1, PublishFlags flags2, uint8_t /* priority */) {
+		return publishCommon(eventName, data, ttl, flags1, flags2);
+	}
+
+	/**
+	 * @brief Sets the retry after publish failure time
+	 *
+	 * @param value The time in milliseconds (default: 30000, or 30 seconds)
+	 *
+	 * If a publish fails, this is the amount of time to wait before trying to send the event again.
+	 * This is the same as withBackoff(value, value), a fixed wait with no jitter.
+	 */
+	inline PublishQueueAsyncBase &withFailureRetryMs(unsigned long value) { return withBackoff(value, value, 1, 0); };
+
+	/**
+	 * @brief Sets exponential backoff after publish failures
+	 *
+	 * @param initialMs Milliseconds to wait after the first failure
+	 *
+	 * @param maxMs Maximum milliseconds to wait
+	 *
+	 * @param multiplier Factor to multiply the wait by after each consecutive failure (default: 2)
+	 *
+	 * @param jitterPercent Maximum random reduction of the wait in percent (default: 50)
+	 *
+	 * This is a PublishQueueBackoff. For example, withBackoff(5000, 300000) waits 5 seconds after the
+	 * first failure, then 10, 20, 40 seconds, and so on, up to 5 minutes, each reduced by a random amount
+	 * up to 50%. A successful publish resets the wait to 5 seconds.
+	 */
+	inline PublishQueueAsyncBase &withBackoff(unsigned long initialMs, unsigned long maxMs, uint16_t multiplier = 2, uint8_t jitterPercent = 50) {
+		backoff.withBackoff(initialMs, maxMs, multiplier, jitterPercent);
+		retryPolicy = &backoff;
+		return *this;
+	};
+
+	/**
+	 * @brief Use a custom retry policy
+	 *
+	 * @param value The policy object. It's not copied, so it must remain valid; typically it's a global
+	 * variable.
+	 */
+	inline PublishQueueAsyncBase &withRetryPolicy(PublishQueueRetryPolicy &value) { retryPolicy = &value; return *this; };
+
+	/**
+	 * @brief Sets the publish rate limit (default: burst 1, refillMs 1010)
+	 *
+	 * @param burst The number of events that can be published back-to-back. Must be at least 1.
+	 *
+	 * @param refillMs The rate that more events can be published after a burst, one every refillMs
+	 * milliseconds. 0 means no rate limit.
+	 *
+	 * This is a token bucket (PublishQueueTokenBucket). The default publishes one event 1010 milliseconds
+	 * after the previous publish completed. The Particle cloud allows an average of one publish per
+	 * second with bursts of up to 4, so withRateLimit(4, 1010) sends a backlog faster after reconnecting.
+	 */
+	inline PublishQueueAsyncBase &withRateLimit(uint16_t burst, unsigned long refillMs) {
+		tokenBucket.withRateLimit(burst, refillMs);
+		rateLimiter = &tokenBucket;
+		return *this;
+	};
+
+	/**
+	 * @brief Use a custom publish rate limit policy
+	 *
+	 * @param value The policy object. It's not copied, so it must remain valid; typically it's a global
+	 * variable.
+	 */
+	inline PublishQueueAsyncBase &withRateLimiter(PublishQueueRateLimiter &value) { rateLimiter = &value; return *this; };
+
+	/**
+	 * @brief Pack consecutive queued events into a single publish (default: disabled)
+	 *
+	 * @param sameNameOnly true to only pack events that have the same event name as the oldest event,
+	 * false to pack events with any name.
+	 *
+	 * @param batchEventName The event name used for a publish containing events with different names.
+	 * Only used if sameNameOnly is false. The string is not copied, so it must remain valid.
+	 *
+	 * Consecutive events starting with the oldest event are packed until the next event doesn't fit in
+	 * MAX_EVENT_DATA_LENGTH bytes or can't be packed. Events are only packed with events that have the
+	 * same flags (PRIVATE, WITH_ACK, etc.), and an event whose data contains a newline is always sent
+	 * by itself. The ttl of the oldest event is used.
+	 *
+	 * If sameNameOnly is true, the publish has the event name of the packed events and the data is the
+	 * data of each event, separated by a newline (\n).
+	 *
+	 * If sameNameOnly is false, the publish uses batchEventName and each packed event is a line
+	 * containing the event name, a tab (\t), and the event data. The lines are separated by a newline.
+	 *
+	 * If only one event can be sent, it's published with its own event name and data, the same as
+	 * without batching. All of the packed events are removed from the queue when the publish succeeds.
+	 *
+	 * This must be called before setup(). A 623-byte buffer is allocated on the heap in setup().
+	 */
+	inline PublishQueueAsyncBase &withBatching(bool sameNameOnly = true, const char *batchEventName = "pubqBatch") {
+		batching = true;
+		batchSameNameOnly = sameNameOnly;
+		this->batchEventName = batchEventName;
+		return *this;
+	};
+
+	/**
+	 * @brief Discard events that have been queued for too long instead of sending them (default: 0, never)
+	 *
+	 * @param seconds The maximum age of an event in seconds, or 0 for no limit
+	 *
+	 * @param useEventTtl true to use the ttl of each event as its maximum age, if it's greater than 0.
+	 * The publish() overloads that don't have a ttl parameter use 60.
+	 *
+	 * Each event stores the time it was queued. An event that's older than the maximum age when it
+	 * becomes the oldest event is discarded instead of being sent, and it's not packed into a batch.
+	 * Events queued before the time was valid (Time.isValid()) are never discarded for age.
+	 */
+	inline PublishQueueAsyncBase &withMaxAge(uint32_t seconds, bool useEventTtl = false) {
+		maxAgeSec = seconds;
+		maxAgeUseTtl = useEventTtl;
+		return *this;
+	};
+
+	/**
+	 * @brief Compress the event data when it's stored in the queue (default: disabled)
+	 *
+	 * @param enable true to compress events that are queued after this is called
+	 *
+	 * The data of each event is compressed with a small LZ77-style codec (PublishQueueCompression)
+	 * and it's stored compressed if that makes the event smaller, so more events fit in the queue.
+	 * The event is decompressed when it's published, so the cloud receives the original data.
+	 * Repetitive data like JSON with the same keys in each event compresses best. Short events and
+	 * random data are stored uncompressed.
+	 *
+	 * Each event is flagged as compressed or not, so the queue can contain both kinds. Compressed
+	 * events are still published correctly after compression is disabled.
+	 *
+	 * This must be called before setup(). About 1.9 Kbytes are allocated on the heap in setup().
+	 */
+	inline PublishQueueAsyncBase &withCompression(bool enable = true) {
+		compression = enable;
+		return *this;
+	};
+
+	/**
+	 * @brief Only keep the newest queued event with this name
+	 *
+	 * @param eventName The event name. The string is not copied, so it must remain valid.
+	 *
+	 * This is for events that report a state, like a battery level or a location, where only the latest
+	 * value is useful. When an event with this name is queued, the unsent event with the same name is
+	 * replaced instead of queueing another one. Events that are being sent are not replaced.
+	 *
+	 * If the new event fits in the space of the old one, the old event is overwritten in place and it
+	 * keeps its place in the queue. Otherwise, with retained memory and FRAM, the old event is removed and
+	 * the new event is queued normally. File system queues can't remove an event from the middle of the
+	 * file, so in that case the new event is added to the end and the old one is still sent, unless it's
+	 * still staged in RAM (withGroupCommit). File system queues only guarantee that the newest event is
+	 * the only one sent if the data never gets larger, for example if it's formatted with a fixed width.
+	 *
+	 * Call this once for each event name, before setup().
+	 */
+	PublishQueueAsyncBase &withLastValueOnly(const char *eventName);
+
+	/**
+	 * @brief Returns the number of events replaced by a newer event with the same name (withLastValueOnly)
+	 */
+	uint32_t getReplacedCount() const { return replacedCount; };
+
+	/**
+	 * @brief Allocate a staging ring for publishFromISR (default: 0, publishFromISR is not used)
+	 *
+	 * @param size The size of the ring in bytes. Each event uses 8 bytes plus the event name and data
+	 * with null terminators, rounded up to a multiple of 4. Events are never split across the end of the
+	 * ring, so make it at least twice the size of the largest event.
+	 *
+	 * The ring is allocated on the heap in setup().
+	 */
+	inline PublishQueueAsyncBase &withISRQueue(uint16_t size) {
+		isrQueueSize = size;
+		return *this;
+	};
+
+	/**
+	 * @brief Queue an event from an interrupt handler or software timer
+	 *
+	 * @param eventName The event name, as is passed to Particle.publish.
+	 *
+	 * @param data The event data.
+	 *
+	 * @param flags1 Normally PRIVATE. You can also use PUBLIC, but one or the other must be specified.
+	 *
+	 * @param flags2 (optional) You can use NO_ACK or WITH_ACK if desired.
+	 *
+	 * @return true if the event was copied to the staging ring, false if it's full, withISRQueue() was not
+	 * used, or the event name or data is too long.
+	 *
+	 * This doesn't lock the mutex, allocate memory, log, or access the storage. The event is copied to a
+	 * lock-free ring in RAM and the publish queue thread adds it to the queue, so it's safe to call from an
+	 * ISR. The ring only supports one producer: call it from one interrupt handler or timer, or make
+	 * sure calls from different contexts can't interrupt each other.
+	 */
+	inline bool publishFromISR(const char *eventName, const char *data, PublishFlags flags1, PublishFlags flags2 = PublishFlags()) {
+		return publishFromISRCommon(eventName, data, 60, flags1, flags2);
+	}
+
+	/**
+	 * @brief Queue an event from an interrupt handler or software timer
+	 *
+	 * @param eventName The event name, as is passed to Particle.publish.
+	 *
+	 * @param data The event data.
+	 *
+	 * @param ttl The time-to-live value. This is not actually used by the Particle cloud.
+	 *
+	 * @param flags1 Normally PRIVATE. You can also use PUBLIC, but one or the other must be specified.
+	 *
+	 * @param flags2 (optional) You can use NO_ACK or WITH_ACK if desired.
+	 *
+	 * @return true if the event was copied to the staging ring
+	 */
+	inline bool publishFromISR(const char *eventName, const char *data, int ttl, PublishFlags flags1, PublishFlags flags2 = PublishFlags()) {
+		return publishFromISRCommon(eventName, data, ttl, flags1, flags2);
+	}
+
+	/**
+	 * @brief Returns the number of publishFromISR calls that failed because the staging ring was full
+	 * or the event was too large, and events from the ring that could not be added to the queue
+	 */
+	uint32_t getISRDroppedCount() const { return isrDroppedCount; };
+
+	/**
+	 * @brief Returns the queue metrics, such as the number of events queued, sent, and discarded, the storage
+	 * used, and the publish latency
+	 *
+	 * This doesn't lock the mutex, so it can be called from any thread, including while a publish is in
+	 * progress. Each count is read atomically, but values that change together, like enqueued and
+	 * eventsInUse, may not be from exactly the same time. latencyAvgMs is calculated from the total
+	 * latency and the number of publishes, which are read separately, so it can be slightly off if a
+	 * publish completes while it's read.
+	 */
+	PublishQueueMetrics getMetrics() const;
+
+	/**
+	 * @brief Resets the metrics counts and latency to 0, and the high water marks to the current usage
+	 *
+	 * Call this after sampling getMetrics() to report the metrics for each period. Each value is reset
+	 * atomically, but an event that's queued or sent while resetting can be counted in either period.
+	 */
+	void resetMetrics();
+
+	/**
+	 * @brief Reserve space for an event so its data can be written directly into the queue
+	 *
+	 * @param eventName The event name, as is passed to Particle.publish.
+	 *
+	 * @param maxDataLen The maximum length of the event data, not including the null terminator. Must be
+	 * 622 or less.
+	 *
+	 * @param flags1 Normally PRIVATE. You can also use PUBLIC, but one or the other must be specified.
+	 *
+	 * @param flags2 (optional) You can use NO_ACK or WITH_ACK if desired.
+	 *
+	 * @return The reservation. It's empty (false) if an event this large can't be stored.
+	 *
+	 * Write the event data into its data() buffer, then call its commit() with the length, or abort(). The
+	 * buffer holds the event record, which is allocated on the heap (704 bytes) by the first reserve(). The
+	 * record is added to the queue by commit(), which discards old events to make room if necessary, so
+	 * nothing is discarded for an event that's aborted.
+	 *
+	 * The mutex is only locked while the header is written and while the event is committed, so other
+	 * threads, including the publish queue thread, can use the queue while the data is written. Only one
+	 * event can be reserved at a time: calling reserve() from another thread waits for the reservation to
+	 * be released. Calling reserve() again from the thread holding it would deadlock, so that logs an
+	 * error and returns an empty reservation instead.
+	 */
+	inline PublishQueueReservation reserve(const char *eventName, size_t maxDataLen, PublishFlags flags1, PublishFlags flags2 = PublishFlags()) {
+		return reserve(eventName, maxDataLen, 60, flags1, flags2);
+	}
+
+	/**
+	 * @brief Reserve space for an event so its data can be written directly into the queue
+	 *
+	 * @param eventName The event name, as is passed to Particle.publish.
+	 *
+	 * @param maxDataLen The maximum length of the event data, not including the null terminator.
+	 *
+	 * @param ttl The time-to-live value. This is not actually used by the Particle cloud.
+	 *
+	 * @param flags1 Normally PRIVATE. You can also use PUBLIC, but one or the other must be specified.
+	 *
+	 * @param flags2 (optional) You can use NO_ACK or WITH_ACK if desired.
+	 *
+	 * @return The reservation, empty (false) if the event could not be reserved
+	 */
+	PublishQueueReservation reserve(const char *eventName, size_t maxDataLen, int ttl, PublishFlags flags1, PublishFlags flags2 = PublishFlags());
+
+	/**
+	 * @brief Allow more than one publish to be in progress at the same time (default: 1)
+	 *
+	 * @param maxInFlight The maximum number of publishes that can be in progress. Must be at least 1.
+	 *
+	 * By default, the next event isn't published until the previous publish completes, so each event
+	 * takes at least one round trip to the cloud. With a larger value, the next events are published
+	 * while waiting for the acknowledgement of earlier ones. The rate limit (withRateLimit) still
+	 * applies, so this only helps when the burst is larger than 1 or the round trip is longer than
+	 * the refill time.
+	 *
+	 * Events are always removed from the queue in order, after the publish that includes them and all
+	 * earlier publishes succeed. If a publish fails, no more publishes are started and the later
+	 * publishes in progress are allowed to finish. After the retry time, only the failed publishes are
+	 * published again, so the events of later publishes that succeeded aren't sent twice.
+	 *
+	 * This must be called before setup(). If greater than 1, maxInFlight * 688 bytes are allocated on
+	 * the heap in setup() for the event names and data.
+	 */
+	inline PublishQueueAsyncBase &withPipelining(uint16_t maxInFlight) {
+		pipelineDepth = (maxInFlight > 0) ? maxInFlight : 1;
+		return *this;
+	};
+
+	/**
+	 * @brief Remove any saved events
+	 *
+	 * @return true if the operation succeeded, or false if an event is currently being sent so the
+	 * events cannot be deleted.
+	 */
+	virtual bool clearEvents() = 0;
+
+	/**
+	 * @brief Get the oldest event that hasn't been published yet
+	 *
+	 * Returns a pointer to a PublishQueueEventData structure. This will remain valid until getOldestEvent()
+	 * is called again.
+	 */
+	virtual PublishQueueEventData *getOldestEvent() = 0;
+
+	/**
+	 * @brief Discards the oldest event or second oldest event
+	 *
+	 * @param secondEvent True to discard the second oldest event
+	 *
+	 * After successfully publishing, this is called with secondEvent = false to discard the event we
+	 * just published.
+	 *
+	 * If the queue is full while the oldest event is being sent, we want to discard an old event to make
+	 * room for a newer event, but we can't dispose of the oldest event, because it would be lost if the
+	 * publish fails, so we pass true for secondEvent. Every storage method supports both.
+	 */
+	virtual bool discardOldEvent(bool secondEvent) = 0;
+
+	/**
+	 * @brief Calls a function for queued events, starting with the oldest event that hasn't been published yet
+	 *
+	 * @param fn Function to call with each event. Return true to continue with the next event or false to
+	 * stop. The event pointer is only valid during the call. Do not call other methods of the publish
+	 * queue from fn, as the mutex is locked.
+	 *
+	 * This is used to pack events when batching is enabled (withBatching). Storage methods that don't
+	 * override it don't call fn, so events are always sent one at a time.
+	 */
+	virtual void forEachEvent(std::function<bool(const PublishQueueEventData *)> /* fn */) {};
+
+	/**
+	 * @brief Get the number of events in the queue (0 = empty)
+	 */
+	virtual uint16_t getNumEvents() const = 0;
+
+	/**
+	 * @brief Pause publishing, even if it would be allowed because the cloud is connected
+	 *
+	 * This is used by the test suite, or you could use it in special cases.
+	 */
+	void setPausePublishing(bool pause) { pausePublishing = pause; wakeThread(); };
+
+	/**
+	 * @brief Returns true if publishing is manually paused.
+	 *
+	 * It does not take into account the cloud connection state, only manual pausing.
+	 */
+	bool getPausePublishing() const { return pausePublishing; };
+
+	/**
+	 * @brief Returns the number of times a publish failed and the queue waited to retry
+	 */
+	uint32_t getBackoffCount() const { return backoffCount; };
+
+	/**
+	 * @brief Returns the total milliseconds spent waiting to retry after publish failures
+	 *
+	 * This includes the time so far if the queue is waiting to retry now.
+	 */
+	uint32_t getBackoffMs() const;
+
+	/**
+	 * @brief Returns the number of consecutive publish failures (0 after a successful publish)
+	 */
+	uint16_t getConsecutiveFailures() const { return consecutiveFailures; };
+
+	/**
+	 * @brief Returns the number of events discarded because they were older than the maximum age (withMaxAge)
+	 */
+	uint32_t getExpiredCount() const { return expiredCount; };
+
+	/**
+	 * @brief Returns true if the event is older than the maximum age (withMaxAge)
+	 */
+	bool isExpired(const PublishQueueEventData *eventData) const;
+
+	/**
+	 * @brief Obtain a mutex lock
+	 *
+	 * This is done before any operation that modifies the retianed buffer or other shared
+	 * resources, typically using the StMutexLock class instead of calling mutexLock()
+	 * and mutexUnlock() directly.
+	 *
+	 * Prior to version 0.1.0 there was no mutex and SINGLE_THREADED_BLOCK was used, but the
+	 * mutex is more efficient and safer. When using a SINGLE_THREADED_BLOCK there is a greater
+	 * chance of accidentally causing deadlock.
+	 */
+	void mutexLock() const;
+
+	/**
+	 * @brief Unlock the mutex
+	 */
+	void mutexUnlock() const;
+
+	/**
+	 * @brief Log event data to the debug log
+	 */
+	void logPublishQueueEventData(const void *data) const;
+
+	/**
+	 * @brief Maximum length of an event name (64), not including the null terminator
+	 */
+	static const size_t MAX_EVENT_NAME_LEN = 64;
+
+	/**
+	 * @brief Maximum size of PublishQueueEventData with strings (704 bytes)
+	 *
+	 * PublishQueueEventData contains flags, ttl, and sizes (16 bytes)
+	 * 65 is the maximum event name length (64) + trailing null
+	 * 623 is the maximum event value length (622) + trailing null
+	 * It's padded to a 4-byte boundary
+	 *
+	 * Events larger than this are not queued.
+	 */
+	static const size_t EVENT_BUF_SIZE = (sizeof(PublishQueueEventData) + MAX_EVENT_NAME_LEN + 1 + particle::protocol::MAX_EVENT_DATA_LENGTH + 1 + 3) & ~3;
+
+	/**
+	 * @brief Returns the size of an event record, including PublishQueueEventData, the two c-strings
+	 * and their null terminators, rounded up to a multiple of 4 bytes.
+	 *
+	 * @param nameLen Length of the event name (strlen)
+	 *
+	 * @param dataLen Length of the event data (strlen)
+	 *
+	 * @return The size in bytes, or 0 if the event name or data is too long to publish
+	 */
+	static size_t getEventSize(size_t nameLen, size_t dataLen);
+
+	/**
+	 * @brief Fill in a version 2 event record
+	 *
+	 * @param buf Buffer to write to. It must be at least size bytes.
+	 *
+	 * @param eventName The name of the event. Must be nameLen bytes plus a null terminator.
+	 *
+	 * @param nameLen The length of eventName
+	 *
+	 * @param data The event data. Must be dataLen bytes plus a null terminator.
+	 *
+	 * @param dataLen The length of data
+	 *
+	 * @param ttl The ttl value to store
+	 *
+	 * @param flags The flags value (PublishFlags value) to store
+	 *
+	 * @param size The size from getEventSize(nameLen, dataLen)
+	 *
+	 * @param priority The event priority (0 - PUBLISH_QUEUE_PRIORITY_MAX) to store in recordFlags
+	 */
+	static void writeEventData(uint8_t *buf, const char *eventName, size_t nameLen, const char *data, size_t dataLen, int ttl, uint8_t flags, size_t size, uint8_t priority = 0);
+
+	/**
+	 * @brief Fill in the header and name of a version 2 event record, without the data or crc
+	 *
+	 * The parameters are the same as writeEventData(). Used by writeEventData() and reserve().
+	 */
+	static void writeEventHeader(uint8_t *buf, const char *eventName, size_t nameLen, int ttl, uint8_t flags, size_t size, uint8_t priority = 0);
+
+	/**
+	 * @brief Returns true if the PublishQueueEventData looks like a valid version 2 event header
+	 *
+	 * @param eventData The event header. Only the PublishQueueEventData structure is read.
+	 *
+	 * @param maxSize The maximum size the event can be (space remaining in the storage)
+	 */
+	static bool isValidEventHeader(const PublishQueueEventData *eventData, size_t maxSize);
+
+	/**
+	 * @brief Calculates the crc of an event record
+	 *
+	 * @param eventData The event record. size bytes are read.
+	 *
+	 * This is CRC-16/CCITT-FALSE of the record with crc set to 0 and without the PUBLISH_QUEUE_RECORD_FLAG_DELETED
+	 * bit. It's calculated without a table, about 10 instructions per byte.
+	 */
+	static uint16_t getEventCrc(const PublishQueueEventData *eventData);
+
+	/**
+	 * @brief Sets the crc of an event record after it's been written or changed
+	 */
+	static void updateEventCrc(PublishQueueEventData *eventData) { eventData->crc = getEventCrc(eventData); };
+
+	/**
+	 * @brief Returns true if the event header is valid and the crc matches the whole record
+	 *
+	 * @param eventData The event record. If the header is valid, size bytes are read.
+	 *
+	 * @param maxSize The maximum size the event can be (space remaining in the storage)
+	 */
+	static bool isValidEvent(const PublishQueueEventData *eventData, size_t maxSize);
+
+	/**
+	 * @brief Returns the event name from a version 2 event record
+	 */
+	static const char *getEventName(const PublishQueueEventData *eventData) {
+		return reinterpret_cast<const char *>(eventData) + sizeof(PublishQueueEventData);
+	}
+
+	/**
+	 * @brief Returns the event data from a version 2 event record
+	 */
+	static const char *getEventData(const PublishQueueEventData *eventData) {
+		return getEventName(eventData) + eventData->nameLen + 1;
+	}
+
+	/**
+	 * @brief Returns the priority (0 - PUBLISH_QUEUE_PRIORITY_MAX) of a version 2 event record
+	 */
+	static uint8_t getEventPriority(const PublishQueueEventData *eventData) {
+		return (uint8_t)((eventData->recordFlags & PUBLISH_QUEUE_RECORD_PRIORITY_MASK) >> PUBLISH_QUEUE_RECORD_PRIORITY_SHIFT);
+	}
+
+	/**
+	 * @brief Converts a version 1 (0.2.x and earlier) event record to version 2
+	 *
+	 * @param src The version 1 event record
+	 *
+	 * @param srcLen The number of valid bytes at src. The strings must be null terminated within this length.
+	 *
+	 * @param dst The buffer to write the version 2 record to. Must be EVENT_BUF_SIZE bytes. Must not overlap src.
+	 *
+	 * @param srcSize Filled in with the size of the version 1 record, including padding.
+	 *
+	 * @return The size of the version 2 record, or 0 if src is not a valid event.
+	 *
+	 * The size in the version 1 record is not used because some old versions did not set it. Version 2
+	 * records are exactly 8 bytes larger than the version 1 record.
+	 */
+	static size_t convertEventDataV1(const uint8_t *src, size_t srcLen, uint8_t *dst, size_t &srcSize);
+
+	/**
+	 * @brief Returns true if the event data in a version 2 event record is compressed
+	 */
+	static bool isEventCompressed(const PublishQueueEventData *eventData) {
+		return (eventData->recordFlags & PUBLISH_QUEUE_RECORD_FLAG_COMPRESSED) != 0;
+	}
+
+	/**
+	 * @brief Copies a version 2 event record, decompressing the event data if it's compressed
+	 *
+	 * @param src The event record
+	 *
+	 * @param dst The buffer to write the uncompressed record to. Must be EVENT_BUF_SIZE bytes. Must
+	 * not overlap src.
+	 *
+	 * @return true if the event was copied, false if the compressed data was not valid. In that case, dst
+	 * contains the event with empty data.
+	 */
+	static bool expandEvent(const PublishQueueEventData *src, uint8_t *dst);
+
+protected:
+	/**
+	 * @brief The thread function for the publish thread
+	 */
+	void threadFunction();
+
+	/**
+	 * @brief Static version of the thread function
+	 */
+	static void threadFunctionStatic(void *param);
+
+	/**
+	 * @brief Worker thread state machine start handler
+	 */
+	void startState();
+
+	/**
+	 * @brief Worker thread state machine check queue state handler
+	 */
+	void checkQueueState();
+
+	/**
+	 * @brief Worker thread state machine wait to retry publishing state handler
+	 */
+	void waitRetryState();
+
+	/**
+	 * @brief Called from the worker thread on every pass through the state machine
+	 *
+	 * Storage methods can override this to do periodic work. The mutex is not locked when this is
+	 * called. The default implementation does nothing.
+	 */
+	virtual void threadTasks() {};
+
+	/**
+	 * @brief Returns the number of milliseconds until threadTasks() has work to do
+	 *
+	 * The publish queue thread sleeps until the sooner of this and the state machine's wait, unless
+	 * it's woken by wakeThread(). The default implementation returns CONCURRENT_WAIT_FOREVER.
+	 */
+	virtual system_tick_t getThreadTasksWaitMs() { return CONCURRENT_WAIT_FOREVER; };
+
+	/**
+	 * @brief Gets the number of events in the queue and the bytes of storage they use, for getMetrics()
+	 *
+	 * You must hold the mutex to call this. The default implementation returns 0 for both.
+	 */
+	virtual void getQueueUsage(uint32_t &numEvents, uint32_t &numBytes) const { numEvents = numBytes = 0; };
+
+	/**
+	 * @brief Updates eventsInUse and bytesInUse in the metrics from getQueueUsage(), and the high water marks
+	 *
+	 * You must hold the mutex to call this.
+	 */
+	void updateUsageMetrics();
+
+	/**
+	 * @brief Counts a queued event in the metrics and wakes the thread
+	 *
+	 * Storage methods call this when an event is queued. You must hold the mutex to call this.
+	 */
+	void eventQueued();
+
+	/**
+	 * @brief Returns true if an event was queued with a higher priority than the events being sent, but
+	 * after them in the order the events are sent
+	 *
+	 * Storage methods that only choose the order when no events are being sent override this. Another
+	 * publish isn't started while it's true, so once the publishes in progress complete, the higher
+	 * priority event is sent next. You must hold the mutex to call this. The default implementation
+	 * returns false.
+	 */
+	virtual bool hasWaitingPriorityEvent() const { return false; };
+
+	/**
+	 * @brief Returns the number of events at the start of the order the events are sent that can be sent
+	 * together
+	 *
+	 * Storage methods that keep each priority lane separately return the number of events in the lane
+	 * being sent, so a batch or pipelined publish doesn't include events from two lanes. Otherwise an
+	 * event queued in the lane being sent would go before events that are being sent. You must hold the
+	 * mutex to call this. The default implementation returns 0xffff.
+	 */
+	virtual uint16_t getActiveLaneEvents() const { return 0xffff; };
+
+	/**
+	 * @brief Storage-specific part of reserve()
+	 *
+	 * @param size The size of the event record with the maximum data length, from getEventSize()
+	 *
+	 * @returns true if an event of this size can be stored. The default implementation returns false, so
+	 * reserve() isn't supported.
+	 */
+	virtual bool reserveEvent(size_t /* size */) { return false; };
+
+	/**
+	 * @brief Storage-specific part of PublishQueueReservation::commit()
+	 *
+	 * @param buf The finished event record, in reserveBuf
+	 *
+	 * @param size The size of the record
+	 *
+	 * Adds the record to the end of the queue, discarding old events to make room the same way as
+	 * publishCommon(), and removes the withLastValueOnly() event it replaces. It's called without the
+	 * mutex locked. The default implementation returns false.
+	 */
+	virtual bool commitEvent(const uint8_t * /* buf */, size_t /* size */) { return false; };
+
+	/**
+	 * @brief Adds complete event records to the end of the queue, used to spill events to the back tier of
+	 * a PublishQueueAsyncTiered
+	 *
+	 * @param buf One or more consecutive event records, as stored in the queue
+	 *
+	 * @param len Length of the records in bytes
+	 *
+	 * @param count Number of records in buf
+	 *
+	 * @returns The number of records added, starting with the first. Old events are discarded to make room
+	 * the same way as publishCommon(). The default implementation returns 0.
+	 *
+	 * The records are stored as they are, so they keep their timestamp, priority, and compression.
+	 */
+	virtual uint16_t appendRecords(const uint8_t * /* buf */, size_t /* len */, uint16_t /* count */) { return 0; };
+
+	/**
+	 * @brief Copies the oldest event records, used to refill a PublishQueueAsyncTiered from its back tier
+	 *
+	 * @param buf Buffer to copy the records to
+	 *
+	 * @param bufSize Size of buf in bytes
+	 *
+	 * @param len Filled in with the number of bytes copied
+	 *
+	 * @returns The number of complete records copied. The events stay in the queue.
+	 *
+	 * The default implementation copies the events from forEachEvent(), up to the end of the priority
+	 * lane being sent (getActiveLaneEvents()).
+	 */
+	virtual uint16_t readRecords(uint8_t *buf, size_t bufSize, size_t &len);
+
+	/**
+	 * @brief Finishes an event record written by reserve() and the caller
+	 *
+	 * @param buf The event record
+	 *
+	 * @param dataLen The length of the event data
+	 *
+	 * @return The size of the record, which is the size from getStoredEventSize()
+	 *
+	 * Null terminates the data, compresses it if withCompression() is used, zeroes the padding, and
+	 * updates the size in the header. The size is never larger than the reserved size.
+	 */
+	size_t finishReservedEvent(uint8_t *buf, size_t dataLen);
+
+	/**
+	 * @brief Common code for publishFromISR. Safe to call from an ISR.
+	 */
+	bool publishFromISRCommon(const char *eventName, const char *data, int ttl, PublishFlags flags1, PublishFlags flags2);
+
+	/**
+	 * @brief Adds the events queued by publishFromISR to the queue. Called from the publish queue thread.
+	 */
+	void drainISRQueue();
+
+	/**
+	 * @brief Wakes the publish queue thread so it checks the queue now
+	 *
+	 * Called when an event is queued, when publishing is paused or resumed, and when the cloud
+	 * connection changes. It doesn't block, so it can be called from an ISR, and waking a thread
+	 * that's already awake does nothing.
+	 */
+	void wakeThread();
+
+	/**
+	 * @brief System event handler for cloud connection changes, which wakes the thread of every queue
+	 */
+	static void systemEventHandler(system_event_t event, int param);
+
+	/**
+	 * @brief Starts publishing the next events that aren't already being sent
+	 *
+	 * @returns true if a publish was started
+	 */
+	bool startPublish();
+
+	/**
+	 * @brief Calls Particle.publish with the event name, data, ttl, and flags saved in slot
+	 */
+	void sendPublish(PublishQueueInFlight &slot);
+
+	/**
+	 * @brief Handles the completion of the oldest publish in progress
+	 */
+	void finishPublish();
+
+	/**
+	 * @brief Publishes the failed publishes in progress again after the retry time
+	 *
+	 * @returns true if a publish was started
+	 */
+	bool retryPublish();
+
+	/**
+	 * @brief Forgets all publishes in progress. Their events will be sent again.
+	 */
+	void abandonPublishes();
+
+	/**
+	 * @brief Returns true if a publish in progress has failed
+	 */
+	bool hasFailedPublish() const;
+
+	/**
+	 * @brief Packs the events after the ones already being sent into a publish
+	 *
+	 * @param slot The publish being started. Its count must be 1 if oldest is not NULL, otherwise 0.
+	 *
+	 * @param oldest The oldest event, from getOldestEvent(), if no other publishes are in progress.
+	 *
+	 * @param nameBuf Buffer for the event name (MAX_EVENT_NAME_LEN + 1 bytes). If NULL, oldest must not
+	 * be NULL.
+	 *
+	 * @param dataBuf Buffer for the event data (MAX_EVENT_DATA_LENGTH + 1 bytes)
+	 *
+	 * @returns The number of events packed. If oldest is not NULL and this is less than 2, the oldest
+	 * event should be sent by itself.
+	 *
+	 * slot.count, slot.ttl, slot.flags, and sendingCount are updated as events are packed.
+	 */
+	uint16_t packEvents(PublishQueueInFlight &slot, const PublishQueueEventData *oldest, char *nameBuf, char *dataBuf);
+
+	/**
+	 * @brief Updates sendingCount when an event is removed. Storage methods call this from discardOldEvent().
+	 *
+	 * @param index The index of the event that was removed, 0 for the oldest event and 1 for the second
+	 * oldest event.
+	 *
+	 * When a batch of events is being sent, removing the second oldest event to make room removes an
+	 * event that is already in the batch, so one fewer event needs to be removed after the publish
+	 * succeeds. When pipelining, the count of the publish that included the event is decremented.
+	 *
+	 * The indexes of the events remembered for withLastValueOnly() are also updated.
+	 *
+	 * Note: You must obtain a mutex lock before calling this!
+	 */
+	void countDiscardedEvent(uint16_t index);
+
+	/**
+	 * @brief Returns the size to store an event, compressing the data if compression is enabled
+	 *
+	 * @param nameLen Length of the event name (strlen)
+	 *
+	 * @param data The event data
+	 *
+	 * @param dataLen Length of the event data (strlen)
+	 *
+	 * @return The size in bytes, or 0 if the event name or data is too long to publish
+	 *
+	 * If the compressed event is smaller, the compressed data is left in compressBuf for writeStoredEvent().
+	 *
+	 * Note: You must obtain a mutex lock before calling this, and keep it locked until writeStoredEvent()
+	 * is called!
+	 */
+	size_t getStoredEventSize(size_t nameLen, const char *data, size_t dataLen);
+
+	/**
+	 * @brief Fill in a version 2 event record, using the compressed data from getStoredEventSize() if there is any
+	 *
+	 * The parameters are the same as writeEventData(). size is the size from getStoredEventSize().
+	 *
+	 * Note: You must obtain a mutex lock before calling this!
+	 */
+	void writeStoredEvent(uint8_t *buf, const char *eventName, size_t nameLen, const char *data, size_t dataLen, int ttl, uint8_t flags, size_t size, uint8_t priority);
+
+	/**
+	 * @brief Returns the event, or an uncompressed copy of it in expandBuf if it's compressed
+	 *
+	 * Note: You must obtain a mutex lock before calling this!
+	 */
+	const PublishQueueEventData *getUncompressedEvent(const PublishQueueEventData *eventData);
+
+	/**
+	 * @brief Returns the withLastValueOnly() entry for an event name, or NULL if all events with the name are kept
+	 */
+	PublishQueueLastValue *findLastValue(const char *eventName, size_t nameLen);
+
+	/**
+	 * @brief Returns true if eventData is an event that isn't deleted and has the name of lastValue
+	 *
+	 * Only the header and event name of eventData are read.
+	 */
+	static bool isLastValueEvent(const PublishQueueLastValue *lastValue, const PublishQueueEventData *eventData);
+
+	/**
+	 * @brief Returns the index of the oldest event that can be replaced or removed
+	 *
+	 * The events being sent can't be changed. The oldest event can't be changed while sending, even
+	 * before sendingCount is updated, because it may be about to be sent.
+	 *
+	 * Note: You must obtain a mutex lock before calling this!
+	 */
+	uint16_t getFirstUnsentIndex() const {
+		return (isSending && sendingCount == 0) ? 1 : sendingCount;
+	}
+
+	/**
+	 * @brief Updates the indexes of the withLastValueOnly() events after an event is inserted at index
+	 *
+	 * Note: You must obtain a mutex lock before calling this!
+	 */
+	void lastValueInserted(uint32_t index);
+
+	/**
+	 * @brief Sets all of the withLastValueOnly() entries to state
+	 *
+	 * Note: You must obtain a mutex lock before calling this!
+	 */
+	void resetLastValues(uint8_t state);
+
+	/**
+	 * @brief Forgets the storage offset of the withLastValueOnly() events after events are moved. The index is still used.
+	 *
+	 * Note: You must obtain a mutex lock before calling this!
+	 */
+	void forgetLastValuePositions();
+
+	/**
+	 * @brief Sets sendingCount and the count of each publish in progress to 0
+	 *
+	 * Storage methods call this from clearEvents(), so there's nothing to remove when the publishes complete.
+	 *
+	 * Note: You must obtain a mutex lock before calling this!
+	 */
+	void clearSendingCount();
+
+	/**
+	 * @brief Thread object, created in setup()
+	 */
+	Thread *thread = NULL;
+
+	/**
+	 * @brief Mutex to protect against concurrent access, created in setup()
+	 */
+	os_mutex_t mutex;
+
+	/**
+	 * @brief Queue the publish queue thread waits on, created in setup()
+	 *
+	 * It holds at most one item, which is put by wakeThread(), so a wake up that happens while the
+	 * thread is busy is not lost.
+	 */
+	os_queue_t wakeQueue = NULL;
+
+	/**
+	 * @brief Milliseconds the thread can sleep after the state handler returns, set by the state handler
+	 */
+	system_tick_t threadWaitMs = 0;
+
+	/**
+	 * @brief Longest the thread sleeps while a publish is in progress
+	 *
+	 * The publish future's onSuccess and onError callbacks wake the thread when it completes. This is
+	 * only a fallback in case a completion is missed, and is longer than Device OS takes to fail a publish.
+	 */
+	static const system_tick_t PUBLISH_TIMEOUT_MS = 60000;
+
+	PublishQueueAsyncBase *nextInstance = NULL;		//!< Next queue woken by systemEventHandler
+
+	PublishQueueISRRing isrRing;			//!< Staging ring for publishFromISR
+	uint16_t isrQueueSize = 0;				//!< Size of isrRing (withISRQueue)
+	std::atomic<uint32_t> isrDroppedCount{0};	//!< Events from publishFromISR that were not queued
+
+	PublishQueueMetricsCounters metrics;	//!< Counters for getMetrics()
+
+	std::atomic<os_thread_t> reservedThread{NULL};	//!< Thread holding the reservation from reserve(), NULL if none
+	os_mutex_t reserveMutex = NULL;			//!< Locked from reserve() until the reservation is released, created in setup()
+	uint8_t *reserveBuf = NULL;				//!< Event record being written for reserve(), allocated by the first reserve()
+	static PublishQueueAsyncBase *firstInstance;	//!< List of queues that have been set up
+
+	/**
+	 * @brief The tiered queue this queue is a tier of, or NULL
+	 *
+	 * A tier doesn't have its own thread. Its events are sent by the PublishQueueAsyncTiered, which is
+	 * told about each discarded event so it can keep track of the events being sent.
+	 */
+	PublishQueueAsyncTiered *tieredQueue = NULL;
+	friend class PublishQueueAsyncTiered;
+	friend class PublishQueueReservation;
+
+	/**
+	 * @brief The default retry policy, configured by withBackoff() or withFailureRetryMs()
+	 */
+	PublishQueueBackoff backoff;
+
+	/**
+	 * @brief The retry policy used to control the time to wait after a publish fails
+	 */
+	PublishQueueRetryPolicy *retryPolicy = &backoff;
+
+	/**
+	 * @brief Time to wait in waitRetryState, from the retry policy
+	 */
+	unsigned long retryDelayMs = 0;
+
+	std::atomic<uint32_t> backoffCount{0};		//!< Number of times waitRetryState was entered
+	std::atomic<uint32_t> backoffMs{0};			//!< Total milliseconds spent in waitRetryState, not including the current wait
+	std::atomic<uint16_t> consecutiveFailures{0};	//!< Publish failures since the last successful publish
+	std::atomic<bool> inBackoff{false};			//!< True while in waitRetryState
+
+	uint32_t maxAgeSec = 0;					//!< Maximum event age in seconds (0 = no limit)
+	bool maxAgeUseTtl = false;				//!< Use the event ttl as its maximum age
+	std::atomic<uint32_t> expiredCount{0};	//!< Number of events discarded for age
+
+	/**
+	 * @brief State handler function pointer
+	 *
+	 * Set to startState, checkQueueState, or waitRetryState
+	 */
+	std::function<void(PublishQueueAsyncBase&)> stateHandler = &PublishQueueAsyncBase::startState;
+
+	/**
+	 * @brief Last millis value for certain state changes like waitRetryState
+	 *
+	 * It's atomic because getBackoffMs() reads it from other threads.
+	 */
+	std::atomic<unsigned long> stateTime{0};
+
+	/**
+	 * @brief milis() value for the last publish
+	 */
+	unsigned long lastPublish = 0;
+
+	/**
+	 * @brief The default rate limit policy, configured by withRateLimit()
+	 */
+	PublishQueueTokenBucket tokenBucket;
+
+	/**
+	 * @brief The rate limit policy used to control the frequency of publishes
+	 */
+	PublishQueueRateLimiter *rateLimiter = &tokenBucket;
+
+	/**
+	 * @brief true if we're currently publishing
+	 *
+	 * This is used to control whether we discard the oldest or second oldest event if the retained buffer
+	 * is full.
+	 */
+	bool isSending = false;
+
+	/**
+	 * @brief Number of events at the beginning of the queue included in the publishes in progress
+	 *
+	 * This is 1 when sending one event and more when sending a batch or pipelining. It's 0 when not sending.
+	 */
+	uint16_t sendingCount = 0;
+
+	bool batching = false;				//!< Pack multiple events into a single publish (withBatching)
+	bool batchSameNameOnly = true;		//!< Only pack events with the same event name
+	const char *batchEventName = NULL;	//!< Event name for a batch of events with different names
+	char *batchBuf = NULL;				//!< Event data for a batch of events, allocated in setup() if batching
+
+	/**
+	 * @brief Size of the event name and data buffer for each publish when pipelining
+	 */
+	static const size_t IN_FLIGHT_BUF_SIZE = MAX_EVENT_NAME_LEN + 1 + particle::protocol::MAX_EVENT_DATA_LENGTH + 1;
+
+	uint16_t pipelineDepth = 1;				//!< Maximum number of publishes in progress (withPipelining)
+	PublishQueueInFlight *inFlight = NULL;	//!< Ring of pipelineDepth publishes in progress, allocated in setup()
+	uint16_t inFlightStart = 0;				//!< Index in inFlight of the oldest publish in progress
+	uint16_t inFlightCount = 0;				//!< Number of publishes in progress
+	char *inFlightBuf = NULL;				//!< Event name and data for each publish, allocated in setup() if pipelineDepth > 1
+
+	bool compression = false;				//!< Compress events when they're queued (withCompression)
+	uint8_t *compressBuf = NULL;			//!< Compressed event data, allocated in setup() if compression
+	uint16_t *compressHash = NULL;			//!< PublishQueueCompression hash table, allocated in setup() if compression
+	size_t compressedLen = 0;				//!< Length of the data in compressBuf, 0 if the event is stored uncompressed
+	uint8_t *expandBuf = NULL;				//!< Uncompressed copy of a compressed event, allocated when needed
+
+	PublishQueueLastValue *lastValues = NULL;	//!< Event names for which only the newest event is kept (withLastValueOnly)
+	uint16_t numLastValues = 0;				//!< Number of entries in lastValues
+	std::atomic<uint32_t> replacedCount{0};	//!< Number of events replaced by a newer event with the same name
+
+	/**
+	 * @brief True if setup() has been called.
+	 *
+	 * You should always call the setup() method from setup().
+	 */
+	bool haveSetup = false;
+
+	/**
+	 * @brief True if publishing has been manually paused
+	 */
+	bool pausePublishing = false;
+};
+
+/**
+ * @brief Class to store the publish queue in retained memory.
+ *
+ * Also works for regular RAM, though it won't survive a reset or SLEEP_MODE_DEEP.
+ */
+class PublishQueueAsyncRetained : public PublishQueueAsyncBase {
+public:
+	/**
+	 * @brief Construct a publish queue
+	 *
+	 * You normally allocate one of these as a global object. You should not create more than one, as
+	 * the rate limiting would not work right.
+	 *
+	 * @param retainedBuffer Pointer to the buffer in retained or regular memory
+	 *
+	 * @param retainedBufferSize Buffer size. Must be at least 716 bytes, but it's best for it to be
+	 * at least 1024 bytes, and ideally larger than that.
+	 */
+	PublishQueueAsyncRetained(uint8_t *retainedBuffer, uint16_t retainedBufferSize);
+
+	/**
+	 * @brief You normally allocate this as a global object and never delete it
+	 */
+	virtual ~PublishQueueAsyncRetained();
+
+	/**
+	 * @brief You must call setup from global setup()
+	 */
+	virtual void setup();
+
+	/**
+	 * @brief Queues an event with normal priority
+	 */
+	virtual bool publishCommon(const char *eventName, const char *data, int ttl, PublishFlags flags1, PublishFlags flags2 = PublishFlags()) {
+		return publishCommon(eventName, data, ttl, flags1, flags2, 0);
+	}
+
+	/**
+	 * @brief Publish an event. All other overloads lead here.
+	 *
+	 * @param eventName The name of the event (63 character maximum).
+	 *
+	 * @param data The event data (255 bytes maximum, 622 bytes in system firmware 0.8.0-rc.4 and later).
+	 *
+	 * @param ttl The time-to-live value. If not specified in one of the other overloads, the value 60 is
+	 * used. However, the ttl is ignored by the cloud, so it doesn't matter what you set it to. Essentially
+	 * all events are discarded immediately if not subscribed to so they essentially have a ttl of 0.
+	 *
+	 * @param flags1 Normally PRIVATE. You can also use PUBLIC, but one or the other must be specified.
+	 *
+	 * @param flags2 (optional) You can use NO_ACK or WITH_ACK if desired.
+	 *
+	 * @return true if the event was queued or false if it was not.
+	 *
+	 * This function almost always returns true. If you queue more events than fit in the buffer the
+	 * oldest (sometimes second oldest) is discarded.
+	 */
+	virtual bool publishCommon(const char *eventName, const char *data, int ttl, PublishFlags flags1, PublishFlags flags2, uint8_t priority);
+
+	/**
+	 * @brief Returns true if an event of size bytes fits in the retained buffer
+	 */
+	virtual bool reserveEvent(size_t size);
+
+	/**
+	 * @brief Copies the reserved event to the tail of the ring and removes the withLastValueOnly() event it replaces
+	 */
+	virtual bool commitEvent(const uint8_t *buf, size_t size);
+
+	/**
+	 * @brief Get the oldest event that hasn't been published yet
+	 *
+	 * Returns a pointer to a PublishQueueEventData structure in the publishBuf member variable.
+	 * This will remain valid until getOldestEvent() is called again.
+	 */
+	virtual PublishQueueEventData *getOldestEvent();
+
+	/**
+	 * @brief Remove any saved events
+	 *
+	 * @return true if the operation succeeded, or false if an event is currently being sent so the
+	 * events cannot be deleted.
+	 */
+	virtual bool clearEvents();
+
+	/**
+	 * @brief Discards the oldest event or second oldest event
+	 *
+	 * @param secondEvent True to discard the second oldest event
+	 *
+	 * If the retained buffer is full, we want to discard an old event to make room for a newer event,
+	 * but we can't dispose of the oldest event while it's being sent, because we need to remove it
+	 * after the publish succeeds, so we pass true for secondEvent.
+	 *
+	 * Discarding the oldest event only advances head. Discarding the second oldest event moves the
+	 * oldest event (only) into the space it occupied. If the second event wrapped around to the
+	 * beginning of the buffer and is smaller than the oldest event, additional events are discarded
+	 * until the oldest event fits.
+	 */
+	bool discardOldEvent(bool secondEvent);
+
+	/**
+	 * @brief Discards the oldest event or second oldest event, like discardOldEvent()
+	 *
+	 * You must hold the mutex to call this.
+	 */
+	bool discardEvent(bool secondEvent);
+
+	/**
+	 * @brief Calls a function for queued events, starting with the oldest event
+	 *
+	 * The event pointer passed to fn points into the retained buffer.
+	 */
+	virtual void forEachEvent(std::function<bool(const PublishQueueEventData *)> fn);
+
+	/**
+	 * @brief Given a pointer into the retained buffer, finds the offset of the next event
+	 *
+	 * @param start Where to start (pointer to RAM, not an offset)
+	 *
+	 * @returns A pointer to the beginning of the next event
+	 *
+	 * This uses the size in PublishQueueEventData and does not handle wrapping around to the
+	 * beginning of the circular buffer.
+	 */
+	uint8_t *skipEvent(uint8_t *start);
+
+	/**
+	 * @brief Get the number of events in the queue (0 = empty)
+	 */
+	uint16_t getNumEvents() const;
+
+	/**
+	 * @brief Gets the number of events and the bytes of the retained buffer between head and tail
+	 */
+	virtual void getQueueUsage(uint32_t &numEvents, uint32_t &numBytes) const;
+
+
+protected:
+	/**
+	 * @brief Returns the header at the beginning of the retained buffer
+	 */
+	PublishQueueRingHeader *getHeader() const { return reinterpret_cast<PublishQueueRingHeader *>(retainedBuffer); }
+
+	/**
+	 * @brief Returns the event at an offset in the retained buffer
+	 */
+	PublishQueueEventData *getEventAt(uint16_t offset) const { return reinterpret_cast<PublishQueueEventData *>(&retainedBuffer[offset]); }
+
+	/**
+	 * @brief Offset of the first byte of the data area (after the header)
+	 */
+	uint16_t dataStart() const { return sizeof(PublishQueueRingHeader); }
+
+	/**
+	 * @brief Offset of the end of the data area. It's the retainedBufferSize rounded down to a multiple of 4.
+	 */
+	uint16_t dataEnd() const { return retainedBufferSize & ~3; }
+
+	/**
+	 * @brief Given the offset just past the end of an event, returns the offset of the next event
+	 *
+	 * Handles wrapping around to the beginning of the data area, both with an explicit wrap marker
+	 * or because there's not enough room left for an event header. Only call this when there is
+	 * another event, as there is no event at tail.
+	 */
+	uint16_t wrapOffset(uint16_t offset) const;
+
+	/**
+	 * @brief Find room for an event of size bytes at tail
+	 *
+	 * @param size Size of the event, including PublishQueueEventData and padding. Must be a multiple of 4.
+	 *
+	 * @param offset Filled in with the offset to store the event at
+	 *
+	 * @returns true if there was room or false if the buffer is full.
+	 *
+	 * If the event does not fit at the end of the buffer but does at the beginning, the wrap marker is
+	 * written. On success, tail and numEvents are updated, so the caller must fill in the event before
+	 * releasing the mutex. You must hold the mutex to call this.
+	 */
+	bool allocateEvent(size_t size, uint16_t &offset);
+
+	/**
+	 * @brief Returns true if allocateEvent() would find room for an event of size bytes
+	 *
+	 * Nothing is changed. You must hold the mutex to call this.
+	 */
+	bool hasRoom(size_t size) const;
+
+	/**
+	 * @brief Returns the index to queue an event with the specified priority at
+	 *
+	 * This is before the first event with a lower priority, but not before the events being sent or
+	 * the oldest event, which may be about to be sent. If there is no such event, it's numEvents, the
+	 * end of the queue. You must hold the mutex to call this.
+	 */
+	uint16_t findInsertIndex(uint8_t priority) const;
+
+	/**
+	 * @brief Find room for an event of size bytes before the event at index
+	 *
+	 * @param index Index of the event to insert before. Must be at least 1 and less than numEvents.
+	 *
+	 * @param size Size of the event, including PublishQueueEventData and padding. Must be a multiple of 4.
+	 *
+	 * @param offset Filled in with the offset to store the event at
+	 *
+	 * @returns true if there was room or false if the buffer is full.
+	 *
+	 * The events before index are moved toward the beginning of the buffer if there's room before head.
+	 * Otherwise, the buffer is made contiguous with linearize() and the events starting at index are
+	 * moved toward the end. On success, head or tail and numEvents are updated, so the caller must fill
+	 * in the event before releasing the mutex. You must hold the mutex to call this.
+	 */
+	bool insertEvent(uint16_t index, size_t size, uint16_t &offset);
+
+	/**
+	 * @brief Removes the event at index by moving the events before it
+	 *
+	 * @param index Index of the event to remove. Must be less than numEvents.
+	 *
+	 * @param count Number of events to remove, starting at index. index + count must not be more than numEvents.
+	 *
+	 * You must hold the mutex to call this.
+	 */
+	void removeEvent(uint16_t index, uint16_t count = 1);
+
+	/**
+	 * @brief Discards the oldest event with the lowest priority to make room for an event
+	 *
+	 * @param priority The priority of the event being queued
+	 *
+	 * @returns true if an event was discarded, or false if there isn't an event that can be discarded
+	 *
+	 * The oldest event is not discarded while sending. Events with a higher priority than the event being
+	 * queued are not discarded.
+	 */
+	bool evictEvent(uint8_t priority);
+
+	/**
+	 * @brief Finds the unsent event with the name of a withLastValueOnly() entry
+	 *
+	 * @returns true if the event was found. lastValue->index is its index.
+	 *
+	 * The remembered index is checked first. The unsent events are only searched if the state is unknown
+	 * or the event at the index has a different name. You must hold the mutex to call this.
+	 */
+	bool findLastValueEvent(PublishQueueLastValue *lastValue);
+
+	/**
+	 * @brief Moves the events so they're contiguous starting at dataStart()
+	 *
+	 * This moves every byte in the buffer when the events wrap around the end of the buffer, so it's
+	 * only used when queueing a priority event or discarding an event that's not at the beginning of
+	 * the queue. You must hold the mutex to call this.
+	 */
+	void linearize();
+
+	/**
+	 * @brief Finds the offset of the event at index
+	 *
+	 * @param index Index of the event. Must be less than numEvents.
+	 *
+	 * @param contiguous Set to false if the events before index wrap around the end of the buffer
+	 */
+	uint16_t getEventOffset(uint16_t index, bool &contiguous) const;
+
+	/**
+	 * @brief Validates the circular buffer structure at startup
+	 *
+	 * @returns true if head, tail, numEvents, and the event sizes are consistent, and the crc of every
+	 * event matches
+	 */
+	bool validateBuffer() const;
+
+	/**
+	 * @brief Keeps the events from head up to the first event that's not valid
+	 *
+	 * @returns false if there are no valid events to keep
+	 *
+	 * This is used when validateBuffer() fails, typically because the device reset while an event was
+	 * being written. The events are checked from head until tail, numEvents events, or an event with an
+	 * invalid header or crc, and numEvents and tail are set to the events found.
+	 */
+	bool recoverBuffer();
+
+	/**
+	 * @brief Converts a retained buffer from 0.2.x and earlier to the circular layout
+	 *
+	 * @returns true if the buffer was converted or false if it was not valid
+	 *
+	 * The events are converted to version 2 records, which are 8 bytes larger, and the header is 4 bytes
+	 * larger. If the buffer is full, the oldest events are discarded to make room.
+	 */
+	bool convertLinearBuffer();
+
+	uint8_t *retainedBuffer;		//!< Pointer to the beginning of the retained (or regular) RAM buffer
+	uint16_t retainedBufferSize;	//!< Size of the buffer in bytes. Must be at least 716 bytes!
+
+	/**
+	 * @brief This holds a copy of the event being published
+	 *
+	 * Making a copy allows the oldest event to be moved in the retained buffer while it's being
+	 * published, which is how discardOldEvent(true) makes room.
+	 */
+	uint8_t publishBuf[EVENT_BUF_SIZE] __attribute__((aligned(4)));
+
+	friend class PublishQueueAsyncTiered;
+};
+
+/**
+ * @brief Backward compatible API so code build for version 0.0.5 and earlier will still compile
+ */
+class PublishQueueAsync : public PublishQueueAsyncRetained {
+public:
+	/**
+	 * @brief Construct a publish queue
+	 *
+	 * You normally allocate one of these as a global object. You should not create more than one, as
+	 * the rate limiting would not work right.
+	 */
+	PublishQueueAsync(uint8_t *retainedBuffer, uint16_t retainedBufferSize) : PublishQueueAsyncRetained(retainedBuffer, retainedBufferSize) {};
+
+	/**
+	 * @brief You normally allocate this as a global object and never delete it
+	 */
+	virtual ~PublishQueueAsync() {};
+};
+
+/**
+ * @brief Class to automatically lock and unlock the mutex. Create as a variable on the stack.
+ *
+ * This is used to make sure the mutex is always unlocked, for example if there is a return
+ * statement in the middle of the function. When the stack variable goes out of scope it will
+ * always unlock the mutex.
+ */
+class StMutexLock {
+public:
+	/**
+	 * @brief Call the mutexLock() method of publishQueue()
+	 *
+	 * Instantiate this object on the stack so unlock can be done when the variable goes out of
+	 * scope, such as when exiting a block or function.
+	 */
+	StMutexLock(const PublishQueueAsyncBase *publishQueue) : publishQueue(publishQueue) {
+		publishQueue->mutexLock();
+	}
+
+	/**
+	 * @brief Unlock the mutex on destructor
+	 */
+	~StMutexLock() {
+		publishQueue->mutexUnlock();
+	}
+
+	/**
+	 * @brief Saved publishQueue, used in destructor
+	 */
+	const PublishQueueAsyncBase *publishQueue;
+};
+
+/**
+ * @brief Publish queue with a small retained memory front tier that spills to a larger FRAM or file system back tier
+ *
+ * Events are always queued in the front tier, so publish() takes the same time as PublishQueueAsyncRetained
+ * no matter how many events are queued. When the front tier is more than the spill threshold full, the
+ * worker thread moves the oldest events to the back tier in bulk, with one write for the contiguous
+ * events. Events are sent from the back tier first, read in bulk into a refill buffer, then from the
+ * front tier, so they're published in the order they were queued.
+ *
+ * Events keep their priority when they're spilled, and the back tier sends its priority events first.
+ * When no events are being sent, the front tier is sent first if it has an event with a higher priority
+ * than the oldest back tier event. Front tier events that are being sent stay in the front tier and the
+ * events after them are spilled, and they're still sent before the back tier events. That isn't saved in
+ * retained memory, so if the device resets before they're sent, they're sent after the back tier events.
+ * Nothing is spilled while the events being sent include both the last back tier events and front tier
+ * events, which only happens with pipelining or batching.
+ *
+ * The tiers are regular queue objects, but only the tiered queue is set up and published to. They don't
+ * have their own threads. For example:
+ *
+ * ```
+ * retained uint8_t publishQueueRetainedBuffer[2048];
+ * PublishQueueAsyncRetained frontQueue(publishQueueRetainedBuffer, sizeof(publishQueueRetainedBuffer));
+ * PublishQueueAsyncFRAM backQueue(fram, 0, 32768);
+ * PublishQueueAsyncTiered publishQueue(frontQueue, backQueue);
+ * ```
+ *
+ * Compression and withLastValueOnly() are configured on the front tier. The rate limit, backoff,
+ * batching, pipelining, maximum age, and ISR queue are configured on the tiered queue. Events the back
+ * tier evicts to make room are counted in its getMetrics(). The back tier can be PublishQueueAsyncFRAM or
+ * a PublishQueueAsyncFileSystem subclass.
+ */
+class PublishQueueAsyncTiered : public PublishQueueAsyncBase {
+public:
+	/**
+	 * @brief Construct a tiered publish queue
+	 *
+	 * @param front The retained memory queue events are queued in. Don't call its setup().
+	 *
+	 * @param back The FRAM or file system queue events are spilled to. Don't call its setup().
+	 */
+	PublishQueueAsyncTiered(PublishQueueAsyncRetained &front, PublishQueueAsyncBase &back);
+
+	/**
+	 * @brief You normally allocate this as a global object and never delete it
+	 */
+	virtual ~PublishQueueAsyncTiered();
+
+	/**
+	 * @brief Percentage of the front tier that can be used before events are spilled (default: 50)
+	 *
+	 * @param percent When more than this percentage of the front tier is used, the worker thread moves
+	 * the oldest events to the back tier until half of that is used. If 100, events are only spilled
+	 * when the next event doesn't fit.
+	 *
+	 * When the cloud is connected and events are sent as fast as they're queued, they're never written
+	 * to the back tier.
+	 */
+	inline PublishQueueAsyncTiered &withSpillThreshold(uint8_t percent) { spillPercent = (percent > 100) ? 100 : percent; return *this; };
+
+	/**
+	 * @brief Size of the buffer the oldest events are read into from the back tier (default: 2048)
+	 *
+	 * @param value Buffer size in bytes, allocated on the heap in setup(). It's increased to EVENT_BUF_SIZE
+	 * (704 bytes) if smaller.
+	 *
+	 * The buffer is refilled with one read when all of the events in it have been sent. Batching only
+	 * packs the back tier events that are in the buffer.
+	 *
+	 * This must be called before setup().
+	 */
+	inline PublishQueueAsyncTiered &withRefillSize(size_t value) { refillSize = (value < EVENT_BUF_SIZE) ? EVENT_BUF_SIZE : value; return *this; };
+
+	/**
+	 * @brief Returns the number of events moved from the front tier to the back tier
+	 */
+	uint32_t getSpilledCount() const { return spilledCount; };
+
+	/**
+	 * @brief You must call setup from global setup(). It sets up both tiers.
+	 *
+	 * As with PublishQueueAsyncRetained, if it hasn't been called, the first publish or reserve() calls it.
+	 * The back tier must be ready by then, for example begin() called on the FRAM or the file system mounted.
+	 */
+	virtual void setup();
+
+	/**
+	 * @brief Queues an event with normal priority
+	 */
+	virtual bool publishCommon(const char *eventName, const char *data, int ttl, PublishFlags flags1, PublishFlags flags2 = PublishFlags()) {
+		return publishCommon(eventName, data, ttl, flags1, flags2, 0);
+	}
+
+	/**
+	 * @brief Queues the event in the front tier, spilling old events to the back tier first if it doesn't fit
+	 */
+	virtual bool publishCommon(const char *eventName, const char *data, int ttl, PublishFlags flags1, PublishFlags flags2, uint8_t priority);
+
+	/**
+	 * @brief Gets the oldest event from the refill buffer, or the front tier if the back tier is empty or
+	 * front tier events are sent first
+	 *
+	 * When no events are being sent, this also chooses whether the front tier is sent first.
+	 */
+	virtual PublishQueueEventData *getOldestEvent();
+
+	/**
+	 * @brief Removes the events in both tiers
+	 */
+	virtual bool clearEvents();
+
+	/**
+	 * @brief Discards the oldest or second oldest event, which may be in either tier
+	 */
+	virtual bool discardOldEvent(bool secondEvent);
+
+	/**
+	 * @brief Calls a function for queued events, starting with the oldest event
+	 *
+	 * The front tier events that are sent before the back tier are visited first (getFrontLead()), then
+	 * the back tier events in the refill buffer, followed by the rest of the front tier events if the
+	 * refill buffer contains all of the back tier events.
+	 */
+	virtual void forEachEvent(std::function<bool(const PublishQueueEventData *)> fn);
+
+	/**
+	 * @brief Get the number of events in both tiers (0 = empty)
+	 */
+	uint16_t getNumEvents() const;
+
+	/**
+	 * @brief Called by a tier when it discards an event
+	 *
+	 * @param tier The front or back tier
+	 *
+	 * @param index Index of the event in the tier
+	 *
+	 * The tier's mutex and the tiered queue's mutex are locked when this is called.
+	 */
+	void tierEventDiscarded(PublishQueueAsyncBase *tier, uint16_t index);
+
+	/**
+	 * @brief Called by the front tier when it inserts a priority event before other events
+	 *
+	 * @param tier The front tier
+	 *
+	 * @param index Index of the inserted event in the tier
+	 *
+	 * The tier's mutex and the tiered queue's mutex are locked when this is called.
+	 */
+	void tierEventInserted(PublishQueueAsyncBase *tier, uint16_t index);
+
+protected:
+	/**
+	 * @brief Spills events in the background when the front tier is over the threshold, and does the tiers' periodic work
+	 */
+	virtual void threadTasks();
+
+	/**
+	 * @brief Returns the sooner of the tiers' getThreadTasksWaitMs()
+	 */
+	virtual system_tick_t getThreadTasksWaitMs();
+
+	/**
+	 * @brief Gets the total usage of both tiers. You must hold the mutex to call this.
+	 */
+	virtual void getQueueUsage(uint32_t &numEvents, uint32_t &numBytes) const;
+
+	/**
+	 * @brief Returns true if the front tier or another lane of the back tier has an event with a higher
+	 * priority than the back tier events being sent
+	 */
+	virtual bool hasWaitingPriorityEvent() const;
+
+	/**
+	 * @brief Returns the number of front tier events when they're sent first, so a batch or pipelined
+	 * publish doesn't continue into the back tier
+	 */
+	virtual uint16_t getActiveLaneEvents() const;
+
+	/**
+	 * @brief Returns true if an event of size bytes fits in the front tier
+	 */
+	virtual bool reserveEvent(size_t size);
+
+	/**
+	 * @brief Commits the reserved event to the front tier, spilling old events first if it doesn't fit
+	 */
+	virtual bool commitEvent(const uint8_t *buf, size_t size);
+
+	/**
+	 * @brief Updates the tiers' sending state from the tiered queue's
+	 *
+	 * The events being sent are the oldest events, so they're in the back tier first, unless some or all
+	 * of the front tier events are sent first (getFrontLead()). Also gets the number of events in the back
+	 * tier. You must hold the mutex to call this.
+	 */
+	void syncTiers();
+
+	/**
+	 * @brief Chooses whether the front tier is sent before the back tier
+	 *
+	 * The front tier is sent first if it has an event with a higher priority than the oldest event in
+	 * the refill buffer. If the back tier has a higher priority
+	 * event than the ones in the refill buffer, the buffer is emptied so it's read again from that lane.
+	 * Only called when no events are being sent. You must hold the mutex to call this.
+	 */
+	void selectTier();
+
+	/**
+	 * @brief Returns the highest priority of the front tier events, or 0 if it's empty
+	 *
+	 * This reads the retained buffer directly, so it can be called while the front tier mutex is locked.
+	 * You must hold the mutex to call this.
+	 */
+	uint8_t getFrontPriority() const;
+
+	/**
+	 * @brief Returns true if an event of size bytes fits in the front tier without discarding events
+	 */
+	bool frontHasRoom(size_t size);
+
+	/**
+	 * @brief Returns the number of front tier events that are sent before the back tier events
+	 *
+	 * That's all of them if the front tier is sent first (sendFront), otherwise frontLead. You must hold
+	 * the mutex to call this.
+	 */
+	uint16_t getFrontLead() const { return sendFront ? front.getHeader()->numEvents : frontLead; };
+
+	/**
+	 * @brief Moves the oldest events in the front tier to the back tier until half of the spill threshold is used
+	 *
+	 * @returns true if any events were moved
+	 *
+	 * Each contiguous run of events is added with one appendRecords() call directly from the retained
+	 * buffer. The front tier events being sent, and the ones already before the back tier (frontLead),
+	 * stay in the front tier and the events after them are spilled. Then frontLead is the number of
+	 * events that stayed. Nothing is spilled if the events being sent include both back tier events
+	 * and front tier events after them. You must hold the mutex to call this.
+	 */
+	bool spillEvents();
+
+	/**
+	 * @brief Reads the oldest back tier events into refillBuf if it's empty
+	 *
+	 * You must hold the mutex to call this.
+	 */
+	void refill();
+
+	/**
+	 * @brief Removes the back tier event at index from refillBuf, if it's there
+	 */
+	void removeRefillEvent(uint16_t index);
+
+	PublishQueueAsyncRetained &front;		//!< Tier events are queued in
+	PublishQueueAsyncBase &back;			//!< Tier events are spilled to
+	uint16_t backEvents = 0;				//!< Number of events in the back tier, from syncTiers()
+	uint8_t spillPercent = 50;				//!< Front tier usage that starts a spill (withSpillThreshold)
+	bool spilling = false;					//!< True while the spilled events are removed from the front tier
+	bool sendFront = false;					//!< True if the front tier is sent before the back tier (selectTier)
+	uint16_t frontLead = 0;					//!< Number of front tier events sent before the back tier, because they were being sent when the events after them were spilled
+	uint32_t spilledCount = 0;				//!< Number of events moved to the back tier
+
+	uint8_t *refillBuf = NULL;				//!< Oldest back tier events, allocated in setup()
+	size_t refillSize = 2048;				//!< Size of refillBuf (withRefillSize)
+	size_t refillStart = 0;					//!< Offset of the oldest event in refillBuf
+	size_t refillLen = 0;					//!< Offset of the end of the events in refillBuf
+	uint16_t refillCount = 0;				//!< Number of events in refillBuf
+
+	/**
+	 * @brief This holds a copy of the event being published when it's from the back tier
+	 */
+	uint8_t publishBuf[EVENT_BUF_SIZE] __attribute__((aligned(4)));
+};
+
+#if defined(__MB85RC256V_FRAM_RK) || defined(DOXYGEN_BUILD)
+
+/**
+ * @brief Support for MB85RC256V-FRAM-RK library.
+ *
+ * If you include "MB85RC256V-FRAM-RK.h" before PublishQueueAsyncRK.h, this code will be enabled
+ *
+ * In 0.3.0 and later, the FRAM uses circular buffers like retained memory: a PublishQueueFRAMHeader
+ * at start, followed by the events. The head and tail offsets are relative to start and are persisted in
+ * the header, so removing an event after it's been published is a single header write instead of
+ * moving the rest of the queue over I2C.
+ *
+ * Events with normal priority are in one circular buffer and are sent oldest first. Events queued with
+ * a priority above 0 are in a second, smaller circular buffer at the end of the FRAM area (see
+ * withPrioritySize()), so queueing one never moves the normal events. Each priority is a lane that's
+ * sent in the order it was queued. An event that's removed when it's not at head, such as a priority
+ * event that's sent before an older event with a lower priority, is marked as deleted with a 2-byte
+ * write, and head skips over it when it's reached. The number of events in each lane is kept in RAM.
+ */
+class PublishQueueAsyncFRAM : public PublishQueueAsyncBase {
+public:
+	/**
+	 * @brief Constrctor for FRAM base class
+	 *
+	 * @param fram The MB85RC256V object for the FRAM. You must call begin() on the FRAM before calling setup() on this object.
+	 *
+	 * @param start Optional start address, default is 0 (beginning of FRAM)
+	 *
+	 * @param len Optional length, default is size of FRAM. Note that this is a length relative to start, not an ending address.
+	 * The offsets in the header are 16 bits, so at most 65532 bytes are used.
+	 */
+	PublishQueueAsyncFRAM(MB85RC &fram, size_t start = 0, size_t len = 0) : fram(fram), start(start), len(len) {
+		if (len == 0) {
+			this->len = fram.length() - start;
+		}
+		if (this->len > 0xfffc) {
+			this->len = 0xfffc;
+		}
+		prioritySize = (this->len / 16) & ~3;
+	}
+
+	/**
+	 * @brief Destructor. You norrmally allocate one of these as a global variable and don't delete it.
+	 */
+	virtual ~PublishQueueAsyncFRAM() {
+
+	}
+
+	/**
+	 * @brief Sets the number of bytes at the end of the FRAM area used for events queued with a priority
+	 *
+	 * @param size Size in bytes. The default is 1/16 of the FRAM area. At most half of the FRAM area is used.
+	 * 0 queues all events with normal priority.
+	 *
+	 * You must call this before setup(). If the size is different than the FRAM was initialized with, the
+	 * events in FRAM are discarded, the same as if the length changed. An event that's larger than this
+	 * area is queued with normal priority.
+	 */
+	PublishQueueAsyncFRAM &withPrioritySize(size_t size) { prioritySize = size; return *this; };
+
+	virtual void setup() {
+		// Do superclass setup (starting the thread)
+		PublishQueueAsyncBase::setup();
+
+		// Don't let the worker thread read the header until it's been validated
+		StMutexLock lock(this);
+
+		if (prioritySize > (size_t)(dataEnd() - dataStart()) / 2) {
+			prioritySize = (dataEnd() - dataStart()) / 2;
+		}
+		prioritySize &= ~3;
+
+		// Initialize the retained buffer
+		bool initBuffer = false;
+
+		if (!fram.readData(start, (uint8_t *)&header, sizeof(PublishQueueFRAMHeader))) {
+			PUBLISH_QUEUE_LOG_ERROR("failed to read FRAM");
+			return;
+		}
+
+		if (header.magic == PUBLISH_QUEUE_FRAM_HEADER_MAGIC && header.size == len && header.prioritySize == prioritySize) {
+			PUBLISH_QUEUE_LOG_TRACE("FRAM numEvents=%u head=%u tail=%u", header.events.numEvents, header.events.head, header.events.tail);
+
+			bool recovered = false;
+			PublishQueueFRAMRing *rings[2] = { &header.events, &header.priority };
+			for(size_t ii = 0; ii < 2; ii++) {
+				if (!validateHeader(*rings[ii])) {
+					recovered = true;
+					recoverEvents(*rings[ii]);
+				}
+			}
+
+			if ((recovered || !loadLaneEvents()) && !countEvents()) {
+				PUBLISH_QUEUE_LOG_INFO("FRAM contents invalid, reinitializing");
+				initBuffer = true;
+			}
+			else
+			if (recovered) {
+				if (getQueuedEvents() != 0) {
+					PUBLISH_QUEUE_LOG_INFO("FRAM header invalid, kept numEvents=%u", getQueuedEvents());
+				}
+				else {
+					PUBLISH_QUEUE_LOG_INFO("FRAM contents invalid, reinitializing");
+					initBuffer = true;
+				}
+			}
+		}
+		else
+		if (header.magic == PUBLISH_QUEUE_HEADER_MAGIC && header.size == len) {
+			// FRAM from 0.2.x or earlier
+			if (!convertEventsV1()) {
+				PUBLISH_QUEUE_LOG_INFO("could not convert FRAM, reinitializing");
+				initBuffer = true;
+			}
+		}
+		else {
+			// Not valid
+			initBuffer = true;
+			// PUBLISH_QUEUE_LOG_INFO("No magic bytes or invalid length");
+		}
+
+		// initBuffer = true; // Uncomment to discard old data
+
+		if (initBuffer) {
+			header.magic = PUBLISH_QUEUE_FRAM_HEADER_MAGIC;
+			header.size = len;
+			header.prioritySize = prioritySize;
+			resetLanes();
+			if (!writeHeader()) {
+				PUBLISH_QUEUE_LOG_ERROR("failed to write FRAM");
+				return;
+			}
+
+			PUBLISH_QUEUE_LOG_INFO("FRAM reinitialized start=%u len=%u", start, len);
+		}
+		else {
+			PUBLISH_QUEUE_LOG_INFO("FRAM numEvents=%u head=%u tail=%u", getQueuedEvents(), header.events.head, header.events.tail);
+		}
+		updateUsageMetrics();
+
+		haveSetup = true;
+	}
+
+	/**
+	 * @brief Queues an event with normal priority
+	 */
+	virtual bool publishCommon(const char *eventName, const char *data, int ttl, PublishFlags flags1, PublishFlags flags2 = PublishFlags()) {
+		return publishCommon(eventName, data, ttl, flags1, flags2, 0);
+	}
+
+	virtual bool publishCommon(const char *eventName, const char *data, int ttl, PublishFlags flags1, PublishFlags flags2, uint8_t priority) {
+		if (!haveSetup) {
+			return false;
+		}
+
+		if (data == NULL) {
+			data = "";
+		}
+
+		size_t nameLen = strlen(eventName);
+		size_t dataLen = strlen(data);
+		size_t size = getEventSize(nameLen, dataLen);
+
+		// PUBLISH_QUEUE_LOG_INFO("queueing eventName=%s data=%s ttl=%d flags1=%d flags2=%d size=%d", eventName, data, ttl, flags1.value(), flags2.value(), size);
+
+		if (size == 0) {
+			// Event name or data is too long to publish
+			metrics.rejected++;
+			return false;
+		}
+
+		if (priority > PUBLISH_QUEUE_PRIORITY_MAX) {
+			priority = PUBLISH_QUEUE_PRIORITY_MAX;
+		}
+		if (priority > 0 && size > (size_t)(dataEnd() - priorityStart())) {
+			PUBLISH_QUEUE_LOG_INFO("event does not fit in the priority area, queueing it with normal priority");
+			priority = 0;
+		}
+		PublishQueueFRAMRing &ring = getRing(priority);
+
+		if  (size > (size_t)(ringEnd(ring) - ringStart(ring))) {
+			// Special case: event is larger than the FRAM. Rather than throw out all events
+			// before discovering this, check that case first
+			metrics.rejected++;
+			return false;
+		}
+
+		while(true) {
+			{
+				StMutexLock lock(this);
+
+				// Compressed again each time because another thread can use compressBuf while the
+				// mutex is unlocked to discard an event
+				size = getStoredEventSize(nameLen, data, dataLen);
+
+				// Replace the unsent event with the same name if only the newest one is kept
+				PublishQueueLastValue *lastValue = findLastValue(eventName, nameLen);
+				bool replace = (lastValue != NULL && findLastValueEvent(lastValue));
+				PublishQueueEventData oldEventData;
+				if (replace) {
+					// findLastValueEvent leaves the event header in eventBuf
+					oldEventData = *(PublishQueueEventData *)eventBuf;
+					PublishQueueFRAMRing &oldRing = getRingAt((uint16_t) lastValue->pos);
+
+					if (oldEventData.size >= size && &oldRing == &ring && getRecordLane(oldRing, &oldEventData) == priority) {
+						// Overwrite it in place. The header doesn't change.
+						PUBLISH_QUEUE_LOG_INFO("replacing event offset=%u size=%u index=%u", (unsigned)lastValue->pos, oldEventData.size, (unsigned)lastValue->index);
+						writeStoredEvent(eventBuf, eventName, nameLen, data, dataLen, ttl, flags1.value() | flags2.value(), oldEventData.size, priority);
+						fram.writeData(start + lastValue->pos, (uint8_t *)&eventBuf, oldEventData.size);
+						replacedCount++;
+						eventQueued();
+						return true;
+					}
+				}
+
+				// Events are always added at tail. The priority only changes the order they're sent in.
+				uint16_t offset;
+				if (allocateEvent(ring, size, offset)) {
+					// There is room to fit this
+					writeStoredEvent(eventBuf, eventName, nameLen, data, dataLen, ttl, flags1.value() | flags2.value(), size, priority);
+
+					// Write the event before the header so the header never refers to an incomplete event
+					fram.writeData(start + offset, (uint8_t *)&eventBuf, size);
+
+					logPublishQueueEventData(&eventBuf);
+
+					uint16_t index = eventAdded(offset, priority);
+
+					if (replace) {
+						// Removed after the new event is written, so it's kept if the new event doesn't fit.
+						// eventAdded() updated its index if the new event is before it in the order.
+						uint16_t oldIndex = (uint16_t) lastValue->index;
+						PUBLISH_QUEUE_LOG_INFO("removing event index=%u to replace it", oldIndex);
+						memcpy(eventBuf, &oldEventData, sizeof(PublishQueueEventData));
+						if (!removeEvent(getRingAt((uint16_t) lastValue->pos), (uint16_t) lastValue->pos)) {
+							PUBLISH_QUEUE_LOG_ERROR("FRAM event invalid in publishCommon, discarding events");
+							resetEvents();
+							continue;
+						}
+						countDiscardedEvent(oldIndex);
+						if (oldIndex < index) {
+							index--;
+						}
+						replacedCount++;
+					}
+					writeHeader();
+
+					PUBLISH_QUEUE_LOG_INFO("wrote event offset=%u size=%u index=%u", offset, size, index);
+
+					if (lastValue != NULL) {
+						lastValue->state = PublishQueueLastValue::STATE_QUEUED;
+						lastValue->index = index;
+						lastValue->pos = offset;
+					}
+
+					PUBLISH_QUEUE_LOG_TRACE("after saving numEvents=%d head=%d tail=%d end=%d", (int)ring.numEvents, (int)ring.head, (int)ring.tail, len);
+
+					eventQueued();
+					return true;
+				}
+
+				PUBLISH_QUEUE_LOG_INFO("need to discard event, FRAM is full");
+			}
+
+			// Discard the oldest event in the circular buffer the event goes in. If we are sending
+			// (isSending=true), the oldest event is not discarded.
+			if (!evictEvent(ring, priority)) {
+				// There isn't an event to discard, so we don't have enough room
+				metrics.rejected++;
+				return false;
+			}
+		}
+
+		// Not reached
+		return false;
+	}
+
+	/**
+	 * @brief Returns true if an event of size bytes fits in the FRAM
+	 */
+	virtual bool reserveEvent(size_t size) {
+		if (!haveSetup) {
+			return false;
+		}
+		return size <= (size_t)(ringEnd(header.events) - ringStart(header.events));
+	}
+
+	/**
+	 * @brief Writes the reserved event to FRAM at tail, then the header
+	 *
+	 * Old events are discarded to make room the same way as publishCommon(), and the withLastValueOnly()
+	 * event it replaces is removed.
+	 */
+	virtual bool commitEvent(const uint8_t *buf, size_t size) {
+		const PublishQueueEventData *eventData = (const PublishQueueEventData *)buf;
+		PublishQueueFRAMRing &ring = header.events;
+
+		while(true) {
+			{
+				StMutexLock lock(this);
+
+				// Look for the event to replace before the new event is in the ring. This reads into eventBuf.
+				PublishQueueLastValue *lastValue = findLastValue(getEventName(eventData), eventData->nameLen);
+				bool replace = (lastValue != NULL && findLastValueEvent(lastValue));
+				PublishQueueEventData oldEventData;
+				if (replace) {
+					oldEventData = *(PublishQueueEventData *)eventBuf;
+				}
+
+				uint16_t offset;
+				if (allocateEvent(ring, size, offset)) {
+					// Write the event before the header so the header never refers to an incomplete event
+					fram.writeData(start + offset, buf, size);
+
+					logPublishQueueEventData(buf);
+
+					uint16_t index = eventAdded(offset, 0);
+
+					if (replace) {
+						// removeEvent() needs the header of the event to replace in eventBuf
+						uint16_t oldIndex = (uint16_t) lastValue->index;
+						PUBLISH_QUEUE_LOG_INFO("removing event index=%u to replace it", oldIndex);
+						memcpy(eventBuf, &oldEventData, sizeof(PublishQueueEventData));
+						if (!removeEvent(getRingAt((uint16_t) lastValue->pos), (uint16_t) lastValue->pos)) {
+							PUBLISH_QUEUE_LOG_ERROR("FRAM event invalid in commitEvent, discarding events");
+							resetEvents();
+							continue;
+						}
+						countDiscardedEvent(oldIndex);
+						if (oldIndex < index) {
+							index--;
+						}
+						replacedCount++;
+					}
+					writeHeader();
+
+					PUBLISH_QUEUE_LOG_INFO("wrote event offset=%u size=%u index=%u", offset, (unsigned)size, index);
+
+					if (lastValue != NULL) {
+						lastValue->state = PublishQueueLastValue::STATE_QUEUED;
+						lastValue->index = index;
+						lastValue->pos = offset;
+					}
+
+					PUBLISH_QUEUE_LOG_TRACE("after saving numEvents=%d head=%d tail=%d end=%d", (int)ring.numEvents, (int)ring.head, (int)ring.tail, len);
+
+					eventQueued();
+					return true;
+				}
+
+				PUBLISH_QUEUE_LOG_INFO("need to discard event, FRAM is full");
+			}
+
+			if (!evictEvent(ring, 0)) {
+				metrics.rejected++;
+				return false;
+			}
+		}
+	}
+
+	/**
+	 * @brief Get the oldest event that hasn't been published yet
+	 *
+	 * Returns a pointer to a PublishQueueEventData structure in the publishBuf member variable.
+	 * This will remain valid until getOldestEvent() is called again.
+	 *
+	 * If no events are being sent, the highest priority lane with events is sent first. While events
+	 * are being sent, the order doesn't change, so a priority event queued then is sent once the
+	 * publishes in progress complete.
+	 */
+	virtual PublishQueueEventData *getOldestEvent() {
+		StMutexLock lock(this);
+
+		uint16_t offset;
+		while(true) {
+			if (getQueuedEvents() == 0) {
+				return NULL;
+			}
+
+			if (sendingCount == 0) {
+				selectLane();
+			}
+
+			// If the events didn't match the counts, they were counted again
+			if (!findEvent(0, offset) && (getQueuedEvents() == 0 || !findEvent(0, offset))) {
+				return NULL;
+			}
+
+			// findEvent() leaves the event header in eventBuf, so only the rest of the event is read
+			memcpy(publishBuf, eventBuf, sizeof(PublishQueueEventData));
+			fram.readData(start + offset + sizeof(PublishQueueEventData), &publishBuf[sizeof(PublishQueueEventData)], ((PublishQueueEventData *)publishBuf)->size - sizeof(PublishQueueEventData));
+			if (isValidEvent((PublishQueueEventData *)publishBuf, EVENT_BUF_SIZE)) {
+				break;
+			}
+
+			// Not only the newest event can be partially written. A withLastValueOnly() event is overwritten
+			// in place, and discardAfterHead() moves the oldest event. The header is still in eventBuf.
+			PUBLISH_QUEUE_LOG_ERROR("FRAM event crc mismatch offset=%u, discarding it", offset);
+			if (!removeEvent(getRingAt(offset), offset)) {
+				PUBLISH_QUEUE_LOG_ERROR("FRAM event invalid, discarding events");
+				resetEvents();
+				return NULL;
+			}
+			countDiscardedEvent(0);
+			metrics.corrupted++;
+			writeHeader();
+			updateUsageMetrics();
+		}
+		logPublishQueueEventData(publishBuf);
+
+		if (isEventCompressed((PublishQueueEventData *)publishBuf)) {
+			memcpy(eventBuf, publishBuf, ((PublishQueueEventData *)publishBuf)->size);
+			expandEvent((PublishQueueEventData *)eventBuf, publishBuf);
+		}
+
+		// The event is left in publishBuf, which we then return
+		PUBLISH_QUEUE_LOG_TRACE("getOldestEvent found an event offset=%u", offset);
+
+		return (PublishQueueEventData *)publishBuf;
+	}
+
+	/**
+	 * @brief Remove any saved events
+	 *
+	 * @return Always returns true.
+	 *
+	 * Since the FRAM code copies the event being published to a separate buffer, the events can always be cleared.
+	 */
+	virtual bool clearEvents() {
+		StMutexLock lock(this);
+		resetEvents();
+
+		isSending = false;
+		clearSendingCount();
+		lastPublish = 0;
+		updateUsageMetrics();
+
+		PUBLISH_QUEUE_LOG_TRACE("clearEvents numEvents=%d size=%d", (int)getQueuedEvents(), (int)header.size);
+
+		return true;
+	}
+
+	/**
+	 * @brief Discards the oldest event or second oldest event
+	 *
+	 * @param secondEvent True to discard the second oldest event
+	 *
+	 * The event being published is in publishBuf, but it must remain in FRAM until the publish succeeds.
+	 * If the FRAM is full, we want to discard an old event to make room for a newer event, but we can't
+	 * dispose of the oldest event while it's being sent, so we pass true for secondEvent.
+	 *
+	 * The oldest and second oldest events are in the order they're sent. Removing the event at head only
+	 * advances head and writes the header. If the second oldest event is the next event after head, the
+	 * oldest event is moved into its space, so the space is available right away. Any other event is
+	 * marked as deleted.
+	 */
+	virtual bool discardOldEvent(bool secondEvent) {
+
+		StMutexLock lock(this);
+
+		uint16_t index = secondEvent ? 1 : 0;
+		if (getQueuedEvents() <= index) {
+			return false;
+		}
+
+		// If the events didn't match the counts, they were counted again
+		uint16_t offset;
+		if (!findEvent(index, offset) && (getQueuedEvents() <= index || !findEvent(index, offset))) {
+			// Events were discarded, so there's room now
+			return true;
+		}
+
+		PublishQueueFRAMRing &ring = getRingAt(offset);
+		PUBLISH_QUEUE_LOG_TRACE("discardOldestEvent secondEvent=%d offset=%d head=%d tail=%d", (int)secondEvent, (int)offset, (int)ring.head, (int)ring.tail);
+
+		if (secondEvent && &ring == &header.events && getFirstLane() == 0) {
+			// The oldest event is at head of the normal circular buffer, and this is the next event
+			if (!discardAfterHead(ring, PUBLISH_QUEUE_PRIORITY_MAX)) {
+				return false;
+			}
+		}
+		else {
+			if (!removeEvent(ring, offset)) {
+				PUBLISH_QUEUE_LOG_ERROR("FRAM event invalid in discardOldEvent, discarding events");
+				resetEvents();
+				return true;
+			}
+			countDiscardedEvent(index);
+		}
+
+		writeHeader();
+
+		PUBLISH_QUEUE_LOG_TRACE("after discardOldestEvent numEvents=%d head=%d tail=%d", ring.numEvents, (int)ring.head, (int)ring.tail);
+
+		return true;
+	}
+
+	/**
+	 * @brief Calls a function for queued events, starting with the oldest event
+	 *
+	 * Each event is read into eventBuf before calling fn. The events are in the order they're sent.
+	 */
+	virtual void forEachEvent(std::function<bool(const PublishQueueEventData *)> fn) {
+		StMutexLock lock(this);
+
+		forEachRecord([&](uint16_t offset, uint16_t /* index */) {
+			// The event header is already in eventBuf
+			PublishQueueEventData *eventData = (PublishQueueEventData *)eventBuf;
+			fram.readData(start + offset + sizeof(PublishQueueEventData), &eventBuf[sizeof(PublishQueueEventData)], eventData->size - sizeof(PublishQueueEventData));
+			return fn(eventData);
+		});
+	}
+
+	/**
+	 * @brief Adds event records spilled from the front tier of a PublishQueueAsyncTiered
+	 *
+	 * The records with normal priority that fit contiguously at tail are written with one I2C write,
+	 * followed by one header write. Records with a priority are written to the priority area one at a time.
+	 * Old events are evicted to make room the same way as publishCommon().
+	 */
+	virtual uint16_t appendRecords(const uint8_t *buf, size_t /* len */, uint16_t count) {
+		if (!haveSetup) {
+			return 0;
+		}
+
+		uint16_t added = 0;
+		size_t pos = 0;
+		while(added < count) {
+			const PublishQueueEventData *eventData = (const PublishQueueEventData *)&buf[pos];
+			uint8_t lane = getAppendLane(eventData);
+			PublishQueueFRAMRing &ring = getRing(lane);
+			{
+				StMutexLock lock(this);
+
+				uint16_t offset;
+				if (allocateEvent(ring, eventData->size, offset)) {
+					// Add the following records with the same priority that fit before head, or the end of the buffer
+					size_t runLen = eventData->size;
+					uint16_t runCount = 1;
+					size_t avail = (ring.tail <= ring.head) ? (ring.head - ring.tail) : (ringEnd(ring) - ring.tail);
+					while(lane == 0 && added + runCount < count) {
+						const PublishQueueEventData *nextEvent = (const PublishQueueEventData *)&buf[pos + runLen];
+						if (nextEvent->size > avail || getAppendLane(nextEvent) != 0) {
+							break;
+						}
+						runLen += nextEvent->size;
+						avail -= nextEvent->size;
+						runCount++;
+					}
+					ring.tail = offset + runLen;
+					ring.numEvents += runCount - 1;
+
+					// Write the events before the header so the header never refers to an incomplete event
+					fram.writeData(start + offset, &buf[pos], runLen);
+					for(size_t runPos = 0; runPos < runLen; ) {
+						eventAdded(offset + runPos, lane);
+						runPos += ((const PublishQueueEventData *)&buf[pos + runPos])->size;
+					}
+					writeHeader();
+
+					pos += runLen;
+					added += runCount;
+					continue;
+				}
+
+				if (ring.numEvents == 0) {
+					// Too large to fit in the FRAM
+					break;
+				}
+			}
+
+			if (!evictEvent(ring, lane)) {
+				break;
+			}
+		}
+
+		StMutexLock lock(this);
+		updateUsageMetrics();
+
+		return added;
+	}
+
+	/**
+	 * @brief Reads the oldest events, up to the end of the buffer or tail, with one I2C read
+	 *
+	 * If priority events are sent first or there are deleted events, the events aren't in the order
+	 * they're sent, so they're read one at a time by PublishQueueAsyncBase::readRecords() instead.
+	 */
+	virtual uint16_t readRecords(uint8_t *buf, size_t bufSize, size_t &len) {
+		{
+			StMutexLock lock(this);
+
+			len = 0;
+			if (getQueuedEvents() == 0) {
+				return 0;
+			}
+
+			if (sendingCount == 0) {
+				selectLane();
+			}
+
+			const PublishQueueFRAMRing &ring = header.events;
+			if (activeLane == 0 && laneEvents[0] != 0 && ring.deletedEvents == 0) {
+				size_t readLen = ((ring.tail > ring.head) ? ring.tail : ringEnd(ring)) - ring.head;
+				if (readLen > bufSize) {
+					readLen = bufSize;
+				}
+				if (!fram.readData(start + ring.head, buf, readLen)) {
+					return 0;
+				}
+
+				// Count the complete events, stopping at the wrap marker
+				uint16_t count = 0;
+				while(count < ring.numEvents && len + sizeof(PublishQueueEventData) <= readLen) {
+					const PublishQueueEventData *eventData = (const PublishQueueEventData *)&buf[len];
+					if (!isValidEventHeader(eventData, readLen - len)) {
+						break;
+					}
+					len += eventData->size;
+					count++;
+				}
+				return count;
+			}
+		}
+
+		return PublishQueueAsyncBase::readRecords(buf, bufSize, len);
+	}
+
+	/**
+	 * @brief Given an address in FRAM, finds the offset of the next event
+	 *
+	 * @param addr Where to start (address in FRAM, not relative to start!)
+	 *
+	 * @param buf Buffer to store the event header in. Typically eventBuf. Only the PublishQueueEventData
+	 * header is read, not the event name and data.
+	 *
+	 * @returns Address of the the next event, or 0 if the event header is not valid
+	 *
+	 * This does not handle wrapping around to the beginning of the circular buffer.
+	 */
+	size_t skipEvent(size_t addr, uint8_t *buf) {
+		PublishQueueEventData *eventDataStruct = (PublishQueueEventData *)buf;
+
+		if (!fram.readData(addr, buf, sizeof(PublishQueueEventData)) || !isValidEventHeader(eventDataStruct, start + dataEnd() - addr)) {
+			PUBLISH_QUEUE_LOG_TRACE("skipEvent invalid event addr=%u", addr);
+			return 0;
+		}
+
+		size_t next = addr + eventDataStruct->size;
+
+		PUBLISH_QUEUE_LOG_TRACE("skipEvent addr=%u next=%u", addr, next);
+
+		return next;
+	}
+
+	/**
+	 * @brief Read an entire event from FRAM
+	 *
+	 * @param addr Address of the event (address in FRAM, not relative to start!)
+	 *
+	 * @param buf Buffer to store the event in, must be EVENT_BUF_SIZE bytes. Typically publishBuf.
+	 *
+	 * @returns true if the event was read or false if it is not valid
+	 */
+	bool readEvent(size_t addr, uint8_t *buf) {
+		PublishQueueEventData *eventDataStruct = (PublishQueueEventData *)buf;
+
+		if (skipEvent(addr, buf) == 0) {
+			return false;
+		}
+
+		fram.readData(addr + sizeof(PublishQueueEventData), &buf[sizeof(PublishQueueEventData)], eventDataStruct->size - sizeof(PublishQueueEventData));
+
+		logPublishQueueEventData(buf);
+
+		return true;
+	}
+
+	/**
+	 * @brief Validates the circular buffer structure by reading every event header
+	 *
+	 * @returns true if head, tail, numEvents, the event headers, and the number of deleted events and
+	 * events in each priority lane are consistent
+	 *
+	 * setup() only checks the queue header and the oldest event so startup time doesn't depend on the
+	 * number of events queued. You can call this after setup() if you want to check the whole queue,
+	 * which reads 16 bytes per event over I2C.
+	 */
+	bool validateBuffer() {
+		StMutexLock lock(this);
+
+		uint16_t counts[PUBLISH_QUEUE_PRIORITY_MAX + 1] = {0};
+		if (!validateRing(header.events, counts) || !validateRing(header.priority, counts) || counts[0] != laneEvents[0]) {
+			return false;
+		}
+		for(uint8_t lane = 1; lane <= PUBLISH_QUEUE_PRIORITY_MAX; lane++) {
+			if (counts[lane] != laneEvents[lane]) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	/**
+	 * @brief Get the number of events in the queue (0 = empty)
+	 */
+	uint16_t getNumEvents() const {
+		uint16_t numEvents = 0;
+
+		{
+			StMutexLock lock(this);
+
+			numEvents = getQueuedEvents();
+		}
+
+		return numEvents;
+	}
+
+	/**
+	 * @brief Gets the number of events and the bytes of FRAM between head and tail
+	 *
+	 * The bytes include the events that are marked as deleted but that head hasn't reached yet, and
+	 * both circular buffers.
+	 */
+	virtual void getQueueUsage(uint32_t &numEvents, uint32_t &numBytes) const {
+		numEvents = getQueuedEvents();
+		numBytes = getRingUsage(header.events) + getRingUsage(header.priority);
+	}
+
+
+protected:
+	/**
+	 * @brief Offset of the first byte of the data area, relative to start (after the header)
+	 */
+	uint16_t dataStart() const { return sizeof(PublishQueueFRAMHeader); }
+
+	/**
+	 * @brief Offset of the end of the data area, relative to start. It's len rounded down to a multiple of 4.
+	 */
+	uint16_t dataEnd() const { return len & ~3; }
+
+	/**
+	 * @brief Offset of the priority area at the end of the data area, relative to start
+	 */
+	uint16_t priorityStart() const { return dataEnd() - prioritySize; }
+
+	/**
+	 * @brief Offset of the first byte of a circular buffer, relative to start
+	 */
+	uint16_t ringStart(const PublishQueueFRAMRing &ring) const { return (&ring == &header.priority) ? priorityStart() : dataStart(); }
+
+	/**
+	 * @brief Offset of the end of a circular buffer, relative to start
+	 */
+	uint16_t ringEnd(const PublishQueueFRAMRing &ring) const { return (&ring == &header.priority) ? dataEnd() : priorityStart(); }
+
+	/**
+	 * @brief Returns the circular buffer for a priority lane
+	 */
+	PublishQueueFRAMRing &getRing(uint8_t lane) { return (lane == 0) ? header.events : header.priority; }
+
+	/**
+	 * @brief Returns the circular buffer an event offset is in
+	 */
+	PublishQueueFRAMRing &getRingAt(uint16_t offset) { return (offset >= priorityStart()) ? header.priority : header.events; }
+
+	/**
+	 * @brief Returns the priority lane of an event in a circular buffer
+	 *
+	 * Events in the normal circular buffer are always sent with normal priority, even if they were
+	 * queued with a priority that didn't fit in the priority area.
+	 */
+	uint8_t getRecordLane(const PublishQueueFRAMRing &ring, const PublishQueueEventData *eventData) const {
+		return (&ring == &header.priority) ? getEventPriority(eventData) : 0;
+	}
+
+	/**
+	 * @brief Returns the priority lane for a record passed to appendRecords()
+	 */
+	uint8_t getAppendLane(const PublishQueueEventData *eventData) const {
+		return (eventData->size <= (size_t)(dataEnd() - priorityStart())) ? getEventPriority(eventData) : 0;
+	}
+
+	/**
+	 * @brief Number of events that are not marked as deleted
+	 */
+	uint16_t getQueuedEvents() const {
+		return header.events.numEvents - header.events.deletedEvents + header.priority.numEvents - header.priority.deletedEvents;
+	}
+
+	/**
+	 * @brief Number of bytes between head and tail of a circular buffer
+	 */
+	uint16_t getRingUsage(const PublishQueueFRAMRing &ring) const {
+		if (ring.numEvents == 0) {
+			return 0;
+		}
+		if (ring.tail > ring.head) {
+			return ring.tail - ring.head;
+		}
+		// Wrapped. This includes the unused space at the end of the circular buffer.
+		return (ringEnd(ring) - ringStart(ring)) - (ring.head - ring.tail);
+	}
+
+	/**
+	 * @brief Write the header from RAM to FRAM
+	 */
+	bool writeHeader() {
+		saveLaneEvents();
+		return fram.writeData(start, (uint8_t *)&header, sizeof(PublishQueueFRAMHeader));
+	}
+
+	/**
+	 * @brief Copies the number of events in each priority lane into the header in RAM
+	 */
+	void saveLaneEvents() {
+		for(uint8_t lane = 1; lane <= PUBLISH_QUEUE_PRIORITY_MAX; lane++) {
+			header.laneEvents[lane - 1] = laneEvents[lane];
+		}
+		header.reserved = 0;
+	}
+
+	/**
+	 * @brief Sets the number of events in each priority lane from the header read in setup()
+	 *
+	 * @returns false if the counts don't match the rings, for example if the device reset while the
+	 * header was being written, in which case countEvents() must be called
+	 */
+	bool loadLaneEvents() {
+		uint32_t priorityEvents = 0;
+
+		laneEvents[0] = header.events.numEvents - header.events.deletedEvents;
+		for(uint8_t lane = 1; lane <= PUBLISH_QUEUE_PRIORITY_MAX; lane++) {
+			laneEvents[lane] = header.laneEvents[lane - 1];
+			laneScan[lane] = 0;
+			priorityEvents += laneEvents[lane];
+		}
+		return priorityEvents == (uint32_t)(header.priority.numEvents - header.priority.deletedEvents);
+	}
+
+	/**
+	 * @brief Returns true if an event with a higher priority than the lane being sent is queued
+	 */
+	virtual bool hasWaitingPriorityEvent() const {
+		if (laneEvents[activeLane] == 0) {
+			return false;
+		}
+		for(uint8_t lane = activeLane + 1; lane <= PUBLISH_QUEUE_PRIORITY_MAX; lane++) {
+			if (laneEvents[lane] != 0) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	/**
+	 * @brief Returns the number of events in the priority lane being sent
+	 */
+	virtual uint16_t getActiveLaneEvents() const {
+		return laneEvents[activeLane];
+	}
+
+	/**
+	 * @brief Given the offset just past the end of an event, returns the offset of the next event
+	 *
+	 * Handles wrapping around to the beginning of the circular buffer, both with an explicit wrap marker
+	 * or because there's not enough room left for an event header. Only call this when there is
+	 * another event, as there is no event at tail.
+	 */
+	uint16_t wrapOffset(const PublishQueueFRAMRing &ring, uint16_t offset) {
+		if ((size_t)(ringEnd(ring) - offset) < sizeof(PublishQueueEventData)) {
+			return ringStart(ring);
+		}
+
+		uint16_t size = 0;
+		fram.readData(start + offset + offsetof(PublishQueueEventData, size), (uint8_t *)&size, sizeof(size));
+		if (size == 0) {
+			return ringStart(ring);
+		}
+		return offset;
+	}
+
+	/**
+	 * @brief Find room for an event of size bytes at tail of a circular buffer
+	 *
+	 * @param ring The circular buffer, header.events or header.priority
+	 *
+	 * @param size Size of the event, including PublishQueueEventData and padding. Must be a multiple of 4.
+	 *
+	 * @param offset Filled in with the offset (relative to start) to store the event at
+	 *
+	 * @returns true if there was room or false if the circular buffer is full.
+	 *
+	 * If the event does not fit at the end of the buffer but does at the beginning, the wrap marker is
+	 * written. On success, tail and numEvents are updated in RAM only. The caller must write the event,
+	 * call eventAdded(), then write the header, before releasing the mutex.
+	 */
+	bool allocateEvent(PublishQueueFRAMRing &ring, size_t size, uint16_t &offset) {
+		if (ring.numEvents == 0) {
+			// Start over at the beginning so there's the maximum amount of contiguous space
+			ring.head = ring.tail = ringStart(ring);
+		}
+
+		if (ring.numEvents > 0 && ring.tail <= ring.head) {
+			// Wrapped (or full when tail == head). Free space is between tail and head.
+			if ((size_t)(ring.head - ring.tail) < size) {
+				return false;
+			}
+			offset = ring.tail;
+		}
+		else
+		if ((size_t)(ringEnd(ring) - ring.tail) >= size) {
+			// Fits between tail and the end of the buffer
+			offset = ring.tail;
+		}
+		else
+		if ((size_t)(ring.head - ringStart(ring)) >= size) {
+			// Fits at the beginning of the buffer
+			if ((size_t)(ringEnd(ring) - ring.tail) >= sizeof(PublishQueueEventData)) {
+				uint16_t wrapMarker = 0;
+				fram.writeData(start + ring.tail + offsetof(PublishQueueEventData, size), (uint8_t *)&wrapMarker, sizeof(wrapMarker));
+			}
+			offset = ringStart(ring);
+		}
+		else {
+			return false;
+		}
+
+		ring.tail = offset + size;
+		ring.numEvents++;
+
+		return true;
+	}
+
+	/**
+	 * @brief Updates the priority lanes after an event is added at tail
+	 *
+	 * @param offset Offset of the event
+	 *
+	 * @param lane Priority of the event
+	 *
+	 * @returns The index of the event in the order the events are sent
+	 *
+	 * The indexes of the withLastValueOnly() events after it are updated. You must hold the mutex to call this.
+	 */
+	uint16_t eventAdded(uint16_t offset, uint8_t lane) {
+		if (laneEvents[lane] == 0) {
+			laneScan[lane] = offset;
+		}
+		uint16_t index = getLaneIndex(lane) + laneEvents[lane];
+		laneEvents[lane]++;
+		lastValueInserted(index);
+		return index;
+	}
+
+	/**
+	 * @brief Chooses the priority lane to send first: the highest priority lane with events
+	 *
+	 * This is only called when no events are being sent, so the events being sent are always the first
+	 * events in the order. The indexes of the withLastValueOnly() events are forgotten if the order
+	 * changes. You must hold the mutex to call this.
+	 */
+	void selectLane() {
+		uint8_t lane = PUBLISH_QUEUE_PRIORITY_MAX;
+		while(lane > 0 && laneEvents[lane] == 0) {
+			lane--;
+		}
+		if (lane != activeLane) {
+			if (laneEvents[activeLane] != 0) {
+				resetLastValues(PublishQueueLastValue::STATE_UNKNOWN);
+			}
+			activeLane = lane;
+		}
+	}
+
+	/**
+	 * @brief Returns the priority lane at a position in the order the events are sent
+	 *
+	 * @param pos 0 for the lane being sent, then the other lanes from the highest priority to the lowest
+	 */
+	uint8_t getLane(uint8_t pos) const {
+		if (pos == 0) {
+			return activeLane;
+		}
+		uint8_t lane = PUBLISH_QUEUE_PRIORITY_MAX + 1 - pos;
+		return (lane <= activeLane) ? lane - 1 : lane;
+	}
+
+	/**
+	 * @brief Returns the priority lane of the oldest event in the order the events are sent
+	 */
+	uint8_t getFirstLane() const {
+		uint8_t lane = activeLane;
+		for(uint8_t pos = 1; pos <= PUBLISH_QUEUE_PRIORITY_MAX && laneEvents[lane] == 0; pos++) {
+			lane = getLane(pos);
+		}
+		return lane;
+	}
+
+	/**
+	 * @brief Returns the index of the oldest event in a priority lane in the order the events are sent
+	 */
+	uint16_t getLaneIndex(uint8_t lane) const {
+		uint16_t index = 0;
+		for(uint8_t pos = 0; getLane(pos) != lane; pos++) {
+			index += laneEvents[getLane(pos)];
+		}
+		return index;
+	}
+
+	/**
+	 * @brief Finds the next event in a priority lane that's not marked as deleted
+	 *
+	 * @param lane The priority lane
+	 *
+	 * @param offset The offset of the event to start at, filled in with the offset of the event found
+	 *
+	 * @param next true to start after the event at offset, whose header must be in eventBuf
+	 *
+	 * @returns true if an event was found. Its header is left in eventBuf.
+	 *
+	 * Reads one event header over I2C for each event checked. You must hold the mutex to call this.
+	 */
+	bool findLaneEvent(uint8_t lane, uint16_t &offset, bool next) {
+		const PublishQueueFRAMRing &ring = getRing(lane);
+		for(uint16_t ii = 0; ii <= ring.numEvents; ii++) {
+			if (next) {
+				uint16_t end = offset + ((PublishQueueEventData *)eventBuf)->size;
+				if (end == ring.tail) {
+					return false;
+				}
+				offset = wrapOffset(ring, end);
+			}
+			if (skipEvent(start + offset, eventBuf) == 0) {
+				return false;
+			}
+			const PublishQueueEventData *eventData = (const PublishQueueEventData *)eventBuf;
+			if ((eventData->recordFlags & PUBLISH_QUEUE_RECORD_FLAG_DELETED) == 0 && getRecordLane(ring, eventData) == lane) {
+				return true;
+			}
+			next = true;
+		}
+		return false;
+	}
+
+	/**
+	 * @brief Finds the oldest event in a priority lane
+	 *
+	 * @returns true if the event was found. Its header is left in eventBuf.
+	 *
+	 * The oldest event with normal priority is always at head. For the other lanes, the search starts
+	 * at the oldest event in the lane found last time, so normally this reads one event header. You must
+	 * hold the mutex to call this.
+	 */
+	bool findLaneHead(uint8_t lane, uint16_t &offset) {
+		offset = (lane != 0 && laneScan[lane] != 0) ? laneScan[lane] : getRing(lane).head;
+		if (!findLaneEvent(lane, offset, false)) {
+			return false;
+		}
+		laneScan[lane] = offset;
+		return true;
+	}
+
+	/**
+	 * @brief Finds the event at index in the order the events are sent
+	 *
+	 * @param index Index of the event. Must be less than getQueuedEvents().
+	 *
+	 * @param offset Filled in with the offset of the event (relative to start)
+	 *
+	 * @returns true if the event was found. Its header is left in eventBuf. If the events don't match the
+	 * counts in the header, the events are counted again, and if they're not valid they're discarded.
+	 * Either way, false is returned. You must hold the mutex to call this.
+	 */
+	bool findEvent(uint16_t index, uint16_t &offset) {
+		for(uint8_t pos = 0; pos <= PUBLISH_QUEUE_PRIORITY_MAX; pos++) {
+			uint8_t lane = getLane(pos);
+			if (index < laneEvents[lane]) {
+				bool found = findLaneHead(lane, offset);
+				for(uint16_t ii = 0; found && ii < index; ii++) {
+					found = findLaneEvent(lane, offset, true);
+				}
+				if (found) {
+					return true;
+				}
+				break;
+			}
+			index -= laneEvents[lane];
+		}
+
+		PUBLISH_QUEUE_LOG_ERROR("FRAM events do not match the header, counting events");
+		if (!countEvents()) {
+			PUBLISH_QUEUE_LOG_ERROR("FRAM event invalid, discarding events");
+			resetEvents();
+		}
+		return false;
+	}
+
+	/**
+	 * @brief Calls a function for each event in the order the events are sent
+	 *
+	 * @param fn Called with the offset and index of each event. The event header is in eventBuf, and fn
+	 * can read the rest of the event into eventBuf. Return false to stop.
+	 *
+	 * You must hold the mutex to call this.
+	 */
+	void forEachRecord(std::function<bool(uint16_t, uint16_t)> fn) {
+		uint16_t index = 0;
+		for(uint8_t pos = 0; pos <= PUBLISH_QUEUE_PRIORITY_MAX; pos++) {
+			uint8_t lane = getLane(pos);
+			uint16_t offset;
+			for(uint16_t ii = 0; ii < laneEvents[lane]; ii++) {
+				if (!((ii == 0) ? findLaneHead(lane, offset) : findLaneEvent(lane, offset, true))) {
+					return;
+				}
+				if (!fn(offset, index++)) {
+					return;
+				}
+			}
+		}
+	}
+
+	/**
+	 * @brief Discards the oldest event in a circular buffer to make room for an event
+	 *
+	 * @param ring The circular buffer the event is being added to
+	 *
+	 * @param priority The priority of the event being queued
+	 *
+	 * @returns true if an event was discarded, or false if there isn't an event that can be discarded
+	 *
+	 * Only discarding the event at head frees space in a circular buffer. If it's being sent, the next
+	 * event is discarded instead, and the event at head is moved into its space. Events with a higher
+	 * priority than the event being queued are not discarded, so normal events never displace priority events.
+	 */
+	bool evictEvent(PublishQueueFRAMRing &ring, uint8_t priority) {
+		StMutexLock lock(this);
+
+		if (ring.numEvents == 0) {
+			return false;
+		}
+
+		uint16_t offset = ring.head;
+		if (skipEvent(start + offset, eventBuf) == 0) {
+			PUBLISH_QUEUE_LOG_ERROR("FRAM event invalid in evictEvent, discarding events");
+			resetEvents();
+			return true;
+		}
+
+		// The oldest event in a lane is always the first one in its circular buffer
+		uint8_t lane = getRecordLane(ring, (PublishQueueEventData *)eventBuf);
+		if (isSending && lane == getFirstLane()) {
+			if (!discardAfterHead(ring, priority)) {
+				return false;
+			}
+		}
+		else {
+			if (lane > priority) {
+				return false;
+			}
+
+			uint16_t index = getLaneIndex(lane);
+			PUBLISH_QUEUE_LOG_TRACE("discarding event index=%u to make room", index);
+
+			if (!removeEvent(ring, offset)) {
+				PUBLISH_QUEUE_LOG_ERROR("FRAM event invalid in evictEvent, discarding events");
+				resetEvents();
+				return true;
+			}
+			countDiscardedEvent(index);
+		}
+		writeHeader();
+		metrics.evicted++;
+		return true;
+	}
+
+	/**
+	 * @brief Discards the event after the event at head and moves the event at head into its space
+	 *
+	 * @param ring The circular buffer
+	 *
+	 * @param priority Events with a higher priority than this are not discarded
+	 *
+	 * @returns true if an event was discarded
+	 *
+	 * This frees space while the event at head is being sent by moving one event, instead of the rest
+	 * of the circular buffer. If the next event wrapped around to the beginning of the buffer, events are
+	 * discarded from the beginning until there's room to move the event at head there. Deleted events
+	 * in the space are removed as well. The header is only updated in RAM. You must hold the mutex to call this.
+	 */
+	bool discardAfterHead(PublishQueueFRAMRing &ring, uint8_t priority) {
+		if (ring.numEvents - ring.deletedEvents < 2) {
+			return false;
+		}
+
+		PublishQueueEventData *eventData = (PublishQueueEventData *)eventBuf;
+		uint16_t head = ring.head;
+		if (skipEvent(start + head, eventBuf) == 0) {
+			return false;
+		}
+		uint16_t headSize = eventData->size;
+		uint8_t headLane = getRecordLane(ring, eventData);
+
+		// Find the next event that's not deleted, or the end of the buffer
+		uint16_t offset = head;
+		uint16_t size = headSize;
+		uint16_t deletedEvents = 0;
+		while(true) {
+			if (offset + size == ring.tail) {
+				return false;
+			}
+			uint16_t next = wrapOffset(ring, offset + size);
+			if (next != offset + size) {
+				break;
+			}
+			offset = next;
+			if (skipEvent(start + offset, eventBuf) == 0) {
+				return false;
+			}
+			size = eventData->size;
+			if ((eventData->recordFlags & PUBLISH_QUEUE_RECORD_FLAG_DELETED) == 0) {
+				// The event to discard is next to head
+				uint8_t lane = getRecordLane(ring, eventData);
+				if (lane > priority) {
+					return false;
+				}
+				uint16_t newHead = offset + size - headSize;
+				fram.moveData(start + head, start + newHead, headSize);
+
+				ring.head = newHead;
+				ring.numEvents -= 1 + deletedEvents;
+				ring.deletedEvents -= deletedEvents;
+				forgetLaneScan(head, offset + size);
+				eventRemoved(lane, headLane);
+				return true;
+			}
+			deletedEvents++;
+		}
+
+		// The events after head up to the end of the buffer are deleted. Check that the events at the
+		// beginning that need to be discarded to fit the event at head can be discarded.
+		uint16_t first = ringStart(ring);
+		uint16_t end = first;
+		uint16_t numEvents = 0;
+		while(end - first < headSize && end != ring.tail) {
+			if (skipEvent(start + end, eventBuf) == 0) {
+				return false;
+			}
+			if ((eventData->recordFlags & PUBLISH_QUEUE_RECORD_FLAG_DELETED) == 0 && getRecordLane(ring, eventData) > priority) {
+				return false;
+			}
+			end += eventData->size;
+			numEvents++;
+		}
+
+		for(uint16_t cur = first; cur < end; cur += eventData->size) {
+			skipEvent(start + cur, eventBuf);
+			if ((eventData->recordFlags & PUBLISH_QUEUE_RECORD_FLAG_DELETED) == 0) {
+				eventRemoved(getRecordLane(ring, eventData), headLane);
+			}
+			else {
+				ring.deletedEvents--;
+			}
+		}
+
+		// Only the event at head is left between the beginning and tail if the space is smaller than it
+		uint16_t newHead = (end - first >= headSize) ? end - headSize : first;
+		fram.moveData(start + head, start + newHead, headSize);
+
+		ring.head = newHead;
+		if (end == ring.tail && newHead == first) {
+			ring.tail = first + headSize;
+		}
+		ring.numEvents -= numEvents + deletedEvents;
+		ring.deletedEvents -= deletedEvents;
+		forgetLaneScan(head, ringEnd(ring));
+		forgetLaneScan(first, end);
+		return true;
+	}
+
+	/**
+	 * @brief Updates the counts after discardAfterHead() discards an event
+	 *
+	 * @param lane The priority lane of the event discarded
+	 *
+	 * @param headLane The priority lane of the event at head, which is the oldest event in its lane
+	 */
+	void eventRemoved(uint8_t lane, uint8_t headLane) {
+		uint16_t index = getLaneIndex(lane) + ((lane == headLane) ? 1 : 0);
+		PUBLISH_QUEUE_LOG_TRACE("discarding event index=%u to make room", index);
+		laneEvents[lane]--;
+		countDiscardedEvent(index);
+
+		// The event at head moved
+		forgetLastValuePositions();
+	}
+
+	/**
+	 * @brief Removes the event at offset
+	 *
+	 * @param ring The circular buffer the event is in
+	 *
+	 * @param offset Offset of the event to remove. Its header must be in eventBuf.
+	 *
+	 * @returns false if an event header is not valid
+	 *
+	 * If the event is at head, head is advanced past it and any deleted events after it. Otherwise, the
+	 * event is marked as deleted in FRAM, which is a 2-byte write. The counts are updated in RAM. The
+	 * caller must write the header before releasing the mutex. You must hold the mutex to call this.
+	 */
+	bool removeEvent(PublishQueueFRAMRing &ring, uint16_t offset) {
+		PublishQueueEventData *eventData = (PublishQueueEventData *)eventBuf;
+		laneEvents[getRecordLane(ring, eventData)]--;
+
+		if (offset != ring.head) {
+			// The flag isn't included in the crc, so the rest of the event doesn't change
+			uint16_t recordFlags = eventData->recordFlags | PUBLISH_QUEUE_RECORD_FLAG_DELETED;
+			fram.writeData(start + offset + offsetof(PublishQueueEventData, recordFlags), (uint8_t *)&recordFlags, sizeof(recordFlags));
+			ring.deletedEvents++;
+			return true;
+		}
+
+		uint16_t size = eventData->size;
+		while(true) {
+			ring.numEvents--;
+			forgetLaneScan(offset, offset + 1);
+			if (ring.numEvents == 0) {
+				ring.head = ring.tail = ringStart(ring);
+				return true;
+			}
+			offset = wrapOffset(ring, offset + size);
+			if (ring.deletedEvents == 0) {
+				break;
+			}
+			if (skipEvent(start + offset, eventBuf) == 0) {
+				return false;
+			}
+			if ((eventData->recordFlags & PUBLISH_QUEUE_RECORD_FLAG_DELETED) == 0) {
+				break;
+			}
+			size = eventData->size;
+			ring.deletedEvents--;
+		}
+		ring.head = offset;
+		return true;
+	}
+
+	/**
+	 * @brief Stops using offsets from first up to end as the place to start looking for the oldest
+	 * event in a lane, because head moved past them
+	 */
+	void forgetLaneScan(uint16_t first, uint16_t end) {
+		for(uint8_t lane = 0; lane <= PUBLISH_QUEUE_PRIORITY_MAX; lane++) {
+			if (laneScan[lane] >= first && laneScan[lane] < end) {
+				laneScan[lane] = 0;
+			}
+		}
+	}
+
+	/**
+	 * @brief Finds the unsent event with the name of a withLastValueOnly() entry
+	 *
+	 * @returns true if the event was found. lastValue->index and lastValue->pos are its index and offset,
+	 * and its header is in eventBuf.
+	 *
+	 * The remembered offset is checked by reading the event header and name. The unsent events are only
+	 * searched if the state is unknown or the remembered event has a different name, so normally
+	 * this reads one event header over I2C. You must hold the mutex to call this.
+	 */
+	bool findLastValueEvent(PublishQueueLastValue *lastValue) {
+		uint16_t first = getFirstUnsentIndex();
+		uint16_t offset;
+
+		if (lastValue->state == PublishQueueLastValue::STATE_QUEUED) {
+			if (lastValue->index < first) {
+				// The newest event with this name is being sent
+				return false;
+			}
+			if (lastValue->index < getQueuedEvents()) {
+				if (lastValue->pos != PublishQueueLastValue::POS_UNKNOWN) {
+					offset = (uint16_t) lastValue->pos;
+				}
+				else
+				if (!findEvent((uint16_t) lastValue->index, offset)) {
+					offset = 0;
+				}
+				if (offset >= dataStart() && readEventName(offset) && isLastValueEvent(lastValue, (PublishQueueEventData *)eventBuf)) {
+					lastValue->pos = offset;
+					return true;
+				}
+			}
+		}
+		else
+		if (lastValue->state == PublishQueueLastValue::STATE_NONE) {
+			return false;
+		}
+
+		// Search the unsent events for the newest one with this name
+		lastValue->state = PublishQueueLastValue::STATE_NONE;
+		if (first < getQueuedEvents()) {
+			forEachRecord([&](uint16_t offset, uint16_t index) {
+				// The event header is already in eventBuf, so only the name is read
+				uint8_t nameLen = ((PublishQueueEventData *)eventBuf)->nameLen;
+				if (index >= first && fram.readData(start + offset + sizeof(PublishQueueEventData), &eventBuf[sizeof(PublishQueueEventData)], nameLen + 1) &&
+					isLastValueEvent(lastValue, (PublishQueueEventData *)eventBuf)) {
+					lastValue->state = PublishQueueLastValue::STATE_QUEUED;
+					lastValue->index = index;
+					lastValue->pos = offset;
+				}
+				return true;
+			});
+		}
+		if (lastValue->state != PublishQueueLastValue::STATE_QUEUED) {
+			return false;
+		}
+
+		// Leave the header of the event that was found in eventBuf
+		return readEventName((uint16_t) lastValue->pos);
+	}
+
+	/**
+	 * @brief Reads the event header and event name at offset (relative to start) into eventBuf
+	 *
+	 * @returns false if the event header is not valid
+	 */
+	bool readEventName(uint16_t offset) {
+		if (skipEvent(start + offset, eventBuf) == 0) {
+			return false;
+		}
+		uint8_t nameLen = ((PublishQueueEventData *)eventBuf)->nameLen;
+		return fram.readData(start + offset + sizeof(PublishQueueEventData), &eventBuf[sizeof(PublishQueueEventData)], nameLen + 1);
+	}
+
+	/**
+	 * @brief Checks one circular buffer in the persisted header at startup
+	 *
+	 * @returns true if head and tail are within the circular buffer and aligned, numEvents and the deleted
+	 * count are possible, and the oldest event header is valid and not deleted
+	 *
+	 * Only the queue header and the oldest event header are read, so setup() takes the same amount of
+	 * time regardless of the number of events. If a later event turns out to be invalid when it's
+	 * reached, the events are discarded then. validateBuffer() checks every event header.
+	 */
+	bool validateHeader(PublishQueueFRAMRing &ring) {
+		uint16_t first = ringStart(ring);
+		uint16_t end = ringEnd(ring);
+		if (ring.head < first || ring.head > end || (ring.head % 4) != 0 ||
+			ring.tail < first || ring.tail > end || (ring.tail % 4) != 0) {
+			return false;
+		}
+
+		if (ring.deletedEvents > ring.numEvents) {
+			return false;
+		}
+
+		if (ring.numEvents == 0) {
+			ring.head = ring.tail = first;
+			return ring.deletedEvents == 0;
+		}
+
+		if (ring.numEvents > (end - first) / getEventSize(0, 0) || (size_t)(end - ring.head) < sizeof(PublishQueueEventData)) {
+			return false;
+		}
+
+		size_t next = skipEvent(start + ring.head, eventBuf);
+		if (next == 0 || next - start > end || (ring.head < ring.tail && next - start > ring.tail)) {
+			return false;
+		}
+		if ((((PublishQueueEventData *)eventBuf)->recordFlags & PUBLISH_QUEUE_RECORD_FLAG_DELETED) != 0) {
+			return false;
+		}
+
+		return true;
+	}
+
+	/**
+	 * @brief Reads every event header in a circular buffer for validateBuffer()
+	 *
+	 * @param counts Incremented for each event that's not deleted, by priority lane
+	 */
+	bool validateRing(const PublishQueueFRAMRing &ring, uint16_t *counts) {
+		uint16_t first = ringStart(ring);
+		uint16_t end = ringEnd(ring);
+		if (ring.head < first || ring.head > end || (ring.head % 4) != 0 ||
+			ring.tail < first || ring.tail > end || (ring.tail % 4) != 0) {
+			return false;
+		}
+
+		uint16_t deletedEvents = 0;
+		uint16_t offset = ring.head;
+		for(uint16_t ii = 0; ii < ring.numEvents; ii++) {
+			if (ii > 0) {
+				offset = wrapOffset(ring, offset);
+			}
+			size_t next = skipEvent(start + offset, eventBuf);
+			if (next == 0 || next - start > end) {
+				// Overflowed buffer, must be corrupted
+				return false;
+			}
+			const PublishQueueEventData *eventData = (const PublishQueueEventData *)eventBuf;
+			if ((eventData->recordFlags & PUBLISH_QUEUE_RECORD_FLAG_DELETED) != 0) {
+				if (ii == 0) {
+					// head is never a deleted event
+					return false;
+				}
+				deletedEvents++;
+			}
+			else {
+				uint8_t lane = getRecordLane(ring, eventData);
+				if (&ring == &header.priority && lane == 0) {
+					return false;
+				}
+				counts[lane]++;
+			}
+			offset = next - start;
+		}
+
+		return deletedEvents == ring.deletedEvents && offset == ((ring.numEvents == 0) ? ring.head : ring.tail);
+	}
+
+	/**
+	 * @brief Counts the deleted events and the events in each priority lane by reading every event header
+	 *
+	 * @returns false if an event header is not valid
+	 *
+	 * This is done in setup() if the header was recovered or the counts in the header don't match the
+	 * rings, and if the events don't match the counts. Deleted events at head are removed. The header is
+	 * written if it changed. You must hold the mutex to call this.
+	 */
+	bool countEvents() {
+		PublishQueueFRAMHeader oldHeader = header;
+
+		for(uint8_t lane = 0; lane <= PUBLISH_QUEUE_PRIORITY_MAX; lane++) {
+			laneEvents[lane] = laneScan[lane] = 0;
+		}
+
+		PublishQueueFRAMRing *rings[2] = { &header.events, &header.priority };
+		for(size_t jj = 0; jj < 2; jj++) {
+			PublishQueueFRAMRing &ring = *rings[jj];
+			ring.deletedEvents = 0;
+
+			uint16_t offset = ring.head;
+			uint16_t numEvents = ring.numEvents;
+			bool atHead = true;
+			for(uint16_t ii = 0; ii < numEvents; ii++) {
+				if (ii > 0) {
+					offset = wrapOffset(ring, offset);
+				}
+				size_t next = skipEvent(start + offset, eventBuf);
+				if (next == 0) {
+					return false;
+				}
+				const PublishQueueEventData *eventData = (const PublishQueueEventData *)eventBuf;
+				if ((eventData->recordFlags & PUBLISH_QUEUE_RECORD_FLAG_DELETED) == 0) {
+					uint8_t lane = getRecordLane(ring, eventData);
+					if (&ring == &header.priority && lane == 0) {
+						return false;
+					}
+					if (laneEvents[lane]++ == 0) {
+						laneScan[lane] = offset;
+					}
+					atHead = false;
+				}
+				else
+				if (atHead) {
+					// Remove it by advancing head
+					ring.numEvents--;
+					ring.head = (ring.numEvents == 0) ? ringStart(ring) : wrapOffset(ring, next - start);
+				}
+				else {
+					ring.deletedEvents++;
+				}
+				offset = next - start;
+			}
+			if (ring.numEvents == 0) {
+				ring.head = ring.tail = ringStart(ring);
+			}
+		}
+
+		resetLastValues(PublishQueueLastValue::STATE_UNKNOWN);
+
+		saveLaneEvents();
+		if (memcmp(&oldHeader, &header, sizeof(PublishQueueFRAMHeader)) != 0) {
+			PUBLISH_QUEUE_LOG_INFO("FRAM counted numEvents=%u deleted=%u priority=%u", getQueuedEvents(), header.events.deletedEvents + header.priority.deletedEvents, getQueuedEvents() - laneEvents[0]);
+			return writeHeader();
+		}
+		return true;
+	}
+
+	/**
+	 * @brief Keeps the events in a circular buffer from head up to the first event that's not valid
+	 *
+	 * @returns false if there are no valid events to keep, in which case the circular buffer is empty
+	 *
+	 * This is used when validateHeader() fails, typically because the device reset while the header
+	 * was being written. Only the event headers are read, from head until tail, numEvents events, or an
+	 * invalid event header, so it reads 16 bytes per event over I2C. Then the whole newest event is read
+	 * and kept only if its crc matches, since an event being added is the most likely to be partially
+	 * written. Events that were being overwritten or moved can be partially written too, so the crc of
+	 * every event is also checked when getOldestEvent() reads it to be sent. The header is only updated
+	 * in RAM; setup() counts the events and writes it. You must hold the mutex to call this.
+	 */
+	bool recoverEvents(PublishQueueFRAMRing &ring) {
+		uint16_t first = ringStart(ring);
+		uint16_t end = ringEnd(ring);
+
+		uint16_t offset = ring.head;
+		uint16_t lastOffset = offset;
+		uint16_t numEvents = 0;
+		size_t used = 0;
+		if (ring.head >= first && (size_t)(ring.head + sizeof(PublishQueueEventData)) <= end && (ring.head % 4) == 0) {
+			while(numEvents < ring.numEvents) {
+				if (numEvents > 0) {
+					if (offset == ring.tail) {
+						break;
+					}
+					offset = wrapOffset(ring, offset);
+				}
+				size_t next = skipEvent(start + offset, eventBuf);
+				if (next == 0 || next - start > end) {
+					break;
+				}
+				uint16_t size = ((PublishQueueEventData *)eventBuf)->size;
+				if (used + size > (size_t)(end - first)) {
+					break;
+				}
+				used += size;
+				lastOffset = offset;
+				offset += size;
+				numEvents++;
+			}
+		}
+
+		if (numEvents > 0 && (!readEvent(start + lastOffset, eventBuf) || !isValidEvent((PublishQueueEventData *)eventBuf, EVENT_BUF_SIZE))) {
+			PUBLISH_QUEUE_LOG_INFO("event invalid at offset=%u index=%u", (unsigned)lastOffset, (unsigned)(numEvents - 1));
+			numEvents--;
+			offset = lastOffset;
+		}
+
+		ring.deletedEvents = 0;
+		if (numEvents == 0) {
+			ring.numEvents = 0;
+			ring.head = ring.tail = first;
+			return false;
+		}
+
+		ring.numEvents = numEvents;
+		ring.tail = offset;
+		return true;
+	}
+
+	/**
+	 * @brief Discards all events and writes the header. You must hold the mutex to call this.
+	 */
+	void resetEvents() {
+		resetLanes();
+		writeHeader();
+		resetLastValues(PublishQueueLastValue::STATE_NONE);
+	}
+
+	/**
+	 * @brief Sets the header and priority lanes in RAM to an empty queue
+	 */
+	void resetLanes() {
+		header.events.numEvents = header.events.deletedEvents = 0;
+		header.events.head = header.events.tail = dataStart();
+		header.priority.numEvents = header.priority.deletedEvents = 0;
+		header.priority.head = header.priority.tail = priorityStart();
+		for(uint8_t lane = 0; lane <= PUBLISH_QUEUE_PRIORITY_MAX; lane++) {
+			laneEvents[lane] = laneScan[lane] = 0;
+		}
+	}
+
+	/**
+	 * @brief Converts the events in FRAM from 0.2.x and earlier to the circular layout with version 2 event records
+	 *
+	 * @returns true if the events were converted or false if they were not valid
+	 *
+	 * The header is 24 bytes larger and each event is 8 bytes larger after conversion, and the priority
+	 * area at the end is not used for the converted events. If the FRAM is full, the oldest events are
+	 * discarded to make room. The old events are moved to the end of the normal circular buffer and
+	 * converted into place from the beginning, so no extra RAM is required. If power is lost during
+	 * conversion, the queue is lost.
+	 */
+	bool convertEventsV1() {
+		const PublishQueueHeader *oldHeader = (const PublishQueueHeader *)&header;
+		uint16_t oldNumEvents = oldHeader->numEvents;
+		uint16_t numEvents = oldNumEvents;
+
+		size_t first = sizeof(PublishQueueHeader);
+
+		size_t cur = first;
+		for(uint16_t ii = 0; ii < numEvents; ii++) {
+			size_t srcSize;
+			if (readEventV1(cur, len, srcSize) == 0) {
+				return false;
+			}
+			cur += srcSize;
+		}
+
+		// Discard the oldest events if they won't fit after conversion
+		const size_t growth = sizeof(PublishQueueEventData) - PUBLISH_QUEUE_EVENT_DATA_V1_SIZE;
+		size_t avail = priorityStart() - dataStart();
+		size_t used = cur - first;
+		while(numEvents > 0 && used + numEvents * growth > avail) {
+			size_t srcSize;
+			readEventV1(first, len, srcSize);
+			first += srcSize;
+			used -= srcSize;
+			numEvents--;
+		}
+
+		// Move the old events to the end, then convert them into place. Since the converted events
+		// all fit, the converted events never overwrite old events that have not been converted yet.
+		size_t src = priorityStart() - used;
+		if (used > 0 && src != first) {
+			fram.moveData(start + first, start + src, used);
+		}
+
+		size_t dst = dataStart();
+		for(uint16_t ii = 0; ii < numEvents; ii++) {
+			size_t srcSize;
+			size_t size = readEventV1(src, priorityStart(), srcSize);
+			fram.writeData(start + dst, publishBuf, size);
+			src += srcSize;
+			dst += size;
+		}
+
+		header.magic = PUBLISH_QUEUE_FRAM_HEADER_MAGIC;
+		header.size = len;
+		header.prioritySize = prioritySize;
+		resetLanes();
+		header.events.numEvents = laneEvents[0] = numEvents;
+		header.events.tail = dst;
+		writeHeader();
+
+		PUBLISH_QUEUE_LOG_INFO("converted FRAM from 0.2.x numEvents=%u discarded=%u", numEvents, oldNumEvents - numEvents);
+
+		return true;
+	}
+
+	/**
+	 * @brief Reads a version 1 event from FRAM into eventBuf and converts it into publishBuf
+	 *
+	 * @param offset Offset of the event, relative to start
+	 *
+	 * @param end Offset of the end of the version 1 data, relative to start
+	 *
+	 * @param srcSize Filled in with the size of the version 1 event in FRAM
+	 *
+	 * @returns The size of the converted event, or 0 if the event is not valid
+	 */
+	size_t readEventV1(size_t offset, size_t end, size_t &srcSize) {
+		if (offset >= end) {
+			return 0;
+		}
+		size_t count = end - offset;
+		if (count > EVENT_BUF_SIZE) {
+			count = EVENT_BUF_SIZE;
+		}
+		if (!fram.readData(start + offset, eventBuf, count)) {
+			return 0;
+		}
+		return convertEventDataV1(eventBuf, count, publishBuf, srcSize);
+	}
+
+	MB85RC &fram;		//!< Object for the FRAM
+	size_t start;		//!< Start offset (0 = beginning of FRAM)
+	size_t len;			//!< Length to use (relative to start!)
+	size_t prioritySize;	//!< Bytes at the end of the FRAM area for priority events (withPrioritySize)
+
+	/**
+	 * @brief The header, copied from FRAM
+	 */
+	PublishQueueFRAMHeader header;
+
+
+	uint16_t laneEvents[PUBLISH_QUEUE_PRIORITY_MAX + 1] = {0};	//!< Number of events in each priority lane, not including deleted events
+	uint16_t laneScan[PUBLISH_QUEUE_PRIORITY_MAX + 1] = {0};	//!< Offset of an event at or before the oldest event in each priority lane, 0 to start at head
+	uint8_t activeLane = 0;			//!< Priority lane sent first, chosen by selectLane()
+
+	/**
+	 * @brief This holds a single event during scanning and writing.
+	 *
+	 * Because the data needs to be in RAM to be written to FRAM, this buffer is required.
+	 */
+	uint8_t eventBuf[EVENT_BUF_SIZE] __attribute__((aligned(4)));
+
+	/**
+	 * @brief This holds a single event during publish.
+	 *
+	 * Because the publish code does not copy the data, we need to keep the data around
+	 * even after getOldestEvent() returns. This is the buffer that holds the data.
+	 *
+	 * It's separate from eventBuf because eventBuf is used to publish new data to the queue.
+	 */
+	uint8_t publishBuf[EVENT_BUF_SIZE] __attribute__((aligned(4)));
+};
+
+#endif /* __MB85RC256V_FRAM_RK */
+
+
+#if defined(__SPIFFSPARTICLERK_H) || defined(SdFat_h) || defined(DOXYGEN_BUILD) || defined(HAL_PLATFORM_FILESYSTEM)
+#ifndef PUBLISH_QUEUE_USE_FS
+#define PUBLISH_QUEUE_USE_FS
+#endif
+#endif
+
+#ifdef PUBLISH_QUEUE_USE_FS
+// This section is for file system-based storage methods (SPIFFS, SdFat, etc.)
+
+/**
+ * @brief Abstract base class for file system-based storage
+ */
+class PublishQueueAsyncFileSystemBase : public PublishQueueAsyncBase {
+public:
+	/**
+	 * @brief Abstract base constructor. Doesn't do anything.
+	 */
+	PublishQueueAsyncFileSystemBase() {
+	}
+
+	/**
+	 * @brief Abstract base destructor. Doesn't do anything.
+	 */
+	virtual ~PublishQueueAsyncFileSystemBase() {
+
+	}
+	/**
+	 * @brief Open the events file
+	 */
+	virtual bool openFile() = 0;
+
+	/**
+	 * @brief Close the events file
+	 */
+	virtual bool closeFile() = 0;
+
+	/**
+	 * @brief Truncate a file to a specified length in bytes
+	 *
+	 * @param size Size is bytes. Must be <= the current length of the file.
+	 *
+	 * Note: Do not use truncate to make the file larger! While this works for POSIX, it
+	 * does not work for SPIFFS so we just always assumes it does not work.
+	 */
+	virtual bool truncate(size_t size) = 0;
+
+	/**
+	 * @brief Read bytes from the file
+	 *
+	 * @param seekTo The file offset to seek to if >= 0. Must be <= file length. Or pass
+	 * -1 to seek to the end of the file to append.
+	 *
+	 * @param buffer Buffer to fill with data
+	 *
+	 * @param length Number of bytes to read. Can be > than the number of bytes in the file.
+	 *
+	 * @returns Number of bytes read. Returns 0 on error.
+	 */
+	virtual size_t readBytes(int seekTo, uint8_t *buffer, size_t length) = 0;
+
+	/**
+	 * @brief Write bytes to the file
+	 *
+	 * @param seekTo The file offset to seek to if >= 0. Must be <= file length. Or pass
+	 * -1 to seek to the end of the file to append.
+	 *
+	 * @param buffer Buffer to write to the file
+	 *
+	 * @param length Number of bytes to write.
+	 */
+	virtual size_t writeBytes(int seekTo, const uint8_t *buffer, size_t length) = 0;
+
+	/**
+	 * @brief Get length of the file (or a negative error code on error)
+	 */
+	virtual int getLength() = 0;
+
+	/**
+	 * @brief Write any data buffered by the file system to the storage media
+	 *
+	 * This is only used when the events file is kept open (withKeepFileOpen). The default
+	 * implementation does nothing and returns true.
+	 */
+	virtual bool syncFile() { return true; };
+
+	/**
+	 * @brief Remove the file for the selected segment. The file must be closed.
+	 *
+	 * This is only used when events are stored in segment files (withSegmentSize). The default
+	 * implementation does nothing and returns false.
+	 */
+	virtual bool removeFile() { return false; };
+
+	/**
+	 * @brief Returns true if the file for the selected segment exists
+	 *
+	 * This is used to avoid creating the priority file when there isn't one. The default
+	 * implementation returns true, so the file is opened (and created) to check it.
+	 */
+	virtual bool fileExists() { return true; };
+
+	/**
+	 * @brief Keep the events file open between operations (default: false)
+	 *
+	 * @param value true to keep the file open, false to open and close it for each operation
+	 *
+	 * By default, the events file is opened and closed for every publish, event retrieval, and discard.
+	 * This is the most robust, but the open and close (path lookup, loading the file metadata, and
+	 * flushing) can take much longer than the actual read or write.
+	 *
+	 * When the file is kept open, the data is written to the storage media based on the sync policy
+	 * set by withSyncEveryWrites() and withSyncIntervalMs(), or when you call sync(). By default the
+	 * file is synced after every operation that modifies it, which is as durable as closing the file.
+	 *
+	 * This should be called before setup().
+	 */
+	inline PublishQueueAsyncFileSystemBase &withKeepFileOpen(bool value = true) { keepFileOpen = value; return *this; };
+
+	/**
+	 * @brief When the file is kept open, sync after this many modifications (default: 1)
+	 *
+	 * @param value Number of publishes and discards before syncing, or 0 to not sync based on the
+	 * number of modifications.
+	 *
+	 * Larger values are faster, but if the device is reset the events queued or discarded since the
+	 * last sync may be lost, or events that have been sent may be sent again.
+	 */
+	inline PublishQueueAsyncFileSystemBase &withSyncEveryWrites(uint16_t value) { syncEveryWrites = value; return *this; };
+
+	/**
+	 * @brief When the file is kept open, sync modifications after this many milliseconds (default: 0)
+	 *
+	 * @param value Time in milliseconds, or 0 to not sync based on time.
+	 *
+	 * The time is checked from the publish queue thread so the file is synced even if there are no
+	 * more publishes.
+	 */
+	inline PublishQueueAsyncFileSystemBase &withSyncIntervalMs(unsigned long value) { syncIntervalMs = value; return *this; };
+
+	/**
+	 * @brief Write any modifications to the events file to the storage media now
+	 *
+	 * @returns true if the file was synced or there was nothing to sync
+	 *
+	 * Call this before going into sleep mode or resetting the device if you have kept the file open
+	 * and set a sync policy that does not sync on every modification. Does nothing if the events file
+	 * is not kept open, as the file is closed after every operation.
+	 */
+	bool sync() {
+		if (!haveSetup) {
+			return false;
+		}
+
+		StMutexLock lock(this);
+
+		return syncIfModified();
+	}
+
+	/**
+	 * @brief Opens the events file if it is not already open. Used by StFileOpenClose.
+	 *
+	 * Note: You must obtain a mutex lock before calling this!
+	 */
+	bool beginFileAccess() {
+		if (!fileIsOpen) {
+			fileIsOpen = openFile();
+		}
+		return fileIsOpen;
+	}
+
+	/**
+	 * @brief Selects the segment file that openFile() opens
+	 *
+	 * @param segment The segment number, or 0 for the events file itself
+	 *
+	 * If a different segment file is open, it's closed first.
+	 *
+	 * Note: You must obtain a mutex lock before calling this!
+	 */
+	void selectSegment(uint32_t segment) {
+		if (segment != fileSegment) {
+			if (fileIsOpen) {
+				closeFile();
+				fileIsOpen = false;
+			}
+			// Closing the file writes any changes
+			unsyncedWrites = 0;
+			fileSegment = segment;
+		}
+	}
+
+	/**
+	 * @brief Selects a segment file and opens it
+	 *
+	 * Note: You must obtain a mutex lock before calling this!
+	 */
+	bool openSegment(uint32_t segment) {
+		selectSegment(segment);
+		return beginFileAccess();
+	}
+
+	/**
+	 * @brief Closes the events file, or if keeping it open, syncs it if required by the sync policy. Used by StFileOpenClose.
+	 *
+	 * Note: You must obtain a mutex lock before calling this!
+	 */
+	void endFileAccess() {
+		if (!keepFileOpen) {
+			if (fileIsOpen) {
+				closeFile();
+				fileIsOpen = false;
+			}
+			unsyncedWrites = 0;
+			return;
+		}
+
+		if (unsyncedWrites != 0 &&
+			((syncEveryWrites != 0 && unsyncedWrites >= syncEveryWrites) || (syncIntervalMs != 0 && millis() - lastSync >= syncIntervalMs))) {
+			syncIfModified();
+		}
+	}
+
+protected:
+	/**
+	 * @brief Syncs the events file if it's open and has been modified since the last sync
+	 *
+	 * Note: You must obtain a mutex lock before calling this!
+	 */
+	bool syncIfModified() {
+		bool result = true;
+
+		if (fileIsOpen && unsyncedWrites != 0) {
+			result = syncFile();
+			if (!result) {
+				PUBLISH_QUEUE_LOG_ERROR("failed to sync events file");
+			}
+		}
+		unsyncedWrites = 0;
+		lastSync = millis();
+
+		return result;
+	}
+
+	/**
+	 * @brief Syncs the events file from the publish queue thread when syncIntervalMs has elapsed
+	 */
+	virtual void threadTasks() {
+		// unsyncedWrites is checked without the mutex so the idle thread doesn't contend for it
+		if (unsyncedWrites != 0 && syncIntervalMs != 0 && millis() - lastSync >= syncIntervalMs) {
+			StMutexLock lock(this);
+
+			syncIfModified();
+		}
+	}
+
+	/**
+	 * @brief Returns the time until the events file should be synced, if there are unsynced writes
+	 */
+	virtual system_tick_t getThreadTasksWaitMs() {
+		if (unsyncedWrites == 0 || syncIntervalMs == 0) {
+			return CONCURRENT_WAIT_FOREVER;
+		}
+		unsigned long elapsed = millis() - lastSync;
+		return (elapsed < syncIntervalMs) ? syncIntervalMs - elapsed : 0;
+	}
+
+	/**
+	 * @brief Gets the filename of the selected segment
+	 *
+	 * @param filename The events filename
+	 *
+	 * For segment 0 this is the events filename. Other segments append a period and the segment number,
+	 * and the priority file (PRIORITY_SEGMENT) appends .p.
+	 */
+	String getSegmentFilename(const char *filename) const {
+		if (fileSegment == 0) {
+			return String(filename);
+		}
+		if (fileSegment == PRIORITY_SEGMENT) {
+			return String::format("%s.p", filename);
+		}
+		return String::format("%s.%lu", filename, (unsigned long)fileSegment);
+	}
+
+	static const uint32_t PRIORITY_SEGMENT = 0xfffffffe;	//!< Segment number of the file events with a priority above 0 are stored in
+
+	uint32_t fileSegment = 0;			//!< Segment number of the file that openFile() opens (0 = the events file)
+	bool keepFileOpen = false;			//!< Keep the events file open between operations
+	bool fileIsOpen = false;			//!< The events file is currently open
+	uint16_t syncEveryWrites = 1;		//!< When keeping the file open, sync after this many modifications (0 = never)
+	uint16_t unsyncedWrites = 0;		//!< Number of modifications since the last sync
+	unsigned long syncIntervalMs = 0;	//!< When keeping the file open, sync modifications after this many milliseconds (0 = never)
+	unsigned long lastSync = 0;			//!< millis() value of the last sync
+};
+
+/**
+ * @brief Class to automatically open and close the events file. Create as a variable on the stack.
+ *
+ * This is used to make sure the file is always closed, for example if there is a return
+ * statement in the middle of the function. When the stack variable goes out of scope it will
+ * always close the file.
+ *
+ * If the file is kept open (withKeepFileOpen), the file is only opened the first time and is
+ * synced instead of closed, based on the sync policy.
+ */
+class StFileOpenClose {
+public:
+	/**
+	 * @brief Constructor opens the events file
+	 */
+	StFileOpenClose(PublishQueueAsyncFileSystemBase *fs) : fs(fs) {
+		fs->beginFileAccess();
+	}
+
+	/**
+	 * @brief Constructor selects a segment file and opens it
+	 */
+	StFileOpenClose(PublishQueueAsyncFileSystemBase *fs, uint32_t segment) : fs(fs) {
+		fs->openSegment(segment);
+	}
+
+	/**
+	 * @brief Destructor closes (or syncs) the events file
+	 */
+	~StFileOpenClose() {
+		fs->endFileAccess();
+	}
+
+	/**
+	 * @brief File system base object, used so closeFile() can be called on it from the destructor.
+	 */
+	PublishQueueAsyncFileSystemBase *fs;
+};
+
+/**
+ * @brief Abstract class for file system-based events storage (SPIFFS, SdCard, etc.)
+ *
+ * All of the file systems work in a similar manner, with only a set of virtual methods
+ * like openFile(), readBytes, writeBytes(), etc. subclasses for each concrete subclass.
+ *
+ * Each operation is atomic. The mutex is obtained, the file opened, manipulated,
+ * then closed. This less efficient than keeping the file open, but is less likely to
+ * lose data if the device is reset. It also makes file system corruption less likely.
+ * Use withKeepFileOpen() to keep the file open instead, with a sync policy set by
+ * withSyncEveryWrites() and withSyncIntervalMs().
+ *
+ * The file contains binary data, basically the same thing as retained memory, with a
+ * few minor changes.
+ *
+ * The file begins with a file header (PublishQueueFileHeader). It has magic bytes, the number
+ * of events in the file, the number of events that have already been sent, the file offset of
+ * the oldest unsent event (oldestPos) and the file offset just past the last event (endPos).
+ *
+ * In setup() the file header is checked. If oldestPos and endPos are consistent with the file and
+ * there's a valid event at oldestPos, the events are used as-is without reading the rest of the
+ * file, so startup time does not depend on the number of events. Otherwise, the events are scanned
+ * from the beginning of the file to find oldestPos. If the events file is not valid, then the
+ * contents are deleted.
+ *
+ * When a publish is queued, the event is written at endPos and then the numEvents and endPos in
+ * the header updated. If the file is longer than endPos at startup, an append was interrupted and
+ * the extra data is removed.
+ *
+ * When a publish is completed, the number of events sent is incremented and oldestPos is advanced
+ * to the next event. If all events have been sent, the header is reset and the file truncated
+ * to the size of the file header.
+ *
+ * The reason for this is that unlike RAM or FRAM, it's really inefficient to remove
+ * data from the beginning of the file. Since the most common situation is that a
+ * bunch of events are queued and eventually all of them are transmitted, the code
+ * is optimized for this most common situation.
+ *
+ * If the queue rarely drains completely, the sent events would never be removed from the file.
+ * With withSegmentSize(), the events are instead stored in a series of segment files, each with the
+ * same layout as the single events file. Events are appended to the tail segment until it reaches
+ * the segment size, then a new segment is started. When all of the events in the head segment have
+ * been sent, the segment file is deleted. The events file itself only contains a
+ * PublishQueueSegmentHeader with the head and tail segment numbers.
+ *
+ * Events queued with a priority above 0 are written to a separate priority file (the events filename
+ * followed by .p), which is created when needed and removed when all of its events have been sent. When
+ * no events are being sent, the highest priority that has events is chosen and its events are sent first,
+ * followed by the other priorities from highest to lowest. An event in the priority file that's sent
+ * (or discarded) before the events in front of it is marked as deleted. The number of events of each
+ * priority is kept in RAM and counted from the priority file in setup().
+ */
+class PublishQueueAsyncFileSystem : public PublishQueueAsyncFileSystemBase {
+public:
+	/**
+	 * @brief Abstract base class constructor
+	 */
+	PublishQueueAsyncFileSystem() {
+	}
+
+	/**
+	 * @brief Abstract base class destructor
+	 */
+	virtual ~PublishQueueAsyncFileSystem() {
+		delete[] stagingBuf;
+	}
+
+	/**
+	 * @brief Stage published events in RAM and write them to the events file in groups (default: disabled)
+	 *
+	 * @param maxEvents Write the staged events when this many are staged
+	 *
+	 * @param maxMs Write the staged events when the oldest staged event is this many milliseconds old, or
+	 * 0 to only write based on the number of events
+	 *
+	 * @param bufferSize Size of the staging buffer in bytes, allocated on the heap in setup(). It's increased
+	 * to EVENT_BUF_SIZE (704 bytes) if smaller. If the next event doesn't fit, the staged events are written first.
+	 *
+	 * Normally each publish appends the event and then rewrites the file header, two writes to different
+	 * locations in the file. With group commit, the staged events are written with one append and one
+	 * header update. You can also write the staged events immediately by calling flush().
+	 *
+	 * Staged events are still published in order and can be published directly from RAM without being
+	 * written to the file. If the device resets, the staged events are lost.
+	 *
+	 * This must be called before setup().
+	 */
+	inline PublishQueueAsyncFileSystem &withGroupCommit(uint16_t maxEvents, unsigned long maxMs, size_t bufferSize = 2048) {
+		groupCommitEvents = maxEvents;
+		groupCommitMs = maxMs;
+		stagingSize = (bufferSize < EVENT_BUF_SIZE) ? EVENT_BUF_SIZE : bufferSize;
+		return *this;
+	};
+
+	/**
+	 * @brief Store events in segment files of approximately this many bytes (default: 0, one events file)
+	 *
+	 * @param value The segment size in bytes, or 0 to store all events in the events file.
+	 *
+	 * A new segment file is started when the next event would make the tail segment larger than
+	 * this size. Segment files are deleted as soon as all of their events have been sent, so space is
+	 * reclaimed even if the queue never becomes empty. Each publish or discard only accesses the
+	 * tail or head segment.
+	 *
+	 * The segment files are named with the events filename followed by a period and the segment
+	 * number, for example events.dat.12. On SdFat this requires long filename support, and on SPIFFS
+	 * the whole name must fit in SPIFFS_OBJ_NAME_LEN.
+	 *
+	 * An existing events file is converted to segments in setup(). If segment files exist but this
+	 * is not set, the existing segments are used but no new segments are started.
+	 *
+	 * This must be called before setup().
+	 */
+	inline PublishQueueAsyncFileSystem &withSegmentSize(size_t value) { segmentSize = value; return *this; };
+
+	/**
+	 * @brief Maximum number of unsent events in the events file or segment files (default: 0, no limit)
+	 *
+	 * @param value The maximum number of events, or 0 for no limit.
+	 *
+	 * When an event is written that would exceed the limit, the oldest event is discarded, or the
+	 * second oldest event if the oldest event is currently being sent. Events staged in RAM by group
+	 * commit are counted when they're written to the file. Events in the priority file are counted too,
+	 * but are only discarded to make room for an event with the same or a higher priority, once there
+	 * are no normal priority events that can be discarded.
+	 */
+	inline PublishQueueAsyncFileSystem &withMaxEvents(uint32_t value) { maxEvents = value; return *this; };
+
+	/**
+	 * @brief Maximum number of bytes of unsent events in the events file or segment files (default: 0, no limit)
+	 *
+	 * @param value The maximum number of bytes, or 0 for no limit. Each event takes 18 bytes plus
+	 * the length of the event name and data, rounded up to a multiple of 4.
+	 *
+	 * When an event is written that would exceed the limit, the oldest events are discarded, or the
+	 * second oldest events if the oldest event is currently being sent. An event larger than this
+	 * is rejected.
+	 *
+	 * Events that have been sent remain in the file until all of the events in it have been sent. Use
+	 * withSegmentSize() as well to limit the file system space used to about this plus the segment size.
+	 */
+	inline PublishQueueAsyncFileSystem &withMaxBytes(size_t value) { maxBytes = value; return *this; };
+
+	/**
+	 * @brief Write any events staged in RAM by group commit to the events file
+	 *
+	 * @returns true if the events were written or there were no staged events
+	 */
+	bool flush() {
+		if (!haveSetup) {
+			return false;
+		}
+
+		StMutexLock lock(this);
+
+		if (stagingStart == stagingEnd) {
+			return true;
+		}
+
+		StFileOpenClose openClose(this, tailSegment);
+
+		return writeStagedEvents();
+	}
+
+	/**
+	 * @brief setup() must be called from the main setup() function!
+	 */
+	virtual void setup() {
+		if (groupCommitEvents != 0 && stagingBuf == NULL) {
+			stagingBuf = new uint8_t[stagingSize];
+		}
+
+		// Do superclass setup (starting the thread)
+		PublishQueueAsyncBase::setup();
+
+		// Lock the mutex and open the events file. Closes and unlocks the mutex on exit.
+		StMutexLock lock(this);
+
+		{
+			StFileOpenClose openClose(this, 0);
+
+			PublishQueueSegmentHeader segmentHeader;
+			if ((size_t) getLength() >= sizeof(PublishQueueSegmentHeader) &&
+				readBytes(0, (uint8_t *)&segmentHeader, sizeof(PublishQueueSegmentHeader)) == sizeof(PublishQueueSegmentHeader) &&
+				segmentHeader.magic == PUBLISH_QUEUE_SEGMENT_HEADER_MAGIC) {
+				if (segmentSize == 0) {
+					PUBLISH_QUEUE_LOG_INFO("events are stored in segments, no new segments will be started");
+				}
+				if (!loadSegments(segmentHeader)) {
+					return;
+				}
+			}
+			else {
+				if (!loadEventsFile()) {
+					return;
+				}
+				if (segmentSize != 0 && !convertToSegments() && segmented) {
+					return;
+				}
+			}
+
+			if ((maxEvents != 0 || maxBytes != 0) && header.numSent < header.numEvents) {
+				// Count the events that were deleted to make room before restarting
+				deleteNextEvent(false);
+			}
+
+			if (!loadPriorityFile()) {
+				return;
+			}
+
+			// If the file is kept open, make sure any changes made here are saved
+			syncIfModified();
+		}
+		updateUsageMetrics();
+
+		haveSetup = true;
+	}
+
+	/**
+	 * @brief Queues an event with normal priority
+	 */
+	virtual bool publishCommon(const char *eventName, const char *data, int ttl, PublishFlags flags1, PublishFlags flags2 = PublishFlags()) {
+		return publishCommon(eventName, data, ttl, flags1, flags2, 0);
+	}
+
+	/**
+	 * @brief Append the publish data to the events file
+	 */
+	virtual bool publishCommon(const char *eventName, const char *data, int ttl, PublishFlags flags1, PublishFlags flags2, uint8_t priority) {
+		if (!haveSetup) {
+			return false;
+		}
+
+		if (data == NULL) {
+			data = "";
+		}
+
+		size_t nameLen = strlen(eventName);
+		size_t dataLen = strlen(data);
+		size_t size = getEventSize(nameLen, dataLen);
+
+		//PUBLISH_QUEUE_LOG_TRACE("queueing eventName=%s data=%s ttl=%d flags1=%d flags2=%d size=%d", eventName, data, ttl, flags1.value(), flags2.value(), size);
+
+		if (size == 0 || (maxBytes != 0 && size > maxBytes)) {
+			// Event name or data is too long to publish or store
+			metrics.rejected++;
+			return false;
+		}
+
+		if (priority > PUBLISH_QUEUE_PRIORITY_MAX) {
+			priority = PUBLISH_QUEUE_PRIORITY_MAX;
+		}
+
+		StMutexLock lock(this);
+
+		if (priority > 0) {
+			// Written to the priority file right away. They're not staged or replaced (withLastValueOnly).
+			size = getStoredEventSize(nameLen, data, dataLen);
+			writeStoredEvent(eventBuf, eventName, nameLen, data, dataLen, ttl, flags1.value() | flags2.value(), size, priority);
+
+			return appendPriorityEvent(size, priority);
+		}
+
+		if (!segmented && (uint32_t)header.numEvents + stagingCount >= 0xffff) {
+			// numEvents is 16 bits. With segments, a new segment is started instead.
+			PUBLISH_QUEUE_LOG_INFO("events file is full");
+			metrics.rejected++;
+			return false;
+		}
+
+		size = getStoredEventSize(nameLen, data, dataLen);
+
+		// Replace the unsent event with the same name if only the newest one is kept
+		PublishQueueLastValue *lastValue = findLastValue(eventName, nameLen);
+		if (lastValue != NULL && replaceLastValueEvent(lastValue, eventName, nameLen, data, dataLen, ttl, flags1.value() | flags2.value(), size, priority)) {
+			// Wakes the thread in case the file now needs to be synced
+			eventQueued();
+			return true;
+		}
+
+		if (stagingBuf != NULL) {
+			return stageEvent(eventName, nameLen, data, dataLen, ttl, flags1.value() | flags2.value(), size, priority, lastValue);
+		}
+
+		// PUBLISH_QUEUE_LOG_INFO("writing event size=%u", size);
+
+		writeStoredEvent(eventBuf, eventName, nameLen, data, dataLen, ttl, flags1.value() | flags2.value(), size, priority);
+
+		return appendEvent(eventBuf, size, lastValue);
+	}
+
+	/**
+	 * @brief Returns true if an event of size bytes isn't larger than maxBytes
+	 */
+	virtual bool reserveEvent(size_t size) {
+		if (!haveSetup) {
+			return false;
+		}
+		return maxBytes == 0 || size <= maxBytes;
+	}
+
+	/**
+	 * @brief Stages or appends the reserved event, or overwrites the withLastValueOnly() event if it fits
+	 */
+	virtual bool commitEvent(const uint8_t *buf, size_t size) {
+		const PublishQueueEventData *eventData = (const PublishQueueEventData *)buf;
+
+		StMutexLock lock(this);
+
+		if (!segmented && (uint32_t)header.numEvents + stagingCount >= 0xffff) {
+			PUBLISH_QUEUE_LOG_INFO("events file is full");
+			metrics.rejected++;
+			return false;
+		}
+
+		PublishQueueLastValue *lastValue = findLastValue(getEventName(eventData), eventData->nameLen);
+		if (lastValue != NULL && replaceLastValueRecord(lastValue, buf, size)) {
+			eventQueued();
+			return true;
+		}
+
+		if (stagingBuf != NULL) {
+			if (stagingEnd + size > stagingSize) {
+				StFileOpenClose openClose(this, tailSegment);
+				if (!writeStagedEvents()) {
+					return false;
+				}
+			}
+			memcpy(&stagingBuf[stagingEnd], buf, size);
+			return commitStagedEvent(size, lastValue);
+		}
+
+		return appendEvent(buf, size, lastValue);
+	}
+
+	/**
+	 * @brief Get the oldest event that hasn't been published yet
+	 *
+	 * Returns a pointer to a PublishQueueEventData structure in the publishBuf member variable.
+	 * This will remain valid until getOldestEvent() is called again.
+	 *
+	 * The event remains in the file until discardOldEvent() is called, so if the publish fails, the
+	 * same event is returned again.
+	 *
+	 * Events staged in RAM by group commit are newer than the events in the file, so they're only
+	 * returned once all of the events in the file have been sent. If there are events in the priority
+	 * file, the priority lane to send first is chosen here.
+	 */
+	virtual PublishQueueEventData *getOldestEvent() {
+		StMutexLock lock(this);
+
+		while(true) {
+			if (sendingCount == 0) {
+				selectLane();
+			}
+
+			uint8_t lane = getFirstLane();
+			if (lane != 0) {
+				StFileOpenClose openClose(this, PRIORITY_SEGMENT);
+
+				PublishQueueEventData eventData;
+				size_t pos = findPriorityEvent(lane, 0, eventData);
+				if (pos == 0 || readEvent(pos, publishBuf, priorityHeader.endPos) == 0) {
+					PUBLISH_QUEUE_LOG_ERROR("priority event invalid, discarding priority events");
+					discardPriorityEvents();
+					return NULL;
+				}
+				if (!isValidEvent((PublishQueueEventData *)publishBuf, EVENT_BUF_SIZE)) {
+					PUBLISH_QUEUE_LOG_ERROR("priority event crc mismatch at pos=%u, discarding it", pos);
+					if (!removePriorityEvent(lane, 0)) {
+						return NULL;
+					}
+					countDiscardedEvent(0);
+					metrics.corrupted++;
+					updateUsageMetrics();
+					continue;
+				}
+				if (isEventCompressed((PublishQueueEventData *)publishBuf)) {
+					memcpy(eventBuf, publishBuf, ((PublishQueueEventData *)publishBuf)->size);
+					expandEvent((PublishQueueEventData *)eventBuf, publishBuf);
+				}
+				return (PublishQueueEventData *)publishBuf;
+			}
+
+			if (header.numSent >= header.numEvents) {
+				break;
+			}
+
+			StFileOpenClose openClose(this, headSegment);
+
+			size_t next = readEvent(header.oldestPos, publishBuf);
+			if (next == 0) {
+				skipInvalidEvent();
+				continue;
+			}
+
+			if ((((PublishQueueEventData *)publishBuf)->recordFlags & PUBLISH_QUEUE_RECORD_FLAG_DELETED) != 0) {
+				// The event was deleted to make room while the event before it was being sent
+				discardHeadEvent();
+				continue;
+			}
+
+			if (!isValidEvent((PublishQueueEventData *)publishBuf, EVENT_BUF_SIZE)) {
+				// The header is valid, so only this event is discarded
+				PUBLISH_QUEUE_LOG_ERROR("event crc mismatch at oldestPos=%u, discarding it", header.oldestPos);
+				uint32_t index = getLaneIndex(0);
+				if (discardHeadEvent()) {
+					countDiscardedEvent(index);
+					metrics.corrupted++;
+				}
+				updateUsageMetrics();
+				continue;
+			}
+
+			if (isEventCompressed((PublishQueueEventData *)publishBuf)) {
+				memcpy(eventBuf, publishBuf, ((PublishQueueEventData *)publishBuf)->size);
+				expandEvent((PublishQueueEventData *)eventBuf, publishBuf);
+			}
+
+			// readEvent will leave the event in publishBuf, which we then return
+			// PUBLISH_QUEUE_LOG_TRACE("getOldestEvent found an event at oldestPos=%u, next=%u", header.oldestPos, next);
+			return (PublishQueueEventData *)publishBuf;
+		}
+
+		// The head segment only has no unsent events if it's also the tail segment
+		if (stagingStart == stagingEnd) {
+			return NULL;
+		}
+
+		PublishQueueEventData *eventData = (PublishQueueEventData *)&stagingBuf[stagingStart];
+		expandEvent(eventData, publishBuf);
+		return (PublishQueueEventData *)publishBuf;
+	}
+
+	/**
+	 * @brief Remove any saved events
+	 *
+	 * @return Always returns true.
+	 *
+	 * Since the FRAM code copies the event being published to a separate buffer, the events can always be cleared.
+	 */
+	virtual bool clearEvents() {
+		StMutexLock lock(this);
+
+		stagingStart = stagingEnd = 0;
+		stagingCount = 0;
+
+		// If an event is being sent, there's nothing to remove after it's sent
+		clearSendingCount();
+		resetLastValues(PublishQueueLastValue::STATE_NONE);
+
+		resetPriorityFile();
+		activeLane = 0;
+
+		{
+			StFileOpenClose openClose(this, headSegment);
+
+			if (headSegment != tailSegment) {
+				// Remove all segments except the tail segment
+				while(headSegment != tailSegment) {
+					removeSegment(headSegment++);
+				}
+				header = tailHeader;
+				middleEvents = 0;
+				middleBytes = 0;
+				writeSegmentHeader();
+				openSegment(tailSegment);
+			}
+
+			bool result = resetEvents();
+			updateUsageMetrics();
+			return result;
+		}
+	}
+
+	/**
+	 * @brief Discard an event
+	 *
+	 * @param secondEvent True to discard the second oldest event in the order the events are sent,
+	 * which is used to make room while the oldest event is being sent
+	 *
+	 * Events after the oldest event that were marked as deleted to make room are removed along with it,
+	 * so they're not counted as a discarded event when a batch of events was sent. The second oldest
+	 * event in the events file or the priority file is marked as deleted instead of rewriting the file.
+	 */
+	virtual bool discardOldEvent(bool secondEvent) {
+
+		StMutexLock lock(this);
+
+		uint8_t lane = getFirstLane();
+		uint16_t index = 0;
+		if (secondEvent) {
+			if (getLaneEvents(lane) >= 2) {
+				return discardSecondEvent(lane);
+			}
+
+			// The second event is the oldest event in the next lane in the order
+			uint8_t pos = 0;
+			while(getLane(pos) != lane) {
+				pos++;
+			}
+			do {
+				if (++pos > PUBLISH_QUEUE_PRIORITY_MAX) {
+					return false;
+				}
+				lane = getLane(pos);
+			} while(getLaneEvents(lane) == 0);
+			index = 1;
+		}
+
+		if (lane != 0) {
+			StFileOpenClose openClose(this, PRIORITY_SEGMENT);
+
+			if (!removePriorityEvent(lane, 0)) {
+				return false;
+			}
+			countDiscardedEvent(index);
+			return true;
+		}
+
+		if (header.numSent >= header.numEvents) {
+			if (stagingStart == stagingEnd) {
+				return false;
+			}
+
+			// The oldest event is staged in RAM
+			stagingStart += ((PublishQueueEventData *)&stagingBuf[stagingStart])->size;
+			stagingCount--;
+			if (stagingStart == stagingEnd) {
+				stagingStart = stagingEnd = 0;
+			}
+			countDiscardedEvent(index);
+			return true;
+		}
+
+		{
+			StFileOpenClose openClose(this, headSegment);
+
+			if (!discardHeadEvent()) {
+				// The oldest event's header was not valid, and skipInvalidEvent() removed and counted it
+				return true;
+			}
+			countDiscardedEvent(index);
+
+			while(deletedEvents != 0 && header.numSent < header.numEvents) {
+				PublishQueueEventData eventData;
+				openSegment(headSegment);
+				if (readBytes(header.oldestPos, (uint8_t *)&eventData, sizeof(PublishQueueEventData)) != sizeof(PublishQueueEventData) ||
+					(eventData.recordFlags & PUBLISH_QUEUE_RECORD_FLAG_DELETED) == 0) {
+					break;
+				}
+				discardHeadEvent();
+			}
+			return true;
+		}
+	}
+
+	/**
+	 * @brief Discards the second oldest event in a priority lane that has at least two events
+	 *
+	 * @param lane The priority lane of the oldest event in the order the events are sent
+	 *
+	 * In the priority file or the events file, the event is marked as deleted. If the oldest normal
+	 * priority event is the last one in the file, the oldest staged event is removed, and if there
+	 * are only staged events, the oldest staged event is moved into the space the second one occupied.
+	 *
+	 * Note: You must obtain a mutex lock before calling this!
+	 */
+	bool discardSecondEvent(uint8_t lane) {
+		if (lane != 0) {
+			StFileOpenClose openClose(this, PRIORITY_SEGMENT);
+
+			if (!removePriorityEvent(lane, 1)) {
+				return false;
+			}
+			countDiscardedEvent(1);
+			return true;
+		}
+
+		uint32_t fileEvents = getFileEvents();
+		if (fileEvents >= 2) {
+			// deleteNextEvent() counts the discarded event
+			StFileOpenClose openClose(this, headSegment);
+			return deleteNextEvent();
+		}
+
+		size_t firstSize = ((PublishQueueEventData *)&stagingBuf[stagingStart])->size;
+		if (fileEvents == 0) {
+			// Both events are staged in RAM
+			size_t secondSize = ((PublishQueueEventData *)&stagingBuf[stagingStart + firstSize])->size;
+			memmove(&stagingBuf[stagingStart + secondSize], &stagingBuf[stagingStart], firstSize);
+			forgetLastValuePositions();
+			firstSize = secondSize;
+		}
+		stagingStart += firstSize;
+		stagingCount--;
+		if (stagingStart == stagingEnd) {
+			stagingStart = stagingEnd = 0;
+		}
+		countDiscardedEvent(1);
+		return true;
+	}
+
+	/**
+	 * @brief Calls a function for queued events, starting with the oldest event
+	 *
+	 * Each event is read into eventBuf before calling fn. Events marked as deleted are skipped. The
+	 * priority lanes are visited in the order they're sent. For normal priority events, only the events
+	 * in the head segment are visited, followed by the events staged in RAM if there's only one segment.
+	 */
+	virtual void forEachEvent(std::function<bool(const PublishQueueEventData *)> fn) {
+		StMutexLock lock(this);
+
+		for(uint8_t pos = 0; pos <= PUBLISH_QUEUE_PRIORITY_MAX; pos++) {
+			uint8_t lane = getLane(pos);
+			if (lane == 0) {
+				if (!forEachFileEvent(fn)) {
+					return;
+				}
+			}
+			else
+			if (laneEvents[lane] != 0) {
+				StFileOpenClose openClose(this, PRIORITY_SEGMENT);
+
+				if (!forEachPriorityEvent(lane, fn)) {
+					return;
+				}
+			}
+		}
+	}
+
+	/**
+	 * @brief Adds event records spilled from the front tier of a PublishQueueAsyncTiered
+	 *
+	 * Any staged events are written first, as they're older. Each run of normal priority records is
+	 * appended with one write and one header update, like a group commit. Records with a priority are
+	 * appended to the priority file one at a time.
+	 */
+	virtual uint16_t appendRecords(const uint8_t *buf, size_t /* len */, uint16_t count) {
+		if (!haveSetup) {
+			return 0;
+		}
+
+		StMutexLock lock(this);
+
+		uint16_t added = 0;
+		size_t offset = 0;
+		while(added < count) {
+			const PublishQueueEventData *eventData = (const PublishQueueEventData *)&buf[offset];
+			uint8_t lane = getEventPriority(eventData);
+			if (lane != 0) {
+				StFileOpenClose openClose(this, PRIORITY_SEGMENT);
+
+				if (!appendPriorityRecord(&buf[offset], eventData->size, lane)) {
+					break;
+				}
+				offset += eventData->size;
+				added++;
+				continue;
+			}
+
+			size_t runLen = 0;
+			uint16_t runCount = 0;
+			while(added + runCount < count && getEventPriority((const PublishQueueEventData *)&buf[offset + runLen]) == 0) {
+				runLen += ((const PublishQueueEventData *)&buf[offset + runLen])->size;
+				runCount++;
+			}
+
+			if (!segmented && (uint32_t)header.numEvents + stagingCount + runCount > 0xffff) {
+				// numEvents is 16 bits. With segments, a new segment is started instead.
+				PUBLISH_QUEUE_LOG_INFO("events file is full");
+				break;
+			}
+
+			StFileOpenClose openClose(this, tailSegment);
+
+			if (!writeStagedEvents() || !appendEvents(&buf[offset], runLen, runCount)) {
+				break;
+			}
+			offset += runLen;
+			added += runCount;
+		}
+		updateUsageMetrics();
+
+		return added;
+	}
+
+	/**
+	 * @brief Reads the oldest events in the head segment with one read, or copies the staged events
+	 *
+	 * Events marked as deleted are left out. If a priority lane is sent first, only the events in that
+	 * lane are read from the priority file, so an event queued in another lane never goes before them.
+	 */
+	virtual uint16_t readRecords(uint8_t *buf, size_t bufSize, size_t &len) {
+		StMutexLock lock(this);
+
+		uint16_t count = 0;
+		len = 0;
+
+		if (sendingCount == 0) {
+			selectLane();
+		}
+
+		uint8_t lane = getFirstLane();
+		if (lane != 0) {
+			StFileOpenClose openClose(this, PRIORITY_SEGMENT);
+
+			forEachPriorityEvent(lane, [&](const PublishQueueEventData *eventData) {
+				if (len + eventData->size > bufSize) {
+					return false;
+				}
+				memcpy(&buf[len], eventData, eventData->size);
+				len += eventData->size;
+				count++;
+				return true;
+			});
+			return count;
+		}
+
+		if (header.numSent >= header.numEvents) {
+			// Only events staged in RAM
+			for(size_t offset = stagingStart; offset < stagingEnd; ) {
+				const PublishQueueEventData *eventData = (const PublishQueueEventData *)&stagingBuf[offset];
+				if (len + eventData->size > bufSize) {
+					break;
+				}
+				memcpy(&buf[len], eventData, eventData->size);
+				len += eventData->size;
+				offset += eventData->size;
+				count++;
+			}
+			return count;
+		}
+
+		StFileOpenClose openClose(this, headSegment);
+
+		size_t readLen = header.endPos - header.oldestPos;
+		if (readLen > bufSize) {
+			readLen = bufSize;
+		}
+		if (readBytes(header.oldestPos, buf, readLen) != readLen) {
+			return 0;
+		}
+
+		// Remove the deleted events and stop at the first incomplete event
+		size_t offset = 0;
+		for(uint32_t ii = header.numSent; ii < header.numEvents && offset + sizeof(PublishQueueEventData) <= readLen; ii++) {
+			PublishQueueEventData *eventData = (PublishQueueEventData *)&buf[offset];
+			if (!isValidEventHeader(eventData, readLen - offset)) {
+				break;
+			}
+			size_t size = eventData->size;
+			if ((eventData->recordFlags & PUBLISH_QUEUE_RECORD_FLAG_DELETED) == 0) {
+				if (len != offset) {
+					memmove(&buf[len], eventData, size);
+				}
+				len += size;
+				count++;
+			}
+			offset += size;
+		}
+		return count;
+	}
+
+	/**
+	 * @brief Skip to the next event
+	 *
+	 * @param addr File offset of the event
+	 *
+	 * @param buf Buffer to store the event header in. Only the PublishQueueEventData header is read,
+	 * not the event name and data.
+	 *
+	 * @returns File offset of the next event, or 0 if there is no valid event at addr
+	 *
+	 * The event must end at or before endPos in the file header.
+	 *
+	 * Note: You must obtain a mutex lock and open the events file before calling this!
+	 */
+	size_t skipEvent(size_t addr, uint8_t *buf) {
+		return skipEvent(addr, buf, header.endPos);
+	}
+
+	/**
+	 * @brief Skip to the next event in a file that ends at endPos
+	 *
+	 * This is used for the priority file. The other parameters and the result are the same as skipEvent(addr, buf).
+	 *
+	 * Note: You must obtain a mutex lock and open the file before calling this!
+	 */
+	size_t skipEvent(size_t addr, uint8_t *buf, size_t endPos) {
+		if (addr >= endPos) {
+			// PUBLISH_QUEUE_LOG_INFO("skipEvent called with no more events at endPos=%u addr=%u", endPos, addr);
+			return 0;
+		}
+
+		PublishQueueEventData *eventDataStruct = (PublishQueueEventData *)buf;
+		if (readBytes(addr, buf, sizeof(PublishQueueEventData)) != sizeof(PublishQueueEventData) || !isValidEventHeader(eventDataStruct, endPos - addr)) {
+			return 0;
+		}
+
+		// PUBLISH_QUEUE_LOG_TRACE("skipEvent addr=%u next=%u", addr, addr + eventDataStruct->size);
+
+		return addr + eventDataStruct->size;
+	}
+
+	/**
+	 * @brief Read an entire event
+	 *
+	 * @param addr File offset of the event
+	 *
+	 * @param buf Buffer to store the event in, must be EVENT_BUF_SIZE bytes. Typically publishBuf.
+	 *
+	 * @returns File offset of the next event, or 0 if there is no valid event at addr
+	 *
+	 * Note: You must obtain a mutex lock and open the events file before calling this!
+	 */
+	size_t readEvent(size_t addr, uint8_t *buf) {
+		return readEvent(addr, buf, header.endPos);
+	}
+
+	/**
+	 * @brief Read an entire event in a file that ends at endPos
+	 *
+	 * This is used for the priority file. The other parameters and the result are the same as readEvent(addr, buf).
+	 *
+	 * Note: You must obtain a mutex lock and open the file before calling this!
+	 */
+	size_t readEvent(size_t addr, uint8_t *buf, size_t endPos) {
+		size_t next = skipEvent(addr, buf, endPos);
+		if (next != 0) {
+			size_t count = next - addr - sizeof(PublishQueueEventData);
+			if (readBytes(addr + sizeof(PublishQueueEventData), &buf[sizeof(PublishQueueEventData)], count) != count) {
+				return 0;
+			}
+		}
+		return next;
+	}
+
+	/**
+	 * @brief Get the number of events in the queue (0 = empty)
+	 *
+	 * This is the number of events that have not been sent yet, including events staged in RAM and events
+	 * in the priority file. If there are more than 65535 events in segment files, 65535 is returned.
+	 */
+	uint16_t getNumEvents() const {
+		uint32_t numEvents = 0;
+
+		{
+			StMutexLock lock(this);
+
+			numEvents = getFileEvents() + stagingCount + getPriorityEvents();
+		}
+
+		return (numEvents < 0xffff) ? (uint16_t)numEvents : 0xffff;
+	}
+
+	/**
+	 * @brief Gets the number of unsent events and their size, including events staged in RAM and events in the priority file
+	 */
+	virtual void getQueueUsage(uint32_t &numEvents, uint32_t &numBytes) const {
+		numEvents = getFileEvents() + stagingCount + getPriorityEvents();
+		numBytes = getFileBytes() + (uint32_t)(stagingEnd - stagingStart) + getPriorityBytes();
+	}
+
+protected:
+	/**
+	 * @brief Reads and validates the events file (or segment file) that is open
+	 *
+	 * @returns false if the file header could not be written
+	 *
+	 * On return, header contains the valid file header. If the file was not valid, it's reinitialized
+	 * with no events.
+	 *
+	 * @param checkCrc Check the crc of each event if the file needs to be scanned (see scanEvents)
+	 *
+	 * Note: You must obtain a mutex lock and open the events file before calling this!
+	 */
+	bool loadEventsFile(bool checkCrc = true) {
+		// Initialize the file
+		bool initBuffer = false;
+
+		size_t len = (size_t) getLength();
+
+		// 0.2.x files have a smaller header, so only read that much if the file is short
+		memset(&header, 0, sizeof(header));
+		size_t headerLen = (len < sizeof(PublishQueueFileHeader)) ? sizeof(PublishQueueHeader) : sizeof(PublishQueueFileHeader);
+		if (len < sizeof(PublishQueueHeader) || readBytes(0, (uint8_t *)&header, headerLen) != headerLen) {
+			initBuffer = true;
+			PUBLISH_QUEUE_LOG_INFO("no data in events file, will generate new");
+		}
+
+		if (!initBuffer && header.magic == PUBLISH_QUEUE_FILE_HEADER_MAGIC && headerLen == sizeof(PublishQueueFileHeader)) {
+			PUBLISH_QUEUE_LOG_TRACE("numEvents=%u numSent=%u oldestPos=%u endPos=%u", header.numEvents, header.numSent, header.oldestPos, header.endPos);
+
+			if (header.numSent >= header.numEvents) {
+				PUBLISH_QUEUE_LOG_INFO("all events have been sent, reinitializing");
+				initBuffer = true;
+			}
+			else
+			if (!validateHeader(len)) {
+				// Header is not consistent with the file, find the oldest event the slow way
+				PUBLISH_QUEUE_LOG_INFO("events file header inconsistent, scanning events");
+				if (!scanEvents(len, checkCrc)) {
+					PUBLISH_QUEUE_LOG_INFO("no valid unsent events, reinitializing");
+					initBuffer = true;
+				}
+			}
+
+			if (!initBuffer && len > header.endPos) {
+				// An event was appended but the header was not updated
+				PUBLISH_QUEUE_LOG_INFO("removing incomplete event at endPos=%u len=%u", header.endPos, len);
+				truncate(header.endPos);
+				unsyncedWrites++;
+			}
+		}
+		else
+		if (!initBuffer && header.magic == PUBLISH_QUEUE_HEADER_MAGIC) {
+			// Events file from 0.2.x or earlier. The numSent and numEvents fields are at the
+			// same offsets as the size and numEvents in PublishQueueHeader.
+			if (header.numSent >= header.numEvents) {
+				PUBLISH_QUEUE_LOG_INFO("all events have been sent, reinitializing");
+				initBuffer = true;
+			}
+			else
+			if (!convertEventsV1(len)) {
+				PUBLISH_QUEUE_LOG_INFO("could not convert events file, reinitializing");
+				initBuffer = true;
+			}
+		}
+		else {
+			// Not valid
+			initBuffer = true;
+			PUBLISH_QUEUE_LOG_INFO("No magic bytes or invalid length");
+		}
+
+		//initBuffer = true; // Uncomment to discard old data
+
+		if (initBuffer) {
+			if (!initEventsFile(header)) {
+				PUBLISH_QUEUE_LOG_ERROR("failed to write file header");
+				return false;
+			}
+
+			PUBLISH_QUEUE_LOG_INFO("initialized events file");
+		}
+		else {
+			PUBLISH_QUEUE_LOG_INFO("using events file with numSent=%u numEvents=%u oldestPos=%u", header.numSent, header.numEvents, header.oldestPos);
+		}
+		return true;
+	}
+
+	/**
+	 * @brief Truncates the open events file (or segment file) and writes a file header with no events
+	 *
+	 * @param fileHeader The file header to initialize, header or tailHeader
+	 *
+	 * Note: You must obtain a mutex lock and open the events file before calling this!
+	 */
+	bool initEventsFile(PublishQueueFileHeader &fileHeader) {
+		// In case the file is reused, truncate to zero length before adding in the header
+		truncate(0);
+
+		fileHeader.magic = PUBLISH_QUEUE_FILE_HEADER_MAGIC;
+		fileHeader.numSent = 0;
+		fileHeader.numEvents = 0;
+		fileHeader.oldestPos = fileHeader.endPos = sizeof(PublishQueueFileHeader);
+		return writeHeader(fileHeader);
+	}
+
+	/**
+	 * @brief Checks the oldestPos and endPos saved in the file header at startup
+	 *
+	 * @param len The length of the events file
+	 *
+	 * @returns true if the header is consistent with the file and there's a valid event at oldestPos
+	 *
+	 * Only the file header and the header of the oldest unsent event are read.
+	 *
+	 * Note: You must obtain a mutex lock and open the events file before calling this!
+	 */
+	bool validateHeader(size_t len) {
+		if (header.oldestPos < sizeof(PublishQueueFileHeader) || (header.oldestPos % 4) != 0 ||
+			header.endPos > len || (header.endPos % 4) != 0 || header.oldestPos >= header.endPos) {
+			return false;
+		}
+
+		// Each unsent event takes at least getEventSize(0, 0) bytes
+		if ((size_t)(header.numEvents - header.numSent) * getEventSize(0, 0) > header.endPos - header.oldestPos) {
+			return false;
+		}
+
+		// This is also called when removing a head segment from appendEvents, so eventBuf is not used
+		PublishQueueEventData eventData;
+		return skipEvent(header.oldestPos, (uint8_t *)&eventData) != 0;
+	}
+
+	/**
+	 * @brief Finds oldestPos and endPos by reading every event in the file
+	 *
+	 * @param len The length of the events file
+	 *
+	 * @returns true if there are unsent events before the first event that's not valid
+	 *
+	 * This is only used if the file header is not consistent with the file. The events are read from the
+	 * beginning of the file until numEvents events or an event with an invalid header or crc, and the
+	 * events before it are kept.
+	 *
+	 * @param checkCrc Read each whole event into eventBuf and check its crc, not just the event header
+	 *
+	 * Note: You must obtain a mutex lock and open the events file before calling this!
+	 */
+	bool scanEvents(size_t len, bool checkCrc) {
+		header.endPos = len;
+
+		PublishQueueEventData eventData;
+		size_t addr = sizeof(PublishQueueFileHeader);
+		uint16_t numEvents = 0;
+		while(numEvents < header.numEvents) {
+			size_t next = checkCrc ? readEvent(addr, eventBuf) : skipEvent(addr, (uint8_t *)&eventData);
+			if (next == 0 || (checkCrc && !isValidEvent((PublishQueueEventData *)eventBuf, next - addr))) {
+				// Overflowed buffer or partially written, must be corrupted
+				PUBLISH_QUEUE_LOG_INFO("event invalid at addr=%u index=%u", addr, numEvents);
+				break;
+			}
+			if (numEvents == header.numSent) {
+				header.oldestPos = addr;
+			}
+			addr = next;
+			numEvents++;
+		}
+		if (numEvents <= header.numSent) {
+			return false;
+		}
+		header.numEvents = numEvents;
+		header.endPos = addr;
+
+		writeHeader();
+
+		PUBLISH_QUEUE_LOG_INFO("file data looks valid numEvents=%u oldestPos=%u endPos=%u", header.numEvents, header.oldestPos, header.endPos);
+
+		return true;
+	}
+
+	/**
+	 * @brief Calls a function for the normal priority events, starting with the oldest event
+	 *
+	 * @returns false if fn returned false or not all of the events were visited
+	 *
+	 * Only the events in the head segment are visited, followed by the events staged in RAM if there's
+	 * only one segment.
+	 *
+	 * Note: You must obtain a mutex lock before calling this!
+	 */
+	bool forEachFileEvent(std::function<bool(const PublishQueueEventData *)> fn) {
+		if (header.numSent < header.numEvents) {
+			StFileOpenClose openClose(this, headSegment);
+
+			size_t addr = header.oldestPos;
+			for(uint16_t ii = header.numSent; ii < header.numEvents; ii++) {
+				size_t next = readEvent(addr, eventBuf);
+				if (next == 0) {
+					return false;
+				}
+				const PublishQueueEventData *eventData = (const PublishQueueEventData *)eventBuf;
+				if ((eventData->recordFlags & PUBLISH_QUEUE_RECORD_FLAG_DELETED) == 0 && !fn(eventData)) {
+					return false;
+				}
+				addr = next;
+			}
+
+			if (headSegment != tailSegment) {
+				return false;
+			}
+		}
+
+		for(size_t offset = stagingStart; offset < stagingEnd; ) {
+			const PublishQueueEventData *eventData = (const PublishQueueEventData *)&stagingBuf[offset];
+			if (!fn(eventData)) {
+				return false;
+			}
+			offset += eventData->size;
+		}
+		return true;
+	}
 
+	/**
+	 * @brief Returns true if an event with a higher priority than the lane being sent is queued
+	 */
+	virtual bool hasWaitingPriorityEvent() const {
+		if (getLaneEvents(activeLane) == 0) {
+			return false;
+		}
+		for(uint8_t lane = activeLane + 1; lane <= PUBLISH_QUEUE_PRIORITY_MAX; lane++) {
+			if (laneEvents[lane] != 0) {
+				return true;
+			}
+		}
+		return false;
 	}
 
-	virtual void setup() {
-		// Do superclass setup (starting the thread)
-		PublishQueueAsyncBase::setup();
+	/**
+	 * @brief Returns the number of events in the priority lane being sent
+	 */
+	virtual uint16_t getActiveLaneEvents() const {
+		uint32_t numEvents = getLaneEvents(activeLane);
+		return (numEvents < 0xffff) ? (uint16_t)numEvents : 0xffff;
+	}
 
-		// Initialize the retained buffer
-		bool initBuffer = false;
+	/**
+	 * @brief Returns the number of unsent events in a priority lane
+	 *
+	 * Lane 0 is the normal priority events in the events file or segment files and staged in RAM. The
+	 * other lanes are in the priority file. You must hold the mutex to call this.
+	 */
+	uint32_t getLaneEvents(uint8_t lane) const {
+		return (lane == 0) ? getFileEvents() + stagingCount : laneEvents[lane];
+	}
 
-		if (!fram.readData(start, (uint8_t *)&header, sizeof(PublishQueueHeader))) {
-			pubqLogger.error("failed to read FRAM");
-			return;
+	/**
+	 * @brief Chooses the priority lane to send first: the highest priority lane with events
+	 *
+	 * This is only called when no events are being sent, so the events being sent are always the first
+	 * events in the order. Only normal priority events are tracked for withLastValueOnly(), and their
+	 * indexes all move by the same amount when the order changes. You must hold the mutex to call this.
+	 */
+	void selectLane() {
+		uint8_t lane = PUBLISH_QUEUE_PRIORITY_MAX;
+		while(lane > 0 && laneEvents[lane] == 0) {
+			lane--;
 		}
-
-		if (header.magic == PUBLISH_QUEUE_HEADER_MAGIC && header.size == len) {
-			// Calculate the next write offset
-
-			nextFree = start + sizeof(PublishQueueHeader);
-			for(uint16_t ii = 0; ii < header.numEvents; ii++) {
-				PublishQueueEventData *eventDataStruct = (PublishQueueEventData *)eventBuf;
-				nextFree = skipEvent(nextFree, eventBuf);
-				if (nextFree > (start + len)) {
-					// Overflowed buffer, must be corrupted
-					pubqLogger.info("FRAM contents invalid, reinitializing");
-					initBuffer = true;
-					break;
-				}
-				if (eventDataStruct->size == 0) {
-					pubqLogger.info("FRAM has old data without size");
-					initBuffer = true;
+		if (lane != activeLane) {
+			uint32_t oldIndex = getLaneIndex(0);
+			activeLane = lane;
+			uint32_t newIndex = getLaneIndex(0);
+
+			for(uint16_t ii = 0; ii < numLastValues; ii++) {
+				if (lastValues[ii].state == PublishQueueLastValue::STATE_QUEUED) {
+					lastValues[ii].index = lastValues[ii].index - oldIndex + newIndex;
 				}
 			}
 		}
-		else {
-			// Not valid
-			initBuffer = true;
-			// pubqLogger.info("No magic bytes or invalid length");
-		}
+	}
 
-		// initBuffer = true; // Uncomment to discard old data
+	/**
+	 * @brief Returns the priority lane at a position in the order the events are sent
+	 *
+	 * @param pos 0 for the lane being sent, then the other lanes from the highest priority to the lowest
+	 */
+	uint8_t getLane(uint8_t pos) const {
+		if (pos == 0) {
+			return activeLane;
+		}
+		uint8_t lane = PUBLISH_QUEUE_PRIORITY_MAX + 1 - pos;
+		return (lane <= activeLane) ? lane - 1 : lane;
+	}
 
-		if (initBuffer) {
-			header.magic = PUBLISH_QUEUE_HEADER_MAGIC;
-			header.size = len;
-			header.numEvents = 0;
-			if (!fram.writeData(start, (uint8_t *)&header, sizeof(PublishQueueHeader))) {
-				pubqLogger.error("failed to write FRAM");
-				return;
+	/**
+	 * @brief Returns the priority lane of the oldest event in the order the events are sent, or 0 if there are no events
+	 */
+	uint8_t getFirstLane() const {
+		for(uint8_t pos = 0; pos <= PUBLISH_QUEUE_PRIORITY_MAX; pos++) {
+			uint8_t lane = getLane(pos);
+			if (getLaneEvents(lane) != 0) {
+				return lane;
 			}
-
-			nextFree = start + sizeof(PublishQueueHeader);
-			pubqLogger.info("FRAM reinitialized start=%u len=%u", start, len);
 		}
-		else {
-			pubqLogger.info("FRAM numEvents=%u nextFree=%u", header.numEvents, nextFree);
+		return 0;
+	}
+
+	/**
+	 * @brief Returns the index of the oldest event in a priority lane in the order the events are sent
+	 */
+	uint32_t getLaneIndex(uint8_t lane) const {
+		uint32_t index = 0;
+		for(uint8_t pos = 0; getLane(pos) != lane; pos++) {
+			index += getLaneEvents(getLane(pos));
 		}
+		return index;
+	}
 
-		haveSetup = true;
+	/**
+	 * @brief Returns the priority lane of an event in the priority file
+	 */
+	static uint8_t getPriorityLane(const PublishQueueEventData *eventData) {
+		uint8_t lane = getEventPriority(eventData);
+		return (lane != 0) ? lane : 1;
 	}
 
-	virtual bool publishCommon(const char *eventName, const char *data, int ttl, PublishFlags flags1, PublishFlags flags2 = PublishFlags()) {
-		if (!haveSetup) {
-			return false;
+	/**
+	 * @brief Gets the number of unsent events in the priority file, not including deleted events
+	 */
+	uint32_t getPriorityEvents() const {
+		uint32_t numEvents = 0;
+		for(uint8_t lane = 1; lane <= PUBLISH_QUEUE_PRIORITY_MAX; lane++) {
+			numEvents += laneEvents[lane];
 		}
+		return numEvents;
+	}
 
-		if (data == NULL) {
-			data = "";
-		}
+	/**
+	 * @brief Gets the number of bytes of unsent events in the priority file, not including deleted events
+	 */
+	uint32_t getPriorityBytes() const {
+		uint32_t numBytes = getUnsentBytes(priorityHeader);
+		return (numBytes > priorityDeletedBytes) ? numBytes - priorityDeletedBytes : 0;
+	}
+
+	/**
+	 * @brief Loads the priority file at startup and counts the events in each priority lane
+	 *
+	 * @returns false if the file header could not be written
+	 *
+	 * The file is checked the same way as the events file. If there are no unsent events, it's removed.
+	 * If there is no priority file, it's not created until an event with a priority is queued.
+	 *
+	 * Note: You must obtain a mutex lock before calling this!
+	 */
+	bool loadPriorityFile() {
+		PublishQueueFileHeader fileHeader = header;
 
-		// Size is the size of the header, the two c-strings (with null terminators), rounded up to a multiple of 4
-		size_t size = sizeof(PublishQueueEventData) + strlen(eventName) + strlen(data) + 2;
-		if ((size % 4) != 0) {
-			size += 4 - (size % 4);
+		for(uint8_t lane = 0; lane <= PUBLISH_QUEUE_PRIORITY_MAX; lane++) {
+			laneEvents[lane] = 0;
+		}
+		priorityDeletedEvents = priorityDeletedBytes = 0;
+		activeLane = 0;
+
+		selectSegment(PRIORITY_SEGMENT);
+		if (!fileExists()) {
+			// The priority file is created by the first event with a priority
+			memset(&priorityHeader, 0, sizeof(priorityHeader));
+			return true;
+		}
+		if (!openSegment(PRIORITY_SEGMENT)) {
+			// Events with a priority can't be queued, but the other events can
+			PUBLISH_QUEUE_LOG_ERROR("failed to open priority file");
+			memset(&priorityHeader, 0, sizeof(priorityHeader));
+			return true;
 		}
 
-		// pubqLogger.info("queueing eventName=%s data=%s ttl=%d flags1=%d flags2=%d size=%d", eventName, data, ttl, flags1.value(), flags2.value(), size);
+		// loadEventsFile() checks the open file using header
+		bool result = loadEventsFile();
+		priorityHeader = header;
+		header = fileHeader;
 
-		if  (size > (len - sizeof(PublishQueueHeader))) {
-			// Special case: event is larger than the FRAM. Rather than throw out all events
-			// before discovering this, check that case first
+		if (!result) {
 			return false;
 		}
 
-		while(true) {
-			{
-				StMutexLock lock(this);
+		// Only the event headers are read. Events after an invalid event header are removed.
+		uint16_t numEvents = priorityHeader.numSent;
+		size_t pos = priorityHeader.oldestPos;
+		while(numEvents < priorityHeader.numEvents) {
+			PublishQueueEventData eventData;
+			size_t next = skipEvent(pos, (uint8_t *)&eventData, priorityHeader.endPos);
+			if (next == 0) {
+				break;
+			}
+			if ((eventData.recordFlags & PUBLISH_QUEUE_RECORD_FLAG_DELETED) != 0) {
+				priorityDeletedEvents++;
+				priorityDeletedBytes += eventData.size;
+			}
+			else {
+				laneEvents[getPriorityLane(&eventData)]++;
+			}
+			pos = next;
+			numEvents++;
+		}
+		if (numEvents != priorityHeader.numEvents) {
+			PUBLISH_QUEUE_LOG_INFO("priority event invalid at pos=%u, removing events after it", pos);
+			priorityHeader.numEvents = numEvents;
+			priorityHeader.endPos = pos;
+			writeHeader(priorityHeader);
+			truncate(pos);
+		}
 
-				if ((start + len - nextFree) >= size) {
-					// There is room to fit this
-					pubqLogger.info("writing event nextFree=%u size=%u", nextFree, size);
+		if (getPriorityEvents() == 0) {
+			resetPriorityFile();
+		}
+		else {
+			PUBLISH_QUEUE_LOG_INFO("using priority file with numEvents=%lu", (unsigned long)getPriorityEvents());
+		}
+		return true;
+	}
 
-					PublishQueueEventData *eventData = (PublishQueueEventData *)eventBuf;
-					eventData->ttl = ttl;
-					eventData->flags = flags1.value() | flags2.value();
-					eventData->size = size;
+	/**
+	 * @brief Removes the priority file and forgets its events
+	 *
+	 * Note: You must obtain a mutex lock before calling this!
+	 */
+	void resetPriorityFile() {
+		if (priorityHeader.magic == PUBLISH_QUEUE_FILE_HEADER_MAGIC) {
+			removeSegment(PRIORITY_SEGMENT);
+		}
+		memset(&priorityHeader, 0, sizeof(priorityHeader));
+		for(uint8_t lane = 0; lane <= PUBLISH_QUEUE_PRIORITY_MAX; lane++) {
+			laneEvents[lane] = 0;
+		}
+		priorityDeletedEvents = priorityDeletedBytes = 0;
+	}
+
+	/**
+	 * @brief Discards all of the events in the priority file because it could not be read
+	 *
+	 * Note: You must obtain a mutex lock before calling this!
+	 */
+	void discardPriorityEvents() {
+		for(uint8_t lane = 1; lane <= PUBLISH_QUEUE_PRIORITY_MAX; lane++) {
+			while(laneEvents[lane] != 0) {
+				laneEvents[lane]--;
+				countDiscardedEvent(getLaneIndex(lane));
+			}
+		}
+		resetPriorityFile();
+	}
 
-					char *cp = (char *) eventBuf;
-					cp += sizeof(PublishQueueEventData);
+	/**
+	 * @brief Appends the event in eventBuf to the priority file
+	 *
+	 * Note: You must obtain a mutex lock before calling this!
+	 */
+	bool appendPriorityEvent(size_t size, uint8_t lane) {
+		StFileOpenClose openClose(this, PRIORITY_SEGMENT);
 
-					strcpy(cp, eventName);
-					cp += strlen(cp) + 1;
+		if (!appendPriorityRecord(eventBuf, size, lane)) {
+			return false;
+		}
+		eventQueued();
+		return true;
+	}
 
-					strcpy(cp, data);
+	/**
+	 * @brief Appends an event with a priority above 0 to the priority file, creating it if necessary
+	 *
+	 * @param buf The event record
+	 *
+	 * @param size The size of the event record
+	 *
+	 * @param lane The priority of the event
+	 *
+	 * @returns true if the event was written
+	 *
+	 * If there's a limit on the number of events or bytes, events are removed to make room first.
+	 *
+	 * Note: You must obtain a mutex lock before calling this!
+	 */
+	bool appendPriorityRecord(const uint8_t *buf, size_t size, uint8_t lane) {
+		makeRoom(1, size, lane);
 
-					fram.writeData(nextFree, (uint8_t *)&eventBuf, size);
+		openSegment(PRIORITY_SEGMENT);
+		if (priorityHeader.magic != PUBLISH_QUEUE_FILE_HEADER_MAGIC && !initEventsFile(priorityHeader)) {
+			PUBLISH_QUEUE_LOG_ERROR("failed to create priority file");
+			priorityHeader.magic = 0;
+			return false;
+		}
+		if (priorityHeader.numEvents == 0xffff) {
+			// numEvents is 16 bits
+			PUBLISH_QUEUE_LOG_INFO("priority file is full");
+			return false;
+		}
 
-					logPublishQueueEventData(&eventBuf);
+		if (writeBytes(priorityHeader.endPos, buf, size) != size) {
+			PUBLISH_QUEUE_LOG_ERROR("failed to write priority event");
+			return false;
+		}
 
-					nextFree += size;
-					header.numEvents++;
-					fram.writeData(start, (uint8_t *)&header, sizeof(PublishQueueHeader));
-					pubqLogger.trace("writing header start=%d size=%u", (int)start, sizeof(PublishQueueHeader));
+		priorityHeader.numEvents++;
+		priorityHeader.endPos += size;
+		bool result = writeHeader(priorityHeader);
 
-					pubqLogger.trace("after saving numEvents=%d nextFree=%d end=%d", (int)header.numEvents, (int)(nextFree - start), len);
+		uint32_t index = getLaneIndex(lane) + laneEvents[lane];
+		laneEvents[lane]++;
+		lastValueInserted(index);
 
-					return true;
-				}
+		PUBLISH_QUEUE_LOG_TRACE("wrote priority %u event index=%lu", lane, (unsigned long)index);
 
-				pubqLogger.info("need to discard event, FRAM is full");
+		return result;
+	}
 
-				// If there's only one event, there's nothing left to discard, this event is too large
-				// to fit with the existing first event (which we can't delete because it might be
-				// in the process of being sent)
-				if (header.numEvents == 1) {
-					return false;
+	/**
+	 * @brief Finds an event in a priority lane in the priority file
+	 *
+	 * @param lane The priority lane
+	 *
+	 * @param skip The number of events in the lane to skip, 0 for the oldest event in the lane
+	 *
+	 * @param eventData Filled in with the event header
+	 *
+	 * @returns The file offset of the event, or 0 if it was not found
+	 *
+	 * Note: You must obtain a mutex lock and open the priority file before calling this!
+	 */
+	size_t findPriorityEvent(uint8_t lane, uint32_t skip, PublishQueueEventData &eventData) {
+		size_t pos = priorityHeader.oldestPos;
+		for(uint16_t ii = priorityHeader.numSent; ii < priorityHeader.numEvents; ii++) {
+			size_t next = skipEvent(pos, (uint8_t *)&eventData, priorityHeader.endPos);
+			if (next == 0) {
+				return 0;
+			}
+			if ((eventData.recordFlags & PUBLISH_QUEUE_RECORD_FLAG_DELETED) == 0 && getPriorityLane(&eventData) == lane) {
+				if (skip == 0) {
+					return pos;
 				}
+				skip--;
 			}
+			pos = next;
+		}
+		return 0;
+	}
 
-			// Discard the oldest event (false) if we're not currently sending.
-			// If we are sending (isSending=true), discard the second oldest event
-			if (!discardOldEvent(isSending)) {
-				// There isn't an event to discard, so we don't have enough room
+	/**
+	 * @brief Calls a function for the events in a priority lane, starting with the oldest event
+	 *
+	 * @returns false if fn returned false or an event could not be read
+	 *
+	 * Each event is read into eventBuf before calling fn.
+	 *
+	 * Note: You must obtain a mutex lock and open the priority file before calling this!
+	 */
+	bool forEachPriorityEvent(uint8_t lane, std::function<bool(const PublishQueueEventData *)> fn) {
+		uint32_t count = 0;
+		size_t addr = priorityHeader.oldestPos;
+		for(uint16_t ii = priorityHeader.numSent; ii < priorityHeader.numEvents && count < laneEvents[lane]; ii++) {
+			PublishQueueEventData *eventData = (PublishQueueEventData *)eventBuf;
+			size_t next = skipEvent(addr, eventBuf, priorityHeader.endPos);
+			if (next == 0) {
 				return false;
 			}
+			if ((eventData->recordFlags & PUBLISH_QUEUE_RECORD_FLAG_DELETED) == 0 && getPriorityLane(eventData) == lane) {
+				size_t len = next - addr - sizeof(PublishQueueEventData);
+				if (readBytes(addr + sizeof(PublishQueueEventData), &eventBuf[sizeof(PublishQueueEventData)], len) != len || !fn(eventData)) {
+					return false;
+				}
+				count++;
+			}
+			addr = next;
 		}
-
-		// Not reached
-		return false;
+		return true;
 	}
 
 	/**
-	 * @brief Get the oldest event that hasn't been published yet
+	 * @brief Removes an event from the priority file
 	 *
-	 * Returns a pointer to a PublishQueueEventData structure in the publishBuf member variable.
-	 * This will remain valid until getOldestEvent() is called again.
+	 * @param lane The priority lane of the event
+	 *
+	 * @param skip The number of events in the lane before it, 0 for the oldest event in the lane
+	 *
+	 * @returns true if the event was removed
+	 *
+	 * If it's the oldest event in the file, oldestPos is advanced past it and the deleted events after it.
+	 * Otherwise it's marked as deleted. When there are no unsent events left, the priority file is removed.
+	 *
+	 * Note: You must obtain a mutex lock before calling this!
 	 */
-	virtual PublishQueueEventData *getOldestEvent() {
-		StMutexLock lock(this);
-
-		if (header.numEvents == 0) {
-			return NULL;
+	bool removePriorityEvent(uint8_t lane, uint32_t skip) {
+		openSegment(PRIORITY_SEGMENT);
+
+		// This may be called from appendEvents, so the event header is not read into eventBuf
+		PublishQueueEventData eventData;
+		size_t pos = findPriorityEvent(lane, skip, eventData);
+		if (pos == 0) {
+			PUBLISH_QUEUE_LOG_ERROR("priority event not found lane=%u", lane);
+			return false;
+		}
+		laneEvents[lane]--;
+
+		if (pos != priorityHeader.oldestPos) {
+			eventData.recordFlags |= PUBLISH_QUEUE_RECORD_FLAG_DELETED;
+			writeBytes(pos + offsetof(PublishQueueEventData, recordFlags), (const uint8_t *)&eventData.recordFlags, sizeof(eventData.recordFlags));
+			unsyncedWrites++;
+			priorityDeletedEvents++;
+			priorityDeletedBytes += eventData.size;
+			return true;
 		}
 
-		size_t addr = start + sizeof(PublishQueueHeader);
-		skipEvent(addr, publishBuf);
+		priorityHeader.numSent++;
+		priorityHeader.oldestPos += eventData.size;
+		while(priorityDeletedEvents != 0 && priorityHeader.numSent < priorityHeader.numEvents) {
+			if (skipEvent(priorityHeader.oldestPos, (uint8_t *)&eventData, priorityHeader.endPos) == 0 ||
+				(eventData.recordFlags & PUBLISH_QUEUE_RECORD_FLAG_DELETED) == 0) {
+				break;
+			}
+			priorityDeletedEvents--;
+			priorityDeletedBytes -= (eventData.size < priorityDeletedBytes) ? eventData.size : priorityDeletedBytes;
+			priorityHeader.numSent++;
+			priorityHeader.oldestPos += eventData.size;
+		}
 
-		// skipEvent will leave the event in publishBuf, which we then return
-		pubqLogger.trace("getOldestEvent found an event addr=%u", addr);
+		// The header is written even if the file is removed, in case removing it fails
+		writeHeader(priorityHeader);
+		if (getPriorityEvents() == 0) {
+			resetPriorityFile();
+		}
+		return true;
+	}
 
-		return (PublishQueueEventData *)publishBuf;
+	/**
+	 * @brief Removes the oldest event in the priority file that's not being sent, with a priority of lane or lower
+	 *
+	 * @returns true if an event was removed
+	 *
+	 * Note: You must obtain a mutex lock before calling this!
+	 */
+	bool evictPriorityEvent(uint8_t lane) {
+		uint32_t first = getFirstUnsentIndex();
+
+		for(uint8_t ii = 1; ii <= lane; ii++) {
+			uint32_t index = getLaneIndex(ii);
+			uint32_t sending = (first > index) ? first - index : 0;
+			if (sending < laneEvents[ii] && removePriorityEvent(ii, sending)) {
+				PUBLISH_QUEUE_LOG_TRACE("discarding priority %u event to make room", ii);
+				countDiscardedEvent(index + sending);
+				metrics.evicted++;
+				return true;
+			}
+		}
+		return false;
 	}
 
 	/**
-	 * @brief Remove any saved events
+	 * @brief Removes events until count events of len bytes fit in the limits set by withMaxEvents() and withMaxBytes()
 	 *
-	 * @return Always returns true.
+	 * @param lane The priority of the events. Normal priority events are removed first, then events
+	 * in the priority file with the same or a lower priority.
 	 *
-	 * Since the FRAM code copies the event being published to a separate buffer, the events can always be cleared.
+	 * If no more events can be removed, the events are added anyway.
+	 *
+	 * Note: You must obtain a mutex lock before calling this!
 	 */
-	virtual bool clearEvents() {
-		StMutexLock lock(this);
-		header.numEvents = 0;
-		fram.writeData(start, (uint8_t *)&header, sizeof(PublishQueueHeader));
+	void makeRoom(uint16_t count, size_t len, uint8_t lane) {
+		while((maxEvents != 0 && getFileEvents() + getPriorityEvents() + count > maxEvents) ||
+			(maxBytes != 0 && getFileBytes() + getPriorityBytes() + len > maxBytes)) {
+			if (!evictEvent() && !evictPriorityEvent(lane)) {
+				break;
+			}
+		}
+	}
 
-		nextFree = start + sizeof(PublishQueueHeader);
-		isSending = false;
-		lastPublish = 0;
+	/**
+	 * @brief Gets the file header for the tail segment, where events are appended
+	 *
+	 * This is header if there's only one segment (or segments are not used), otherwise tailHeader.
+	 */
+	PublishQueueFileHeader &getTailHeader() {
+		return (headSegment == tailSegment) ? header : tailHeader;
+	}
 
-		pubqLogger.trace("clearEvents numEvents=%d size=%d", (int)header.numEvents, (int)header.size);
+	/**
+	 * @brief Gets the number of unsent events from a file header, or 0 if it's not valid
+	 */
+	static uint32_t getUnsentEvents(const PublishQueueFileHeader &fileHeader) {
+		if (fileHeader.magic == PUBLISH_QUEUE_FILE_HEADER_MAGIC && fileHeader.numSent < fileHeader.numEvents) {
+			return fileHeader.numEvents - fileHeader.numSent;
+		}
+		return 0;
+	}
 
-		return true;
+	/**
+	 * @brief Gets the number of bytes of unsent events from a file header, or 0 if it's not valid
+	 */
+	static uint32_t getUnsentBytes(const PublishQueueFileHeader &fileHeader) {
+		if (getUnsentEvents(fileHeader) != 0 && fileHeader.oldestPos < fileHeader.endPos) {
+			return fileHeader.endPos - fileHeader.oldestPos;
+		}
+		return 0;
 	}
 
 	/**
-	 * @brief Discards the oldest event or second oldest event
+	 * @brief Gets the number of unsent events in the events file or segment files, not including deleted events
 	 *
-	 * @param secondEvent True to discard the second oldest event
+	 * Note: You must obtain a mutex lock before calling this!
+	 */
+	uint32_t getFileEvents() const {
+		uint32_t numEvents = getUnsentEvents(header) + middleEvents;
+		if (headSegment != tailSegment) {
+			numEvents += getUnsentEvents(tailHeader);
+		}
+		return (numEvents > deletedEvents) ? numEvents - deletedEvents : 0;
+	}
+
+	/**
+	 * @brief Gets the number of bytes of unsent events in the events file or segment files, not including deleted events
 	 *
-	 * When using retained memory, the getOldestEvent() function returns a pointer to retained memory. This
-	 * pointer must remain valid while in the process of publishing. If the retained buffer is full, we
-	 * want to discard and old event to make room for a newer event, but we can't dispose of the oldest
-	 * event, because it may be in use, so we pass true for secondEvent.
+	 * Note: You must obtain a mutex lock before calling this!
 	 */
-	virtual bool discardOldEvent(bool secondEvent) {
+	uint32_t getFileBytes() const {
+		uint32_t numBytes = getUnsentBytes(header) + middleBytes;
+		if (headSegment != tailSegment) {
+			numBytes += getUnsentBytes(tailHeader);
+		}
+		return (numBytes > deletedBytes) ? numBytes - deletedBytes : 0;
+	}
 
-		StMutexLock lock(this);
+	/**
+	 * @brief Removes the oldest event in the events file or head segment
+	 *
+	 * @returns true if an event was removed. false if there are no unsent events in the file, or if the
+	 * oldest event's header was not valid, in which case skipInvalidEvent() removed and counted it.
+	 *
+	 * If this was the last unsent event, the file is truncated, or if there are more segments, the
+	 * head segment is removed.
+	 *
+	 * Note: You must obtain a mutex lock before calling this!
+	 */
+	bool discardHeadEvent() {
+		if (header.numSent >= header.numEvents) {
+			return false;
+		}
+		openSegment(headSegment);
 
-		if (header.numEvents == 0) {
+		// This may be called from appendEvents, so the event header is not read into eventBuf
+		PublishQueueEventData eventData;
+		size_t next = skipEvent(header.oldestPos, (uint8_t *)&eventData);
+		if (next == 0) {
+			skipInvalidEvent();
 			return false;
 		}
 
-		size_t addr = start + sizeof(PublishQueueHeader);
-		size_t prevAddr = addr;
+		if ((eventData.recordFlags & PUBLISH_QUEUE_RECORD_FLAG_DELETED) != 0 && deletedEvents != 0) {
+			deletedEvents--;
+			deletedBytes -= (eventData.size < deletedBytes) ? eventData.size : deletedBytes;
+		}
 
+		header.numSent++;
+		header.oldestPos = next;
+		if (header.numSent == header.numEvents) {
+			if (headSegment == tailSegment) {
+				// PUBLISH_QUEUE_LOG_TRACE("sent all events, truncating file");
+				resetEvents();
+			}
+			else {
+				// Remove the head segment instead of updating it
+				advanceHeadSegment();
+			}
+		}
+		else {
+			writeHeader();
+		}
 
-		uint16_t ii = 1;
+		//PUBLISH_QUEUE_LOG_TRACE("discardHeadEvent numEvents=%u numSent=%u oldestPos=%u", header.numEvents, header.numSent, header.oldestPos);
 
-		// Skip the first event
-		addr = skipEvent(addr, eventBuf);
+		return true;
+	}
 
-		// If we're currently publishing, delete the second event instead
-		if (secondEvent) {
-			if (header.numEvents == 1) {
-				// Only have one event so we can't delete the second event
-				return false;
+	/**
+	 * @brief Removes the oldest event in the events file or head segment when its header is not valid,
+	 * keeping the valid events after it
+	 *
+	 * The size in the header can't be used to skip the event, so the file is searched 4 bytes at a time
+	 * for the first offset from which the event headers lead exactly to endPos, and the events from there
+	 * on are kept. If there isn't one, the rest of the head segment is discarded. Either way, the unsent
+	 * events removed are counted as discarded and in getMetrics().corrupted. Only event headers are read,
+	 * so this can be called while eventBuf or publishBuf hold an event. The crc of each event kept is
+	 * checked when getOldestEvent() reads it.
+	 *
+	 * Note: You must obtain a mutex lock before calling this!
+	 */
+	void skipInvalidEvent() {
+		openSegment(headSegment);
+
+		uint32_t oldEvents = getFileEvents();
+		uint32_t unsent = getUnsentEvents(header);
+
+		size_t pos;
+		uint32_t numEvents = 0;
+		for(pos = header.oldestPos + 4; pos < header.endPos; pos += 4) {
+			size_t next = pos;
+			for(numEvents = 0; numEvents < unsent && next != 0 && next < header.endPos; numEvents++) {
+				PublishQueueEventData eventData;
+				next = skipEvent(next, (uint8_t *)&eventData);
+			}
+			if (next == header.endPos && numEvents < unsent) {
+				break;
 			}
-			prevAddr = addr;
-			addr = skipEvent(addr, eventBuf);
-			ii++;
 		}
 
-		pubqLogger.trace("discardOldestEvent secondEvent=%d addr=%d prevAddr=%d nextFree=%d", (int)secondEvent, (int)addr, (int)prevAddr, (int)nextFree);
+		// Deleted events are counted again from the new oldest event
+		deletedEvents = deletedBytes = 0;
+		if (pos < header.endPos) {
+			PUBLISH_QUEUE_LOG_ERROR("event invalid at oldestPos=%u, skipping to pos=%u", header.oldestPos, pos);
+			header.numSent = header.numEvents - numEvents;
+			header.oldestPos = pos;
+			writeHeader();
+		}
+		else {
+			PUBLISH_QUEUE_LOG_ERROR("event invalid at oldestPos=%u, discarding the events after it", header.oldestPos);
+			resetEvents();
+			advanceHeadSegment();
+		}
+		if (header.numSent < header.numEvents) {
+			deleteNextEvent(false);
+		}
+		openSegment(headSegment);
 
-		if (nextFree > addr) {
-			// pubqLogger.info("moveData from %u to %u len=%u", addr, prevAddr, nextFree - addr);
-			fram.moveData(addr, prevAddr, nextFree - addr);
+		for(uint32_t ii = getFileEvents(); ii < oldEvents; ii++) {
+			countDiscardedEvent(getLaneIndex(0));
+			metrics.corrupted++;
 		}
-		nextFree -= (addr - prevAddr);
+		updateUsageMetrics();
+	}
 
-		header.numEvents--;
-		fram.writeData(start, (uint8_t *)&header, sizeof(PublishQueueHeader));
+	/**
+	 * @brief Removes an event to make room for new events
+	 *
+	 * @returns true if an event was removed, or false if there are no events that can be removed
+	 *
+	 * The oldest normal priority event is removed, unless it's being sent. Then the next event is marked
+	 * as deleted instead of rewriting the file.
+	 *
+	 * Note: You must obtain a mutex lock before calling this!
+	 */
+	bool evictEvent() {
+		if (header.numSent >= header.numEvents) {
+			return false;
+		}
 
-		pubqLogger.trace("after discardOldestEvent numEvents=%d nextFree=%d", header.numEvents, (int)nextFree);
+		uint32_t index = getLaneIndex(0);
+		if (isSending && getFirstUnsentIndex() > index) {
+			if (!deleteNextEvent()) {
+				return false;
+			}
+			metrics.evicted++;
+			return true;
+		}
 
+		PUBLISH_QUEUE_LOG_TRACE("discarding oldest event to make room");
+		uint32_t oldDeletedEvents = deletedEvents;
+		if (!discardHeadEvent()) {
+			// The oldest event's header was not valid, and skipInvalidEvent() removed and counted it
+			return true;
+		}
+		if (deletedEvents == oldDeletedEvents) {
+			// Only count it if it was not already marked as deleted
+			countDiscardedEvent(index);
+			metrics.evicted++;
+		}
 		return true;
 	}
 
 	/**
-	 * @brief Given an address in FRAM, finds the offset of the next event
+	 * @brief Marks the oldest event after the event being sent (and previously deleted events) as deleted
 	 *
-	 * @param addr Where to start (address in FRAM, not relative to start!)
+	 * @param markEvent true to mark an event as deleted, or false to only count the events already
+	 * marked as deleted, which is done in setup().
+	 *
+	 * @returns true if an event was marked as deleted
 	 *
-	 * @param buf Buffer to store the event in. Typically either eventBuf or publishBuf.
+	 * Only the recordFlags in the event header are written. Deleted events remain in the file until
+	 * they become the oldest event, so they're always in one run at or just after the oldest event.
 	 *
-	 * @returns Address of the the next event
+	 * Note: You must obtain a mutex lock before calling this!
 	 */
-	size_t skipEvent(size_t addr, uint8_t *buf) {
-		char bufName[16];
-		if (buf == eventBuf) {
-			strcpy(bufName, "event");
-		}
-		else if (buf == publishBuf) {
-			strcpy(bufName, "publish");
+	bool deleteNextEvent(bool markEvent = true) {
+		uint32_t segment;
+		size_t pos;
+
+		if (deletedEvents != 0) {
+			// Continue after the last deleted event
+			segment = deleteSegment;
+			pos = deletePos;
 		}
 		else {
-			snprintf(bufName, sizeof(bufName), "0x%x", (int)buf);
+			segment = headSegment;
+			pos = header.oldestPos;
 		}
 
-		pubqLogger.trace("skipEvent buf=%s addr=%u", bufName, addr);
-
-		PublishQueueEventData *eventDataStruct = (PublishQueueEventData *)buf;
-
-		fram.readData(addr, buf, sizeof(PublishQueueEventData));
+		size_t endPos = getSegmentEndPos(segment);
+		while(true) {
+			if (pos >= endPos) {
+				if (segment == tailSegment) {
+					// Only the event being sent is left
+					return false;
+				}
+				segment++;
+				pos = sizeof(PublishQueueFileHeader);
+				endPos = getSegmentEndPos(segment);
+				continue;
+			}
 
-		fram.readData(addr + sizeof(PublishQueueEventData), &buf[sizeof(PublishQueueEventData)], eventDataStruct->size);
-		
-		logPublishQueueEventData(buf);
+			// Called from appendEvents, so the event header is not read into eventBuf
+			openSegment(segment);
+			PublishQueueEventData eventData;
+			if (readBytes(pos, (uint8_t *)&eventData, sizeof(PublishQueueEventData)) != sizeof(PublishQueueEventData) || !isValidEventHeader(&eventData, endPos - pos)) {
+				PUBLISH_QUEUE_LOG_ERROR("event invalid at pos=%u, not deleting", pos);
+				return false;
+			}
 
-		size_t next = addr + eventDataStruct->size;
+			bool wasDeleted = (eventData.recordFlags & PUBLISH_QUEUE_RECORD_FLAG_DELETED) != 0;
+			if (!wasDeleted && segment == headSegment && pos == header.oldestPos) {
+				// Skip the oldest event, which is being sent
+				pos += eventData.size;
+				continue;
+			}
+			if (!wasDeleted) {
+				if (!markEvent) {
+					return false;
+				}
+				eventData.recordFlags |= PUBLISH_QUEUE_RECORD_FLAG_DELETED;
+				writeBytes(pos + offsetof(PublishQueueEventData, recordFlags), (const uint8_t *)&eventData.recordFlags, sizeof(eventData.recordFlags));
+				unsyncedWrites++;
+				countDiscardedEvent(getLaneIndex(0) + 1);
+			}
 
-		pubqLogger.trace("skipEvent addr=%u next=%u", addr, next);
+			deletedEvents++;
+			deletedBytes += eventData.size;
+			pos += eventData.size;
+			deleteSegment = segment;
+			deletePos = pos;
 
-		return next;
+			if (!wasDeleted) {
+				PUBLISH_QUEUE_LOG_TRACE("deleted second oldest event to make room");
+				return true;
+			}
+		}
 	}
 
 	/**
-	 * @brief Get the number of events in the queue (0 = empty)
+	 * @brief Gets the endPos from the file header of a segment
+	 *
+	 * Note: You must obtain a mutex lock before calling this!
 	 */
-	uint16_t getNumEvents() const {
-		uint16_t numEvents = 0;
-
-		{
-			StMutexLock lock(this);
-
-			numEvents = header.numEvents;
+	size_t getSegmentEndPos(uint32_t segment) {
+		if (segment == headSegment) {
+			return header.endPos;
+		}
+		if (segment == tailSegment) {
+			return tailHeader.endPos;
 		}
 
-		return numEvents;
+		PublishQueueFileHeader fileHeader;
+		openSegment(segment);
+		if (readBytes(0, (uint8_t *)&fileHeader, sizeof(PublishQueueFileHeader)) != sizeof(PublishQueueFileHeader) || fileHeader.magic != PUBLISH_QUEUE_FILE_HEADER_MAGIC) {
+			return 0;
+		}
+		return fileHeader.endPos;
 	}
 
-
-protected:
-	MB85RC &fram;		//!< Object for the FRAM
-	size_t start;		//!< Start offset (0 = beginning of FRAM)
-	size_t len;			//!< Length to use (relative to start!)
-
-	/**
-	 * @brief The header, copied from FRAM
-	 */
-	PublishQueueHeader header;
-
 	/**
-	 * @brief This holds a single event during scanning and writing.
+	 * @brief Appends events to the tail segment and updates its file header
 	 *
-	 * Because the data needs to be in RAM to be written to FRAM, this buffer is required.
-	 */
-	uint8_t eventBuf[EVENT_BUF_SIZE];
-
-	/**
-	 * @brief This holds a single event during publish.
+	 * @param buf Buffer containing one or more events
 	 *
-	 * Because the publish code does not copy the data, we need to keep the data around
-	 * even after getOldestEvent() returns. This is the buffer that holds the data.
+	 * @param len Length of the events in bytes
 	 *
-	 * It's separate from eventBuf because eventBuf is used to publish new data to the queue.
-	 */
-	uint8_t publishBuf[EVENT_BUF_SIZE];
-
-	/**
-	 * @brief Offset of the next free entry in FRAM. This includes "start" so don't add it again!
+	 * @param count Number of events in buf
+	 *
+	 * @returns true if the events were written
+	 *
+	 * If there's a limit on the number of events or bytes, events are removed to make room first. If
+	 * segments are used and the events don't fit in the tail segment, a new segment is started.
+	 *
+	 * Note: You must obtain a mutex lock and open the events file before calling this!
 	 */
-	size_t nextFree = 0;
-};
+	bool appendEvents(const uint8_t *buf, size_t len, uint16_t count) {
+		makeRoom(count, len, 0);
+
+		if (segmented) {
+			PublishQueueFileHeader &fileHeader = getTailHeader();
+			if (fileHeader.numEvents != 0 &&
+				((segmentSize != 0 && fileHeader.endPos + len > segmentSize) || (uint32_t)fileHeader.numEvents + count > 0xffff)) {
+				if (!addSegment()) {
+					return false;
+				}
+			}
+		}
+		openSegment(tailSegment);
 
-#endif /* __MB85RC256V_FRAM_RK */
+		PublishQueueFileHeader &fileHeader = getTailHeader();
 
+		// Write at the end of the events. Normally this is the end of the file.
+		if (writeBytes(fileHeader.endPos, buf, len) != len) {
+			PUBLISH_QUEUE_LOG_ERROR("failed to write events");
+			return false;
+		}
 
-#if defined(__SPIFFSPARTICLERK_H) || defined(SdFat_h) || defined(DOXYGEN_BUILD) || defined(HAL_PLATFORM_FILESYSTEM)
-#ifndef PUBLISH_QUEUE_USE_FS
-#define PUBLISH_QUEUE_USE_FS
-#endif
-#endif
+		// Update the file header
+		fileHeader.numEvents += count;
+		fileHeader.endPos += len;
+		bool result = writeHeader(fileHeader);
 
-#ifdef PUBLISH_QUEUE_USE_FS
-// This section is for file system-based storage methods (SPIFFS, SdFat, etc.)
+		PUBLISH_QUEUE_LOG_TRACE("after writing numEvents=%u endPos=%u", fileHeader.numEvents, fileHeader.endPos);
 
-/**
- * @brief Abstract base class for file system-based storage
- */
-class PublishQueueAsyncFileSystemBase : public PublishQueueAsyncBase {
-public:
-	/**
-	 * @brief Abstract base constructor. Doesn't do anything.
-	 */
-	PublishQueueAsyncFileSystemBase() {
+		return result;
 	}
 
 	/**
-	 * @brief Abstract base destructor. Doesn't do anything.
+	 * @brief Starts a new tail segment
+	 *
+	 * The new segment file is created before the segment header is updated, so a reset in between
+	 * only leaves an empty segment file that is reused by the next addSegment().
+	 *
+	 * Note: You must obtain a mutex lock and open the events file before calling this!
 	 */
-	virtual ~PublishQueueAsyncFileSystemBase() {
+	bool addSegment() {
+		PublishQueueFileHeader newHeader;
 
-	}
-	/**
-	 * @brief Open the events file
-	 */
-	virtual bool openFile() = 0;
+		openSegment(tailSegment + 1);
+		if (!initEventsFile(newHeader)) {
+			PUBLISH_QUEUE_LOG_ERROR("failed to create segment %lu", (unsigned long)(tailSegment + 1));
+			openSegment(tailSegment);
+			return false;
+		}
 
-	/**
-	 * @brief Close the events file
-	 */
-	virtual bool closeFile() = 0;
+		if (headSegment != tailSegment) {
+			// The old tail segment is now between the head and tail segments
+			middleEvents += getUnsentEvents(tailHeader);
+			middleBytes += getUnsentBytes(tailHeader);
+		}
+		tailHeader = newHeader;
+		tailSegment++;
 
-	/**
-	 * @brief Truncate a file to a specified length in bytes
-	 *
-	 * @param size Size is bytes. Must be <= the current length of the file.
-	 *
-	 * Note: Do not use truncate to make the file larger! While this works for POSIX, it
-	 * does not work for SPIFFS so we just always assumes it does not work.
-	 */
-	virtual bool truncate(size_t size) = 0;
+		PUBLISH_QUEUE_LOG_TRACE("started segment %lu", (unsigned long)tailSegment);
 
-	/**
-	 * @brief Read bytes from the file
-	 *
-	 * @param seekTo The file offset to seek to if >= 0. Must be <= file length. Or pass
-	 * -1 to seek to the end of the file to append.
-	 *
-	 * @param buffer Buffer to fill with data
-	 *
-	 * @param length Number of bytes to read. Can be > than the number of bytes in the file.
-	 *
-	 * @returns Number of bytes read. Returns 0 on error.
-	 */
-	virtual size_t readBytes(int seekTo, uint8_t *buffer, size_t length) = 0;
+		if (!convertingToSegments) {
+			writeSegmentHeader();
+		}
+		return true;
+	}
 
 	/**
-	 * @brief Write bytes to the file
+	 * @brief Removes head segments that have no unsent events, up to the tail segment
 	 *
-	 * @param seekTo The file offset to seek to if >= 0. Must be <= file length. Or pass
-	 * -1 to seek to the end of the file to append.
-	 *
-	 * @param buffer Buffer to write to the file
+	 * The segment file is removed before the segment header is updated. If the device resets in
+	 * between, the missing head segment is skipped in setup().
 	 *
-	 * @param length Number of bytes to write.
-	 */
-	virtual size_t writeBytes(int seekTo, const uint8_t *buffer, size_t length) = 0;
-
-	/**
-	 * @brief Get length of the file (or a negative error code on error)
+	 * Note: You must obtain a mutex lock and open the events file before calling this!
 	 */
-	virtual int getLength() = 0;
+	void advanceHeadSegment() {
+		bool changed = false;
 
-};
+		while(headSegment != tailSegment && header.numSent >= header.numEvents) {
+			removeSegment(headSegment++);
+			changed = true;
 
-/**
- * @brief Class to automatically open and close the events file. Create as a variable on the stack.
- *
- * This is used to make sure the file is always closed, for example if there is a return
- * statement in the middle of the function. When the stack variable goes out of scope it will
- * always close the file.
- */
-class StFileOpenClose {
-public:
-	/**
-	 * @brief Constructor opens the events file
-	 */
-	StFileOpenClose(PublishQueueAsyncFileSystemBase *fs) : fs(fs) {
-		fs->openFile();
-	}
+			if (headSegment == tailSegment) {
+				header = tailHeader;
+			}
+			else {
+				// The number of unsent events in the segment was counted from its file header, which
+				// doesn't change once it's no longer the tail segment
+				openSegment(headSegment);
+				if (readBytes(0, (uint8_t *)&header, sizeof(PublishQueueFileHeader)) != sizeof(PublishQueueFileHeader)) {
+					memset(&header, 0, sizeof(header));
+				}
+				uint32_t unsent = getUnsentEvents(header);
+				middleEvents -= (unsent < middleEvents) ? unsent : middleEvents;
+				unsent = getUnsentBytes(header);
+				middleBytes -= (unsent < middleBytes) ? unsent : middleBytes;
+
+				// eventBuf can hold an event being appended, so the event crcs are not checked here. They're
+				// checked when getOldestEvent() reads each event.
+				loadEventsFile(false);
+			}
+		}
 
-	/**
-	 * @brief Destructor closes the events file
-	 */
-	~StFileOpenClose() {
-		fs->closeFile();
+		if (changed) {
+			writeSegmentHeader();
+		}
 	}
 
 	/**
-	 * @brief File system base object, used so closeFile() can be called on it from the destructor.
-	 */
-	PublishQueueAsyncFileSystemBase *fs;
-};
-
-/**
- * @brief Abstract class for file system-based events storage (SPIFFS, SdCard, etc.)
- *
- * All of the file systems work in a similar manner, with only a set of virtual methods
- * like openFile(), readBytes, writeBytes(), etc. subclasses for each concrete subclass.
- *
- * Each operation is atomic. The mutex is obtained, the file opened, manipulated,
- * then closed. This less efficient than keeping the file open, but is less likely to
- * lose data if the device is reset. It also makes file system corruption less likely.
- *
- * The file contains binary data, basically the same thing as retained memory, with a
- * few minor changes.
- *
- * The file begins with a file header, just like the retained memory version. It has
- * magic bytes and other fields that can be used to check validity.
- *
- * The size in the file header is not the size of the file, since that's unnecessary.
- * It is, however, the number of events that have already been sent, as explained below.
- *
- * In setup() the file integrity is checked. If the events file is not valid, then the
- * contents are deleted.
- *
- * When a publish is queued, the event is appeneded to the file and the numEvents in the
- * header updated.
- *
- * When a publish is completed, the size in the header (actually, the number of events sent)
- * is incremented. If size == numEvents, then both are set to 0 and the file truncated
- * to the size of the file header.
- *
- * The reason for this is that unlike RAM or FRAM, it's really inefficient to remove
- * data from the beginning of the file. Since the most common situation is that a
- * bunch of events are queued and eventually all of them are transmitted, the code
- * is optimized for this most common situation.
- */
-class PublishQueueAsyncFileSystem : public PublishQueueAsyncFileSystemBase {
-public:
-	/**
-	 * @brief Abstract base class constructor
+	 * @brief Closes and removes a segment file
+	 *
+	 * Note: You must obtain a mutex lock before calling this!
 	 */
-	PublishQueueAsyncFileSystem() {
+	void removeSegment(uint32_t segment) {
+		selectSegment(segment);
+		if (fileIsOpen) {
+			closeFile();
+			fileIsOpen = false;
+		}
+		if (!removeFile()) {
+			PUBLISH_QUEUE_LOG_ERROR("failed to remove segment %lu", (unsigned long)segment);
+		}
+		PUBLISH_QUEUE_LOG_TRACE("removed segment %lu", (unsigned long)segment);
 	}
 
 	/**
-	 * @brief Abstract base class destructor
+	 * @brief Writes the head and tail segment numbers to the events file
+	 *
+	 * Note: You must obtain a mutex lock before calling this!
 	 */
-	virtual ~PublishQueueAsyncFileSystem() {
+	bool writeSegmentHeader() {
+		PublishQueueSegmentHeader segmentHeader;
+		segmentHeader.magic = PUBLISH_QUEUE_SEGMENT_HEADER_MAGIC;
+		segmentHeader.headSegment = headSegment;
+		segmentHeader.tailSegment = tailSegment;
+		segmentHeader.reserved = 0;
+
+		openSegment(0);
+		unsyncedWrites++;
+		return writeBytes(0, (uint8_t *)&segmentHeader, sizeof(PublishQueueSegmentHeader)) == sizeof(PublishQueueSegmentHeader);
 	}
 
 	/**
-	 * @brief setup() must be called from the main setup() function!
+	 * @brief Loads the head and tail segments at startup
+	 *
+	 * @param segmentHeader The segment header read from the events file
+	 *
+	 * @returns false if a segment file header could not be written
+	 *
+	 * Head segments with no unsent events are removed. The headers of the segments between the head and
+	 * tail segments are read to count their events.
+	 *
+	 * Note: You must obtain a mutex lock before calling this!
 	 */
-	virtual void setup() {
-		// Do superclass setup (starting the thread)
-		PublishQueueAsyncBase::setup();
-
-		// Lock the mutex and open the events file. Closes and unlocks the mutex on exit.
-		StMutexLock lock(this);
+	bool loadSegments(const PublishQueueSegmentHeader &segmentHeader) {
+		segmented = true;
+		middleEvents = middleBytes = 0;
+
+		headSegment = segmentHeader.headSegment;
+		tailSegment = segmentHeader.tailSegment;
+		if (headSegment == 0 || tailSegment < headSegment) {
+			PUBLISH_QUEUE_LOG_INFO("invalid segment header head=%lu tail=%lu, reinitializing", (unsigned long)headSegment, (unsigned long)tailSegment);
+			headSegment = tailSegment = 1;
+			openSegment(headSegment);
+			if (!initEventsFile(header)) {
+				return false;
+			}
+			return writeSegmentHeader();
+		}
 
-		{
-			StFileOpenClose openClose(this);
+		bool changed = false;
+		while(true) {
+			openSegment(headSegment);
+			if (!loadEventsFile()) {
+				return false;
+			}
+			if (headSegment == tailSegment || header.numSent < header.numEvents) {
+				break;
+			}
+			removeSegment(headSegment++);
+			changed = true;
+		}
 
-			// Initialize the file
-			bool initBuffer = false;
+		if (headSegment != tailSegment) {
+			PublishQueueFileHeader headHeader = header;
 
-			size_t len = (size_t) getLength();
+			for(uint32_t segment = headSegment + 1; segment < tailSegment; segment++) {
+				PublishQueueFileHeader fileHeader;
+				openSegment(segment);
+				if (readBytes(0, (uint8_t *)&fileHeader, sizeof(PublishQueueFileHeader)) == sizeof(PublishQueueFileHeader)) {
+					middleEvents += getUnsentEvents(fileHeader);
+					middleBytes += getUnsentBytes(fileHeader);
+				}
+			}
 
-			if (len < sizeof(PublishQueueHeader) || readBytes(0, (uint8_t *)&header, sizeof(PublishQueueHeader)) != sizeof(PublishQueueHeader)) {
-				initBuffer = true;
-				pubqLogger.info("no data in events file, will generate new");
+			openSegment(tailSegment);
+			if (!loadEventsFile()) {
+				return false;
 			}
+			tailHeader = header;
+			header = headHeader;
+		}
 
-			if (!initBuffer && header.magic == PUBLISH_QUEUE_HEADER_MAGIC) {
-				pubqLogger.trace("numEvents=%u numSent=%u", header.numEvents, header.size);
-				oldestPos = sizeof(PublishQueueHeader);
+		if (changed) {
+			writeSegmentHeader();
+		}
 
-				if (header.numEvents == header.size) {
-					pubqLogger.info("all events have been sent, reinitializing");
-					initBuffer = true;
-				}
-				else
-				if (header.numEvents > 0) {
-					// Calculate the offset of the oldest event and validate the file structure
-					size_t addr = sizeof(PublishQueueHeader);
-					for(uint16_t ii = 0; ii < header.numEvents; ii++) {
-						size_t next = skipEvent(addr, eventBuf);
-						if (addr == 0) {
-							// Overflowed buffer, must be corrupted
-							pubqLogger.info("Overflowed buffer on initial read, reinitializing");
-							initBuffer = true;
-							break;
-						}
-						if (ii == header.size) {
-							oldestPos = addr;
-						}
-						addr = next;
-					}
-					if (!initBuffer) {
-						pubqLogger.info("file data looks valid oldestPos=%u", oldestPos);
-					}
-				}
+		PUBLISH_QUEUE_LOG_INFO("using segments head=%lu tail=%lu", (unsigned long)headSegment, (unsigned long)tailSegment);
+		return true;
+	}
+
+	/**
+	 * @brief Moves the unsent events in the events file to segment files
+	 *
+	 * @returns false if the events could not be copied or a segment file header could not be written.
+	 * If the events could not be copied, the segment files are removed and the events file is still
+	 * used (segmented is false).
+	 *
+	 * The events file is only replaced with the segment header after all of the events have been
+	 * copied, so if the device resets during conversion, the conversion is done again.
+	 *
+	 * Note: You must obtain a mutex lock and open the events file before calling this!
+	 */
+	bool convertToSegments() {
+		PublishQueueFileHeader fileHeader = header;
+
+		segmented = true;
+		convertingToSegments = true;
+		middleEvents = middleBytes = 0;
+
+		headSegment = tailSegment = 1;
+		openSegment(headSegment);
+		bool copied = initEventsFile(header);
+
+		size_t addr = fileHeader.oldestPos;
+		while(copied && addr < fileHeader.endPos) {
+			// The events file was already validated by loadEventsFile()
+			openSegment(0);
+			PublishQueueEventData *eventData = (PublishQueueEventData *)eventBuf;
+			if (readBytes(addr, eventBuf, sizeof(PublishQueueEventData)) != sizeof(PublishQueueEventData) ||
+				!isValidEventHeader(eventData, fileHeader.endPos - addr)) {
+				copied = false;
+				break;
 			}
-			else {
-				// Not valid
-				initBuffer = true;
-				pubqLogger.info("No magic bytes or invalid length");
+			size_t size = eventData->size;
+			if (readBytes(addr + sizeof(PublishQueueEventData), &eventBuf[sizeof(PublishQueueEventData)], size - sizeof(PublishQueueEventData)) != size - sizeof(PublishQueueEventData)) {
+				copied = false;
+				break;
+			}
+
+			if (!appendEvents(eventBuf, size, 1)) {
+				copied = false;
+				break;
 			}
+			addr += size;
+		}
+		convertingToSegments = false;
 
-			//initBuffer = true; // Uncomment to discard old data
+		if (!copied) {
+			// Leave the events file as it was. The conversion is tried again in the next setup().
+			PUBLISH_QUEUE_LOG_ERROR("failed to copy events at addr=%u to segments, using events file", addr);
+			for(uint32_t segment = headSegment; segment <= tailSegment; segment++) {
+				removeSegment(segment);
+			}
+			segmented = false;
+			headSegment = tailSegment = 0;
+			middleEvents = middleBytes = 0;
+			deletedEvents = deletedBytes = 0;
+			header = fileHeader;
+			openSegment(0);
+			return false;
+		}
 
-			if (initBuffer) {
-				// In case the file is reused, truncate to zero length before adding in the header
-				truncate(0);
+		if (!writeSegmentHeader()) {
+			return false;
+		}
+		truncate(sizeof(PublishQueueSegmentHeader));
 
-				// For file system queues, size is not the size in bytes, but the number of events that have already been sent!
-				header.magic = PUBLISH_QUEUE_HEADER_MAGIC;
-				header.size = 0;
-				header.numEvents = 0;
-				if (!writeBytes(0, (uint8_t *)&header, sizeof(PublishQueueHeader))) {
-					pubqLogger.error("failed to write file header");
-					return;
-				}
+		PUBLISH_QUEUE_LOG_INFO("converted events file to segments head=%lu tail=%lu", (unsigned long)headSegment, (unsigned long)tailSegment);
+		return true;
+	}
 
-				oldestPos = sizeof(PublishQueueHeader);
-				pubqLogger.info("initialized events file");
-			}
-			else {
-				pubqLogger.info("using events file with size=%u numEvents=%u oldestPos=%u", header.size, header.numEvents, oldestPos);
-			}
+	/**
+	 * @brief Removes the staged withLastValueOnly() event that a larger event replaces
+	 *
+	 * @param lastValue The entry, from findLastValueEvent(), of an event in the staging buffer
+	 *
+	 * @param oldSize The size of the staged event
+	 *
+	 * @param size The size of the new event
+	 *
+	 * The old event is only removed if the new event fits in the staging buffer without it. The new
+	 * event is then staged at the end without writing the staged events, so it can't fail.
+	 *
+	 * Note: You must obtain a mutex lock before calling this!
+	 */
+	void removeStagedLastValueEvent(PublishQueueLastValue *lastValue, uint16_t oldSize, size_t size) {
+		if (stagingEnd - oldSize + size > stagingSize) {
+			return;
 		}
 
-		haveSetup = true;
+		PUBLISH_QUEUE_LOG_TRACE("removing staged event index=%lu to replace it", (unsigned long)lastValue->index);
+		memmove(&stagingBuf[lastValue->pos], &stagingBuf[lastValue->pos + oldSize], stagingEnd - lastValue->pos - oldSize);
+		stagingEnd -= oldSize;
+		stagingCount--;
+		if (stagingStart == stagingEnd) {
+			stagingStart = stagingEnd = 0;
+		}
+		forgetLastValuePositions();
+		countDiscardedEvent((uint16_t)lastValue->index);
+		replacedCount++;
 	}
 
 	/**
-	 * @brief Append the publish data to the events file
+	 * @brief Overwrites the unsent event with the name of a withLastValueOnly() entry, if the new event fits
+	 *
+	 * @returns true if the event was replaced, or false if the new event must be queued normally
+	 *
+	 * The parameters are the same as writeEventData(). size is the size from getStoredEventSize().
+	 * The old event is overwritten in place, in the file or in the staging buffer, because events can't
+	 * be removed from the middle of the file. If the new event is larger, a staged old event is removed
+	 * and false is returned so the new event is staged, but an old event in the file is still sent.
+	 *
+	 * Note: You must obtain a mutex lock before calling this!
 	 */
-	virtual bool publishCommon(const char *eventName, const char *data, int ttl, PublishFlags flags1, PublishFlags flags2 = PublishFlags()) {
-		if (!haveSetup) {
+	bool replaceLastValueEvent(PublishQueueLastValue *lastValue, const char *eventName, size_t nameLen, const char *data, size_t dataLen, int ttl, uint8_t flags, size_t size, uint8_t priority) {
+		StFileOpenClose openClose(this, headSegment);
+
+		if (!findLastValueEvent(lastValue)) {
 			return false;
 		}
 
-		if (data == NULL) {
-			data = "";
+		if (lastValue->segment == PublishQueueLastValue::SEGMENT_STAGED) {
+			uint16_t oldSize = ((PublishQueueEventData *)&stagingBuf[lastValue->pos])->size;
+			if (oldSize < size) {
+				removeStagedLastValueEvent(lastValue, oldSize, size);
+				return false;
+			}
+			writeStoredEvent(&stagingBuf[lastValue->pos], eventName, nameLen, data, dataLen, ttl, flags, oldSize, priority);
 		}
-
-		// Size is the size of the header, the two c-strings (with null terminators), rounded up to a multiple of 4
-		size_t size = sizeof(PublishQueueEventData) + strlen(eventName) + strlen(data) + 2;
-		if ((size % 4) != 0) {
-			size += 4 - (size % 4);
+		else {
+			// findLastValueEvent leaves the event header in eventBuf
+			uint16_t oldSize = ((PublishQueueEventData *)eventBuf)->size;
+			if (oldSize < size) {
+				return false;
+			}
+			writeStoredEvent(eventBuf, eventName, nameLen, data, dataLen, ttl, flags, oldSize, priority);
+			openSegment(lastValue->segment);
+			if (writeBytes(lastValue->pos, eventBuf, oldSize) != oldSize) {
+				PUBLISH_QUEUE_LOG_ERROR("failed to replace event");
+				return false;
+			}
+			unsyncedWrites++;
 		}
 
-		//pubqLogger.trace("queueing eventName=%s data=%s ttl=%d flags1=%d flags2=%d size=%d", eventName, data, ttl, flags1.value(), flags2.value(), size);
-
-		StMutexLock lock(this);
-		StFileOpenClose openClose(this);
-
-		// pubqLogger.info("writing event size=%u", size);
-
-		PublishQueueEventData *eventData = (PublishQueueEventData *)eventBuf;
-		eventData->ttl = ttl;
-		eventData->flags = flags1.value() | flags2.value();
-		eventData->size = size;
-
-		char *cp = (char *) eventBuf;
-		cp += sizeof(PublishQueueEventData);
-
-		strcpy(cp, eventName);
-		cp += strlen(cp) + 1;
-
-		strcpy(cp, data);
-
-		// Append to file (-1)
-		writeBytes(-1, (uint8_t *)&eventBuf, size);
+		PUBLISH_QUEUE_LOG_TRACE("replaced event index=%lu", (unsigned long)lastValue->index);
+		replacedCount++;
+		return true;
+	}
 
-		// Update the file header
-		header.numEvents++;
-		writeBytes(0, (uint8_t *)&header, sizeof(PublishQueueHeader));
+	/**
+	 * @brief Finds the unsent event with the name of a withLastValueOnly() entry
+	 *
+	 * @returns true if the event was found. lastValue contains its index and location. If it's in the
+	 * file, its header and name are in eventBuf.
+	 *
+	 * The remembered location is checked by reading the event header and name. The unsent events in all
+	 * segments and the staging buffer are only searched if the state is unknown or the remembered
+	 * event has a different name.
+	 *
+	 * Note: You must obtain a mutex lock and open the events file before calling this!
+	 */
+	bool findLastValueEvent(PublishQueueLastValue *lastValue) {
+		uint32_t first = getFirstUnsentIndex();
 
-		pubqLogger.trace("after writing numEvents=%u fileLength=%d", header.numEvents, getLength());
+		if (lastValue->state == PublishQueueLastValue::STATE_QUEUED) {
+			if (lastValue->index < first) {
+				// The newest event with this name is being sent
+				return false;
+			}
+			if (lastValue->segment == PublishQueueLastValue::SEGMENT_STAGED) {
+				if (lastValue->pos >= stagingStart && lastValue->pos < stagingEnd &&
+					isLastValueEvent(lastValue, (PublishQueueEventData *)&stagingBuf[lastValue->pos])) {
+					return true;
+				}
+			}
+			else
+			if (lastValue->segment >= headSegment && lastValue->segment <= tailSegment &&
+				(lastValue->segment != headSegment || lastValue->pos >= header.oldestPos) &&
+				readEventName(lastValue->segment, lastValue->pos) && isLastValueEvent(lastValue, (PublishQueueEventData *)eventBuf)) {
+				return true;
+			}
+		}
+		else
+		if (lastValue->state == PublishQueueLastValue::STATE_NONE) {
+			return false;
+		}
 
-		return true;
+		// Search the unsent normal priority events for the newest one with this name
+		lastValue->state = PublishQueueLastValue::STATE_NONE;
+		uint32_t index = getLaneIndex(0);
+		if (header.numSent < header.numEvents) {
+			for(uint32_t segment = headSegment; ; segment++) {
+				size_t pos = (segment == headSegment) ? header.oldestPos : sizeof(PublishQueueFileHeader);
+				size_t endPos = getSegmentEndPos(segment);
+				while(pos < endPos) {
+					if (!readEventName(segment, pos)) {
+						break;
+					}
+					PublishQueueEventData *eventData = (PublishQueueEventData *)eventBuf;
+					if ((eventData->recordFlags & PUBLISH_QUEUE_RECORD_FLAG_DELETED) == 0) {
+						if (index >= first && isLastValueEvent(lastValue, eventData)) {
+							lastValue->state = PublishQueueLastValue::STATE_QUEUED;
+							lastValue->index = index;
+							lastValue->segment = segment;
+							lastValue->pos = pos;
+						}
+						index++;
+					}
+					pos += eventData->size;
+				}
+				if (segment == tailSegment) {
+					break;
+				}
+			}
+		}
+		for(size_t offset = stagingStart; offset < stagingEnd; ) {
+			const PublishQueueEventData *eventData = (const PublishQueueEventData *)&stagingBuf[offset];
+			if (index >= first && isLastValueEvent(lastValue, eventData)) {
+				lastValue->state = PublishQueueLastValue::STATE_QUEUED;
+				lastValue->index = index;
+				lastValue->segment = PublishQueueLastValue::SEGMENT_STAGED;
+				lastValue->pos = offset;
+			}
+			index++;
+			offset += eventData->size;
+		}
+		if (lastValue->state != PublishQueueLastValue::STATE_QUEUED) {
+			return false;
+		}
 
+		// Leave the header of the event that was found in eventBuf
+		return lastValue->segment == PublishQueueLastValue::SEGMENT_STAGED || readEventName(lastValue->segment, lastValue->pos);
 	}
 
 	/**
-	 * @brief Get the oldest event that hasn't been published yet
+	 * @brief Reads the event header and event name at pos in a segment into eventBuf
 	 *
-	 * Returns a pointer to a PublishQueueEventData structure in the publishBuf member variable.
-	 * This will remain valid until getOldestEvent() is called again.
+	 * @returns false if the event header is not valid
+	 *
+	 * Note: You must obtain a mutex lock and open the events file before calling this!
 	 */
-	virtual PublishQueueEventData *getOldestEvent() {
-		StMutexLock lock(this);
+	bool readEventName(uint32_t segment, size_t pos) {
+		openSegment(segment);
 
-		if (header.size >= header.numEvents) {
-			return NULL;
+		PublishQueueEventData *eventData = (PublishQueueEventData *)eventBuf;
+		if (readBytes(pos, eventBuf, sizeof(PublishQueueEventData)) != sizeof(PublishQueueEventData) ||
+			!isValidEventHeader(eventData, getSegmentEndPos(segment) - pos)) {
+			return false;
 		}
+		size_t count = eventData->nameLen + 1;
+		return readBytes(pos + sizeof(PublishQueueEventData), &eventBuf[sizeof(PublishQueueEventData)], count) == count;
+	}
 
-		{
-			StFileOpenClose openClose(this);
+	/**
+	 * @brief Adds an event to the group commit staging buffer
+	 *
+	 * The staged events are written to the file first if the event doesn't fit, and after adding the
+	 * event if groupCommitEvents events are staged.
+	 *
+	 * Note: You must obtain a mutex lock before calling this!
+	 */
+	bool stageEvent(const char *eventName, size_t nameLen, const char *data, size_t dataLen, int ttl, uint8_t flags, size_t size, uint8_t priority, PublishQueueLastValue *lastValue = NULL) {
+		if (stagingEnd + size > stagingSize) {
+			StFileOpenClose openClose(this, tailSegment);
+			writeStagedEvents();
 
-			size_t next = skipEvent(oldestPos, publishBuf);
-			if (next == 0) {
-				// pubqLogger.trace("getOldestEvent failed, oldestPos=%u, clearing events", oldestPos);
-				return NULL;
+			if (stagingEnd + size > stagingSize) {
+				// Could not write the staged events to the file
+				return false;
 			}
+		}
+
+		writeStoredEvent(&stagingBuf[stagingEnd], eventName, nameLen, data, dataLen, ttl, flags, size, priority);
+		return commitStagedEvent(size, lastValue);
+	}
 
-			// skipEvent will leave the event in publishBuf, which we then return
-			// pubqLogger.trace("getOldestEvent found an event at oldestPos=%u, next=%u", oldestPos, next);
+	/**
+	 * @brief Adds the event that was written at stagingEnd to the staged events
+	 *
+	 * The staged events are written to the file if groupCommitEvents events are staged.
+	 *
+	 * Note: You must obtain a mutex lock before calling this!
+	 */
+	bool commitStagedEvent(size_t size, PublishQueueLastValue *lastValue) {
+		if (stagingCount == 0) {
+			stagingTime = millis();
+		}
 
-			oldestPos = next;
+		if (lastValue != NULL) {
+			lastValue->state = PublishQueueLastValue::STATE_QUEUED;
+			lastValue->index = getLaneIndex(0) + getLaneEvents(0);
+			lastValue->segment = PublishQueueLastValue::SEGMENT_STAGED;
+			lastValue->pos = stagingEnd;
+		}
+		stagingEnd += size;
+		stagingCount++;
 
-			return (PublishQueueEventData *)publishBuf;
+		if (stagingCount >= groupCommitEvents) {
+			StFileOpenClose openClose(this, tailSegment);
+			writeStagedEvents();
 		}
+
+		eventQueued();
+		return true;
 	}
 
 	/**
-	 * @brief Remove any saved events
-	 *
-	 * @return Always returns true.
+	 * @brief Appends an event record, in eventBuf or reserveBuf, to the events file
 	 *
-	 * Since the FRAM code copies the event being published to a separate buffer, the events can always be cleared.
+	 * Note: You must obtain a mutex lock before calling this!
 	 */
-	virtual bool clearEvents() {
-		StMutexLock lock(this);
-		{
-			StFileOpenClose openClose(this);
+	bool appendEvent(const uint8_t *buf, size_t size, PublishQueueLastValue *lastValue) {
+		StFileOpenClose openClose(this, tailSegment);
 
-			header.numEvents = header.size = 0;
-			writeBytes(0, (uint8_t *)&header, sizeof(PublishQueueHeader));
-			return truncate(sizeof(PublishQueueHeader));
+		if (!appendEvents(buf, size, 1)) {
+			return false;
+		}
+
+		if (lastValue != NULL) {
+			lastValue->state = PublishQueueLastValue::STATE_QUEUED;
+			lastValue->index = getLaneIndex(0) + getFileEvents() - 1;
+			lastValue->segment = tailSegment;
+			lastValue->pos = getTailHeader().endPos - size;
 		}
+		eventQueued();
+		return true;
 	}
 
 	/**
-	 * @brief Discard an event
+	 * @brief Overwrites the unsent event with the name of a withLastValueOnly() entry with an event record, if it fits
+	 *
+	 * @returns true if the event was replaced, or false if the record must be queued normally
 	 *
-	 * Note: secondEvent will never be true for file systems, which always append an event
+	 * This is replaceLastValueEvent() for the record committed by reserve(). The record is padded to the
+	 * size of the old event, so the events after it don't move.
+	 *
+	 * Note: You must obtain a mutex lock before calling this!
 	 */
-	virtual bool discardOldEvent(bool secondEvent) {
+	bool replaceLastValueRecord(PublishQueueLastValue *lastValue, const uint8_t *buf, size_t size) {
+		StFileOpenClose openClose(this, headSegment);
 
-		StMutexLock lock(this);
-
-		if (header.numEvents == 0) {
+		if (!findLastValueEvent(lastValue)) {
 			return false;
 		}
 
-		{
-			StFileOpenClose openClose(this);
-
-			header.size++;
-			if (header.size == header.numEvents) {
-				// pubqLogger.trace("sent all events, truncating file");
-				header.size = header.numEvents = 0;
-				oldestPos = sizeof(PublishQueueHeader);
-				truncate(oldestPos);
+		// findLastValueEvent leaves the event header in eventBuf if it's in the file
+		bool staged = (lastValue->segment == PublishQueueLastValue::SEGMENT_STAGED);
+		uint8_t *oldEvent = staged ? &stagingBuf[lastValue->pos] : eventBuf;
+		uint16_t oldSize = ((PublishQueueEventData *)oldEvent)->size;
+		if (oldSize < size) {
+			if (staged) {
+				removeStagedLastValueEvent(lastValue, oldSize, size);
 			}
-			writeBytes(0, (uint8_t *)&header, sizeof(PublishQueueHeader));
+			return false;
+		}
 
-			//pubqLogger.trace("discardOldestEvent numEvents=%u numSent=%u fileLength=%d", header.numEvents, header.size, getLength());
+		memcpy(oldEvent, buf, size);
+		memset(&oldEvent[size], 0, oldSize - size);
+		((PublishQueueEventData *)oldEvent)->size = oldSize;
+		updateEventCrc((PublishQueueEventData *)oldEvent);
 
-			return false;
+		if (!staged) {
+			openSegment(lastValue->segment);
+			if (writeBytes(lastValue->pos, eventBuf, oldSize) != oldSize) {
+				PUBLISH_QUEUE_LOG_ERROR("failed to replace event");
+				return false;
+			}
+			unsyncedWrites++;
 		}
+
+		PUBLISH_QUEUE_LOG_TRACE("replaced event index=%lu", (unsigned long)lastValue->index);
+		replacedCount++;
+		return true;
 	}
 
 	/**
-	 * @brief Skip to the next event
+	 * @brief Appends the events staged by group commit to the events file and updates the file header once
+	 *
+	 * @returns true if the events were written
 	 *
 	 * Note: You must obtain a mutex lock and open the events file before calling this!
 	 */
-	size_t skipEvent(size_t addr, uint8_t *buf) {
-		// Read event at addr
-		size_t len = (size_t) getLength();
+	bool writeStagedEvents() {
+		size_t len = stagingEnd - stagingStart;
+		if (len == 0) {
+			return true;
+		}
 
-		size_t count = len - addr;
-		if (count == 0) {
-			// pubqLogger.info("skipEvent called with no more events at len=%u addr=%u", len, addr);
-			return 0;
+		if (!appendEvents(&stagingBuf[stagingStart], len, stagingCount)) {
+			PUBLISH_QUEUE_LOG_ERROR("failed to write staged events");
+			return false;
 		}
 
-		if (count > EVENT_BUF_SIZE) {
-			count = EVENT_BUF_SIZE;
+		// The staged events are now at the end of the tail segment
+		uint32_t endPos = getTailHeader().endPos;
+		for(uint16_t ii = 0; ii < numLastValues; ii++) {
+			PublishQueueLastValue &lastValue = lastValues[ii];
+			if (lastValue.state == PublishQueueLastValue::STATE_QUEUED && lastValue.segment == PublishQueueLastValue::SEGMENT_STAGED) {
+				lastValue.segment = tailSegment;
+				lastValue.pos = endPos - (stagingEnd - lastValue.pos);
+			}
 		}
 
-		// pubqLogger.info("skipEvent len=%u count=%u", len, count);
+		stagingStart = stagingEnd = 0;
+		stagingCount = 0;
+
+		return true;
+	}
 
-		readBytes(addr, buf, count);
+	/**
+	 * @brief Writes the staged events when the oldest is groupCommitMs old, then does the periodic sync
+	 */
+	virtual void threadTasks() {
+		// stagingCount is checked without the mutex so the idle thread doesn't contend for it
+		if (stagingCount != 0 && groupCommitMs != 0 && millis() - stagingTime >= groupCommitMs) {
+			StMutexLock lock(this);
 
-		// pubqLogger.info("skipEvent addr=%u ttl=%d flags=%02x", addr, ((PublishQueueEventData *)buf)->ttl, ((PublishQueueEventData *)buf)->flags);
+			if (stagingCount != 0) {
+				StFileOpenClose openClose(this, tailSegment);
+				writeStagedEvents();
+			}
+		}
 
-		size_t next = addr;
+		PublishQueueAsyncFileSystemBase::threadTasks();
+	}
 
-		next += sizeof(PublishQueueEventData);
-		// pubqLogger.info("skipEvent event=%s", &buf[next - addr]);
+	/**
+	 * @brief Returns the time until the staged events must be written, or the file synced, whichever is sooner
+	 */
+	virtual system_tick_t getThreadTasksWaitMs() {
+		system_tick_t waitMs = PublishQueueAsyncFileSystemBase::getThreadTasksWaitMs();
+		if (stagingCount != 0 && groupCommitMs != 0) {
+			unsigned long elapsed = millis() - stagingTime;
+			system_tick_t stagingWaitMs = (elapsed < groupCommitMs) ? groupCommitMs - elapsed : 0;
+			if (stagingWaitMs < waitMs) {
+				waitMs = stagingWaitMs;
+			}
+		}
+		return waitMs;
+	}
 
-		next += strlen((const char *)&buf[next - addr]) + 1;
-		// pubqLogger.info("skipEvent data=%s", &buf[next - addr]);
+	/**
+	 * @brief Writes the file header to the beginning of the events file
+	 *
+	 * @returns true if the header was written
+	 *
+	 * Every modification to the events file ends by writing the header, so this also counts
+	 * the modifications for the sync policy.
+	 *
+	 * Note: You must obtain a mutex lock and open the events file before calling this!
+	 */
+	bool writeHeader() {
+		return writeHeader(header);
+	}
 
-		next += strlen((const char *)&buf[next - addr]) + 1;
+	/**
+	 * @brief Writes a file header to the beginning of the open events file or segment file
+	 *
+	 * @param fileHeader The file header to write, header or tailHeader
+	 *
+	 * Note: You must obtain a mutex lock and open the events file before calling this!
+	 */
+	bool writeHeader(const PublishQueueFileHeader &fileHeader) {
+		unsyncedWrites++;
+		return writeBytes(0, (const uint8_t *)&fileHeader, sizeof(PublishQueueFileHeader)) == sizeof(PublishQueueFileHeader);
+	}
 
-		// Align
-		if ((next % 4) != 0) {
-			next += 4 - (next % 4);
+	/**
+	 * @brief Discards all events, writes the file header, and truncates the file
+	 *
+	 * Note: You must obtain a mutex lock and open the events file before calling this!
+	 */
+	bool resetEvents() {
+		header.numSent = header.numEvents = 0;
+		header.oldestPos = header.endPos = sizeof(PublishQueueFileHeader);
+		deletedEvents = deletedBytes = 0;
+
+		// The file offsets will be reused, so search for events that were in the file
+		for(uint16_t ii = 0; ii < numLastValues; ii++) {
+			if (lastValues[ii].state == PublishQueueLastValue::STATE_QUEUED && lastValues[ii].segment != PublishQueueLastValue::SEGMENT_STAGED) {
+				lastValues[ii].state = PublishQueueLastValue::STATE_UNKNOWN;
+			}
 		}
 
-		// pubqLogger.trace("skipEvent addr=%u next=%u", addr, next);
-
-		return next;
+		// Write the header first so an interrupted truncate is cleaned up in setup()
+		writeHeader();
+		return truncate(sizeof(PublishQueueFileHeader));
 	}
 
 	/**
-	 * @brief Get the number of events in the queue (0 = empty)
+	 * @brief Converts an events file from 0.2.x and earlier to version 2 event records
+	 *
+	 * @param len The length of the events file
+	 *
+	 * @returns true if the events were converted or false if they were not valid
+	 *
+	 * Events that have already been sent are removed. The unsent events are converted and appended to the
+	 * end of the file, then copied down to follow the file header and the file is truncated.
+	 *
+	 * Note: You must obtain a mutex lock and open the events file before calling this!
 	 */
-	uint16_t getNumEvents() const {
+	bool convertEventsV1(size_t len) {
 		uint16_t numEvents = 0;
+		size_t convertedLen = 0;
 
-		{
-			StMutexLock lock(this);
+		size_t addr = sizeof(PublishQueueHeader);
+		for(uint16_t ii = 0; ii < header.numEvents; ii++) {
+			if (addr >= len) {
+				return false;
+			}
+			size_t count = len - addr;
+			if (count > EVENT_BUF_SIZE) {
+				count = EVENT_BUF_SIZE;
+			}
+			if (readBytes(addr, eventBuf, count) != count) {
+				return false;
+			}
+
+			size_t srcSize;
+			size_t size = convertEventDataV1(eventBuf, count, publishBuf, srcSize);
+			if (size == 0) {
+				return false;
+			}
+			if (ii >= header.numSent) {
+				writeBytes(len + convertedLen, publishBuf, size);
+				convertedLen += size;
+				numEvents++;
+			}
+			addr += srcSize;
+		}
 
-			numEvents = header.numEvents;
+		// Copy the converted events down to follow the file header
+		size_t src = len;
+		size_t dst = sizeof(PublishQueueFileHeader);
+		while(src < len + convertedLen) {
+			size_t count = len + convertedLen - src;
+			if (count > EVENT_BUF_SIZE) {
+				count = EVENT_BUF_SIZE;
+			}
+			readBytes(src, eventBuf, count);
+			writeBytes(dst, eventBuf, count);
+			src += count;
+			dst += count;
 		}
+		truncate(dst);
 
-		return numEvents;
+		header.magic = PUBLISH_QUEUE_FILE_HEADER_MAGIC;
+		header.numSent = 0;
+		header.numEvents = numEvents;
+		header.oldestPos = sizeof(PublishQueueFileHeader);
+		header.endPos = dst;
+		writeHeader();
+
+		PUBLISH_QUEUE_LOG_INFO("converted events file from 0.2.x numEvents=%u", numEvents);
+
+		return true;
 	}
 
-protected:
 	/**
 	 * @brief The header, copied from the file system
+	 *
+	 * When segments are used, this is the header of the head segment.
 	 */
-	PublishQueueHeader header;
+	PublishQueueFileHeader header;
+
+	PublishQueueFileHeader tailHeader;	//!< When segments are used and headSegment != tailSegment, the header of the tail segment
+	size_t segmentSize = 0;				//!< Start a new segment when the tail segment would be larger than this (0 = don't start segments)
+	bool segmented = false;				//!< Events are stored in segment files
+	bool convertingToSegments = false;	//!< Don't write the segment header when adding segments because the events file is being converted
+	uint32_t headSegment = 0;			//!< Segment number of the oldest events (0 = the events file when not using segments)
+	uint32_t tailSegment = 0;			//!< Segment number where events are appended (0 = the events file when not using segments)
+	uint32_t middleEvents = 0;			//!< Number of unsent events in segments between headSegment and tailSegment
+	uint32_t middleBytes = 0;			//!< Number of bytes of unsent events in segments between headSegment and tailSegment
+
+	uint32_t maxEvents = 0;				//!< Maximum number of unsent events in the file (0 = no limit)
+	size_t maxBytes = 0;				//!< Maximum number of bytes of unsent events in the file (0 = no limit)
+	uint32_t deletedEvents = 0;			//!< Number of events after the oldest event that were marked as deleted to make room
+	uint32_t deletedBytes = 0;			//!< Number of bytes in the deleted events
+	uint32_t deleteSegment = 0;			//!< If deletedEvents != 0, the segment of deletePos
+	size_t deletePos = 0;				//!< If deletedEvents != 0, the file offset just past the last deleted event
+
+	uint16_t groupCommitEvents = 0;		//!< Write staged events when this many are staged (0 = group commit disabled)
+	unsigned long groupCommitMs = 0;	//!< Write staged events when the oldest is this many milliseconds old (0 = disabled)
+	size_t stagingSize = 0;				//!< Size of stagingBuf in bytes
+	uint8_t *stagingBuf = NULL;			//!< Group commit staging buffer, allocated in setup() if enabled
+	size_t stagingStart = 0;			//!< Offset in stagingBuf of the oldest staged event
+	size_t stagingEnd = 0;				//!< Offset in stagingBuf just past the newest staged event
+	uint16_t stagingCount = 0;			//!< Number of events in stagingBuf
+	unsigned long stagingTime = 0;		//!< millis() value when the oldest staged event was staged
+
+	PublishQueueFileHeader priorityHeader = {};	//!< Header of the priority file, or all 0 if there's no priority file
+	uint32_t laneEvents[PUBLISH_QUEUE_PRIORITY_MAX + 1] = {0};	//!< Number of events of each priority in the priority file, not including deleted events (0 is not used)
+	uint32_t priorityDeletedEvents = 0;	//!< Number of unsent events in the priority file that were marked as deleted
+	uint32_t priorityDeletedBytes = 0;	//!< Number of bytes in the deleted events in the priority file
+	uint8_t activeLane = 0;				//!< Priority lane sent first, chosen by selectLane()
+
 
 	/**
 	 * @brief This holds a single event during scanning and writing.
 	 *
 	 * Because the data needs to be in RAM to be written to FRAM, this buffer is required.
 	 */
-	uint8_t eventBuf[EVENT_BUF_SIZE];
+	uint8_t eventBuf[EVENT_BUF_SIZE] __attribute__((aligned(4)));
 
 	/**
 	 * @brief This holds a single event during publish.
@@ -1314,14 +7482,7 @@ protected:
 	 *
 	 * It's separate from eventBuf because eventBuf is used to publish new data to the queue.
 	 */
-	uint8_t publishBuf[EVENT_BUF_SIZE];
-
-	/**
-	 * @brief Offset in the file for the oldest event. We begin publishing at this offset.
-	 *
-	 * This is set in setup() and updated in discardOldEvent().
-	 */
-	size_t oldestPos = 0;
+	uint8_t publishBuf[EVENT_BUF_SIZE] __attribute__((aligned(4)));
 };
 
 #endif /* PUBLISH_QUEUE_USE_FS */
@@ -1347,17 +7508,34 @@ public:
 	 * @brief Destructor
 	 */
 	virtual ~PublishQueueAsyncSpiffs() {
-
+		if (fileIsOpen) {
+			closeFile();
+		}
 	}
 
 	/**
 	 * @brief Open the events file
 	 */
 	virtual bool openFile() {
-		file = spiffs.openFile(filename, SPIFFS_O_CREAT|SPIFFS_O_RDWR);
+		file = spiffs.openFile(getSegmentFilename(filename), SPIFFS_O_CREAT|SPIFFS_O_RDWR);
 		return true;
 	}
 
+	/**
+	 * @brief Remove the file for the selected segment
+	 */
+	virtual bool removeFile() {
+		return spiffs.remove(getSegmentFilename(filename)) == SPIFFS_OK;
+	}
+
+	/**
+	 * @brief Returns true if the file for the selected segment exists
+	 */
+	virtual bool fileExists() {
+		spiffs_stat st;
+		return spiffs.stat(getSegmentFilename(filename), &st) == SPIFFS_OK;
+	}
+
 	/**
 	 * @brief Close the events file
 	 */
@@ -1397,7 +7575,7 @@ public:
 	 */
 	virtual size_t readBytes(int seekTo, uint8_t *buffer, size_t length) {
 		if (!seek(seekTo)) {
-			pubqLogger.error("readBytes seek failed seekTo=%d", seekTo);
+			PUBLISH_QUEUE_LOG_ERROR("readBytes seek failed seekTo=%d", seekTo);
 			return 0;
 		}
 		return file.readBytes((char *)buffer, length);
@@ -1415,7 +7593,7 @@ public:
 	 */
 	virtual size_t writeBytes(int seekTo, const uint8_t *buffer, size_t length) {
 		if (!seek(seekTo)) {
-			pubqLogger.error("writeBytes seek failed seekTo=%d", seekTo);
+			PUBLISH_QUEUE_LOG_ERROR("writeBytes seek failed seekTo=%d", seekTo);
 			return 0;
 		}
 		return file.write(buffer, length);
@@ -1438,6 +7616,14 @@ public:
 		return file.truncate((s32_t)size) == SPIFFS_OK;
 	}
 
+	/**
+	 * @brief Write the SPIFFS file cache to flash
+	 */
+	virtual bool syncFile() {
+		file.flush();
+		return true;
+	}
+
 
 protected:
 	SpiffsParticle &spiffs;		//!< SpiffsParticle object for the file system to store events on
@@ -1466,13 +7652,30 @@ public:
 	}
 
 	virtual ~PublishQueueAsyncSdFat() {
+		if (fileIsOpen) {
+			closeFile();
+		}
 	}
 
 	/**
 	 * @brief Open the events file
 	 */
 	virtual bool openFile() {
-		return file.open(filename, O_RDWR | O_CREAT) != 0;
+		return file.open(getSegmentFilename(filename), O_RDWR | O_CREAT) != 0;
+	}
+
+	/**
+	 * @brief Remove the file for the selected segment
+	 */
+	virtual bool removeFile() {
+		return sdFat.remove(getSegmentFilename(filename));
+	}
+
+	/**
+	 * @brief Returns true if the file for the selected segment exists
+	 */
+	virtual bool fileExists() {
+		return sdFat.exists(getSegmentFilename(filename));
 	}
 
 	/**
@@ -1509,7 +7712,7 @@ public:
 	 */
 	virtual size_t readBytes(int seekTo, uint8_t *buffer, size_t length) {
 		if (!seek(seekTo)) {
-			pubqLogger.error("readBytes seek failed seekTo=%d", seekTo);
+			PUBLISH_QUEUE_LOG_ERROR("readBytes seek failed seekTo=%d", seekTo);
 			return 0;
 		}
 		return file.read((char *)buffer, length);
@@ -1527,7 +7730,7 @@ public:
 	 */
 	virtual size_t writeBytes(int seekTo, const uint8_t *buffer, size_t length) {
 		if (!seek(seekTo)) {
-			pubqLogger.error("writeBytes seek failed seekTo=%d", seekTo);
+			PUBLISH_QUEUE_LOG_ERROR("writeBytes seek failed seekTo=%d", seekTo);
 			return 0;
 		}
 		return file.write(buffer, length);
@@ -1550,6 +7753,13 @@ public:
 		return file.truncate((uint32_t)size);
 	}
 
+	/**
+	 * @brief Write the cached data and directory entry to the SD card
+	 */
+	virtual bool syncFile() {
+		return file.sync();
+	}
+
 
 protected:
 	SdFat &sdFat;			//!< SdFat object for the file system to store the events on
@@ -1576,17 +7786,33 @@ public:
 	}
 
 	virtual ~PublishQueueAsyncPOSIX() {
+		closeFile();
 	}
 
 	/**
 	 * @brief Open the events file
 	 */
 	virtual bool openFile() {
-		fd = open(filename, O_RDWR | O_CREAT);
+		fd = open(getSegmentFilename(filename), O_RDWR | O_CREAT, 0666);
 
 		return (fd != -1);
 	}
 
+	/**
+	 * @brief Remove the file for the selected segment
+	 */
+	virtual bool removeFile() {
+		return unlink(getSegmentFilename(filename)) == 0;
+	}
+
+	/**
+	 * @brief Returns true if the file for the selected segment exists
+	 */
+	virtual bool fileExists() {
+		struct stat sb;
+		return stat(getSegmentFilename(filename), &sb) == 0;
+	}
+
 	/**
 	 * @brief Close the events file
 	 */
@@ -1624,7 +7850,7 @@ public:
 	 */
 	virtual size_t readBytes(int seekTo, uint8_t *buffer, size_t length) {
 		if (!seek(seekTo)) {
-			pubqLogger.error("readBytes seek failed seekTo=%d", seekTo);
+			PUBLISH_QUEUE_LOG_ERROR("readBytes seek failed seekTo=%d", seekTo);
 			return 0;
 		}
 		int count = read(fd, buffer, length);
@@ -1648,16 +7874,16 @@ public:
 	 */
 	virtual size_t writeBytes(int seekTo, const uint8_t *buffer, size_t length) {
 		if (!seek(seekTo)) {
-			pubqLogger.error("writeBytes seek failed seekTo=%d", seekTo);
+			PUBLISH_QUEUE_LOG_ERROR("writeBytes seek failed seekTo=%d", seekTo);
 			return 0;
 		}
 		int count = write(fd, buffer, length);
 		if (count > 0) {
-			// pubqLogger.trace("writeBytes seekTo=%d count=%d length=%u", seekTo, count, length);
+			// PUBLISH_QUEUE_LOG_TRACE("writeBytes seekTo=%d count=%d length=%u", seekTo, count, length);
 			return count;
 		}
 		else {
-			pubqLogger.error("writeBytes failed count=%d length=%u", count, length);
+			PUBLISH_QUEUE_LOG_ERROR("writeBytes failed count=%d length=%u", count, length);
 			return 0;
 		}
 	}
@@ -1681,6 +7907,13 @@ public:
 		return ftruncate(fd, (s32_t)size) == 0;
 	}
 
+	/**
+	 * @brief Write the file data and metadata to the file system
+	 */
+	virtual bool syncFile() {
+		return fsync(fd) == 0;
+	}
+
 
 protected:
 	String filename;		//!< Filename for the events file (set in constructor)